@@ -0,0 +1,419 @@
+#!/usr/bin/env python3
+"""Generate unrolled DdQq BGK kernels in C from a lattice descriptor.
+
+A descriptor names a lattice and gives its velocity set, weights and,
+optionally, the opposite of each velocity (derived if absent)::
+
+    {"name": "d2q9",
+     "velocities": [[0, 0], [1, 0], [0, 1], [-1, 0], [0, -1],
+                    [1, 1], [-1, 1], [-1, -1], [1, -1]],
+     "weights": ["4/9", "1/9", "1/9", "1/9", "1/9",
+                 "1/36", "1/36", "1/36", "1/36"]}
+
+The descriptor is checked (weights sum to one, the velocity set is
+closed under reversal, and the lattice is isotropic to second order
+with c_s^2 = 1/3) before anything is written. For each lattice
+gen/<name>.h gets:
+
+- timestep_<name>(): pull streaming with periodic wrap, half-way
+  bounce-back in obstacle cells, BGK collision towards the second
+  order equilibrium elsewhere, in one pass over SoA arrays, returning
+  the average speed of the fluid cells. This is the scheme of
+  timestep() in d2q9-bgk.c.
+- macroscopic_<name>(): density and velocity of every cell.
+- conservation_<name>(): the drift of the total mass and momentum of a
+  periodic box of random populations over a number of timesteps,
+  which --selftest in d2q9-bgk.c checks for every lattice.
+
+The functions are static inline, so each header can be included in
+any number of translation units.
+
+D2Q9, in the speed numbering of d2q9-bgk.c, is emitted over the
+solver's own t_param and t_speeds, so that it drops into the kernel
+registry; other lattices get their own speeds and parameter structs.
+Regenerate with ``make generate`` or::
+
+    python3 codegen/ddqq.py [--out gen] [descriptor.json ...]
+"""
+
+import argparse
+import json
+import os
+import sys
+from fractions import Fraction
+
+AXES = "xyz"
+
+LATTICES = {
+    "d2q9": {
+        "velocities": [[0, 0], [1, 0], [0, 1], [-1, 0], [0, -1],
+                       [1, 1], [-1, 1], [-1, -1], [1, -1]],
+        "weights": ["4/9"] + ["1/9"] * 4 + ["1/36"] * 4,
+    },
+    "d3q19": {
+        "velocities": [[0, 0, 0],
+                       [1, 0, 0], [-1, 0, 0], [0, 1, 0], [0, -1, 0], [0, 0, 1], [0, 0, -1],
+                       [1, 1, 0], [-1, -1, 0], [1, -1, 0], [-1, 1, 0],
+                       [1, 0, 1], [-1, 0, -1], [1, 0, -1], [-1, 0, 1],
+                       [0, 1, 1], [0, -1, -1], [0, 1, -1], [0, -1, 1]],
+        "weights": ["1/3"] + ["1/18"] * 6 + ["1/36"] * 12,
+    },
+    "d3q27": {
+        "velocities": [[x, y, z] for z in (0, 1, -1) for y in (0, 1, -1) for x in (0, 1, -1)],
+        "weights": None,  # by the number of non-zero components, below
+    },
+}
+LATTICES["d3q27"]["weights"] = [
+    ["8/27", "2/27", "1/54", "1/216"][sum(1 for c in v if c)] for v in LATTICES["d3q27"]["velocities"]
+]
+
+# lattices emitted over the solver's own types (the speed numbering of d2q9-bgk.c)
+NATIVE = {"d2q9"}
+
+
+class Lattice:
+    """A checked velocity set with weights and opposites."""
+
+    def __init__(self, name, velocities, weights, opposites=None):
+        self.name = name
+        self.c = [tuple(v) for v in velocities]
+        self.w = [Fraction(w) for w in weights]
+        self.d = len(self.c[0])
+        self.q = len(self.c)
+        if self.d not in (2, 3) or any(len(v) != self.d for v in self.c):
+            raise ValueError(f"{name}: velocities must all have 2 or all have 3 components")
+        if len(self.w) != self.q:
+            raise ValueError(f"{name}: {self.q} velocities but {len(self.w)} weights")
+        if self.c[0] != (0,) * self.d:
+            raise ValueError(f"{name}: velocity 0 must be the rest velocity")
+        if any(abs(x) > 1 for v in self.c for x in v) or len(set(self.c)) != self.q:
+            raise ValueError(f"{name}: velocities must be distinct nearest or next-nearest neighbour links")
+        derived = [self.c.index(tuple(-x for x in v)) if tuple(-x for x in v) in self.c else -1 for v in self.c]
+        if -1 in derived:
+            raise ValueError(f"{name}: the velocity set is not closed under reversal")
+        if opposites is not None and list(opposites) != derived:
+            raise ValueError(f"{name}: opposites {list(opposites)} do not match the velocities ({derived})")
+        self.opp = derived
+        self.check_isotropy()
+
+    def check_isotropy(self):
+        """Weights must give sum w = 1, sum w c = 0 and sum w c c = I / 3."""
+        if sum(self.w) != 1:
+            raise ValueError(f"{self.name}: weights sum to {sum(self.w)}")
+        for a in range(self.d):
+            if sum(w * v[a] for w, v in zip(self.w, self.c)) != 0:
+                raise ValueError(f"{self.name}: first moment of the weights is not zero")
+            for b in range(self.d):
+                m = sum(w * v[a] * v[b] for w, v in zip(self.w, self.c))
+                if m != (Fraction(1, 3) if a == b else 0):
+                    raise ValueError(f"{self.name}: second moment {AXES[a]}{AXES[b]} is {m}, not c_s^2 delta")
+
+
+def signed_sum(terms):
+    """C for a sum of (sign, name) terms, positives first: a + b - (c + d)."""
+    pos = [n for s, n in terms if s > 0]
+    neg = [n for s, n in terms if s < 0]
+    if not pos and not neg:
+        return "0.f"
+    if not neg:
+        return " + ".join(pos)
+    if not pos:
+        return "-(" + " + ".join(neg) + ")"
+    return " + ".join(pos) + " - (" + " + ".join(neg) + ")"
+
+
+def chained_sum(terms):
+    """C for a sum of (sign, name) terms in order: -a + b - c."""
+    text = ("-" if terms[0][0] < 0 else "") + terms[0][1]
+    for sign, name in terms[1:]:
+        text += (" - " if sign < 0 else " + ") + name
+    return text
+
+
+def weight(w):
+    return f"{w.numerator}.f / {w.denominator}.f"
+
+
+class Emitter:
+    """Writes the C source of one lattice's kernels."""
+
+    def __init__(self, lat):
+        self.lat = lat
+        self.native = lat.name in NATIVE
+        self.speeds = "t_speeds" if self.native else f"t_{lat.name}_speeds"
+        self.param = "t_param" if self.native else f"t_{lat.name}_param"
+        self.axes = AXES[:lat.d]
+        self.lines = []
+
+    def out(self, text=""):
+        self.lines.append(text)
+
+    # index of a cell, from per-axis index variable names
+    def index(self, names):
+        if self.lat.d == 2:
+            return f"{names[0]} + {names[1]} * params.nx"
+        return f"{names[0]} + ({names[1]} + {names[2]} * params.ny) * params.nx"
+
+    def upstream(self, v):
+        """Index variables of the cell a population with velocity v streams from."""
+        own = ["ii", "jj", "kk"]
+        minus = ["x_w", "y_s", "z_d"]  # one cell back along each axis
+        plus = ["x_e", "y_n", "z_u"]   # one cell forward
+        return [plus[a] if v[a] < 0 else (minus[a] if v[a] > 0 else own[a]) for a in range(self.lat.d)]
+
+    def header(self):
+        lat = self.lat
+        guard = f"{lat.name.upper()}_GEN_H"
+        self.out(f"/* Generated by codegen/ddqq.py from the {lat.name.upper()} descriptor: edit the descriptor, not this file. */")
+        self.out()
+        self.out(f"#ifndef {guard}")
+        self.out(f"#define {guard}")
+        self.out()
+        self.out("/*")
+        self.out(f"** {lat.name.upper()}: {lat.q} velocities")
+        for s, (v, w) in enumerate(zip(lat.c, lat.w)):
+            self.out(f"**   s{s:<2} c = ({', '.join(f'{x:2d}' for x in v)})  w = {str(w):<5}  opposite s{lat.opp[s]}")
+        self.out("*/")
+        self.out()
+        if not self.native:
+            self.out("#include <math.h>")
+            self.out("#include <stdlib.h>")
+            self.out("#include <x86intrin.h>")
+            self.out()
+            self.out("typedef struct")
+            self.out("{")
+            self.out("  int nx;      /* no. of cells in x-direction */")
+            self.out("  int ny;      /* no. of cells in y-direction */")
+            if lat.d == 3:
+                self.out("  int nz;      /* no. of cells in z-direction */")
+            self.out("  float omega; /* relaxation parameter */")
+            self.out(f"}} {self.param};")
+            self.out()
+            self.out("typedef struct")
+            self.out("{")
+            for s in range(lat.q):
+                self.out(f"  float *s{s};")
+            self.out(f"}} {self.speeds};")
+            self.out()
+
+    def loops_open(self, reduction, neighbours):
+        """The loop nest over cells, with the neighbour indices of each axis if asked for."""
+        lat = self.lat
+        red = " reduction(+ : tot_cells) reduction(+ : tot_u)" if reduction else ""
+        if lat.d == 3:
+            self.out(f"#pragma omp parallel for collapse(2){red}")
+            self.out("  for (int kk = 0; kk < params.nz; kk++)")
+            self.out("  {")
+            self.out("    for (int jj = 0; jj < params.ny; jj++)")
+            self.out("    {")
+            ind = "      "
+        if lat.d == 3 and neighbours:
+            self.out(f"{ind}const int z_d = (kk == 0) ? (kk + params.nz - 1) : (kk - 1);")
+            self.out(f"{ind}const int z_u = (kk + 1) % params.nz;")
+        if lat.d == 2:
+            self.out(f"#pragma omp parallel for{red}")
+            self.out("  for (int jj = 0; jj < params.ny; jj++)")
+            self.out("  {")
+            ind = "    "
+        if neighbours:
+            self.out(f"{ind}const int y_s = (jj == 0) ? (jj + params.ny - 1) : (jj - 1);")
+            self.out(f"{ind}const int y_n = (jj + 1) % params.ny;")
+        self.out(f"#pragma omp simd{red}")
+        self.out(f"{ind}for (int ii = 0; ii < params.nx; ii++)")
+        self.out(f"{ind}{{")
+        return ind + "  "
+
+    def loops_close(self):
+        if self.lat.d == 3:
+            self.out("      }")
+            self.out("    }")
+        else:
+            self.out("    }")
+        self.out("  }")
+
+    def moments(self, ind, f, rho, store=None):
+        """Density and velocity from the populations named f0, f1, .., into locals or stored at index store."""
+        lat = self.lat
+        self.out(f"{ind}const float {rho} = {' + '.join(f'{f}{s}' for s in range(lat.q))};")
+        if store is not None:
+            self.out(f"{ind}rho[{store}] = {rho};")
+        for a, ax in enumerate(self.axes):
+            terms = [(v[a], f"{f}{s}") for s, v in enumerate(lat.c) if v[a]]
+            target = f"const float u_{ax}" if store is None else f"u_{ax}[{store}]"
+            self.out(f"{ind}{target} = ({signed_sum(terms)}) / {rho};")
+
+    def timestep(self):
+        lat = self.lat
+        self.out(f"static inline float timestep_{lat.name}(const {self.param} params, {self.speeds} *restrict cells, "
+                 f"{self.speeds} *restrict tmp_cells, int *obstacles)")
+        self.out("{")
+        self.out("  int tot_cells = 0;")
+        self.out("  float tot_u = 0.f;")
+        self.out()
+        for which in ("cells", "tmp_cells"):
+            for s in range(lat.q):
+                self.out(f"  __assume_aligned({which}->s{s}, 64);")
+        self.out()
+        ind = self.loops_open(True, True)
+        self.out(f"{ind}const int x_e = (ii + 1) % params.nx;")
+        self.out(f"{ind}const int x_w = (ii == 0) ? (ii + params.nx - 1) : (ii - 1);")
+        own = self.index(["ii", "jj", "kk"])
+        self.out()
+        self.out(f"{ind}/* propagate: pull each population from the cell upstream of it */")
+        for s, v in enumerate(lat.c):
+            self.out(f"{ind}const float f{s} = cells->s{s}[{self.index(self.upstream(v))}];")
+        self.out()
+        self.out(f"{ind}/* rebound: reverse the populations of occupied cells */")
+        self.out(f"{ind}if (obstacles[{own}])")
+        self.out(f"{ind}{{")
+        for s in range(1, lat.q):
+            self.out(f"{ind}  tmp_cells->s{lat.opp[s]}[{own}] = f{s};")
+        self.out(f"{ind}}}")
+        self.out(f"{ind}/* collision: relax towards the second order equilibrium */")
+        self.out(f"{ind}else")
+        self.out(f"{ind}{{")
+        inner = ind + "  "
+        self.moments(inner, "f", "local_density")
+        self.out(f"{inner}const float u_sq = {' + '.join(f'u_{a} * u_{a}' for a in self.axes)};")
+        self.out()
+        for s, v in enumerate(lat.c):
+            terms = [(v[a], f"u_{ax}") for a, ax in enumerate(self.axes) if v[a]]
+            if s == 0:
+                eq = f"{weight(lat.w[s])} * local_density * (1.f - u_sq * 1.5f)"
+            else:
+                self.out(f"{inner}const float cu{s} = {chained_sum(terms)};")
+                eq = (f"{weight(lat.w[s])} * local_density * "
+                      f"(1.f + cu{s} * 3.f + (cu{s} * cu{s}) * 4.5f - u_sq * 1.5f)")
+            self.out(f"{inner}tmp_cells->s{s}[{own}] = f{s} + params.omega * ({eq} - f{s});")
+        self.out()
+        self.out(f"{inner}/* average speed */")
+        self.out(f"{inner}tot_cells = tot_cells + 1;")
+        self.out(f"{inner}tot_u = tot_u + sqrtf(u_sq);")
+        self.out(f"{ind}}}")
+        self.loops_close()
+        self.out()
+        self.out("  return tot_u / (float)tot_cells;")
+        self.out("}")
+        self.out()
+
+    def macroscopic(self):
+        lat = self.lat
+        fields = ", ".join(f"float *u_{a}" for a in self.axes)
+        self.out(f"static inline void macroscopic_{lat.name}(const {self.param} params, {self.speeds} *cells, "
+                 f"float *rho, {fields})")
+        self.out("{")
+        ind = self.loops_open(False, False)
+        own = self.index(["ii", "jj", "kk"])
+        for s in range(lat.q):
+            self.out(f"{ind}const float f{s} = cells->s{s}[{own}];")
+        self.moments(ind, "f", "local_density", own)
+        self.loops_close()
+        self.out("}")
+        self.out()
+
+    def conservation(self):
+        """Relative drift of the total mass and momentum of a periodic box over steps timesteps."""
+        lat = self.lat
+        cells = " * ".join(f"params.n{a}" for a in self.axes)
+        totals = 1 + lat.d
+        self.out("/*")
+        self.out("** Run steps timesteps from random populations about rest, with every")
+        self.out("** solid_every-th cell solid (none if 0), and set *mass and *momentum")
+        self.out("** to the change of the totals relative to the mass. Streaming and")
+        self.out("** rebound move every population once and collision keeps the moments,")
+        self.out("** so both are conserved to rounding, the momentum only without walls.")
+        self.out("*/")
+        self.out(f"static inline void conservation_{lat.name}(const {self.param} params, int steps, int solid_every, "
+                 f"double *mass, double *momentum)")
+        self.out("{")
+        self.out(f"  const int ncells = {cells};")
+        self.out("  const size_t bytes = sizeof(float) * ncells;")
+        self.out(f"  float *rho = (float *)malloc(bytes * {totals});")
+        self.out("  int *obstacles = (int *)malloc(sizeof(int) * ncells);")
+        self.out(f"  double before[{totals}] = {{0}}, after[{totals}] = {{0}};")
+        self.out("  unsigned int seed = 12345u;")
+        self.out(f"  {self.speeds} cells, tmp_cells, swap;")
+        self.out()
+        for which in ("cells", "tmp_cells"):
+            for s in range(lat.q):
+                self.out(f"  {which}.s{s} = (float *)_mm_malloc(bytes, 64);")
+        self.out()
+        self.out("  for (int ii = 0; ii < ncells; ii++)")
+        self.out("  {")
+        self.out("    obstacles[ii] = solid_every > 0 && ii % solid_every == 0;")
+        for s in range(lat.q):
+            self.out("    seed = seed * 1664525u + 1013904223u;")
+            self.out(f"    cells.s{s}[ii] = tmp_cells.s{s}[ii] = {weight(lat.w[s])} * (0.9f + 0.2f * (float)(seed >> 8) / 16777216.f);")
+        self.out("  }")
+        self.out()
+        self.out("  for (int pass = 0; pass < 2; pass++)")
+        self.out("  {")
+        self.out("    double *total = pass ? after : before;")
+        self.out()
+        self.out("    for (int tt = 0; pass && tt < steps; tt++)")
+        self.out("    {")
+        self.out(f"      timestep_{lat.name}(params, &cells, &tmp_cells, obstacles);")
+        self.out("      swap = cells;")
+        self.out("      cells = tmp_cells;")
+        self.out("      tmp_cells = swap;")
+        self.out("    }")
+        fields = ", ".join(f"rho + {a + 1} * ncells" for a in range(lat.d))
+        self.out(f"    macroscopic_{lat.name}(params, &cells, rho, {fields});")
+        self.out("    for (int ii = 0; ii < ncells; ii++)")
+        self.out("    {")
+        self.out("      total[0] += rho[ii];")
+        for a in range(lat.d):
+            self.out(f"      total[{a + 1}] += (double)rho[ii] * rho[{a + 1} * ncells + ii];")
+        self.out("    }")
+        self.out("  }")
+        self.out()
+        self.out("  *mass = fabs(after[0] - before[0]) / before[0];")
+        self.out("  *momentum = 0.0;")
+        self.out(f"  for (int aa = 1; aa < {totals}; aa++)")
+        self.out("  {")
+        self.out("    *momentum = fmax(*momentum, fabs(after[aa] - before[aa]) / before[0]);")
+        self.out("  }")
+        self.out()
+        for which in ("cells", "tmp_cells"):
+            for s in range(lat.q):
+                self.out(f"  _mm_free({which}.s{s});")
+        self.out("  free(obstacles);")
+        self.out("  free(rho);")
+        self.out("}")
+        self.out()
+
+    def source(self):
+        self.header()
+        self.timestep()
+        self.macroscopic()
+        self.conservation()
+        self.out(f"#endif")
+        return "\n".join(self.lines) + "\n"
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("descriptors", nargs="*", help="JSON descriptors, default the built-in D2Q9, D3Q19 and D3Q27")
+    parser.add_argument("--out", default=os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "gen"),
+                        help="directory for the generated headers")
+    args = parser.parse_args(argv)
+
+    descriptors = []
+    for path in args.descriptors:
+        with open(path) as fp:
+            descriptors.append(json.load(fp))
+    if not descriptors:
+        descriptors = [dict(name=name, **d) for name, d in LATTICES.items()]
+
+    os.makedirs(args.out, exist_ok=True)
+    for d in descriptors:
+        lat = Lattice(d["name"].lower(), d["velocities"], d["weights"], d.get("opposites"))
+        path = os.path.join(args.out, f"{lat.name}.h")
+        with open(path, "w") as fp:
+            fp.write(Emitter(lat).source())
+        print(f"{path}: D{lat.d}Q{lat.q}")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv[1:]))
@@ -47,18 +47,164 @@
 **
 ** Be sure to adjust the grid dimensions in the parameter file
 ** if you choose a different obstacle file.
+**
+** Optional flags go before the file names, e.g.:
+**
+**   ./d2q9-bgk --energy input.params obstacles.dat
+**
+** Run with no arguments for the list of flags.
 */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* sched_getcpu() */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <omp.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+#include <zlib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 #define NSPEEDS 9
+#define NMOMENTS 6 /* rho, j_x, j_y, p_xx, p_yy, p_xy */
+#define MOMENTTOL 0.25f /* selftest: --moments against the reference away from omega 1, relative */
 #define FINALSTATEFILE "final_state.dat"
 #define AVVELSFILE "av_vels.dat"
+#define FINALSTATEBIN "final_state.bin"
+#define FINALSTATEGZ "final_state.dat.gz"
+#define AVVELSBIN "av_vels.bin"
+#define BINMAGIC "D2Q9BIN1"  /* first bytes of a binary output file */
+#define BINFINALSTATE 0      /* t_binheader.kind: u_x, u_y, u, pressure (floats), obstacles (ints) */
+#define BINAVVELS 1          /* t_binheader.kind: av. velocity of each timestep (floats) */
+#define RAPLDIR "/sys/class/powercap"
+#define MAXRAPLZONES 32
+#define CPUDIR "/sys/devices/system/cpu"
+#define NODEDIR "/sys/devices/system/node"
+#define MAXNODES 256
+#define BENCHCSVFILE "bench.csv"
+#define BENCHJSONFILE "bench.json"
+#define MAXBENCHLIST 32 /* most sizes or thread counts in one benchmark */
+#define GEOM_CHANNEL 0  /* synthetic geometries: walls along the top and bottom */
+#define GEOM_CYLINDER 1 /* ... and a cylinder */
+#define GEOM_POROUS 2   /* ... and random discs up to a solid fraction */
+#define MICROSIZE 1024         /* grid size of the out-of-cache microbenchmarks */
+#define MICROBLOCK 32          /* grid size of the in-cache collision microbenchmark */
+#define MICRO_STREAM 0         /* microbenchmark stages, in the order they are reported */
+#define MICRO_COLLIDE 1
+#define MICRO_REBOUND 2
+#define MICRO_ACCELERATE 3
+#define MICRO_AV_VELOCITY 4
+#define MICRO_TOTAL_DENSITY 5
+#define MICRO_TIMESTEP 6
+#define MICRO_NSTAGES 7
+#define PARAREALTOL 1e-5f /* parareal stops when no population changes by more than this x density */
+#define SENSITIVITYFILE "sensitivity.dat"
+#define ADJ_VELOCITY 0    /* adjoint objective: av. velocity, averaged over the timesteps */
+#define ADJ_DRAG 1        /* ... x-momentum taken up by solid and porous cells, per timestep */
+#define ADJVELEPS 1e-5    /* |u| is sqrt(u.u + eps^2) in the adjoint, differentiable where the fluid is at rest */
+#define ADJFDSTEP 1e-4    /* porosity step of the finite difference check */
+#define ADJCHECKTOL 1e-3  /* relative difference the check accepts */
+#define ANDERSONMAX 10      /* deepest anderson history */
+#define ANDERSONPERIOD 300  /* default timesteps between steady state checks */
+#define ANDERSONGUARD 1.0   /* a mix is undone if the residual after it grows by more than this factor */
+#define TILESIZE 16         /* --sparse tiles are TILESIZE x TILESIZE cells */
+#define TILECELLS (TILESIZE * TILESIZE)
+#define TILEHALO (TILESIZE + 2) /* a tile and its one cell halo, per side */
+#define SMTDISTANCE 4       /* rows the --smt-prefetch helpers run ahead of their compute threads */
+#define SMTSTRIDE 16        /* ints between progress counters, one cache line each */
+#define AIO_SYNC 0          /* output engines: write in the calling thread */
+#define AIO_THREADS 1       /* ... queue to a pool of writer threads */
+#define AIO_URING 2         /* ... submit to an io_uring */
+#define AIOALIGN 4096       /* O_DIRECT alignment of buffers, file offsets and lengths */
+#define AIODIRECTMIN (1 << 20) /* files from this size bypass the page cache with O_DIRECT */
+#define AIOCHUNK (1 << 24)  /* most bytes in one write */
+#define AIOMAXFILES 8       /* files in flight before a new one waits for the oldest */
+#define AIOENTRIES 64       /* io_uring submission queue entries */
+#define AIOTHREADS 2        /* writers of the thread pool engine */
+#define SNAPSHOTFILE "snapshot_%06d.bin" /* --snapshot output, by timestep */
+#define LINECHARS 128       /* room for a final_state.dat line: three ints, four floats of at most 19 chars */
+#define AVLINECHARS 40      /* ... and for an av_vels.dat line */
+#define AVCHUNK 4096        /* av_vels.dat lines a thread formats at a time */
+#define FMTBYTES (1 << 24)  /* text the parallel writers format before writing it out */
+#define NFORMATCHECK (1 << 18) /* random values --selftest formats both ways */
+#define GZBLOCK (1 << 20)   /* text per gzip member of --gzip, at most, unless a row is longer */
+#define GZLEVEL 6           /* --gzip compression level, zlib's default */
+#define GZWRAPPER 32        /* gzip header and trailer bytes, and to spare, beyond compressBound() */
+#define FS_GAS 0            /* free surface cell types, --free-surface */
+#define FS_INTERFACE 1
+#define FS_FLUID 2
+#define FS_OBSTACLE 3
+#define FS_FILLED 1         /* ... and the conversions an interface cell is listed for */
+#define FS_EMPTIED 2
+#define FSKAPPA 1e-3f       /* mass beyond full or empty, relative to the density, before an interface cell converts */
+#define FSUMAX 0.25f        /* speed the free surface equilibria are limited to, below the lattice speed of sound */
+#define SPONGESTRENGTH 0.1f /* default blend towards the target at the outer edge of a --sponge */
+#define MAXROIS 16          /* --roi windows, at most */
+#define ROIFILE "roi_x%d_y%d_w%d_h%d_%06d.bin" /* --roi output, by window and timestep */
+#define COARSEFILE "coarse%d_%06d.bin" /* --roi-coarse output, by factor and timestep */
+#define PROBESIZE (1 << 25) /* floats per array in the bandwidth probe, well beyond the LLC */
+#define PROBEREPS 10        /* repetitions of each probe kernel, the best is reported */
+
+/*
+** Vectors for the shuffle kernel: VECWIDTH floats, with the east/west
+** neighbour vectors built in registers from aligned loads. VWEST(prev,
+** cur) is the row one cell to the west of cur, taking its first lane
+** from the last lane of prev; VEAST(cur, next) the row one cell to the
+** east. Without AVX2 the kernel falls back to timestep().
+*/
+#if defined(__AVX512F__)
+#define VECWIDTH 16
+typedef __m512 t_vec;
+typedef __mmask16 t_vmask;
+#define VLOAD(p) _mm512_load_ps(p)
+#define VSTORE(p, v) _mm512_store_ps(p, v)
+#define VSTOREU(p, v) _mm512_storeu_ps(p, v)
+#define VSET1(x) _mm512_set1_ps(x)
+#define VWEST(prev, cur) _mm512_castsi512_ps(_mm512_alignr_epi32(_mm512_castps_si512(cur), _mm512_castps_si512(prev), 15))
+#define VEAST(cur, next) _mm512_castsi512_ps(_mm512_alignr_epi32(_mm512_castps_si512(next), _mm512_castps_si512(cur), 1))
+#define VFLUID(p) _mm512_cmpeq_epi32_mask(_mm512_loadu_si512(p), _mm512_setzero_si512())
+#define VSELECT(m, a, b) _mm512_mask_blend_ps(m, b, a) /* a where m is set, else b */
+#define VADD _mm512_add_ps
+#define VSUB _mm512_sub_ps
+#define VMUL _mm512_mul_ps
+#define VDIV _mm512_div_ps
+#define VSQRT _mm512_sqrt_ps
+#elif defined(__AVX2__)
+#define VECWIDTH 8
+typedef __m256 t_vec;
+typedef __m256 t_vmask;
+#define VLOAD(p) _mm256_load_ps(p)
+#define VSTORE(p, v) _mm256_store_ps(p, v)
+#define VSTOREU(p, v) _mm256_storeu_ps(p, v)
+#define VSET1(x) _mm256_set1_ps(x)
+/* alignr works within 128-bit lanes, so first pair up the halves that meet across the lane boundary */
+#define VWEST(prev, cur) _mm256_castsi256_ps(_mm256_alignr_epi8(_mm256_castps_si256(cur), \
+    _mm256_castps_si256(_mm256_permute2f128_ps(prev, cur, 0x21)), 12))
+#define VEAST(cur, next) _mm256_castsi256_ps(_mm256_alignr_epi8( \
+    _mm256_castps_si256(_mm256_permute2f128_ps(cur, next, 0x21)), _mm256_castps_si256(cur), 4))
+#define VFLUID(p) _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(p)), _mm256_setzero_si256()))
+#define VSELECT(m, a, b) _mm256_blendv_ps(b, a, m) /* a where m is set, else b */
+#define VADD _mm256_add_ps
+#define VSUB _mm256_sub_ps
+#define VMUL _mm256_mul_ps
+#define VDIV _mm256_div_ps
+#define VSQRT _mm256_sqrt_ps
+#endif
 
 /* struct to hold the parameter values */
 typedef struct
@@ -90,30 +236,373 @@ typedef struct
   float *s7;
   float *s8;
 } t_speeds;
+
+/*
+** The lattice as moments, for the regularised scheme: density,
+** momentum and momentum flux, from which the populations are
+** rebuilt, to second order, whenever they are needed. A solid cell
+** holds what rebound() reflects into it, which six moments cannot,
+** so the few solid cells keep their nine populations instead.
+*/
+typedef struct
+{
+  float *rho;     /* sum of f_i */
+  float *j_x;     /* sum of f_i c_ix */
+  float *j_y;     /* sum of f_i c_iy */
+  float *p_xx;    /* sum of f_i c_ix c_ix */
+  float *p_yy;    /* sum of f_i c_iy c_iy */
+  float *p_xy;    /* sum of f_i c_ix c_iy */
+  float *solid;   /* the NSPEEDS populations of each solid cell, in row order */
+  int *solid_row; /* index of the first solid cell of each row, ny + 1 entries */
+  float *rows;    /* per thread, the three rebuilt rows of timestep_moments() */
+} t_moments;
+
+/*
+** A sparse lattice of TILESIZE x TILESIZE tiles, for mostly solid
+** domains: only tiles with fluid in them or in their halo are kept.
+** Each tile holds its nine speeds one after the other, TILECELLS
+** values each, in row major order within the tile. Dropped tiles all
+** map to one extra tile at the rest state, which is read but never
+** updated.
+*/
+typedef struct
+{
+  int ntx, nty;    /* no. of tiles in x- and y-direction */
+  int ntiles;      /* no. of kept tiles, and the number of the rest tile */
+  int *tile_of;    /* ntx * nty: the number of the tile at (tx, ty) */
+  int *coords;     /* tx, ty of each kept tile */
+  int *neighbours; /* NSPEEDS per tile: the tile in the direction of each speed */
+  int *obstacles;  /* TILECELLS per kept tile */
+  float *cells;    /* NSPEEDS * TILECELLS per tile */
+  float *tmp_cells;
+  int nfluid;      /* no. of fluid cells */
+} t_tiles;
+
+/*
+** SMT helper prefetching: a pthread pinned on the idle hyperthread
+** sibling of each compute thread follows that thread's progress
+** through its block of rows and prefetches the rows just ahead into
+** the L2 they share.
+*/
+typedef struct t_smt t_smt;
+
+typedef struct
+{
+  t_smt *smt;  /* the mode it belongs to */
+  int thread;  /* the OpenMP thread it follows */
+  int cpu;     /* where it is pinned, -1 for no helper */
+  pthread_t tid;
+  int running; /* 1 once started */
+  long rows;   /* rows prefetched */
+} t_smt_helper;
+
+struct t_smt
+{
+  t_param params;
+  int *obstacles;
+  t_speeds *cells;       /* the lattice the current timestep reads, published before each timestep */
+  int *rows;             /* per compute thread, SMTSTRIDE apart: the last row it finished, -1 before its first each timestep */
+  int *compute_cpu;      /* cpu of each compute thread */
+  t_smt_helper *helpers; /* one per compute thread */
+  int nthreads;          /* no. of compute threads */
+  int nhelpers;          /* no. of helpers started */
+  int distance;          /* rows to prefetch ahead */
+  int stop;              /* set to end the helpers */
+};
+
+/*
+** A timestep implementation: propagate, rebound and collide cells
+** into tmp_cells, returning the average velocity of the new state.
+** The caller accelerates the flow in cells first, so that the
+** serial accelerate_flow() can be timed on its own.
+*/
+typedef float (*t_kernel_fn)(const t_param params, t_speeds *cells, t_speeds *tmp_cells, int *obstacles);
+
+/* a kernel variant, selected at runtime with --kernel <name> */
+typedef struct
+{
+  const char *name;        /* name on the command line */
+  t_kernel_fn fn;          /* the timestep */
+  const char *description; /* one line for usage() */
+} t_kernel;
+
+/*
+** Header of the binary output files. It is followed by nfields
+** arrays of nx * ny values, each in the same row major order as
+** the text output.
+*/
+typedef struct
+{
+  char magic[8]; /* BINMAGIC, not terminated */
+  int kind;      /* BINFINALSTATE or BINAVVELS */
+  int nx;        /* no. of cells in x-direction, or no. of timesteps */
+  int ny;        /* no. of cells in y-direction, or 1 */
+  int nfields;   /* no. of arrays that follow */
+} t_binheader;
+
+/* bytes a run needs, in the order initialise() allocates them */
+typedef struct
+{
+  size_t lattices;  /* cells and tmp_cells */
+  size_t obstacles; /* obstacle mask */
+  size_t av_vels;   /* av. velocity history */
+  size_t optional;  /* buffers of the enabled optional modes */
+  size_t per_cell;  /* bytes that scale with nx * ny */
+  size_t fixed;     /* bytes that do not */
+} t_footprint;
+
+/*
+** Asynchronous output. A file is handed over as one AIOALIGN aligned
+** image and written by an io_uring or a pool of threads while the
+** solver keeps stepping; the engine frees the image once it is on
+** disk. Large images are padded to AIOALIGN and written with O_DIRECT,
+** and the file is truncated to its length afterwards.
+*/
+typedef struct t_aio_file t_aio_file;
+
+/* one write of a file, in flight on the io_uring */
+typedef struct
+{
+  t_aio_file *file; /* the file it belongs to */
+  size_t offset;    /* first byte of the image still to write */
+  size_t bytes;     /* bytes still to write */
+} t_aio_op;
+
+struct t_aio_file
+{
+  char name[64];    /* for error messages */
+  int fd;
+  int direct;       /* 1 while the file is open with O_DIRECT */
+  char *buffer;     /* the image, freed once written */
+  size_t length;    /* bytes of the file */
+  size_t padded;    /* bytes of the image, length rounded up to AIOALIGN */
+  int pending;      /* writes in flight */
+  t_aio_op *ops;    /* one per AIOCHUNK, io_uring only */
+  t_aio_file *next; /* queue of the thread pool */
+};
+
+typedef struct
+{
+  int backend;         /* AIO_URING, AIO_THREADS or AIO_SYNC */
+  int inflight;        /* files queued or being written */
+  long files;          /* files written */
+  double bytes;        /* ... and their bytes */
+  double blocked;      /* seconds the solver waited on the engine */
+  /* io_uring: the rings shared with the kernel */
+  int ring_fd;
+  void *sq_map, *cq_map;
+  size_t sq_size, cq_size;
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned sq_entries;
+  unsigned ops;        /* writes submitted and not yet completed */
+  /* thread pool */
+  pthread_t threads[AIOTHREADS];
+  pthread_mutex_t lock;
+  pthread_cond_t wake; /* a file was queued, or stop was set */
+  pthread_cond_t done; /* a file was written */
+  t_aio_file *head, *tail;
+  int stop;
+} t_aio;
+
+/*
+** Emulated distributed run: the rows are split into nranks blocks,
+** and each timestep the populations that stream across a block
+** boundary travel as 16 bit deviations from their rest equilibrium
+** w_i density, with one float scale per population and message. A
+** full precision run alongside measures what the encoding costs.
+*/
+typedef struct
+{
+  int nranks;             /* no. of emulated ranks */
+  int *first;             /* first row of each rank, and ny */
+  short *message;         /* the encoded deviations of each message */
+  double max_error;       /* largest |decoded - sent| / density */
+  double sum_sq;          /* ... summed squared */
+  long nvalues;           /* populations sent */
+  size_t bytes16;         /* bytes of the messages of one timestep, as sent */
+  size_t bytes32;         /* ... and as floats */
+  t_speeds *ref_cells;    /* the full precision run */
+  t_speeds *ref_tmp_cells;
+  float *ref_av_vels;     /* ... and its av. velocities */
+} t_halo;
+
+/*
+** Free surface run: each cell is gas, interface, fluid or obstacle.
+** Only the fluid and interface cells, in the active list, are
+** updated; the interface cells track the liquid mass they hold, and
+** those that fill or empty are listed for conversion after the
+** timestep, so the types change only around the surface.
+*/
+typedef struct
+{
+  unsigned char *type;    /* FS_GAS, FS_INTERFACE, FS_FLUID or FS_OBSTACLE */
+  unsigned char *pending; /* FS_FILLED or FS_EMPTIED while listed, else 0 */
+  float *mass;            /* liquid mass of each cell */
+  float *fill;            /* ... as a fraction of its density */
+  float *rho;             /* density after the last timestep */
+  int *active;            /* the fluid and interface cells */
+  int nactive;
+  int *filled;            /* interface cells to convert to fluid */
+  int nfilled;
+  int *emptied;           /* ... and to gas */
+  int nemptied;
+  double initial_mass;    /* liquid mass at the start */
+  double lost_mass;       /* excess mass no interface neighbour could take */
+  double sum_active;      /* active cells, summed over the timesteps */
+  long conversions;       /* cells filled or emptied */
+} t_free_surface;
+
+/*
+** Absorbing sponge: within the listed cells near the chosen edges,
+** the populations are blended towards one target equilibrium after
+** each timestep, so that disturbances die out instead of wrapping
+** around the periodic boundaries.
+*/
+typedef struct
+{
+  int ncells;              /* cells in any sponge */
+  int *cell;               /* ... their indices */
+  float *sigma;            /* ... and blend strengths */
+  float target[NSPEEDS];   /* the target equilibrium */
+} t_sponge;
+
+/* a --roi window: first cell and extent */
+typedef struct
+{
+  int x, y; /* first column and row */
+  int w, h; /* columns and rows */
+} t_roi;
+
+/*
+** The discrete adjoint runs a gray lattice: after streaming, each
+** cell blends the BGK collision with bounce-back by its porosity s,
+** f_i = (1 - s) BGK(f)_i + s f_opp(i), so that s = 0 is fluid and
+** s = 1 is the deck's rebound() of an obstacle.
+*/
+typedef struct
+{
+  int objective;   /* ADJ_VELOCITY or ADJ_DRAG */
+  double *porosity; /* s of every cell, from 0 (fluid) to 1 (solid) */
+  int *obstacles;  /* the deck's mask, which fixes the accelerated and averaged cells */
+  int nfluid;      /* no. of cells the av. velocity is averaged over */
+  double weight;   /* 1 / maxIters, the time average of the objective */
+  double *work;    /* the accelerated copy of a state */
+} t_adjoint;
+
+/*
+** Steady state detection and anderson mixing. Every period timesteps
+** the macroscopic state x = (rho, u_x, u_y) is compared with the
+** previous one; the history of iterates and residuals extrapolates
+** the next x, and the populations are moved to its equilibrium.
+*/
+typedef struct
+{
+  float tol;                   /* residual that counts as steady, 0 to never stop */
+  int depth;                   /* anderson history depth m, 0 for no mixing */
+  int period;                  /* timesteps between checks */
+  int nhist;                   /* (iterate, residual) pairs held */
+  float *x[ANDERSONMAX + 1];   /* iterates, oldest first */
+  float *r[ANDERSONMAX + 1];   /* their residuals */
+  float *x_prev;               /* the iterate the last period started from */
+  float *x_cur;                /* the state at this check */
+  t_speeds *backup;            /* populations before the last mix */
+  int have_prev;               /* 0 until the first check */
+  int mixed;                   /* 1 if the last period started from a mix */
+  double res_before;           /* residual the last mix started from */
+  int cooldown;                /* checks to skip mixing after a rejected mix */
+  int streak;                  /* mixes rejected in a row */
+  double residual;             /* latest residual, -1 before the second check */
+  int mixes;                   /* mixes applied */
+  int rejected;                /* ... and undone by the guard */
+} t_steady;
+
+/* RAPL energy counters (package and DRAM domains) found under RAPLDIR */
+typedef struct
+{
+  int nzones;                              /* no. of readable zones, 0 if none */
+  char path[MAXRAPLZONES][160];            /* energy_uj file of each zone */
+  int is_dram[MAXRAPLZONES];               /* 1 for a DRAM zone, 0 for a package zone */
+  unsigned long long max_uj[MAXRAPLZONES]; /* counter range, for wraparound */
+} t_energy;
+
+/* where an OpenMP thread runs, and where the lattice rows it updates live */
+typedef struct
+{
+  int cpu;           /* cpu at the start of the check */
+  int cpu_after;     /* cpu at the end of the check, differs if the thread migrated */
+  int core;          /* core id within the socket */
+  int socket;        /* physical package id */
+  int node;          /* NUMA node of the cpu */
+  long local_pages;  /* lattice pages on the thread's own node */
+  long remote_pages; /* lattice pages on another node */
+} t_placement;
+
+/* one reading of every zone in a t_energy */
+typedef struct
+{
+  unsigned long long uj[MAXRAPLZONES];
+} t_energy_sample;
+
 /*
 ** function prototypes
 */
 
-/* load params, allocate memory, load obstacles & initialise fluid particle densities */
-int initialise(const char *paramfile, const char *obstaclefile,
-               t_param *params, t_speeds **cells_ptr, t_speeds **tmp_cells_ptr,
-               int **obstacles_ptr, float **av_vels_ptr);
+/* load params, allocate memory, load obstacles & initialise fluid particle densities;
+** with moments set the caller keeps the lattices as moments, and the cells are left NULL */
+int initialise(const char *paramfile, const char *obstaclefile, t_param *params, int moments,
+               t_speeds **cells_ptr, t_speeds **tmp_cells_ptr, int **obstacles_ptr, float **av_vels_ptr);
+int read_params(const char *paramfile, t_param *params);
+t_speeds *alloc_speeds(const t_param *params, const char *name);
+void init_speeds(const t_param *params, t_speeds *cells);
+void free_speeds(t_speeds **speeds_ptr);
 
 /*
 ** The main calculation methods.
-** timestep calls, in order, the functions:
-** accelerate_flow(), propagate(), rebound() & collision()
+** Each timestep starts with accelerate_flow(), then
+** timestep fuses the other stages into one pass over the grid, and
+** timestep_reference calls, in order, the functions:
+** propagate(), rebound() & collision()
 */
 float timestep(const t_param params, t_speeds *cells, t_speeds *tmp_cells, int *obstacles);
+float timestep_reference(const t_param params, t_speeds *cells, t_speeds *tmp_cells, int *obstacles);
+float timestep_shuffle(const t_param params, t_speeds *cells, t_speeds *tmp_cells, int *obstacles);
 int accelerate_flow(const t_param params, t_speeds *cells, int *obstacles);
-int propagate(const t_param params, t_speed *cells, t_speed *tmp_cells);
-int rebound(const t_param params, t_speed *cells, t_speed *tmp_cells, int *obstacles);
-int collision(const t_param params, t_speed *cells, t_speed *tmp_cells, int *obstacles);
-int write_values(const t_param params, t_speeds *cells, int *obstacles, float *av_vels);
+int propagate(const t_param params, t_speeds *cells, t_speeds *tmp_cells);
+int rebound(const t_param params, t_speeds *cells, t_speeds *tmp_cells, int *obstacles);
+int collision(const t_param params, t_speeds *cells, t_speeds *tmp_cells, int *obstacles);
+int write_values(const t_param params, t_speeds *cells, int *obstacles, float *av_vels, int gzip);
+int write_av_vels(const t_param params, float *av_vels);
+int write_binary(const t_param params, t_speeds *cells, int *obstacles, float *av_vels, t_aio *aio);
+char *state_image(const t_param params, t_speeds *cells, int *obstacles, size_t *length);
+void row_values(const t_param params, t_speeds *cells, int *obstacles, int jj,
+                float *u_x, float *u_y, float *u, float *pressure);
+
+/* the text outputs: byte for byte printf("%.12E") and printf("%d"), formatted and compressed in parallel */
+int write_state(const t_param params, t_speeds *cells, int *obstacles, t_tiles *tiles, int gzip);
+size_t gzip_member(const char *text, size_t length, char *out, size_t room);
+size_t format_row(const t_param params, int jj, const float *u_x, const float *u_y, const float *u,
+                  const float *pressure, const int *blocked, char *out);
+int format_float(char *out, float value);
+void decimal_scale(unsigned int m, int e, int s, unsigned long long *q, int *half);
+int format_int(char *out, int value);
 
-int propagate_single(const t_param params, t_speed *cells, t_speed *tmp_cells, int jj, int ii);
-int rebound_single(const t_param params, t_speed *cells, t_speed *tmp_cells, int *obstacles, int jj, int ii);
-int collision_single(const t_param params, t_speed *cells, t_speed *tmp_cells, int *obstacles, int jj, int ii);
+int propagate_single(const t_param params, t_speeds *cells, t_speeds *tmp_cells, int jj, int ii);
+int rebound_single(const t_param params, t_speeds *cells, t_speeds *tmp_cells, int *obstacles, int jj, int ii);
+int collision_single(const t_param params, t_speeds *cells, t_speeds *tmp_cells, int *obstacles, int jj, int ii);
+
+/* the kernel registry, and the self-test of every kernel against the reference */
+const t_kernel *find_kernel(const char *name);
+int selftest(void);
+int selftest_moments(const t_param params, int *obstacles, const float *start, int nsteps, float tolerance,
+                     float av_tolerance);
+int selftest_tiles(const t_param geometry, float solid, unsigned int seed, int nsteps, float tolerance,
+                   float av_tolerance);
+int selftest_lattices(int nsteps, double tolerance);
+int format_check(void);
+float rand_uniform(unsigned int *state);
 
 /* finalise, including freeing up allocated memory */
 int finalise(const t_param *params, t_speeds **cells_ptr, t_speeds **tmp_cells_ptr,
@@ -129,10 +618,179 @@ float av_velocity(const t_param params, t_speeds *cells, int *obstacles);
 /* calculate Reynolds number */
 float calc_reynolds(const t_param params, t_speeds *cells, int *obstacles);
 
+/* energy measurement: find the RAPL zones, read them, and compute joules between two readings */
+int energy_init(t_energy *energy);
+int read_counter(const char *file, unsigned long long *value);
+void energy_read(const t_energy *energy, t_energy_sample *sample);
+void energy_delta(const t_energy *energy, const t_energy_sample *from, const t_energy_sample *to,
+                  double *pkg_joules, double *dram_joules);
+void report_energy(const t_param params, const t_energy *energy, const t_energy_sample *e_init,
+                   const t_energy_sample *e_comp, const t_energy_sample *e_out, const t_energy_sample *e_end);
+
+/* roofline: measure sustainable bandwidth, and model the traffic and work of one lattice update */
+void bandwidth_probe(double *copy_bw, double *triad_bw);
+void kernel_traffic(int moments, double *bytes, double *bytes_wa, double *flops);
+void report_roofline(const t_param params, int *obstacles, double comp_time, double copy_bw, double triad_bw,
+                     int moments);
+
+/* report each thread's cpu/core/socket/node and the locality of its lattice pages, abort if strict and misplaced */
+void check_affinity(const t_param params, t_speeds *cells, t_speeds *tmp_cells, int strict);
+void cpu_topology(int cpu, int *core, int *socket, int *node);
+int sysfs_int(const char *file);
+
+/* memory planning: bytes a run needs, what the node has, and the largest grid that fits */
+void plan_footprint(const t_param params, int roofline, int moments, t_footprint *footprint);
+size_t available_memory(int *nnodes, size_t *node_bytes);
+int local_ranks(void);
+void report_plan(const t_param params, int roofline, int moments);
+
+/* synthetic benchmark: generated geometries x grid sizes x kernels x thread counts */
+int benchmark(const char *sizes_list, const char *threads_list, int iterations);
+void make_geometry(const t_param params, int *obstacles, int kind, float solid, unsigned int seed);
+int parse_list(const char *text, int *values, int max_values);
+
+/* strong or weak scaling of a deck over thread counts, with a per-phase breakdown */
+int scaling(const char *paramfile, const char *obstaclefile, int weak, const char *threads_list,
+            const t_kernel *kernel);
+
+/* microbenchmarks of the stages of a timestep, in cycles per cell */
+int microbench(void);
+void micro_stream(const t_param params, t_speeds *cells, t_speeds *tmp_cells);
+float micro_collide(const t_param params, t_speeds *cells, t_speeds *tmp_cells);
+unsigned long long cycle_count(void);
+
+/* parareal: time slices advanced concurrently by timestep(), corrected by a 2x coarser lattice */
+int parareal(const t_param params, t_speeds **cells_ptr, int *obstacles, float *av_vels,
+             const t_kernel *kernel, int nslices, int max_k);
+void coarse_propagate(const t_param params, const t_param coarse, t_speeds *in, t_speeds *out,
+                      int *coarse_obstacles, t_speeds *c_cells, t_speeds *c_tmp_cells,
+                      const t_kernel *kernel, int steps);
+float parareal_correct(const t_param params, t_speeds *u, t_speeds *fine, t_speeds *g_new, t_speeds *g_old);
+void copy_speeds(const t_param params, t_speeds *dst, t_speeds *src);
+
+/* discrete adjoint of the timestep: sensitivity of an objective to the porosity of every cell */
+int adjoint(const t_param params, int *obstacles, int objective, int ncheckpoints, int ncheck);
+double adj_run(const t_param params, const t_adjoint *adj, double *checkpoints, int stride);
+void adj_accelerate(const t_param params, const t_adjoint *adj, double *f);
+double adj_step(const t_param params, const t_adjoint *adj, const double *f, double *f_next);
+void adj_step_back(const t_param params, const t_adjoint *adj, const double *f, const double *f_next,
+                   const double *lambda_next, double *lambda, double *grad);
+
+/* steady state: convergence check and anderson mixing of the macroscopic state; steady_update() is 1 once
+** steady, and -1 when it undid a mix and put back the populations of the period before */
+void steady_init(const t_param params, t_steady *steady, float tol, int depth, int period);
+int steady_update(const t_param params, t_steady *steady, t_speeds *cells, int *obstacles);
+int anderson_mix(const t_param params, t_steady *steady, t_speeds *cells, int *obstacles);
+void macroscopic_state(const t_param params, t_speeds *cells, int *obstacles, float *x);
+void reequilibrate(const t_param params, t_speeds *cells, int *obstacles, const float *x_old, const float *x_new);
+void steady_free(t_steady *steady);
+
+/* moment space storage: six moments per cell in place of nine populations */
+float timestep_moments(const t_param params, t_moments *cells, t_moments *tmp_cells, int *obstacles);
+void moment_row(const t_param params, t_moments *cells, int *obstacles, int jj, float *row);
+float moment_population(int ss, float rho, float j_x, float j_y, float p_xx, float p_yy, float p_xy);
+int accelerate_flow_moments(const t_param params, t_moments *cells, int *obstacles);
+t_moments *alloc_moments(const t_param *params, int *obstacles, const char *name);
+void init_moments(const t_param *params, t_moments *cells);
+void free_moments(t_moments **moments_ptr);
+void moments_to_speeds(const t_param params, t_moments *moments, int *obstacles, t_speeds *cells);
+
+/* sparse tiles: only the tiles of the domain that hold fluid are allocated and updated */
+int initialise_tiles(const char *paramfile, const char *obstaclefile, t_param *params, t_tiles *tiles,
+                     float **av_vels_ptr);
+void tiles_init(const t_param *params, t_tiles *tiles, const unsigned char *solid);
+float timestep_tiles(const t_param params, t_tiles *tiles);
+int accelerate_flow_tiles(const t_param params, t_tiles *tiles);
+float av_velocity_tiles(const t_param params, t_tiles *tiles);
+int write_tiles(const t_param params, t_tiles *tiles, float *av_vels, int gzip);
+void tile_row_values(const t_param params, t_tiles *tiles, int jj, float *u_x, float *u_y, float *u,
+                     float *pressure, int *blocked);
+void free_tiles(t_tiles *tiles);
+
+/* SMT helper threads that prefetch ahead of the compute threads of timestep() */
+int smt_start(const t_param params, t_smt *smt, int *obstacles, int distance);
+void smt_step(t_smt *smt, t_speeds *cells);
+void *smt_helper(void *arg);
+int smt_sibling(int cpu);
+void smt_stop(t_smt *smt);
+
+/* asynchronous output: io_uring, a thread pool or plain writes of aligned file images */
+int aio_init(t_aio *aio, int backend);
+int uring_init(t_aio *aio);
+char *aio_alloc(size_t length);
+void aio_write(t_aio *aio, const char *name, char *buffer, size_t length);
+void uring_submit(t_aio *aio, t_aio_op *op);
+void uring_reap(t_aio *aio, int wait);
+int aio_pwrite(t_aio_file *file);
+void aio_undirect(t_aio_file *file);
+void aio_finish(t_aio_file *file);
+void *aio_worker(void *arg);
+void aio_poll(t_aio *aio);
+void aio_wait(t_aio *aio);
+void aio_close(t_aio *aio);
+
+/* emulated halo exchange of a 1D decomposition in 16 bit, checked against a float exchange */
+int halo_init(const t_param params, t_halo *halo, int nranks, t_speeds *cells);
+void halo_exchange(const t_param params, t_halo *halo, t_speeds *cells);
+void halo_reference_step(const t_param params, t_halo *halo, const t_kernel *kernel, int *obstacles, int tt);
+void report_halo(const t_param params, t_halo *halo, t_speeds *cells, int *obstacles, float *av_vels);
+void halo_free(t_halo *halo);
+
+/* free surface flow tracked by the mass of the interface cells; gas cells are skipped */
+int fs_init(const t_param params, t_free_surface *fs, int *obstacles, float height, float width);
+float fs_equilibrium(int kk, float rho, float u_x, float u_y);
+void fs_limit(float *u_x, float *u_y);
+float timestep_free_surface(const t_param params, t_free_surface *fs, t_speeds *cells, t_speeds *tmp_cells);
+void fs_convert(const t_param params, t_free_surface *fs, t_speeds *cells);
+double fs_mass(t_free_surface *fs);
+void fs_mask(const t_param params, t_free_surface *fs, int *obstacles);
+void fs_free(t_free_surface *fs);
+
+/* absorbing sponge layers along chosen edges, applied after the kernel */
+int sponge_init(const t_param params, t_sponge *sponge, const char *spec, float strength, float velocity,
+                int *obstacles);
+void apply_sponge(t_sponge *sponge, t_speeds *cells);
+void sponge_free(t_sponge *sponge);
+
+/* snapshots of regions of interest at full resolution, and of the whole grid coarsened */
+char *window_image(const t_param params, t_speeds *cells, int *obstacles, const t_roi *roi, size_t *length);
+char *coarse_image(const t_param params, t_speeds *cells, int *obstacles, int factor, size_t *length);
+size_t roi_snapshot(const t_param params, t_speeds *cells, int *obstacles, const t_roi *rois, int nrois, int coarse,
+                    int tt, t_aio *aio);
+
 /* utility functions */
 void die(const char *message, const int line, const char *file);
 void usage(const char *exe);
+double wall_time(void);
+
+/* kernels generated from lattice descriptors by codegen/ddqq.py */
+#include "gen/d2q9.h"
+#include "gen/d3q19.h"
+#include "gen/d3q27.h"
 
+/*
+** The kernel variants. The first is the default, and --selftest
+** checks all of them against "reference".
+*/
+const t_kernel kernels[] = {
+    {"fused", timestep, "propagate, rebound and collision fused in one pass over the SoA lattice"},
+    {"reference", timestep_reference, "separate accelerate_flow, propagate, rebound and collision passes"},
+    {"shuffle", timestep_shuffle, "fused, with east/west neighbours shifted in registers (AVX2/AVX-512, nx a multiple of the width)"},
+    {"generated", timestep_d2q9, "fused kernel generated from the D2Q9 descriptor by codegen/ddqq.py"},
+};
+#define NKERNELS (int)(sizeof(kernels) / sizeof(kernels[0]))
+
+/* the lattice velocities, their weights and opposites, in the speed numbering above */
+const int lat_cx[NSPEEDS] = {0, 1, 0, -1, 0, 1, -1, -1, 1};
+const int lat_cy[NSPEEDS] = {0, 0, 1, 0, -1, 1, 1, -1, -1};
+const int lat_opp[NSPEEDS] = {0, 3, 4, 1, 2, 7, 8, 5, 6};
+const double lat_w[NSPEEDS] = {4.0 / 9.0, 1.0 / 9.0, 1.0 / 9.0, 1.0 / 9.0, 1.0 / 9.0,
+                               1.0 / 36.0, 1.0 / 36.0, 1.0 / 36.0, 1.0 / 36.0};
+
+/* where timestep() publishes each thread's progress for --smt-prefetch, NULL when off */
+int *smt_rows = NULL;
+
+#ifndef D2Q9_LIBRARY /* defined when the solver is built into python/_d2q9.c */
 /*
 ** main program:
 ** initialise, timestep loop, finalise
@@ -148,36 +806,392 @@ int main(int argc, char *argv[])
   float *av_vels = NULL;                                                             /* a record of the av. velocity computed for each timestep */
   struct timeval timstr;                                                             /* structure to hold elapsed time */
   double tot_tic, tot_toc, init_tic, init_toc, comp_tic, comp_toc, col_tic, col_toc; /* floating point numbers to calculate elapsed wallclock time */
+  double out_tic, out_toc;                                                           /* elapsed time of writing the output files */
+  int measure_energy = 0;                                                            /* read the RAPL counters around each phase */
+  t_energy energy;                                                                   /* RAPL zones found at startup */
+  t_energy_sample e_init, e_comp, e_out, e_end;                                      /* counter readings at the phase boundaries */
+  int affinity = 0;                                                                  /* 1 to report thread placement, 2 to also enforce it */
+  const t_kernel *kernel = &kernels[0];                                              /* timestep implementation */
+  int binary_output = 0;                                                             /* write final_state.bin/av_vels.bin instead of text */
+  int bench = 0;                                                                     /* run the synthetic benchmark, then exit */
+  const char *bench_sizes = NULL, *bench_threads = NULL;                             /* benchmark lists, NULL for the defaults */
+  int bench_iters = 0;                                                               /* benchmark iterations, 0 to scale with size */
+  int scale = 0;                                                                     /* 1 for strong, 2 for weak scaling, then exit */
+  const char *scaling_threads = NULL;                                                /* scaling thread counts, NULL for the default */
+  int plan = 0;                                                                      /* only report the memory footprint, then exit */
+  int roofline = 0;                                                                  /* probe bandwidth and report attained vs attainable */
+  double copy_bw, triad_bw;                                                          /* bandwidth probe results (bytes/s) */
+  int parareal_slices = 0;                                                           /* time slices, 0 for the serial timestep loop */
+  int parareal_iters = 0;                                                            /* most parareal corrections, 0 for one per slice */
+  int adjoint_objective = -1;                                                        /* ADJ_VELOCITY or ADJ_DRAG, -1 for a forward run */
+  int adjoint_checkpoints = 0;                                                       /* adjoint checkpoints, 0 for sqrt(maxIters) */
+  int adjoint_check = 0;                                                             /* cells to check by finite differences */
+  float steady_tol = 0.f;                                                            /* stop once steady to this residual, 0 to run maxIters */
+  int anderson_depth = 0;                                                            /* anderson history, 0 for no mixing */
+  int anderson_period = 0;                                                           /* timesteps between steady checks, 0 for the default */
+  t_steady steady;                                                                   /* steady state check and mixing history */
+  int moments = 0;                                                                   /* store the lattice as moments (regularised scheme) */
+  t_moments *m_cells = NULL, *m_tmp_cells = NULL;                                    /* the lattice and scratch space, as moments */
+  int sparse = 0;                                                                    /* allocate only the tiles that hold fluid */
+  t_tiles tiles;                                                                     /* the lattice, as tiles */
+  int smt_prefetch = 0;                                                              /* run prefetching helpers on idle SMT siblings */
+  int smt_distance = 0;                                                              /* rows the helpers run ahead, 0 for the default */
+  t_smt smt;                                                                         /* the helpers */
+  int io_backend = AIO_URING;                                                        /* engine of the binary output and snapshots */
+  int snapshot_every = 0;                                                            /* timesteps between snapshots, 0 for none */
+  t_aio aio;                                                                         /* the output engine */
+  int gzip_output = 0;                                                               /* write final_state.dat.gz instead */
+  int halo_ranks = 0;                                                                /* emulated ranks of --halo16, 0 for none */
+  t_halo halo;                                                                       /* ... their messages and the float run */
+  float fs_height = 0.f;                                                             /* liquid fraction of the height, 0 for no free surface */
+  float fs_width = 1.f;                                                              /* ... and of the width */
+  t_free_surface fs;                                                                 /* cell types and liquid mass */
+  const char *sponge_spec = NULL;                                                    /* --sponge edges and widths, NULL for none */
+  float sponge_strength = SPONGESTRENGTH;                                            /* blend at the outer edge */
+  float sponge_velocity = 0.f;                                                       /* eastward velocity of the target */
+  t_sponge sponge;                                                                   /* the sponge cells */
+  t_roi rois[MAXROIS];                                                               /* --roi windows of the snapshots */
+  int nrois = 0;                                                                     /* ... how many */
+  int roi_coarse = 0;                                                                /* coarsening of the whole grid, 0 for none */
+  size_t roi_bytes = 0;                                                              /* bytes of the last snapshot */
 
   /* parse the command line */
-  if (argc != 3)
+  for (int arg = 1; arg < argc; arg++)
   {
-    usage(argv[0]);
+    if (!strcmp(argv[arg], "--energy"))
+      measure_energy = 1;
+    else if (!strcmp(argv[arg], "--affinity"))
+      affinity = (affinity > 1) ? affinity : 1;
+    else if (!strcmp(argv[arg], "--affinity-strict"))
+      affinity = 2;
+    else if (!strcmp(argv[arg], "--kernel") && arg + 1 < argc)
+      kernel = find_kernel(argv[++arg]);
+    else if (!strcmp(argv[arg], "--selftest"))
+      return selftest() ? EXIT_FAILURE : EXIT_SUCCESS;
+    else if (!strcmp(argv[arg], "--binary"))
+      binary_output = 1;
+    else if (!strcmp(argv[arg], "--bench"))
+      bench = 1;
+    else if (!strcmp(argv[arg], "--bench-sizes") && arg + 1 < argc)
+      bench_sizes = argv[++arg];
+    else if (!strcmp(argv[arg], "--bench-threads") && arg + 1 < argc)
+      bench_threads = argv[++arg];
+    else if (!strcmp(argv[arg], "--bench-iters") && arg + 1 < argc)
+      bench_iters = atoi(argv[++arg]);
+    else if (!strcmp(argv[arg], "--scaling") && arg + 1 < argc)
+    {
+      arg++;
+      scale = !strcmp(argv[arg], "strong") ? 1 : (!strcmp(argv[arg], "weak") ? 2 : 0);
+      if (!scale)
+        usage(argv[0]);
+    }
+    else if (!strcmp(argv[arg], "--scaling-threads") && arg + 1 < argc)
+      scaling_threads = argv[++arg];
+    else if (!strcmp(argv[arg], "--microbench"))
+      return microbench();
+    else if (!strcmp(argv[arg], "--plan"))
+      plan = 1;
+    else if (!strcmp(argv[arg], "--roofline"))
+      roofline = 1;
+    else if (!strcmp(argv[arg], "--parareal") && arg + 1 < argc)
+      parareal_slices = atoi(argv[++arg]);
+    else if (!strcmp(argv[arg], "--parareal-iters") && arg + 1 < argc)
+      parareal_iters = atoi(argv[++arg]);
+    else if (!strcmp(argv[arg], "--adjoint") && arg + 1 < argc)
+    {
+      arg++;
+      adjoint_objective = !strcmp(argv[arg], "velocity") ? ADJ_VELOCITY : (!strcmp(argv[arg], "drag") ? ADJ_DRAG : -1);
+      if (adjoint_objective < 0)
+        usage(argv[0]);
+    }
+    else if (!strcmp(argv[arg], "--adjoint-checkpoints") && arg + 1 < argc)
+      adjoint_checkpoints = atoi(argv[++arg]);
+    else if (!strcmp(argv[arg], "--adjoint-check") && arg + 1 < argc)
+      adjoint_check = atoi(argv[++arg]);
+    else if (!strcmp(argv[arg], "--steady") && arg + 1 < argc)
+      steady_tol = atof(argv[++arg]);
+    else if (!strcmp(argv[arg], "--anderson") && arg + 1 < argc)
+      anderson_depth = atoi(argv[++arg]);
+    else if (!strcmp(argv[arg], "--anderson-period") && arg + 1 < argc)
+      anderson_period = atoi(argv[++arg]);
+    else if (!strcmp(argv[arg], "--moments"))
+      moments = 1;
+    else if (!strcmp(argv[arg], "--sparse"))
+      sparse = 1;
+    else if (!strcmp(argv[arg], "--smt-prefetch"))
+      smt_prefetch = 1;
+    else if (!strcmp(argv[arg], "--smt-distance") && arg + 1 < argc)
+      smt_distance = atoi(argv[++arg]);
+    else if (!strcmp(argv[arg], "--snapshot") && arg + 1 < argc)
+      snapshot_every = atoi(argv[++arg]);
+    else if (!strcmp(argv[arg], "--gzip"))
+      gzip_output = 1;
+    else if (!strcmp(argv[arg], "--halo16") && arg + 1 < argc)
+      halo_ranks = atoi(argv[++arg]);
+    else if (!strcmp(argv[arg], "--free-surface") && arg + 1 < argc)
+      fs_height = atof(argv[++arg]);
+    else if (!strcmp(argv[arg], "--free-surface-width") && arg + 1 < argc)
+      fs_width = atof(argv[++arg]);
+    else if (!strcmp(argv[arg], "--sponge") && arg + 1 < argc)
+      sponge_spec = argv[++arg];
+    else if (!strcmp(argv[arg], "--sponge-strength") && arg + 1 < argc)
+      sponge_strength = atof(argv[++arg]);
+    else if (!strcmp(argv[arg], "--sponge-velocity") && arg + 1 < argc)
+      sponge_velocity = atof(argv[++arg]);
+    else if (!strcmp(argv[arg], "--roi") && arg + 1 < argc)
+    {
+      t_roi *roi = &rois[nrois];
+
+      if (nrois == MAXROIS || sscanf(argv[++arg], "%d,%d,%d,%d", &roi->x, &roi->y, &roi->w, &roi->h) != 4)
+        usage(argv[0]);
+      nrois++;
+    }
+    else if (!strcmp(argv[arg], "--roi-coarse") && arg + 1 < argc)
+      roi_coarse = atoi(argv[++arg]);
+    else if (!strcmp(argv[arg], "--io") && arg + 1 < argc)
+    {
+      arg++;
+      io_backend = !strcmp(argv[arg], "uring") ? AIO_URING
+                   : (!strcmp(argv[arg], "threads") ? AIO_THREADS : (!strcmp(argv[arg], "sync") ? AIO_SYNC : -1));
+      if (io_backend < 0)
+        usage(argv[0]);
+    }
+    else if (argv[arg][0] == '-' && argv[arg][1] == '-')
+      usage(argv[0]);
+    else if (paramfile == NULL)
+      paramfile = argv[arg];
+    else if (obstaclefile == NULL)
+      obstaclefile = argv[arg];
+    else
+      usage(argv[0]);
   }
-  else
+
+  /* the benchmark generates its own geometries */
+  if (bench)
+    return benchmark(bench_sizes, bench_threads, bench_iters);
+
+  /* planning needs only the grid dimensions */
+  if (plan && paramfile != NULL)
+  {
+    read_params(paramfile, &params);
+    report_plan(params, roofline, moments);
+    if (sparse)
+      printf("Sparse tiles:\t\t\tchosen by the geometry, which --plan does not read; the dense figures\n"
+             "\t\t\t\tabove are about the most a sparse run needs\n");
+    return EXIT_SUCCESS;
+  }
+
+  if (obstaclefile == NULL)
+    usage(argv[0]);
+
+  if (scale)
+    return scaling(paramfile, obstaclefile, scale == 2, scaling_threads, kernel);
+
+  if (moments && (parareal_slices || steady_tol > 0.f || anderson_depth > 0 || affinity || kernel != &kernels[0]))
+    die("--moments runs its own kernel, and does not support --kernel, --parareal, --steady, --anderson or --affinity",
+        __LINE__, __FILE__);
+
+  if ((steady_tol > 0.f || anderson_depth > 0) && parareal_slices)
+    die("--steady and --anderson do not support --parareal", __LINE__, __FILE__);
+
+  if (sparse && (moments || parareal_slices || steady_tol > 0.f || anderson_depth > 0 || affinity ||
+                 adjoint_objective >= 0 || binary_output || roofline || kernel != &kernels[0]))
+    die("--sparse runs its own kernel, and does not support --kernel, --moments, --parareal, --steady, --anderson, "
+        "--affinity, --adjoint, --binary or --roofline", __LINE__, __FILE__);
+
+  if (smt_prefetch && (kernel->fn != timestep || moments || sparse || parareal_slices || adjoint_objective >= 0))
+    die("--smt-prefetch follows the fused kernel only, without --moments, --sparse, --parareal or --adjoint",
+        __LINE__, __FILE__);
+
+  if (snapshot_every > 0 && (moments || sparse || parareal_slices || adjoint_objective >= 0))
+    die("--snapshot does not support --moments, --sparse, --parareal or --adjoint", __LINE__, __FILE__);
+
+  if (gzip_output && binary_output)
+    die("--gzip compresses the text output, it does not apply to --binary", __LINE__, __FILE__);
+
+  if (halo_ranks && (moments || sparse || parareal_slices || adjoint_objective >= 0 || steady_tol > 0.f ||
+                     anderson_depth > 0 || smt_prefetch))
+    die("--halo16 does not support --moments, --sparse, --parareal, --adjoint, --steady, --anderson or --smt-prefetch",
+        __LINE__, __FILE__);
+
+  if (fs_height > 0.f && (moments || sparse || parareal_slices || adjoint_objective >= 0 || steady_tol > 0.f ||
+                         anderson_depth > 0 || smt_prefetch || halo_ranks || snapshot_every > 0 ||
+                         kernel != &kernels[0]))
+    die("--free-surface runs its own kernel, and does not support --kernel, --moments, --sparse, --parareal, "
+        "--adjoint, --steady, --anderson, --smt-prefetch, --halo16 or --snapshot", __LINE__, __FILE__);
+
+  if (sponge_spec != NULL && (moments || sparse || parareal_slices || adjoint_objective >= 0 || halo_ranks ||
+                              fs_height > 0.f))
+    die("--sponge does not support --moments, --sparse, --parareal, --adjoint, --halo16 or --free-surface",
+        __LINE__, __FILE__);
+
+  if ((nrois || roi_coarse) && snapshot_every <= 0)
+    die("--roi and --roi-coarse choose what --snapshot writes, and need it", __LINE__, __FILE__);
+
+  if (measure_energy && energy_init(&energy) == 0)
   {
-    paramfile = argv[1];
-    obstaclefile = argv[2];
+    fprintf(stderr, "RAPL energy counters under %s are not readable, energy will not be reported\n", RAPLDIR);
+    measure_energy = 0;
   }
 
+  /* probe before anything is allocated, with the same OpenMP placement as the kernel */
+  if (roofline)
+    bandwidth_probe(&copy_bw, &triad_bw);
+
   /* Total/init time starts here: initialise our data structures and load values from file */
+  if (measure_energy)
+    energy_read(&energy, &e_init);
   gettimeofday(&timstr, NULL);
   tot_tic = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
   init_tic = tot_tic;
-  initialise(paramfile, obstaclefile, &params, &cells, &tmp_cells, &obstacles, &av_vels);
+  if (sparse)
+    initialise_tiles(paramfile, obstaclefile, &params, &tiles, &av_vels);
+  else
+    initialise(paramfile, obstaclefile, &params, moments, &cells, &tmp_cells, &obstacles, &av_vels);
 
-  /* Init time stops here, compute time starts*/
+  if (moments)
+  {
+    m_cells = alloc_moments(&params, obstacles, "cells");
+    m_tmp_cells = alloc_moments(&params, obstacles, "tmp_cells");
+    init_moments(&params, m_cells);
+  }
+
+  /* Init time stops here */
   gettimeofday(&timstr, NULL);
   init_toc = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
-  comp_tic = init_toc;
 
-  for (int tt = 0; tt < params.maxIters; tt++)
+  /* the placement check is timed as neither init nor compute */
+  if (affinity)
+    check_affinity(params, cells, tmp_cells, affinity > 1);
+
+  /* the adjoint runs its own double precision forward pass */
+  if (adjoint_objective >= 0)
+  {
+    const int status = adjoint(params, obstacles, adjoint_objective, adjoint_checkpoints, adjoint_check);
+    finalise(&params, &cells, &tmp_cells, &obstacles, &av_vels);
+    return status;
+  }
+
+  /* compute time starts */
+  gettimeofday(&timstr, NULL);
+  comp_tic = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
+  if (measure_energy)
+    energy_read(&energy, &e_comp);
+
+  if (parareal_slices)
+    parareal(params, &cells, obstacles, av_vels, kernel, parareal_slices, parareal_iters);
+
+  if (steady_tol > 0.f || anderson_depth > 0)
+    steady_init(params, &steady, steady_tol, anderson_depth, anderson_period);
+
+  if (smt_prefetch && smt_start(params, &smt, obstacles, smt_distance) == 0)
+    printf("SMT prefetch:\t\t\tno idle siblings, running without helpers\n");
+
+  if (binary_output || snapshot_every > 0)
+    aio_init(&aio, io_backend);
+
+  if (halo_ranks)
+    halo_init(params, &halo, halo_ranks, cells);
+
+  if (fs_height > 0.f)
+    fs_init(params, &fs, obstacles, fs_height, fs_width);
+
+  for (int rr = 0; rr < nrois; rr++)
+  {
+    if (rois[rr].x < 0 || rois[rr].y < 0 || rois[rr].w < 1 || rois[rr].h < 1 || rois[rr].x + rois[rr].w > params.nx ||
+        rois[rr].y + rois[rr].h > params.ny)
+    {
+      char message[1024];
+      sprintf(message, "--roi %d,%d,%d,%d does not fit in the %d x %d grid", rois[rr].x, rois[rr].y, rois[rr].w,
+              rois[rr].h, params.nx, params.ny);
+      die(message, __LINE__, __FILE__);
+    }
+  }
+
+  if (roi_coarse == 1 || roi_coarse < 0)
+    die("--roi-coarse expects a factor of 2 or more", __LINE__, __FILE__);
+
+  if (sponge_spec != NULL)
+    sponge_init(params, &sponge, sponge_spec, sponge_strength, sponge_velocity, obstacles);
+
+  /* gravity pulls along -y at accel, in place of accelerate_flow() */
+  for (int tt = 0; tt < params.maxIters && fs_height > 0.f; tt++)
+  {
+    av_vels[tt] = timestep_free_surface(params, &fs, cells, tmp_cells);
+    t_speeds *tmp = cells;
+    cells = tmp_cells;
+    tmp_cells = tmp;
+  }
+
+  for (int tt = 0; tt < params.maxIters && moments; tt++)
+  {
+    accelerate_flow_moments(params, m_cells, obstacles);
+    av_vels[tt] = timestep_moments(params, m_cells, m_tmp_cells, obstacles);
+    t_moments *tmp = m_cells;
+    m_cells = m_tmp_cells;
+    m_tmp_cells = tmp;
+  }
+
+  for (int tt = 0; tt < params.maxIters && sparse; tt++)
   {
-    av_vels[tt] = timestep(params, cells, tmp_cells, obstacles);
+    accelerate_flow_tiles(params, &tiles);
+    av_vels[tt] = timestep_tiles(params, &tiles);
+    float *tmp = tiles.cells;
+    tiles.cells = tiles.tmp_cells;
+    tiles.tmp_cells = tmp;
+  }
+
+  for (int tt = 0; tt < params.maxIters && !parareal_slices && !moments && !sparse && fs_height <= 0.f; tt++)
+  {
+    accelerate_flow(params, cells, obstacles);
+    if (halo_ranks)
+      halo_exchange(params, &halo, cells);
+    if (smt_prefetch)
+      smt_step(&smt, cells);
+    av_vels[tt] = kernel->fn(params, cells, tmp_cells, obstacles);
     t_speeds *tmp = cells;
     cells = tmp_cells;
     tmp_cells = tmp;
 
+    if (sponge_spec != NULL)
+      apply_sponge(&sponge, cells);
+
+    if (halo_ranks)
+      halo_reference_step(params, &halo, kernel, obstacles, tt);
+
+    /* the image is taken now, and written while the next timesteps run */
+    if (snapshot_every > 0)
+    {
+      if ((tt + 1) % snapshot_every == 0 && (nrois || roi_coarse))
+        roi_bytes = roi_snapshot(params, cells, obstacles, rois, nrois, roi_coarse, tt + 1, &aio);
+      else if ((tt + 1) % snapshot_every == 0)
+      {
+        char name[64]; /* snapshot file */
+        size_t length; /* ... and its bytes */
+        char *image = state_image(params, cells, obstacles, &length);
+
+        sprintf(name, SNAPSHOTFILE, tt + 1);
+        aio_write(&aio, name, image, length);
+      }
+      aio_poll(&aio);
+    }
+
+    if ((steady_tol > 0.f || anderson_depth > 0) && (tt + 1) % steady.period == 0)
+    {
+      const int state = steady_update(params, &steady, cells, obstacles);
+
+      /* once steady, the run and its av. velocities end here */
+      if (state > 0)
+      {
+        params.maxIters = tt + 1;
+        break;
+      }
+
+      /* an undone mix put back the populations of a period ago: run that period again */
+      if (state < 0)
+        tt -= steady.period;
+    }
+
 #ifdef DEBUG
     printf("==timestep: %d==\n", tt);
     printf("av velocity: %.12E\n", av_vels[tt]);
@@ -190,8 +1204,24 @@ int main(int argc, char *argv[])
   comp_toc = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
   col_tic = comp_toc;
 
+  if (smt_prefetch)
+    smt_stop(&smt);
+
   // Collate data from ranks here
 
+  /* the output and the Reynolds number skip the gas as they do obstacles */
+  if (fs_height > 0.f)
+    fs_mask(params, &fs, obstacles);
+
+  /* the output reads populations, which the moments and the solid cells give exactly */
+  if (moments)
+  {
+    free_moments(&m_tmp_cells);
+    cells = alloc_speeds(&params, "cells");
+    moments_to_speeds(params, m_cells, obstacles, cells);
+    free_moments(&m_cells);
+  }
+
   /* Total/collate time stops here.*/
   gettimeofday(&timstr, NULL);
   col_toc = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
@@ -199,16 +1229,103 @@ int main(int argc, char *argv[])
 
   /* write final values and free memory */
   printf("==done==\n");
-  printf("Reynolds number:\t\t%.12E\n", calc_reynolds(params, cells, obstacles));
+  if (sparse)
+    printf("Reynolds number:\t\t%.12E\n",
+           av_velocity_tiles(params, &tiles) * params.reynolds_dim / (1.f / 6.f * (2.f / params.omega - 1.f)));
+  else
+    printf("Reynolds number:\t\t%.12E\n", calc_reynolds(params, cells, obstacles));
   printf("Elapsed Init time:\t\t\t%.6lf (s)\n", init_toc - init_tic);
   printf("Elapsed Compute time:\t\t\t%.6lf\n", comp_toc - comp_tic);
   printf("Elapsed Collate time:\t\t\t%.6lf (s)\n", col_toc - col_tic);
   printf("Elapsed Total time:\t\t\t%.6lf (s)\n", tot_toc - tot_tic);
-  write_values(params, cells, obstacles, av_vels);
+  if (roofline)
+    report_roofline(params, obstacles, comp_toc - comp_tic, copy_bw, triad_bw, moments);
+  if (halo_ranks)
+  {
+    report_halo(params, &halo, cells, obstacles, av_vels);
+    halo_free(&halo);
+  }
+  if (fs_height > 0.f)
+  {
+    int ntype[4] = {0, 0, 0, 0}; /* cells of each type */
+
+    for (int idx = 0; idx < params.nx * params.ny; idx++)
+      ntype[fs.type[idx]]++;
+
+    printf("Free surface cells:\t\t%d fluid, %d interface, %d gas, %d obstacle\n", ntype[FS_FLUID],
+           ntype[FS_INTERFACE], ntype[FS_GAS], ntype[FS_OBSTACLE]);
+    printf("Free surface updates:\t\t%.1f%% of the cells per timestep, %ld conversions\n",
+           100.0 * fs.sum_active / ((double)params.maxIters * params.nx * params.ny), fs.conversions);
+    printf("Free surface mass:\t\t%.6E initial, %.6E final, %.6E lost\n", fs.initial_mass, fs_mass(&fs),
+           fs.lost_mass);
+    fs_free(&fs);
+  }
+  if (sponge_spec != NULL)
+  {
+    printf("Sponge cells:\t\t\t%d of %d (%.1f%%), strength %g towards u_x %g\n", sponge.ncells,
+           params.nx * params.ny, 100.0 * sponge.ncells / (params.nx * params.ny), sponge_strength, sponge_velocity);
+    sponge_free(&sponge);
+  }
+  if (sparse)
+    printf("Sparse tiles:\t\t\t%d of %d kept, %d fluid cells\n", tiles.ntiles, tiles.ntx * tiles.nty, tiles.nfluid);
+  if (steady_tol > 0.f || anderson_depth > 0)
+  {
+    if (steady.residual >= 0.0)
+      printf("Steady state residual:\t\t%.6E after %d iterations (%s)\n", steady.residual, params.maxIters,
+             (steady.residual < steady_tol) ? "converged" : "not converged");
+    else
+      printf("Steady state residual:\t\tn/a after %d iterations (fewer than two checks)\n", params.maxIters);
+    if (anderson_depth > 0)
+      printf("Anderson mixes:\t\t\t%d (%d undone)\n", steady.mixes, steady.rejected);
+    steady_free(&steady);
+  }
+
+  /* Output time starts here */
+  if (measure_energy)
+    energy_read(&energy, &e_out);
+  gettimeofday(&timstr, NULL);
+  out_tic = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
+  if (sparse)
+    write_tiles(params, &tiles, av_vels, gzip_output);
+  else if (binary_output)
+    write_binary(params, cells, obstacles, av_vels, &aio);
+  else
+    write_values(params, cells, obstacles, av_vels, gzip_output);
+  if (binary_output || snapshot_every > 0)
+    aio_wait(&aio);
+  gettimeofday(&timstr, NULL);
+  out_toc = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
+
+  printf("Elapsed Output time:\t\t\t%.6lf (s)\n", out_toc - out_tic);
+
+  if (measure_energy)
+  {
+    energy_read(&energy, &e_end);
+    report_energy(params, &energy, &e_init, &e_comp, &e_out, &e_end);
+  }
+
+  if (binary_output || snapshot_every > 0)
+  {
+    static const char *engines[] = {"sync", "threads", "io_uring"};
+    printf("Async output:\t\t\t%ld files, %.1f MiB via %s, solver blocked %.6lf (s)\n", aio.files,
+           aio.bytes / (1 << 20), engines[aio.backend], aio.blocked);
+    aio_close(&aio);
+  }
+
+  if ((nrois || roi_coarse) && roi_bytes > 0)
+  {
+    const size_t full = sizeof(t_binheader) + (sizeof(float) * 4 + sizeof(int)) * (size_t)params.nx * params.ny;
+    printf("ROI snapshots:\t\t\t%d windows%s, %.1f KiB per snapshot, %.1f%% of the full state\n", nrois,
+           roi_coarse ? " and the coarse grid" : "", roi_bytes / 1024.0, 100.0 * roi_bytes / full);
+  }
+
+  if (sparse)
+    free_tiles(&tiles);
   finalise(&params, &cells, &tmp_cells, &obstacles, &av_vels);
 
   return EXIT_SUCCESS;
 }
+#endif
 
 float timestep(const t_param params, t_speeds *restrict cells, t_speeds *restrict tmp_cells, int *obstacles)
 {
@@ -219,8 +1336,8 @@ float timestep(const t_param params, t_speeds *restrict cells, t_speeds *restric
 
   int tot_cells = 0;
   float tot_u = 0.f;
+  int *const smt_progress = smt_rows; /* NULL unless --smt-prefetch, read once rather than per row */
 
-  accelerate_flow(params, cells, obstacles);
   __assume_aligned(cells->s0, 64);
   __assume_aligned(cells->s1, 64);
   __assume_aligned(cells->s2, 64);
@@ -337,31 +1454,330 @@ float timestep(const t_param params, t_speeds *restrict cells, t_speeds *restric
         tot_u = tot_u + sqrtf(u_sq);
       }
     }
+
+    /* tell this thread's --smt-prefetch helper that the row is done */
+    if (smt_progress != NULL)
+      __atomic_store_n(&smt_progress[omp_get_thread_num() * SMTSTRIDE], jj, __ATOMIC_RELEASE);
   }
   return tot_u / (float)tot_cells;
 }
 
-int accelerate_flow(const t_param params, t_speeds *cells, int *obstacles)
+float timestep_shuffle(const t_param params, t_speeds *restrict cells, t_speeds *restrict tmp_cells, int *obstacles)
 {
-  /* compute weighting factors */
-  float w1 = params.density * params.accel / 9.f;
-  float w2 = params.density * params.accel / 36.f;
+#ifndef VECWIDTH
+  /* built without AVX2 */
+  return timestep(params, cells, tmp_cells, obstacles);
+#else
+  /* rows must split into whole, aligned vectors */
+  if (params.nx % VECWIDTH)
+    return timestep(params, cells, tmp_cells, obstacles);
 
-  /* modify the 2nd row of the grid */
-  int jj = params.ny - 2;
+  const int nx = params.nx;
+  int tot_cells = 0;
+  float tot_u = 0.f;
 
-  for (int ii = 0; ii < params.nx; ii++)
+#pragma omp parallel for reduction(+ : tot_cells) reduction(+ : tot_u)
+  for (int jj = 0; jj < params.ny; jj++)
   {
-    /* if the cell is not occupied and
-    ** we don't send a negative density */
-    if (!obstacles[ii + jj * params.nx] && (cells->s3[ii + jj * params.nx] - w1) > 0.f && (cells->s6[ii + jj * params.nx] - w2) > 0.f && (cells->s7[ii + jj * params.nx] - w2) > 0.f)
+    const t_vec zero = VSET1(0.f), one = VSET1(1.f), omega = VSET1(params.omega);
+    const t_vec c = VSET1(3.f), c_sq15 = VSET1(4.5f), c_sq05 = VSET1(1.5f); /* c, 1.5 c and 0.5 c of timestep() */
+    const t_vec w0 = VSET1(4.f / 9.f), w1 = VSET1(1.f / 9.f), w2 = VSET1(1.f / 36.f);
+    const int y_s = (jj == 0) ? (jj + params.ny - 1) : (jj - 1);
+    const int y_n = (jj + 1) % params.ny;
+
+    /* the rows the shifted speeds stream from */
+    const float *row1 = cells->s1 + jj * nx, *row5 = cells->s5 + y_s * nx, *row8 = cells->s8 + y_n * nx;
+    const float *row3 = cells->s3 + jj * nx, *row6 = cells->s6 + y_s * nx, *row7 = cells->s7 + y_n * nx;
+
+    /*
+    ** Speeds from the west keep the vector before the current one, which
+    ** starts as the last of the row (the periodic wrap); speeds from the
+    ** east keep the current vector and load the next, which wraps to the
+    ** first. Every vector of every row is loaded once, aligned.
+    */
+    t_vec prev1 = VLOAD(row1 + nx - VECWIDTH), prev5 = VLOAD(row5 + nx - VECWIDTH), prev8 = VLOAD(row8 + nx - VECWIDTH);
+    t_vec cur3 = VLOAD(row3), cur6 = VLOAD(row6), cur7 = VLOAD(row7);
+    t_vec sum_u = zero, sum_cells = zero;
+
+    for (int ii = 0; ii < nx; ii += VECWIDTH)
     {
-      /* increase 'east-side' densities */
-      cells->s1[ii + jj * params.nx] += w1;
-      cells->s5[ii + jj * params.nx] += w2;
-      cells->s8[ii + jj * params.nx] += w2;
-      /* decrease 'west-side' densities */
-      cells->s3[ii + jj * params.nx] -= w1;
+      const int idx = ii + jj * nx;
+      const int next = (ii + VECWIDTH == nx) ? 0 : ii + VECWIDTH;
+
+      /* propagate */
+      const t_vec cur1 = VLOAD(row1 + ii), cur5 = VLOAD(row5 + ii), cur8 = VLOAD(row8 + ii);
+      const t_vec next3 = VLOAD(row3 + next), next6 = VLOAD(row6 + next), next7 = VLOAD(row7 + next);
+      const t_vec prop0 = VLOAD(cells->s0 + idx);         /* central cell, no movement */
+      const t_vec prop1 = VWEST(prev1, cur1);              /* east */
+      const t_vec prop2 = VLOAD(cells->s2 + ii + y_s * nx); /* north */
+      const t_vec prop3 = VEAST(cur3, next3);              /* west */
+      const t_vec prop4 = VLOAD(cells->s4 + ii + y_n * nx); /* south */
+      const t_vec prop5 = VWEST(prev5, cur5);              /* north-east */
+      const t_vec prop6 = VEAST(cur6, next6);              /* north-west */
+      const t_vec prop7 = VEAST(cur7, next7);              /* south-west */
+      const t_vec prop8 = VWEST(prev8, cur8);              /* south-east */
+
+      prev1 = cur1;
+      prev5 = cur5;
+      prev8 = cur8;
+      cur3 = next3;
+      cur6 = next6;
+      cur7 = next7;
+
+      /* collision, in every lane; obstacle lanes take the rebound instead */
+      const t_vmask fluid = VFLUID(obstacles + idx);
+      const t_vec local_density = VADD(VADD(VADD(VADD(VADD(VADD(VADD(VADD(prop0, prop1), prop2), prop3), prop4),
+                                                    prop5), prop6), prop7), prop8);
+      const t_vec u_x = VDIV(VSUB(VADD(VADD(prop1, prop5), prop8), VADD(VADD(prop3, prop6), prop7)), local_density);
+      const t_vec u_y = VDIV(VSUB(VADD(VADD(prop2, prop5), prop6), VADD(VADD(prop4, prop7), prop8)), local_density);
+      const t_vec u_sq = VADD(VMUL(u_x, u_x), VMUL(u_y, u_y));
+      const t_vec rest = VMUL(u_sq, c_sq05);
+      const t_vec w1_rho = VMUL(w1, local_density), w2_rho = VMUL(w2, local_density);
+
+      /* directional velocity components */
+      const t_vec u[NSPEEDS] = {zero, u_x, u_y, VSUB(zero, u_x), VSUB(zero, u_y),
+                                VADD(u_x, u_y), VSUB(u_y, u_x), VSUB(VSUB(zero, u_x), u_y), VSUB(u_x, u_y)};
+      const t_vec prop[NSPEEDS] = {prop0, prop1, prop2, prop3, prop4, prop5, prop6, prop7, prop8};
+      float *const out[NSPEEDS] = {tmp_cells->s0, tmp_cells->s1, tmp_cells->s2, tmp_cells->s3, tmp_cells->s4,
+                                   tmp_cells->s5, tmp_cells->s6, tmp_cells->s7, tmp_cells->s8};
+
+      VSTORE(out[0] + idx, VSELECT(fluid, VADD(prop0, VMUL(omega, VSUB(VMUL(VMUL(w0, local_density), VSUB(one, rest)), prop0))),
+                                   prop0));
+      for (int ss = 1; ss < NSPEEDS; ss++)
+      {
+        const t_vec d_equ = VMUL(ss < 5 ? w1_rho : w2_rho,
+                                 VSUB(VADD(VADD(one, VMUL(u[ss], c)), VMUL(VMUL(u[ss], u[ss]), c_sq15)), rest));
+        const t_vec collided = VADD(prop[ss], VMUL(omega, VSUB(d_equ, prop[ss])));
+
+        VSTORE(out[ss] + idx, VSELECT(fluid, collided, prop[lat_opp[ss]]));
+      }
+
+      /* average speed */
+      sum_u = VADD(sum_u, VSELECT(fluid, VSQRT(u_sq), zero));
+      sum_cells = VADD(sum_cells, VSELECT(fluid, one, zero));
+    }
+
+    float lanes_u[VECWIDTH], lanes_cells[VECWIDTH];
+    VSTOREU(lanes_u, sum_u);
+    VSTOREU(lanes_cells, sum_cells);
+    for (int ll = 0; ll < VECWIDTH; ll++)
+    {
+      tot_u += lanes_u[ll];
+      tot_cells += (int)lanes_cells[ll];
+    }
+  }
+
+  return tot_u / (float)tot_cells;
+#endif
+}
+
+float timestep_reference(const t_param params, t_speeds *cells, t_speeds *tmp_cells, int *obstacles)
+{
+  propagate(params, cells, tmp_cells);
+  rebound(params, cells, tmp_cells, obstacles);
+  collision(params, cells, tmp_cells, obstacles);
+
+  /*
+  ** rebound() and collision() leave the new state in cells, but the
+  ** caller expects it in tmp_cells, as from timestep(): swap the
+  ** arrays behind the two structs.
+  */
+  t_speeds tmp = *cells;
+  *cells = *tmp_cells;
+  *tmp_cells = tmp;
+
+  return av_velocity(params, tmp_cells, obstacles);
+}
+
+int propagate(const t_param params, t_speeds *cells, t_speeds *tmp_cells)
+{
+  /* loop over _all_ cells */
+#pragma omp parallel for
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    for (int ii = 0; ii < params.nx; ii++)
+    {
+      propagate_single(params, cells, tmp_cells, jj, ii);
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int propagate_single(const t_param params, t_speeds *cells, t_speeds *tmp_cells, int jj, int ii)
+{
+  /* determine indices of axis-direction neighbours
+  ** respecting periodic boundary conditions (wrap around) */
+  const int y_n = (jj + 1) % params.ny;
+  const int x_e = (ii + 1) % params.nx;
+  const int y_s = (jj == 0) ? (jj + params.ny - 1) : (jj - 1);
+  const int x_w = (ii == 0) ? (ii + params.nx - 1) : (ii - 1);
+
+  /* propagate densities from neighbouring cells, following
+  ** appropriate directions of travel and writing into
+  ** scratch space grid */
+  tmp_cells->s0[ii + jj * params.nx] = cells->s0[ii + jj * params.nx];   /* central cell, no movement */
+  tmp_cells->s1[ii + jj * params.nx] = cells->s1[x_w + jj * params.nx];  /* east */
+  tmp_cells->s2[ii + jj * params.nx] = cells->s2[ii + y_s * params.nx];  /* north */
+  tmp_cells->s3[ii + jj * params.nx] = cells->s3[x_e + jj * params.nx];  /* west */
+  tmp_cells->s4[ii + jj * params.nx] = cells->s4[ii + y_n * params.nx];  /* south */
+  tmp_cells->s5[ii + jj * params.nx] = cells->s5[x_w + y_s * params.nx]; /* north-east */
+  tmp_cells->s6[ii + jj * params.nx] = cells->s6[x_e + y_s * params.nx]; /* north-west */
+  tmp_cells->s7[ii + jj * params.nx] = cells->s7[x_e + y_n * params.nx]; /* south-west */
+  tmp_cells->s8[ii + jj * params.nx] = cells->s8[x_w + y_n * params.nx]; /* south-east */
+
+  return EXIT_SUCCESS;
+}
+
+int rebound(const t_param params, t_speeds *cells, t_speeds *tmp_cells, int *obstacles)
+{
+  /* loop over the cells in the grid */
+#pragma omp parallel for
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    for (int ii = 0; ii < params.nx; ii++)
+    {
+      rebound_single(params, cells, tmp_cells, obstacles, jj, ii);
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int rebound_single(const t_param params, t_speeds *cells, t_speeds *tmp_cells, int *obstacles, int jj, int ii)
+{
+  /* if the cell contains an obstacle */
+  if (obstacles[jj * params.nx + ii])
+  {
+    /* called after propagate, so taking values from scratch space
+    ** mirroring, and writing into main grid */
+    cells->s1[ii + jj * params.nx] = tmp_cells->s3[ii + jj * params.nx];
+    cells->s2[ii + jj * params.nx] = tmp_cells->s4[ii + jj * params.nx];
+    cells->s3[ii + jj * params.nx] = tmp_cells->s1[ii + jj * params.nx];
+    cells->s4[ii + jj * params.nx] = tmp_cells->s2[ii + jj * params.nx];
+    cells->s5[ii + jj * params.nx] = tmp_cells->s7[ii + jj * params.nx];
+    cells->s6[ii + jj * params.nx] = tmp_cells->s8[ii + jj * params.nx];
+    cells->s7[ii + jj * params.nx] = tmp_cells->s5[ii + jj * params.nx];
+    cells->s8[ii + jj * params.nx] = tmp_cells->s6[ii + jj * params.nx];
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int collision(const t_param params, t_speeds *cells, t_speeds *tmp_cells, int *obstacles)
+{
+  /* loop over the cells in the grid
+  ** NB the collision step is called after
+  ** the propagate step and so values of interest
+  ** are in the scratch-space grid */
+#pragma omp parallel for
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    for (int ii = 0; ii < params.nx; ii++)
+    {
+      collision_single(params, cells, tmp_cells, obstacles, jj, ii);
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int collision_single(const t_param params, t_speeds *cells, t_speeds *tmp_cells, int *obstacles, int jj, int ii)
+{
+  const float c_sq = 1.f / 3.f; /* square of speed of sound */
+  const float w0 = 4.f / 9.f;   /* weighting factor */
+  const float w1 = 1.f / 9.f;   /* weighting factor */
+  const float w2 = 1.f / 36.f;  /* weighting factor */
+
+  /* don't consider occupied cells */
+  if (!obstacles[ii + jj * params.nx])
+  {
+    /* the propagated speeds of this cell */
+    float f[NSPEEDS];
+    f[0] = tmp_cells->s0[ii + jj * params.nx];
+    f[1] = tmp_cells->s1[ii + jj * params.nx];
+    f[2] = tmp_cells->s2[ii + jj * params.nx];
+    f[3] = tmp_cells->s3[ii + jj * params.nx];
+    f[4] = tmp_cells->s4[ii + jj * params.nx];
+    f[5] = tmp_cells->s5[ii + jj * params.nx];
+    f[6] = tmp_cells->s6[ii + jj * params.nx];
+    f[7] = tmp_cells->s7[ii + jj * params.nx];
+    f[8] = tmp_cells->s8[ii + jj * params.nx];
+
+    /* compute local density total */
+    float local_density = 0.f;
+
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      local_density += f[kk];
+    }
+
+    /* compute x velocity component */
+    const float u_x = (f[1] + f[5] + f[8] - (f[3] + f[6] + f[7])) / local_density;
+    /* compute y velocity component */
+    const float u_y = (f[2] + f[5] + f[6] - (f[4] + f[7] + f[8])) / local_density;
+
+    /* velocity squared */
+    const float u_sq = u_x * u_x + u_y * u_y;
+
+    /* directional velocity components */
+    float u[NSPEEDS];
+    u[1] = u_x;        /* east */
+    u[2] = u_y;        /* north */
+    u[3] = -u_x;       /* west */
+    u[4] = -u_y;       /* south */
+    u[5] = u_x + u_y;  /* north-east */
+    u[6] = -u_x + u_y; /* north-west */
+    u[7] = -u_x - u_y; /* south-west */
+    u[8] = u_x - u_y;  /* south-east */
+
+    /* equilibrium densities */
+    float d_equ[NSPEEDS];
+    /* zero velocity density: weight w0 */
+    d_equ[0] = w0 * local_density * (1.f - u_sq / (2.f * c_sq));
+    /* axis speeds: weight w1, diagonal speeds: weight w2 */
+    for (int kk = 1; kk < NSPEEDS; kk++)
+    {
+      const float w = (kk < 5) ? w1 : w2;
+      d_equ[kk] = w * local_density * (1.f + u[kk] / c_sq + (u[kk] * u[kk]) / (2.f * c_sq * c_sq) - u_sq / (2.f * c_sq));
+    }
+
+    /* relaxation step */
+    cells->s0[ii + jj * params.nx] = f[0] + params.omega * (d_equ[0] - f[0]);
+    cells->s1[ii + jj * params.nx] = f[1] + params.omega * (d_equ[1] - f[1]);
+    cells->s2[ii + jj * params.nx] = f[2] + params.omega * (d_equ[2] - f[2]);
+    cells->s3[ii + jj * params.nx] = f[3] + params.omega * (d_equ[3] - f[3]);
+    cells->s4[ii + jj * params.nx] = f[4] + params.omega * (d_equ[4] - f[4]);
+    cells->s5[ii + jj * params.nx] = f[5] + params.omega * (d_equ[5] - f[5]);
+    cells->s6[ii + jj * params.nx] = f[6] + params.omega * (d_equ[6] - f[6]);
+    cells->s7[ii + jj * params.nx] = f[7] + params.omega * (d_equ[7] - f[7]);
+    cells->s8[ii + jj * params.nx] = f[8] + params.omega * (d_equ[8] - f[8]);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int accelerate_flow(const t_param params, t_speeds *cells, int *obstacles)
+{
+  /* compute weighting factors */
+  float w1 = params.density * params.accel / 9.f;
+  float w2 = params.density * params.accel / 36.f;
+
+  /* modify the 2nd row of the grid */
+  int jj = params.ny - 2;
+
+  for (int ii = 0; ii < params.nx; ii++)
+  {
+    /* if the cell is not occupied and
+    ** we don't send a negative density */
+    if (!obstacles[ii + jj * params.nx] && (cells->s3[ii + jj * params.nx] - w1) > 0.f && (cells->s6[ii + jj * params.nx] - w2) > 0.f && (cells->s7[ii + jj * params.nx] - w2) > 0.f)
+    {
+      /* increase 'east-side' densities */
+      cells->s1[ii + jj * params.nx] += w1;
+      cells->s5[ii + jj * params.nx] += w2;
+      cells->s8[ii + jj * params.nx] += w2;
+      /* decrease 'west-side' densities */
+      cells->s3[ii + jj * params.nx] -= w1;
       cells->s6[ii + jj * params.nx] -= w2;
       cells->s7[ii + jj * params.nx] -= w2;
     }
@@ -414,9 +1830,8 @@ float av_velocity(const t_param params, t_speeds *cells, int *obstacles)
   return tot_u / (float)tot_cells;
 }
 
-int initialise(const char *paramfile, const char *obstaclefile,
-               t_param *params, t_speeds **cells_ptr, t_speeds **tmp_cells_ptr,
-               int **obstacles_ptr, float **av_vels_ptr)
+int initialise(const char *paramfile, const char *obstaclefile, t_param *params, int moments,
+               t_speeds **cells_ptr, t_speeds **tmp_cells_ptr, int **obstacles_ptr, float **av_vels_ptr)
 {
   char message[1024]; /* message buffer */
   FILE *fp;           /* file pointer */
@@ -424,54 +1839,21 @@ int initialise(const char *paramfile, const char *obstaclefile,
   int blocked;        /* indicates whether a cell is blocked by an obstacle */
   int retval;         /* to hold return value for checking */
 
-  /* open the parameter file */
-  fp = fopen(paramfile, "r");
+  read_params(paramfile, params);
 
-  if (fp == NULL)
+  /* fail now, rather than part way through allocating */
+  t_footprint footprint;
+  plan_footprint(*params, 0, moments, &footprint);
+  const size_t required = footprint.per_cell * params->nx * params->ny + footprint.fixed;
+  const size_t available = available_memory(NULL, NULL);
+
+  if (available > 0 && required > available)
   {
-    sprintf(message, "could not open input parameter file: %s", paramfile);
+    sprintf(message, "grid needs %.2f GiB but only %.2f GiB is available (see --plan)",
+            required / 1073741824.0, available / 1073741824.0);
     die(message, __LINE__, __FILE__);
   }
 
-  /* read in the parameter values */
-  retval = fscanf(fp, "%d\n", &(params->nx));
-
-  if (retval != 1)
-    die("could not read param file: nx", __LINE__, __FILE__);
-
-  retval = fscanf(fp, "%d\n", &(params->ny));
-
-  if (retval != 1)
-    die("could not read param file: ny", __LINE__, __FILE__);
-
-  retval = fscanf(fp, "%d\n", &(params->maxIters));
-
-  if (retval != 1)
-    die("could not read param file: maxIters", __LINE__, __FILE__);
-
-  retval = fscanf(fp, "%d\n", &(params->reynolds_dim));
-
-  if (retval != 1)
-    die("could not read param file: reynolds_dim", __LINE__, __FILE__);
-
-  retval = fscanf(fp, "%f\n", &(params->density));
-
-  if (retval != 1)
-    die("could not read param file: density", __LINE__, __FILE__);
-
-  retval = fscanf(fp, "%f\n", &(params->accel));
-
-  if (retval != 1)
-    die("could not read param file: accel", __LINE__, __FILE__);
-
-  retval = fscanf(fp, "%f\n", &(params->omega));
-
-  if (retval != 1)
-    die("could not read param file: omega", __LINE__, __FILE__);
-
-  /* and close up the file */
-  fclose(fp);
-
   /*
   ** Allocate memory.
   **
@@ -491,68 +1873,19 @@ int initialise(const char *paramfile, const char *obstaclefile,
   ** a 1D array of these structs.
   */
 
-  /* main grid */
-  *cells_ptr = (t_speeds *)malloc(sizeof(t_speeds));
-
-  (*cells_ptr)->s0 = (float *)_mm_malloc(sizeof(float) * params->ny * params->nx, 64);
-  (*cells_ptr)->s1 = (float *)_mm_malloc(sizeof(float) * params->ny * params->nx, 64);
-  (*cells_ptr)->s2 = (float *)_mm_malloc(sizeof(float) * params->ny * params->nx, 64);
-  (*cells_ptr)->s3 = (float *)_mm_malloc(sizeof(float) * params->ny * params->nx, 64);
-  (*cells_ptr)->s4 = (float *)_mm_malloc(sizeof(float) * params->ny * params->nx, 64);
-  (*cells_ptr)->s5 = (float *)_mm_malloc(sizeof(float) * params->ny * params->nx, 64);
-  (*cells_ptr)->s6 = (float *)_mm_malloc(sizeof(float) * params->ny * params->nx, 64);
-  (*cells_ptr)->s7 = (float *)_mm_malloc(sizeof(float) * params->ny * params->nx, 64);
-  (*cells_ptr)->s8 = (float *)_mm_malloc(sizeof(float) * params->ny * params->nx, 64);
-
-  if (*cells_ptr == NULL)
-    die("cannot allocate memory for cells", __LINE__, __FILE__);
-
-  /* 'helper' grid, used as scratch space */
-  *tmp_cells_ptr = (t_speeds *)malloc(sizeof(t_speeds));
-
-  (*tmp_cells_ptr)->s0 = (float *)_mm_malloc(sizeof(float) * params->ny * params->nx, 64);
-  (*tmp_cells_ptr)->s1 = (float *)_mm_malloc(sizeof(float) * params->ny * params->nx, 64);
-  (*tmp_cells_ptr)->s2 = (float *)_mm_malloc(sizeof(float) * params->ny * params->nx, 64);
-  (*tmp_cells_ptr)->s3 = (float *)_mm_malloc(sizeof(float) * params->ny * params->nx, 64);
-  (*tmp_cells_ptr)->s4 = (float *)_mm_malloc(sizeof(float) * params->ny * params->nx, 64);
-  (*tmp_cells_ptr)->s5 = (float *)_mm_malloc(sizeof(float) * params->ny * params->nx, 64);
-  (*tmp_cells_ptr)->s6 = (float *)_mm_malloc(sizeof(float) * params->ny * params->nx, 64);
-  (*tmp_cells_ptr)->s7 = (float *)_mm_malloc(sizeof(float) * params->ny * params->nx, 64);
-  (*tmp_cells_ptr)->s8 = (float *)_mm_malloc(sizeof(float) * params->ny * params->nx, 64);
-
-  if (*tmp_cells_ptr == NULL)
-    die("cannot allocate memory for tmp_cells", __LINE__, __FILE__);
+  /* main grid, and the 'helper' grid used as scratch space, unless the caller stores them as moments */
+  *cells_ptr = moments ? NULL : alloc_speeds(params, "cells");
+  *tmp_cells_ptr = moments ? NULL : alloc_speeds(params, "tmp_cells");
 
   /* the map of obstacles */
-  *obstacles_ptr = malloc(sizeof(int) * (params->ny * params->nx));
+  *obstacles_ptr = malloc(sizeof(int) * ((size_t)params->ny * params->nx));
 
   if (*obstacles_ptr == NULL)
     die("cannot allocate column memory for obstacles", __LINE__, __FILE__);
 
   /* initialise densities */
-  float w0 = params->density * 4.f / 9.f;
-  float w1 = params->density / 9.f;
-  float w2 = params->density / 36.f;
-
-#pragma omp parallel for
-  for (int jj = 0; jj < params->ny; jj++)
-  {
-    for (int ii = 0; ii < params->nx; ii++)
-    {
-      /* centre */
-      (*cells_ptr)->s0[ii + jj * params->nx] = w0;
-      /* axis directions */
-      (*cells_ptr)->s1[ii + jj * params->nx] = w1;
-      (*cells_ptr)->s2[ii + jj * params->nx] = w1;
-      (*cells_ptr)->s3[ii + jj * params->nx] = w1;
-      (*cells_ptr)->s4[ii + jj * params->nx] = w1;
-      /* diagonals */
-      (*cells_ptr)->s5[ii + jj * params->nx] = w2;
-      (*cells_ptr)->s6[ii + jj * params->nx] = w2;
-      (*cells_ptr)->s7[ii + jj * params->nx] = w2;
-      (*cells_ptr)->s8[ii + jj * params->nx] = w2;
-    }
-  }
+  if (!moments)
+    init_speeds(params, *cells_ptr);
 
   /* first set all cells in obstacle array to zero */
   for (int jj = 0; jj < params->ny; jj++)
@@ -601,134 +1934,5539 @@ int initialise(const char *paramfile, const char *obstaclefile,
   */
   *av_vels_ptr = (float *)malloc(sizeof(float) * params->maxIters);
 
+  if (*av_vels_ptr == NULL)
+    die("cannot allocate memory for av_vels", __LINE__, __FILE__);
+
   return EXIT_SUCCESS;
 }
 
-int finalise(const t_param *params, t_speeds **cells_ptr, t_speeds **tmp_cells_ptr,
-             int **obstacles_ptr, float **av_vels_ptr)
+void init_speeds(const t_param *params, t_speeds *cells)
 {
-  /*
-  ** free up allocated memory
-  */
-  free(*cells_ptr);
-  *cells_ptr = NULL;
-
-  free(*tmp_cells_ptr);
-  *tmp_cells_ptr = NULL;
-
-  free(*obstacles_ptr);
-  *obstacles_ptr = NULL;
-
-  free(*av_vels_ptr);
-  *av_vels_ptr = NULL;
+  float w0 = params->density * 4.f / 9.f;
+  float w1 = params->density / 9.f;
+  float w2 = params->density / 36.f;
 
-  return EXIT_SUCCESS;
+#pragma omp parallel for
+  for (int jj = 0; jj < params->ny; jj++)
+  {
+    for (int ii = 0; ii < params->nx; ii++)
+    {
+      /* centre */
+      cells->s0[ii + jj * params->nx] = w0;
+      /* axis directions */
+      cells->s1[ii + jj * params->nx] = w1;
+      cells->s2[ii + jj * params->nx] = w1;
+      cells->s3[ii + jj * params->nx] = w1;
+      cells->s4[ii + jj * params->nx] = w1;
+      /* diagonals */
+      cells->s5[ii + jj * params->nx] = w2;
+      cells->s6[ii + jj * params->nx] = w2;
+      cells->s7[ii + jj * params->nx] = w2;
+      cells->s8[ii + jj * params->nx] = w2;
+    }
+  }
 }
 
-float calc_reynolds(const t_param params, t_speeds *cells, int *obstacles)
+t_speeds *alloc_speeds(const t_param *params, const char *name)
 {
-  const float viscosity = 1.f / 6.f * (2.f / params.omega - 1.f);
+  char message[1024];                                                   /* message buffer */
+  const size_t bytes = sizeof(float) * (size_t)params->ny * params->nx; /* per speed */
+  t_speeds *speeds = (t_speeds *)malloc(sizeof(t_speeds));
 
-  return av_velocity(params, cells, obstacles) * params.reynolds_dim / viscosity;
-}
+  if (speeds == NULL)
+  {
+    sprintf(message, "cannot allocate memory for %s", name);
+    die(message, __LINE__, __FILE__);
+  }
 
-float total_density(const t_param params, t_speeds *cells)
-{
-  float total = 0.f; /* accumulator */
+  float **arrays[NSPEEDS] = {&speeds->s0, &speeds->s1, &speeds->s2, &speeds->s3, &speeds->s4,
+                             &speeds->s5, &speeds->s6, &speeds->s7, &speeds->s8};
 
-  for (int jj = 0; jj < params.ny; jj++)
+  for (int ss = 0; ss < NSPEEDS; ss++)
   {
-    for (int ii = 0; ii < params.nx; ii++)
+    *arrays[ss] = (float *)_mm_malloc(bytes, 64);
+
+    if (*arrays[ss] == NULL)
     {
-      total += cells->s0[ii + jj * params.nx];
-      total += cells->s1[ii + jj * params.nx];
-      total += cells->s2[ii + jj * params.nx];
-      total += cells->s3[ii + jj * params.nx];
-      total += cells->s4[ii + jj * params.nx];
-      total += cells->s5[ii + jj * params.nx];
-      total += cells->s6[ii + jj * params.nx];
-      total += cells->s7[ii + jj * params.nx];
-      total += cells->s8[ii + jj * params.nx];
+      sprintf(message, "cannot allocate %.2f MiB for %s->s%d (see --plan)", bytes / 1048576.0, name, ss);
+      die(message, __LINE__, __FILE__);
     }
   }
 
-  return total;
+  return speeds;
 }
 
-int write_values(const t_param params, t_speeds *cells, int *obstacles, float *av_vels)
+void free_speeds(t_speeds **speeds_ptr)
 {
-  FILE *fp;                     /* file pointer */
-  const float c_sq = 1.f / 3.f; /* sq. of speed of sound */
-  float local_density;          /* per grid cell sum of densities */
-  float pressure;               /* fluid pressure in grid cell */
-  float u_x;                    /* x-component of velocity in grid cell */
-  float u_y;                    /* y-component of velocity in grid cell */
-  float u;                      /* norm--root of summed squares--of u_x and u_y */
+  t_speeds *speeds = *speeds_ptr;
+
+  if (speeds == NULL)
+    return;
+
+  _mm_free(speeds->s0);
+  _mm_free(speeds->s1);
+  _mm_free(speeds->s2);
+  _mm_free(speeds->s3);
+  _mm_free(speeds->s4);
+  _mm_free(speeds->s5);
+  _mm_free(speeds->s6);
+  _mm_free(speeds->s7);
+  _mm_free(speeds->s8);
+  free(speeds);
+  *speeds_ptr = NULL;
+}
+
+int read_params(const char *paramfile, t_param *params)
+{
+  char message[1024]; /* message buffer */
+  FILE *fp;           /* file pointer */
+  int retval;         /* to hold return value for checking */
 
-  fp = fopen(FINALSTATEFILE, "w");
+  /* open the parameter file */
+  fp = fopen(paramfile, "r");
 
   if (fp == NULL)
   {
-    die("could not open file output file", __LINE__, __FILE__);
+    sprintf(message, "could not open input parameter file: %s", paramfile);
+    die(message, __LINE__, __FILE__);
   }
 
-  for (int jj = 0; jj < params.ny; jj++)
-  {
-    for (int ii = 0; ii < params.nx; ii++)
-    {
-      /* an occupied cell */
-      if (obstacles[ii + jj * params.nx])
-      {
-        u_x = u_y = u = 0.f;
-        pressure = params.density * c_sq;
-      }
-      /* no obstacle */
-      else
-      {
-        local_density = 0.f;
+  /* read in the parameter values */
+  retval = fscanf(fp, "%d\n", &(params->nx));
 
-        local_density += cells->s0[ii + jj * params.nx];
-        local_density += cells->s1[ii + jj * params.nx];
-        local_density += cells->s2[ii + jj * params.nx];
-        local_density += cells->s3[ii + jj * params.nx];
-        local_density += cells->s4[ii + jj * params.nx];
-        local_density += cells->s5[ii + jj * params.nx];
-        local_density += cells->s6[ii + jj * params.nx];
-        local_density += cells->s7[ii + jj * params.nx];
-        local_density += cells->s8[ii + jj * params.nx];
+  if (retval != 1)
+    die("could not read param file: nx", __LINE__, __FILE__);
+
+  retval = fscanf(fp, "%d\n", &(params->ny));
+
+  if (retval != 1)
+    die("could not read param file: ny", __LINE__, __FILE__);
+
+  retval = fscanf(fp, "%d\n", &(params->maxIters));
+
+  if (retval != 1)
+    die("could not read param file: maxIters", __LINE__, __FILE__);
+
+  retval = fscanf(fp, "%d\n", &(params->reynolds_dim));
+
+  if (retval != 1)
+    die("could not read param file: reynolds_dim", __LINE__, __FILE__);
+
+  retval = fscanf(fp, "%f\n", &(params->density));
+
+  if (retval != 1)
+    die("could not read param file: density", __LINE__, __FILE__);
+
+  retval = fscanf(fp, "%f\n", &(params->accel));
+
+  if (retval != 1)
+    die("could not read param file: accel", __LINE__, __FILE__);
+
+  retval = fscanf(fp, "%f\n", &(params->omega));
+
+  if (retval != 1)
+    die("could not read param file: omega", __LINE__, __FILE__);
+
+  /* and close up the file */
+  fclose(fp);
+
+  return EXIT_SUCCESS;
+}
+
+
+int finalise(const t_param *params, t_speeds **cells_ptr, t_speeds **tmp_cells_ptr,
+             int **obstacles_ptr, float **av_vels_ptr)
+{
+  /*
+  ** free up allocated memory
+  */
+  free_speeds(cells_ptr);
+  free_speeds(tmp_cells_ptr);
+
+  free(*obstacles_ptr);
+  *obstacles_ptr = NULL;
+
+  free(*av_vels_ptr);
+  *av_vels_ptr = NULL;
+
+  return EXIT_SUCCESS;
+}
+
+float calc_reynolds(const t_param params, t_speeds *cells, int *obstacles)
+{
+  const float viscosity = 1.f / 6.f * (2.f / params.omega - 1.f);
+
+  return av_velocity(params, cells, obstacles) * params.reynolds_dim / viscosity;
+}
+
+float total_density(const t_param params, t_speeds *cells)
+{
+  float total = 0.f; /* accumulator */
+
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    for (int ii = 0; ii < params.nx; ii++)
+    {
+      total += cells->s0[ii + jj * params.nx];
+      total += cells->s1[ii + jj * params.nx];
+      total += cells->s2[ii + jj * params.nx];
+      total += cells->s3[ii + jj * params.nx];
+      total += cells->s4[ii + jj * params.nx];
+      total += cells->s5[ii + jj * params.nx];
+      total += cells->s6[ii + jj * params.nx];
+      total += cells->s7[ii + jj * params.nx];
+      total += cells->s8[ii + jj * params.nx];
+    }
+  }
+
+  return total;
+}
+
+int write_values(const t_param params, t_speeds *cells, int *obstacles, float *av_vels, int gzip)
+{
+  write_state(params, cells, obstacles, NULL, gzip);
+
+  return write_av_vels(params, av_vels);
+}
+
+int write_av_vels(const t_param params, float *av_vels)
+{
+  FILE *fp;                                                      /* file pointer */
+  const int nchunks = (params.maxIters + AVCHUNK - 1) / AVCHUNK; /* AVCHUNK lines are formatted at a time */
+  int group = (int)(FMTBYTES / (AVCHUNK * AVLINECHARS));         /* chunks formatted per pass */
+
+  if (group < omp_get_max_threads())
+    group = omp_get_max_threads();
+  if (group > nchunks)
+    group = nchunks;
+  if (group < 1)
+    group = 1;
+
+  char *text = (char *)malloc((size_t)AVCHUNK * AVLINECHARS * group); /* the chunks of a pass */
+  size_t *length = (size_t *)malloc(sizeof(size_t) * group);         /* ... and their chars */
+
+  if (text == NULL || length == NULL)
+    die("cannot allocate memory for output", __LINE__, __FILE__);
+
+  fp = fopen(AVVELSFILE, "w");
+
+  if (fp == NULL)
+  {
+    die("could not open file output file", __LINE__, __FILE__);
+  }
+
+  for (int first = 0; first < nchunks; first += group)
+  {
+    const int nformat = (nchunks - first < group) ? nchunks - first : group;
+
+    /* printf("%d:\t%.12E\n") of each timestep */
+#pragma omp parallel for
+    for (int cc = 0; cc < nformat; cc++)
+    {
+      const int start = (first + cc) * AVCHUNK;
+      const int end = (start + AVCHUNK < params.maxIters) ? start + AVCHUNK : params.maxIters;
+      char *p = &text[(size_t)cc * AVCHUNK * AVLINECHARS];
+
+      for (int ii = start; ii < end; ii++)
+      {
+        p += format_int(p, ii);
+        *p++ = ':';
+        *p++ = '\t';
+        p += format_float(p, av_vels[ii]);
+        *p++ = '\n';
+      }
+
+      length[cc] = (size_t)(p - &text[(size_t)cc * AVCHUNK * AVLINECHARS]);
+    }
+
+    for (int cc = 0; cc < nformat; cc++)
+    {
+      if (fwrite(&text[(size_t)cc * AVCHUNK * AVLINECHARS], 1, length[cc], fp) != length[cc])
+        die("could not write av. velocities", __LINE__, __FILE__);
+    }
+  }
+
+  fclose(fp);
+  free(text);
+  free(length);
+
+  return EXIT_SUCCESS;
+}
+
+void row_values(const t_param params, t_speeds *cells, int *obstacles, int jj,
+                float *u_x, float *u_y, float *u, float *pressure)
+{
+  const float c_sq = 1.f / 3.f; /* sq. of speed of sound */
+
+  for (int ii = 0; ii < params.nx; ii++)
+  {
+    /* an occupied cell */
+    if (obstacles[ii + jj * params.nx])
+    {
+      u_x[ii] = u_y[ii] = u[ii] = 0.f;
+      pressure[ii] = params.density * c_sq;
+    }
+    /* no obstacle */
+    else
+    {
+      float local_density = 0.f; /* per grid cell sum of densities */
+
+      local_density += cells->s0[ii + jj * params.nx];
+      local_density += cells->s1[ii + jj * params.nx];
+      local_density += cells->s2[ii + jj * params.nx];
+      local_density += cells->s3[ii + jj * params.nx];
+      local_density += cells->s4[ii + jj * params.nx];
+      local_density += cells->s5[ii + jj * params.nx];
+      local_density += cells->s6[ii + jj * params.nx];
+      local_density += cells->s7[ii + jj * params.nx];
+      local_density += cells->s8[ii + jj * params.nx];
+
+      /* compute x velocity component */
+      u_x[ii] = (cells->s1[ii + jj * params.nx] + cells->s5[ii + jj * params.nx] + cells->s8[ii + jj * params.nx] - (cells->s3[ii + jj * params.nx] + cells->s6[ii + jj * params.nx] + cells->s7[ii + jj * params.nx])) / local_density;
+      /* compute y velocity component */
+      u_y[ii] = (cells->s2[ii + jj * params.nx] + cells->s5[ii + jj * params.nx] + cells->s6[ii + jj * params.nx] - (cells->s4[ii + jj * params.nx] + cells->s7[ii + jj * params.nx] + cells->s8[ii + jj * params.nx])) / local_density;
+      /* compute norm of velocity */
+      u[ii] = sqrtf((u_x[ii] * u_x[ii]) + (u_y[ii] * u_y[ii]));
+      /* compute pressure */
+      pressure[ii] = local_density * c_sq;
+    }
+  }
+}
+
+int write_binary(const t_param params, t_speeds *cells, int *obstacles, float *av_vels, t_aio *aio)
+{
+  t_binheader header; /* describes the arrays that follow */
+  size_t length;      /* bytes of a file */
+  char *image = state_image(params, cells, obstacles, &length);
+
+  aio_write(aio, FINALSTATEBIN, image, length);
+
+  memcpy(header.magic, BINMAGIC, sizeof(header.magic));
+  header.kind = BINAVVELS;
+  header.nx = params.maxIters;
+  header.ny = 1;
+  header.nfields = 1;
+
+  length = sizeof(header) + sizeof(float) * params.maxIters;
+  image = aio_alloc(length);
+  memcpy(image, &header, sizeof(header));
+  memcpy(image + sizeof(header), av_vels, sizeof(float) * params.maxIters);
+  aio_write(aio, AVVELSBIN, image, length);
+
+  return EXIT_SUCCESS;
+}
+
+/* the final state file as one aligned image: header, u_x, u_y, u, pressure and obstacles */
+char *state_image(const t_param params, t_speeds *cells, int *obstacles, size_t *length)
+{
+  t_binheader header; /* describes the arrays that follow */
+  const size_t ncells = (size_t)params.nx * params.ny;
+
+  *length = sizeof(header) + sizeof(float) * 4 * ncells + sizeof(int) * ncells;
+
+  char *image = aio_alloc(*length);
+  float *fields = (float *)(image + sizeof(header)); /* u_x, u_y, u and pressure, each nx * ny */
+
+  memcpy(header.magic, BINMAGIC, sizeof(header.magic));
+  header.kind = BINFINALSTATE;
+  header.nx = params.nx;
+  header.ny = params.ny;
+  header.nfields = 5;
+  memcpy(image, &header, sizeof(header));
+
+#pragma omp parallel for
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    const size_t row = (size_t)jj * params.nx;
+    row_values(params, cells, obstacles, jj, &fields[row], &fields[ncells + row],
+               &fields[2 * ncells + row], &fields[3 * ncells + row]);
+  }
+
+  memcpy(&fields[4 * ncells], obstacles, sizeof(int) * ncells);
+
+  return image;
+}
+
+/*
+** A window of the final state as one aligned image, in the format of
+** state_image(): row_values() reads each row of the window as a grid
+** w cells wide whose lattice starts at the window's first cell.
+*/
+char *window_image(const t_param params, t_speeds *cells, int *obstacles, const t_roi *roi, size_t *length)
+{
+  t_binheader header; /* describes the arrays that follow */
+  const size_t ncells = (size_t)roi->w * roi->h;
+
+  *length = sizeof(header) + sizeof(float) * 4 * ncells + sizeof(int) * ncells;
+
+  char *image = aio_alloc(*length);
+  float *fields = (float *)(image + sizeof(header)); /* u_x, u_y, u and pressure, each w * h */
+  int *flags = (int *)&fields[4 * ncells];
+
+  memcpy(header.magic, BINMAGIC, sizeof(header.magic));
+  header.kind = BINFINALSTATE;
+  header.nx = roi->w;
+  header.ny = roi->h;
+  header.nfields = 5;
+  memcpy(image, &header, sizeof(header));
+
+  t_param window = params;
+  window.nx = roi->w;
+
+#pragma omp parallel for
+  for (int jj = 0; jj < roi->h; jj++)
+  {
+    const size_t first = (size_t)roi->x + (size_t)(roi->y + jj) * params.nx; /* the row's first cell in the grid */
+    const size_t row = (size_t)jj * roi->w;
+    t_speeds segment = {cells->s0 + first, cells->s1 + first, cells->s2 + first, cells->s3 + first, cells->s4 + first,
+                        cells->s5 + first, cells->s6 + first, cells->s7 + first, cells->s8 + first};
+
+    row_values(window, &segment, obstacles + first, 0, &fields[row], &fields[ncells + row],
+               &fields[2 * ncells + row], &fields[3 * ncells + row]);
+    memcpy(&flags[row], obstacles + first, sizeof(int) * roi->w);
+  }
+
+  return image;
+}
+
+/*
+** The whole grid at 1/factor resolution, in the format of
+** state_image(): each coarse cell holds the mean u_x, u_y, u and
+** pressure of the open cells in its factor x factor block, and is
+** flagged 1 when the block has none.
+*/
+char *coarse_image(const t_param params, t_speeds *cells, int *obstacles, int factor, size_t *length)
+{
+  t_binheader header; /* describes the arrays that follow */
+  const int cnx = (params.nx + factor - 1) / factor;
+  const int cny = (params.ny + factor - 1) / factor;
+  const size_t ncells = (size_t)cnx * cny;
+
+  *length = sizeof(header) + sizeof(float) * 4 * ncells + sizeof(int) * ncells;
+
+  char *image = aio_alloc(*length);
+  float *fields = (float *)(image + sizeof(header)); /* u_x, u_y, u and pressure, each cnx * cny */
+  int *flags = (int *)&fields[4 * ncells];
+
+  memcpy(header.magic, BINMAGIC, sizeof(header.magic));
+  header.kind = BINFINALSTATE;
+  header.nx = cnx;
+  header.ny = cny;
+  header.nfields = 5;
+  memcpy(image, &header, sizeof(header));
+
+#pragma omp parallel
+  {
+    float *rows = (float *)malloc(sizeof(float) * 4 * params.nx); /* u_x, u_y, u and pressure of one fine row */
+    double *sums = (double *)malloc(sizeof(double) * 4 * cnx);    /* ... summed over a row of blocks */
+    int *open = (int *)malloc(sizeof(int) * cnx);                 /* open cells in each block */
+
+    if (rows == NULL || sums == NULL || open == NULL)
+      die("cannot allocate memory for the coarse snapshot", __LINE__, __FILE__);
+
+#pragma omp for
+    for (int cj = 0; cj < cny; cj++)
+    {
+      memset(sums, 0, sizeof(double) * 4 * cnx);
+      memset(open, 0, sizeof(int) * cnx);
+
+      for (int jj = cj * factor; jj < (cj + 1) * factor && jj < params.ny; jj++)
+      {
+        row_values(params, cells, obstacles, jj, rows, rows + params.nx, rows + 2 * params.nx, rows + 3 * params.nx);
+
+        for (int ii = 0; ii < params.nx; ii++)
+        {
+          if (obstacles[ii + jj * params.nx])
+            continue;
+
+          for (int ff = 0; ff < 4; ff++)
+            sums[ff * cnx + ii / factor] += rows[ff * params.nx + ii];
+          open[ii / factor]++;
+        }
+      }
+
+      for (int ci = 0; ci < cnx; ci++)
+      {
+        const size_t cc = ci + (size_t)cj * cnx;
+
+        for (int ff = 0; ff < 4; ff++)
+          fields[ff * ncells + cc] = open[ci] ? (float)(sums[ff * cnx + ci] / open[ci]) : 0.f;
+        if (!open[ci])
+          fields[3 * ncells + cc] = params.density / 3.f;
+        flags[cc] = !open[ci];
+      }
+    }
+
+    free(rows);
+    free(sums);
+    free(open);
+  }
+
+  return image;
+}
+
+/*
+** In place of the full state, a snapshot with regions of interest
+** queues each window at full resolution and, with a coarse factor,
+** the whole grid at that coarser resolution. Returns the bytes queued.
+*/
+size_t roi_snapshot(const t_param params, t_speeds *cells, int *obstacles, const t_roi *rois, int nrois, int coarse,
+                    int tt, t_aio *aio)
+{
+  char name[96]; /* snapshot file */
+  size_t length; /* ... and its bytes */
+  size_t bytes = 0;
+
+  for (int rr = 0; rr < nrois; rr++)
+  {
+    char *image = window_image(params, cells, obstacles, &rois[rr], &length);
+
+    sprintf(name, ROIFILE, rois[rr].x, rois[rr].y, rois[rr].w, rois[rr].h, tt);
+    aio_write(aio, name, image, length);
+    bytes += length;
+  }
+
+  if (coarse > 1)
+  {
+    char *image = coarse_image(params, cells, obstacles, coarse, &length);
+
+    sprintf(name, COARSEFILE, coarse, tt);
+    aio_write(aio, name, image, length);
+    bytes += length;
+  }
+
+  return bytes;
+}
+
+int energy_init(t_energy *energy)
+{
+  char zone[128]; /* sysfs directory of the zone being probed */
+  char file[160]; /* a file within that directory */
+  char name[64];  /* zone name, e.g. "package-0" or "dram" */
+  FILE *fp;       /* file pointer */
+
+  energy->nzones = 0;
+
+  /*
+  ** Packages are intel-rapl:<pkg> and their sub-zones (core, uncore,
+  ** dram) are intel-rapl:<pkg>:<sub>. Only the package and dram zones
+  ** are kept, as the others are already included in the package total.
+  */
+  for (int pkg = 0; pkg < MAXRAPLZONES; pkg++)
+  {
+    for (int sub = -1; sub < MAXRAPLZONES; sub++)
+    {
+      if (sub < 0)
+        sprintf(zone, "%s/intel-rapl:%d", RAPLDIR, pkg);
+      else
+        sprintf(zone, "%s/intel-rapl:%d:%d", RAPLDIR, pkg, sub);
+
+      sprintf(file, "%s/name", zone);
+      fp = fopen(file, "r");
+
+      if (fp == NULL)
+      {
+        if (sub < 0)
+          return energy->nzones; /* no more packages */
+
+        break; /* no more sub-zones in this package */
+      }
+
+      if (fscanf(fp, "%63s", name) != 1)
+        name[0] = '\0';
+
+      fclose(fp);
+
+      const int is_dram = !strcmp(name, "dram");
+
+      if ((sub < 0 && strncmp(name, "package", 7)) || (sub >= 0 && !is_dram))
+        continue;
+
+      if (energy->nzones == MAXRAPLZONES)
+        return energy->nzones;
+
+      /* energy_uj is only readable by root on many systems */
+      unsigned long long value;
+      sprintf(energy->path[energy->nzones], "%s/energy_uj", zone);
+
+      if (!read_counter(energy->path[energy->nzones], &value))
+        continue;
+
+      sprintf(file, "%s/max_energy_range_uj", zone);
+
+      if (!read_counter(file, &energy->max_uj[energy->nzones]))
+        energy->max_uj[energy->nzones] = 0;
+
+      energy->is_dram[energy->nzones] = is_dram;
+      energy->nzones++;
+    }
+  }
+
+  return energy->nzones;
+}
+
+int read_counter(const char *file, unsigned long long *value)
+{
+  FILE *fp = fopen(file, "r");
+
+  if (fp == NULL)
+    return 0;
+
+  const int ok = (fscanf(fp, "%llu", value) == 1);
+  fclose(fp);
+
+  return ok;
+}
+
+void energy_read(const t_energy *energy, t_energy_sample *sample)
+{
+  for (int zone = 0; zone < energy->nzones; zone++)
+  {
+    if (!read_counter(energy->path[zone], &sample->uj[zone]))
+      sample->uj[zone] = 0;
+  }
+}
+
+void energy_delta(const t_energy *energy, const t_energy_sample *from, const t_energy_sample *to,
+                  double *pkg_joules, double *dram_joules)
+{
+  *pkg_joules = 0.0;
+  *dram_joules = 0.0;
+
+  for (int zone = 0; zone < energy->nzones; zone++)
+  {
+    unsigned long long uj = to->uj[zone] - from->uj[zone];
+
+    /* the counter wrapped around during the phase: it counts 0..max_uj, so max_uj + 1 values */
+    if (to->uj[zone] < from->uj[zone])
+      uj = energy->max_uj[zone] - from->uj[zone] + to->uj[zone] + 1;
+
+    if (energy->is_dram[zone])
+      *dram_joules += uj * 1e-6;
+    else
+      *pkg_joules += uj * 1e-6;
+  }
+}
+
+void report_energy(const t_param params, const t_energy *energy, const t_energy_sample *e_init,
+                   const t_energy_sample *e_comp, const t_energy_sample *e_out, const t_energy_sample *e_end)
+{
+  const double mlups = (double)params.nx * params.ny * params.maxIters / 1e6; /* millions of lattice updates */
+  double pkg, dram;                                                          /* joules used in a phase */
+
+  energy_delta(energy, e_init, e_comp, &pkg, &dram);
+  printf("Energy Init (pkg/dram):\t\t%.3lf / %.3lf (J)\n", pkg, dram);
+  energy_delta(energy, e_comp, e_out, &pkg, &dram);
+  printf("Energy Compute (pkg/dram):\t%.3lf / %.3lf (J)\n", pkg, dram);
+  printf("Energy per MLUP (pkg/dram):\t%.6lf / %.6lf (J)\n", pkg / mlups, dram / mlups);
+  energy_delta(energy, e_out, e_end, &pkg, &dram);
+  printf("Energy Output (pkg/dram):\t%.3lf / %.3lf (J)\n", pkg, dram);
+  energy_delta(energy, e_init, e_end, &pkg, &dram);
+  printf("Energy Total (pkg/dram):\t%.3lf / %.3lf (J)\n", pkg, dram);
+}
+
+void make_geometry(const t_param params, int *obstacles, int kind, float solid, unsigned int seed)
+{
+  const int nx = params.nx;
+  const int ny = params.ny;
+
+  /* every geometry is a channel: walls along the top and bottom rows */
+#pragma omp parallel for
+  for (int jj = 0; jj < ny; jj++)
+  {
+    for (int ii = 0; ii < nx; ii++)
+      obstacles[ii + jj * nx] = (jj == 0 || jj == ny - 1);
+  }
+
+  if (kind == GEOM_CYLINDER)
+  {
+    /* a cylinder a quarter of the way along, blocking a quarter of the channel */
+    const int radius = ny / 8;
+    const int cx = nx / 4;
+    const int cy = ny / 2;
+
+    for (int jj = cy - radius; jj <= cy + radius; jj++)
+    {
+      for (int ii = cx - radius; ii <= cx + radius; ii++)
+      {
+        if ((ii - cx) * (ii - cx) + (jj - cy) * (jj - cy) <= radius * radius)
+          obstacles[((ii + nx) % nx) + ((jj + ny) % ny) * nx] = 1;
+      }
+    }
+  }
+  else if (kind == GEOM_POROUS)
+  {
+    /* overlapping discs at random positions, until the solid fraction is reached */
+    const int radius = (ny / 64 > 2) ? ny / 64 : 2;
+    const long target = (long)(solid * (double)nx * ny);
+    long blocked = 2L * nx;
+
+    while (blocked < target)
+    {
+      const int cx = (int)(rand_uniform(&seed) * nx);
+      const int cy = (int)(rand_uniform(&seed) * ny);
+
+      for (int jj = cy - radius; jj <= cy + radius && blocked < target; jj++)
+      {
+        for (int ii = cx - radius; ii <= cx + radius && blocked < target; ii++)
+        {
+          const int cell = ((ii + nx) % nx) + ((jj + ny) % ny) * nx;
+
+          if ((ii - cx) * (ii - cx) + (jj - cy) * (jj - cy) <= radius * radius && !obstacles[cell])
+          {
+            obstacles[cell] = 1;
+            blocked++;
+          }
+        }
+      }
+    }
+  }
+}
+
+int parse_list(const char *text, int *values, int max_values)
+{
+  int count = 0;
+
+  while (*text && count < max_values)
+  {
+    char *next;
+    const long value = strtol(text, &next, 10);
+
+    if (next == text || value <= 0)
+      return 0;
+
+    values[count++] = (int)value;
+    text = (*next == ',') ? next + 1 : next;
+  }
+
+  return count;
+}
+
+int benchmark(const char *sizes_list, const char *threads_list, int iterations)
+{
+  /* the geometries: kind, target solid fraction of the porous media, and name */
+  const int kinds[] = {GEOM_CHANNEL, GEOM_CYLINDER, GEOM_POROUS, GEOM_POROUS, GEOM_POROUS, GEOM_POROUS};
+  const float solids[] = {0.f, 0.f, 0.1f, 0.3f, 0.5f, 0.7f};
+  const char *names[] = {"channel", "cylinder", "porous10", "porous30", "porous50", "porous70"};
+  const int ngeometries = sizeof(kinds) / sizeof(kinds[0]);
+  const int max_threads = omp_get_max_threads();
+  int sizes[MAXBENCHLIST] = {128, 256, 512, 1024, 2048, 4096, 8192};
+  int threads[MAXBENCHLIST];
+  int nsizes = 7;
+  int nthreads = 0;
+  FILE *csv, *json; /* the results table, in both formats */
+
+  if (sizes_list != NULL && (nsizes = parse_list(sizes_list, sizes, MAXBENCHLIST)) == 0)
+    die("--bench-sizes expects a comma separated list of grid sizes", __LINE__, __FILE__);
+
+  if (threads_list != NULL)
+  {
+    if ((nthreads = parse_list(threads_list, threads, MAXBENCHLIST)) == 0)
+      die("--bench-threads expects a comma separated list of thread counts", __LINE__, __FILE__);
+  }
+  else
+  {
+    /* powers of two, and the whole machine */
+    for (int tt = 1; tt < max_threads && nthreads < MAXBENCHLIST - 1; tt *= 2)
+      threads[nthreads++] = tt;
+    threads[nthreads++] = max_threads;
+  }
+
+  csv = fopen(BENCHCSVFILE, "w");
+  json = fopen(BENCHJSONFILE, "w");
+
+  if (csv == NULL || json == NULL)
+    die("could not open benchmark output file", __LINE__, __FILE__);
+
+  fprintf(csv, "nx,ny,geometry,solid,kernel,threads,iterations,seconds,mlups\n");
+  fprintf(json, "[\n");
+  printf("==benchmark==\n");
+  printf("%-6s %-9s %-6s %-10s %-7s %-6s %s\n", "size", "geometry", "solid", "kernel", "threads", "iters", "MLUPS");
+
+  const size_t available = available_memory(NULL, NULL);
+  int first = 1; /* no comma before the first JSON record */
+
+  for (int ss = 0; ss < nsizes; ss++)
+  {
+    t_param params;
+    params.nx = sizes[ss];
+    params.ny = sizes[ss];
+    params.reynolds_dim = sizes[ss];
+    params.density = 0.1f;
+    params.accel = 0.005f;
+    params.omega = 1.7f;
+
+    /* about 2e8 lattice updates per run, unless told otherwise */
+    const double ncells = (double)params.nx * params.ny;
+    params.maxIters = (iterations > 0) ? iterations : (int)fmax(10.0, fmin(2000.0, 2e8 / ncells));
+
+    t_footprint footprint;
+    plan_footprint(params, 0, 0, &footprint);
+
+    if (available > 0 && footprint.per_cell * ncells + footprint.fixed > available)
+    {
+      printf("%d x %d skipped: needs more memory than is available\n", params.nx, params.ny);
+      continue;
+    }
+
+    t_speeds *cells = alloc_speeds(&params, "cells");
+    t_speeds *tmp_cells = alloc_speeds(&params, "tmp_cells");
+    int *obstacles = malloc(sizeof(int) * params.nx * params.ny);
+
+    if (obstacles == NULL)
+      die("cannot allocate memory for obstacles", __LINE__, __FILE__);
+
+    for (int gg = 0; gg < ngeometries; gg++)
+    {
+      make_geometry(params, obstacles, kinds[gg], solids[gg], 1234u + gg);
+
+      /* the solid fraction actually generated, walls included */
+      long blocked = 0;
+
+      for (int ii = 0; ii < params.nx * params.ny; ii++)
+        blocked += obstacles[ii];
+
+      const double solid = blocked / ncells;
+
+      for (int kk = 0; kk < NKERNELS; kk++)
+      {
+        for (int tt = 0; tt < nthreads; tt++)
+        {
+          omp_set_num_threads(threads[tt]);
+          init_speeds(&params, cells);
+          init_speeds(&params, tmp_cells);
+
+          /* warm up, then time */
+          for (int it = 0; it < 2; it++)
+          {
+            accelerate_flow(params, cells, obstacles);
+            kernels[kk].fn(params, cells, tmp_cells, obstacles);
+            t_speeds *tmp = cells;
+            cells = tmp_cells;
+            tmp_cells = tmp;
+          }
+
+          const double tic = wall_time();
+
+          for (int it = 0; it < params.maxIters; it++)
+          {
+            accelerate_flow(params, cells, obstacles);
+            kernels[kk].fn(params, cells, tmp_cells, obstacles);
+            t_speeds *tmp = cells;
+            cells = tmp_cells;
+            tmp_cells = tmp;
+          }
+
+          const double seconds = wall_time() - tic;
+          const double mlups = ncells * params.maxIters / seconds / 1e6;
+
+          printf("%-6d %-9s %-6.2f %-10s %-7d %-6d %.1f\n", params.nx, names[gg], solid,
+                 kernels[kk].name, threads[tt], params.maxIters, mlups);
+          fflush(stdout);
+          fprintf(csv, "%d,%d,%s,%.2f,%s,%d,%d,%.6f,%.3f\n", params.nx, params.ny, names[gg], solid,
+                  kernels[kk].name, threads[tt], params.maxIters, seconds, mlups);
+          fprintf(json, "%s  {\"nx\": %d, \"ny\": %d, \"geometry\": \"%s\", \"solid\": %.2f, \"kernel\": \"%s\", "
+                        "\"threads\": %d, \"iterations\": %d, \"seconds\": %.6f, \"mlups\": %.3f}",
+                  first ? "" : ",\n", params.nx, params.ny, names[gg], solid, kernels[kk].name,
+                  threads[tt], params.maxIters, seconds, mlups);
+          first = 0;
+        }
+      }
+    }
+
+    free_speeds(&cells);
+    free_speeds(&tmp_cells);
+    free(obstacles);
+  }
+
+  fprintf(json, "\n]\n");
+  fclose(csv);
+  fclose(json);
+  omp_set_num_threads(max_threads);
+
+  printf("results written to %s and %s\n", BENCHCSVFILE, BENCHJSONFILE);
+
+  return EXIT_SUCCESS;
+}
+
+int scaling(const char *paramfile, const char *obstaclefile, int weak, const char *threads_list,
+            const t_kernel *kernel)
+{
+  const int max_threads = omp_get_max_threads();
+  int threads[MAXBENCHLIST]; /* thread counts to run with */
+  int nthreads = 0;
+  t_param deck;             /* the deck as read from the files */
+  t_speeds *cells = NULL, *tmp_cells = NULL;
+  int *deck_obstacles = NULL;
+  float *av_vels = NULL;
+  double base_time = 0.0;   /* total time of the first run */
+
+  if (threads_list != NULL)
+  {
+    if ((nthreads = parse_list(threads_list, threads, MAXBENCHLIST)) == 0)
+      die("--scaling-threads expects a comma separated list of thread counts", __LINE__, __FILE__);
+  }
+  else
+  {
+    for (int tt = 1; tt < max_threads && nthreads < MAXBENCHLIST - 1; tt *= 2)
+      threads[nthreads++] = tt;
+    threads[nthreads++] = max_threads;
+  }
+
+  /*
+  ** A weak-scaled run places copies of the deck's obstacles side by
+  ** side in x, one per thread, so that accelerate_flow() drives the
+  ** same row of every copy and each does the same work as the deck.
+  */
+  if (weak)
+  {
+    initialise(paramfile, obstaclefile, &deck, 0, &cells, &tmp_cells, &deck_obstacles, &av_vels);
+    free_speeds(&cells);
+    free_speeds(&tmp_cells);
+    free(av_vels);
+  }
+
+  printf("==%s scaling, kernel %s==\n", weak ? "weak" : "strong", kernel->name);
+  printf("threads\tgrid\t\tinit (s)\taccel (s)\tkernel (s)\toutput (s)\ttotal (s)\tspeedup\tefficiency\n");
+
+  for (int tt = 0; tt < nthreads; tt++)
+  {
+    t_param params;
+    int *obstacles = NULL;
+    omp_set_num_threads(threads[tt]);
+
+    /* init: read the deck, or replicate it, and first-touch the lattice with this many threads */
+    double tic = wall_time();
+
+    if (weak)
+    {
+      params = deck;
+      params.nx = deck.nx * threads[tt];
+      cells = alloc_speeds(&params, "cells");
+      tmp_cells = alloc_speeds(&params, "tmp_cells");
+      obstacles = malloc(sizeof(int) * params.nx * params.ny);
+      av_vels = malloc(sizeof(float) * params.maxIters);
+
+      if (obstacles == NULL || av_vels == NULL)
+        die("cannot allocate memory for scaling run", __LINE__, __FILE__);
+
+      init_speeds(&params, cells);
+
+      for (int jj = 0; jj < deck.ny; jj++)
+      {
+        for (int copy = 0; copy < threads[tt]; copy++)
+          memcpy(&obstacles[(size_t)jj * params.nx + (size_t)copy * deck.nx], &deck_obstacles[(size_t)jj * deck.nx],
+                 sizeof(int) * deck.nx);
+      }
+    }
+    else
+    {
+      initialise(paramfile, obstaclefile, &params, 0, &cells, &tmp_cells, &obstacles, &av_vels);
+    }
+
+    const double init_time = wall_time() - tic;
+    double accel_time = 0.0, kernel_time = 0.0;
+
+    /* compute, with the serial accelerate_flow() timed apart from the kernel */
+    for (int it = 0; it < params.maxIters; it++)
+    {
+      tic = wall_time();
+      accelerate_flow(params, cells, obstacles);
+      const double mid = wall_time();
+      av_vels[it] = kernel->fn(params, cells, tmp_cells, obstacles);
+      const double toc = wall_time();
+      accel_time += mid - tic;
+      kernel_time += toc - mid;
+
+      t_speeds *tmp = cells;
+      cells = tmp_cells;
+      tmp_cells = tmp;
+    }
+
+    tic = wall_time();
+    write_values(params, cells, obstacles, av_vels, 0);
+    const double output_time = wall_time() - tic;
+
+    const double total = init_time + accel_time + kernel_time + output_time;
+
+    /*
+    ** Strong: speedup over the one-thread time, extrapolated linearly
+    ** if the first run used more threads. Weak: the time one thread
+    ** would take for this much work over the actual time, assuming the
+    ** first run scaled ideally. Ideal is a speedup equal to the threads.
+    */
+    if (tt == 0)
+      base_time = weak ? total : total * threads[0];
+
+    const double speedup = (weak ? base_time * threads[tt] : base_time) / total;
+
+    printf("%d\t%d x %d\t%.6lf\t%.6lf\t%.6lf\t%.6lf\t%.6lf\t%.2lf\t%.1lf%%\n", threads[tt], params.nx, params.ny,
+           init_time, accel_time, kernel_time, output_time, total, speedup, 100.0 * speedup / threads[tt]);
+    fflush(stdout);
+
+    finalise(&params, &cells, &tmp_cells, &obstacles, &av_vels);
+  }
+
+  free(deck_obstacles);
+  omp_set_num_threads(max_threads);
+
+  return EXIT_SUCCESS;
+}
+
+int microbench(void)
+{
+  t_param params;              /* the out-of-cache grid */
+  t_param block;               /* the in-cache grid */
+  const double min_time = 0.2; /* seconds each stage runs for, at least */
+
+  params.nx = params.ny = MICROSIZE;
+  params.maxIters = 1;
+  params.reynolds_dim = MICROSIZE;
+  params.density = 0.1f;
+  params.accel = 0.005f;
+  params.omega = 1.7f;
+  block = params;
+  block.nx = block.ny = MICROBLOCK;
+
+  t_speeds *cells = alloc_speeds(&params, "cells");
+  t_speeds *tmp_cells = alloc_speeds(&params, "tmp_cells");
+  int *fluid = calloc((size_t)params.nx * params.ny, sizeof(int)); /* no obstacles */
+  int *solid = malloc(sizeof(int) * params.nx * params.ny);       /* all obstacles */
+
+  if (fluid == NULL || solid == NULL)
+    die("cannot allocate memory for microbenchmarks", __LINE__, __FILE__);
+
+  for (int ii = 0; ii < params.nx * params.ny; ii++)
+    solid[ii] = 1;
+
+  init_speeds(&params, cells);
+  init_speeds(&params, tmp_cells);
+
+  printf("==microbenchmarks: %d x %d grid, %d x %d in-cache block, %d thread(s)==\n",
+         MICROSIZE, MICROSIZE, MICROBLOCK, MICROBLOCK, omp_get_max_threads());
+  printf("%-22s %12s %12s %12s\n", "stage", "cells/call", "ns/cell", "cycles/cell");
+
+  for (int stage = 0; stage < MICRO_NSTAGES; stage++)
+  {
+    const char *names[MICRO_NSTAGES] = {"stream", "collide (in cache)", "rebound", "accelerate_flow",
+                                        "av_velocity", "total_density", "timestep (fused)"};
+    const t_param *grid = (stage == MICRO_COLLIDE) ? &block : &params;
+    const double cells_per_call = (stage == MICRO_ACCELERATE) ? grid->nx : (double)grid->nx * grid->ny;
+    double best_time = 1e30, best_cycles = 1e30; /* per call */
+    double elapsed = 0.0;
+    volatile float sink = 0.f; /* keeps the reductions from being optimised away */
+
+    for (int rep = 0; elapsed < min_time || rep < 3; rep++)
+    {
+      const double tic = wall_time();
+      const unsigned long long c_tic = cycle_count();
+
+      switch (stage)
+      {
+      case MICRO_STREAM:
+        micro_stream(*grid, cells, tmp_cells);
+        break;
+      case MICRO_COLLIDE:
+        sink += micro_collide(*grid, cells, tmp_cells);
+        break;
+      case MICRO_REBOUND:
+        /* the deck's rebound() pass alone, with every cell an obstacle so that every cell mirrors */
+        rebound(*grid, cells, tmp_cells, solid);
+        break;
+      case MICRO_ACCELERATE:
+        accelerate_flow(*grid, cells, fluid);
+        break;
+      case MICRO_AV_VELOCITY:
+        sink += av_velocity(*grid, cells, fluid);
+        break;
+      case MICRO_TOTAL_DENSITY:
+        sink += total_density(*grid, cells);
+        break;
+      default:
+        sink += timestep(*grid, cells, tmp_cells, fluid);
+        break;
+      }
+
+      const unsigned long long c_toc = cycle_count();
+      const double toc = wall_time();
+
+      elapsed += toc - tic;
+      if (toc - tic < best_time)
+        best_time = toc - tic;
+      if ((double)(c_toc - c_tic) < best_cycles)
+        best_cycles = (double)(c_toc - c_tic);
+
+      /* stages that stream/collide leave the new state in tmp_cells, keep going from it */
+      if (stage == MICRO_STREAM || stage == MICRO_COLLIDE || stage == MICRO_REBOUND || stage == MICRO_TIMESTEP)
+      {
+        t_speeds *tmp = cells;
+        cells = tmp_cells;
+        tmp_cells = tmp;
+      }
+
+      /* keep accelerate_flow from draining the row it pushes */
+      if (stage == MICRO_ACCELERATE && rep % 64 == 63)
+        init_speeds(&params, cells);
+    }
+
+    printf("%-22s %12.0f %12.3f ", names[stage], cells_per_call, 1e9 * best_time / cells_per_call);
+
+    if (best_cycles > 0.0)
+      printf("%12.2f\n", best_cycles / cells_per_call);
+    else
+      printf("%12s\n", "n/a");
+
+    init_speeds(&params, cells);
+  }
+
+  printf("cycles are TSC (reference) cycles; multiply by the ratio of core to TSC clock for core cycles\n");
+
+  free_speeds(&cells);
+  free_speeds(&tmp_cells);
+  free(fluid);
+  free(solid);
+
+  return EXIT_SUCCESS;
+}
+
+void micro_stream(const t_param params, t_speeds *restrict cells, t_speeds *restrict tmp_cells)
+{
+  /* the gather at the top of timestep(), with a plain store in place of the collision */
+#pragma omp parallel for
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    const int y_s = (jj == 0) ? (jj + params.ny - 1) : (jj - 1);
+    const int y_n = (jj + 1) % params.ny;
+#pragma omp simd
+    for (int ii = 0; ii < params.nx; ii++)
+    {
+      const int x_e = (ii + 1) % params.nx;
+      const int x_w = (ii == 0) ? (ii + params.nx - 1) : (ii - 1);
+
+      tmp_cells->s0[ii + jj * params.nx] = cells->s0[ii + jj * params.nx];
+      tmp_cells->s1[ii + jj * params.nx] = cells->s1[x_w + jj * params.nx];
+      tmp_cells->s2[ii + jj * params.nx] = cells->s2[ii + y_s * params.nx];
+      tmp_cells->s3[ii + jj * params.nx] = cells->s3[x_e + jj * params.nx];
+      tmp_cells->s4[ii + jj * params.nx] = cells->s4[ii + y_n * params.nx];
+      tmp_cells->s5[ii + jj * params.nx] = cells->s5[x_w + y_s * params.nx];
+      tmp_cells->s6[ii + jj * params.nx] = cells->s6[x_e + y_s * params.nx];
+      tmp_cells->s7[ii + jj * params.nx] = cells->s7[x_e + y_n * params.nx];
+      tmp_cells->s8[ii + jj * params.nx] = cells->s8[x_w + y_n * params.nx];
+    }
+  }
+}
+
+float micro_collide(const t_param params, t_speeds *restrict cells, t_speeds *restrict tmp_cells)
+{
+  const float c = 3.f;
+  const float w0 = 4.f / 9.f;  /* weighting factor */
+  const float w1 = 1.f / 9.f;  /* weighting factor */
+  const float w2 = 1.f / 36.f; /* weighting factor */
+  float tot_u = 0.f;
+
+  /* the collision of timestep(), with every speed read from the cell itself */
+#pragma omp parallel for reduction(+ : tot_u)
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+#pragma omp simd reduction(+ : tot_u)
+    for (int ii = 0; ii < params.nx; ii++)
+    {
+      const int idx = ii + jj * params.nx;
+      const float prop0 = cells->s0[idx];
+      const float prop1 = cells->s1[idx];
+      const float prop2 = cells->s2[idx];
+      const float prop3 = cells->s3[idx];
+      const float prop4 = cells->s4[idx];
+      const float prop5 = cells->s5[idx];
+      const float prop6 = cells->s6[idx];
+      const float prop7 = cells->s7[idx];
+      const float prop8 = cells->s8[idx];
+
+      const float local_density = prop0 + prop1 + prop2 + prop3 + prop4 + prop5 + prop6 + prop7 + prop8;
+      const float u_x = (prop1 + prop5 + prop8 - (prop3 + prop6 + prop7)) / local_density;
+      const float u_y = (prop2 + prop5 + prop6 - (prop4 + prop7 + prop8)) / local_density;
+      const float u_sq = (u_x * u_x) + (u_y * u_y);
+      const float u5 = u_x + u_y;
+      const float u6 = -u_x + u_y;
+
+      tmp_cells->s0[idx] = prop0 + params.omega * (w0 * local_density * (1.f - u_sq * (0.5f * c)) - prop0);
+      tmp_cells->s1[idx] = prop1 + params.omega * (w1 * local_density * (1.f + u_x * c + (u_x * u_x) * (1.5f * c) - u_sq * (0.5f * c)) - prop1);
+      tmp_cells->s2[idx] = prop2 + params.omega * (w1 * local_density * (1.f + u_y * c + (u_y * u_y) * (1.5f * c) - u_sq * (0.5f * c)) - prop2);
+      tmp_cells->s3[idx] = prop3 + params.omega * (w1 * local_density * (1.f - u_x * c + (u_x * u_x) * (1.5f * c) - u_sq * (0.5f * c)) - prop3);
+      tmp_cells->s4[idx] = prop4 + params.omega * (w1 * local_density * (1.f - u_y * c + (u_y * u_y) * (1.5f * c) - u_sq * (0.5f * c)) - prop4);
+      tmp_cells->s5[idx] = prop5 + params.omega * (w2 * local_density * (1.f + u5 * c + (u5 * u5) * (1.5f * c) - u_sq * (0.5f * c)) - prop5);
+      tmp_cells->s6[idx] = prop6 + params.omega * (w2 * local_density * (1.f + u6 * c + (u6 * u6) * (1.5f * c) - u_sq * (0.5f * c)) - prop6);
+      tmp_cells->s7[idx] = prop7 + params.omega * (w2 * local_density * (1.f - u5 * c + (u5 * u5) * (1.5f * c) - u_sq * (0.5f * c)) - prop7);
+      tmp_cells->s8[idx] = prop8 + params.omega * (w2 * local_density * (1.f - u6 * c + (u6 * u6) * (1.5f * c) - u_sq * (0.5f * c)) - prop8);
+
+      tot_u = tot_u + sqrtf(u_sq);
+    }
+  }
+
+  return tot_u;
+}
+
+unsigned long long cycle_count(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+int parareal(const t_param params, t_speeds **cells_ptr, int *obstacles, float *av_vels,
+             const t_kernel *kernel, int nslices, int max_k)
+{
+  char message[1024]; /* message buffer */
+  t_param coarse;     /* the 2x downsampled lattice */
+  const float tau = 1.f / params.omega;
+
+  if (params.nx % 2 || params.ny % 2)
+    die("parareal needs even nx and ny for the coarse lattice", __LINE__, __FILE__);
+
+  if (nslices < 2 || params.maxIters < 2 * nslices)
+  {
+    sprintf(message, "parareal needs 2 <= slices <= maxIters/2, got %d slices of %d iterations",
+            nslices, params.maxIters);
+    die(message, __LINE__, __FILE__);
+  }
+
+  if (max_k < 1 || max_k > nslices)
+    max_k = nslices;
+
+  /*
+  ** Halving the resolution at a fixed lattice velocity doubles both
+  ** dx and dt, so each coarse step covers two fine steps, and the
+  ** lattice viscosity (tau - 1/2)/3 halves for the same physical one.
+  ** The accelerated row ends up further from the wall on the coarse
+  ** lattice, where less of its momentum is lost to the wall, and half
+  ** the acceleration tracks the fine run's av. velocity far better.
+  */
+  coarse = params;
+  coarse.nx = params.nx / 2;
+  coarse.ny = params.ny / 2;
+  coarse.reynolds_dim = params.reynolds_dim / 2;
+  coarse.omega = 1.f / (0.5f + 0.5f * (tau - 0.5f));
+  coarse.accel = 0.5f * params.accel;
+
+  int *coarse_obstacles = malloc(sizeof(int) * coarse.nx * coarse.ny);
+  int *first = malloc(sizeof(int) * (nslices + 1)); /* first iteration of each slice, and maxIters */
+  t_speeds **u = malloc(sizeof(t_speeds *) * (nslices + 1));      /* state at the start of each slice */
+  t_speeds **fine = malloc(sizeof(t_speeds *) * (nslices + 1));   /* fine propagation of u[n - 1] */
+  t_speeds **g_old = malloc(sizeof(t_speeds *) * (nslices + 1));  /* coarse propagation of u[n - 1] */
+  t_speeds **scratch = malloc(sizeof(t_speeds *) * nslices);      /* per slice tmp_cells */
+  t_speeds *c_cells = alloc_speeds(&coarse, "coarse cells");
+  t_speeds *c_tmp_cells = alloc_speeds(&coarse, "coarse tmp_cells");
+  t_speeds *g_new = alloc_speeds(&params, "parareal g_new");
+
+  if (coarse_obstacles == NULL || first == NULL || u == NULL || fine == NULL || g_old == NULL || scratch == NULL)
+    die("cannot allocate memory for parareal", __LINE__, __FILE__);
+
+  for (int n = 0; n <= nslices; n++)
+  {
+    first[n] = (int)((long)n * params.maxIters / nslices);
+    u[n] = (n == 0) ? *cells_ptr : alloc_speeds(&params, "parareal u");
+    fine[n] = (n == 0) ? NULL : alloc_speeds(&params, "parareal fine");
+    g_old[n] = (n == 0) ? NULL : alloc_speeds(&params, "parareal g_old");
+    if (n < nslices)
+      scratch[n] = alloc_speeds(&params, "parareal tmp_cells");
+  }
+
+  /* a coarse cell is blocked if any of its four fine cells is */
+  for (int jj = 0; jj < coarse.ny; jj++)
+  {
+    for (int ii = 0; ii < coarse.nx; ii++)
+    {
+      const int f = 2 * ii + 2 * jj * params.nx;
+      coarse_obstacles[ii + jj * coarse.nx] = obstacles[f] || obstacles[f + 1] ||
+                                              obstacles[f + params.nx] || obstacles[f + params.nx + 1];
+    }
+  }
+
+  printf("==parareal: %d slices of ~%d iterations, at most %d corrections, %d thread(s)==\n",
+         nslices, params.maxIters / nslices, max_k, omp_get_max_threads());
+  printf("coarse lattice %d x %d, omega %.6f\n", coarse.nx, coarse.ny, coarse.omega);
+
+  /* initial prediction: one serial sweep of the coarse propagator */
+  double tic = wall_time();
+  for (int n = 0; n < nslices; n++)
+  {
+    coarse_propagate(params, coarse, u[n], g_old[n + 1], coarse_obstacles, c_cells, c_tmp_cells,
+                     kernel, (first[n + 1] - first[n] + 1) / 2);
+    copy_speeds(params, u[n + 1], g_old[n + 1]);
+  }
+  printf("%-6s %14s %10s\n", "k", "max change", "time (s)");
+  printf("%-6d %14s %10.4f\n", 0, "-", wall_time() - tic);
+
+  /*
+  ** Corrections. After k of them the first k slices match the serial
+  ** run exactly, so their fine propagations are not repeated.
+  */
+  const float tolerance = PARAREALTOL * params.density;
+  float change = 0.f;
+  int k;
+
+  /* slices are the parallelism: the kernels inside a slice run on its one thread */
+  const int levels = omp_get_max_active_levels();
+  omp_set_max_active_levels(1);
+
+  for (k = 1; k <= max_k; k++)
+  {
+    tic = wall_time();
+
+    /* the fine propagation of every unconverged slice, concurrently */
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int n = k - 1; n < nslices; n++)
+    {
+      t_speeds *work = fine[n + 1];
+      t_speeds *tmp_work = scratch[n];
+
+      copy_speeds(params, work, u[n]);
+      for (int tt = first[n]; tt < first[n + 1]; tt++)
+      {
+        accelerate_flow(params, work, obstacles);
+        av_vels[tt] = kernel->fn(params, work, tmp_work, obstacles);
+        t_speeds *tmp = work;
+        work = tmp_work;
+        tmp_work = tmp;
+      }
+
+      /* keep the result in fine[n + 1], whichever buffer it ended in */
+      if (work != fine[n + 1])
+      {
+        scratch[n] = fine[n + 1];
+        fine[n + 1] = work;
+      }
+    }
+
+    /* the serial coarse sweep: u[n + 1] = F(u[n]) + G(u[n]) - G(u_old[n]) */
+    change = 0.f;
+
+    for (int n = k - 1; n < nslices; n++)
+    {
+      coarse_propagate(params, coarse, u[n], g_new, coarse_obstacles, c_cells, c_tmp_cells,
+                       kernel, (first[n + 1] - first[n] + 1) / 2);
+      const float slice_change = parareal_correct(params, u[n + 1], fine[n + 1], g_new, g_old[n + 1]);
+      change = (slice_change > change) ? slice_change : change;
+
+      t_speeds *tmp = g_old[n + 1];
+      g_old[n + 1] = g_new;
+      g_new = tmp;
+    }
+
+    printf("%-6d %14.6E %10.4f\n", k, change, wall_time() - tic);
+
+    if (change <= tolerance)
+      break;
+  }
+
+  omp_set_max_active_levels(levels);
+
+  if (k > max_k)
+    k = max_k;
+  printf("stopped after %d of %d corrections (serial run is %d)\n", k, max_k, nslices);
+
+  /* the last fine sweep started slices k.. from corrected, not serial, states */
+  if (k < nslices)
+    printf("av_vels of iterations %d..%d and the final state are approximate: their slices started "
+           "%s (max change %.6E)\n", first[k], params.maxIters - 1,
+           (change <= tolerance) ? "within tolerance of the serial run" : "from unconverged states", change);
+
+  /* the final state replaces cells */
+  copy_speeds(params, *cells_ptr, u[nslices]);
+
+  for (int n = 0; n <= nslices; n++)
+  {
+    if (n > 0)
+    {
+      free_speeds(&u[n]);
+      free_speeds(&fine[n]);
+      free_speeds(&g_old[n]);
+    }
+    if (n < nslices)
+      free_speeds(&scratch[n]);
+  }
+  free_speeds(&c_cells);
+  free_speeds(&c_tmp_cells);
+  free_speeds(&g_new);
+  free(coarse_obstacles);
+  free(first);
+  free(u);
+  free(fine);
+  free(g_old);
+  free(scratch);
+
+  return k;
+}
+
+void coarse_propagate(const t_param params, const t_param coarse, t_speeds *in, t_speeds *out,
+                      int *coarse_obstacles, t_speeds *c_cells, t_speeds *c_tmp_cells,
+                      const t_kernel *kernel, int steps)
+{
+  float *f_in[NSPEEDS] = {in->s0, in->s1, in->s2, in->s3, in->s4, in->s5, in->s6, in->s7, in->s8};
+  float *f_out[NSPEEDS] = {out->s0, out->s1, out->s2, out->s3, out->s4, out->s5, out->s6, out->s7, out->s8};
+
+  /* restrict: average the 2 x 2 fine cells, which conserves their mass and momentum */
+  {
+    float *c[NSPEEDS] = {c_cells->s0, c_cells->s1, c_cells->s2, c_cells->s3, c_cells->s4,
+                         c_cells->s5, c_cells->s6, c_cells->s7, c_cells->s8};
+
+#pragma omp parallel for
+    for (int jj = 0; jj < coarse.ny; jj++)
+    {
+      for (int ss = 0; ss < NSPEEDS; ss++)
+      {
+        for (int ii = 0; ii < coarse.nx; ii++)
+        {
+          const int f = 2 * ii + 2 * jj * params.nx;
+          c[ss][ii + jj * coarse.nx] = 0.25f * (f_in[ss][f] + f_in[ss][f + 1] +
+                                                f_in[ss][f + params.nx] + f_in[ss][f + params.nx + 1]);
+        }
+      }
+    }
+  }
+
+  for (int tt = 0; tt < steps; tt++)
+  {
+    accelerate_flow(coarse, c_cells, coarse_obstacles);
+    kernel->fn(coarse, c_cells, c_tmp_cells, coarse_obstacles);
+    t_speeds *tmp = c_cells;
+    c_cells = c_tmp_cells;
+    c_tmp_cells = tmp;
+  }
+
+  /*
+  ** prolong: inject each fluid coarse cell into its fine cells. Blocked
+  ** coarse cells may cover fluid fine cells, next to the walls for one;
+  ** they get the rest state, so that the correction there is the fine
+  ** propagation alone rather than a copy of the input added to it.
+  */
+  float *c[NSPEEDS] = {c_cells->s0, c_cells->s1, c_cells->s2, c_cells->s3, c_cells->s4,
+                       c_cells->s5, c_cells->s6, c_cells->s7, c_cells->s8};
+  const float rest[NSPEEDS] = {params.density * 4.f / 9.f, params.density / 9.f, params.density / 9.f,
+                               params.density / 9.f, params.density / 9.f, params.density / 36.f,
+                               params.density / 36.f, params.density / 36.f, params.density / 36.f};
+
+#pragma omp parallel for
+  for (int jj = 0; jj < coarse.ny; jj++)
+  {
+    for (int ss = 0; ss < NSPEEDS; ss++)
+    {
+      for (int ii = 0; ii < coarse.nx; ii++)
+      {
+        const int f = 2 * ii + 2 * jj * params.nx;
+        const float value = coarse_obstacles[ii + jj * coarse.nx] ? rest[ss] : c[ss][ii + jj * coarse.nx];
+
+        f_out[ss][f] = value;
+        f_out[ss][f + 1] = value;
+        f_out[ss][f + params.nx] = value;
+        f_out[ss][f + params.nx + 1] = value;
+      }
+    }
+  }
+}
+
+float parareal_correct(const t_param params, t_speeds *u, t_speeds *fine, t_speeds *g_new, t_speeds *g_old)
+{
+  float *a_u[NSPEEDS] = {u->s0, u->s1, u->s2, u->s3, u->s4, u->s5, u->s6, u->s7, u->s8};
+  float *a_f[NSPEEDS] = {fine->s0, fine->s1, fine->s2, fine->s3, fine->s4, fine->s5, fine->s6, fine->s7, fine->s8};
+  float *a_n[NSPEEDS] = {g_new->s0, g_new->s1, g_new->s2, g_new->s3, g_new->s4, g_new->s5, g_new->s6, g_new->s7, g_new->s8};
+  float *a_o[NSPEEDS] = {g_old->s0, g_old->s1, g_old->s2, g_old->s3, g_old->s4, g_old->s5, g_old->s6, g_old->s7, g_old->s8};
+  const int ncells = params.nx * params.ny;
+  float change = 0.f;
+
+  for (int ss = 0; ss < NSPEEDS; ss++)
+  {
+    /* the coarse difference is added last, so an unchanged input reproduces the fine result exactly */
+#pragma omp parallel for reduction(max : change)
+    for (int ii = 0; ii < ncells; ii++)
+    {
+      const float value = a_f[ss][ii] + (a_n[ss][ii] - a_o[ss][ii]);
+      change = fmaxf(change, fabsf(value - a_u[ss][ii]));
+      a_u[ss][ii] = value;
+    }
+  }
+
+  return change;
+}
+
+void copy_speeds(const t_param params, t_speeds *dst, t_speeds *src)
+{
+  const size_t bytes = sizeof(float) * (size_t)params.nx * params.ny;
+
+  memcpy(dst->s0, src->s0, bytes);
+  memcpy(dst->s1, src->s1, bytes);
+  memcpy(dst->s2, src->s2, bytes);
+  memcpy(dst->s3, src->s3, bytes);
+  memcpy(dst->s4, src->s4, bytes);
+  memcpy(dst->s5, src->s5, bytes);
+  memcpy(dst->s6, src->s6, bytes);
+  memcpy(dst->s7, src->s7, bytes);
+  memcpy(dst->s8, src->s8, bytes);
+}
+
+int adjoint(const t_param params, int *obstacles, int objective, int ncheckpoints, int ncheck)
+{
+  const size_t ncells = (size_t)params.nx * params.ny;
+  const size_t state = NSPEEDS * ncells; /* doubles per lattice state */
+  const int nsteps = params.maxIters;
+  t_adjoint adj;
+
+  if (ncheckpoints < 1)
+    ncheckpoints = (int)ceil(sqrt((double)nsteps));
+  if (ncheckpoints > nsteps)
+    ncheckpoints = nsteps;
+
+  /* two-level checkpointing: every stride-th state is kept, each segment is recomputed once */
+  const int stride = (nsteps + ncheckpoints - 1) / ncheckpoints;
+  const int nsegments = (nsteps + stride - 1) / stride;
+
+  adj.objective = objective;
+  adj.obstacles = obstacles;
+  adj.porosity = malloc(sizeof(double) * ncells);
+  adj.work = malloc(sizeof(double) * state);
+  adj.nfluid = 0;
+  adj.weight = 1.0 / nsteps;
+
+  double *grad = calloc(ncells, sizeof(double));                           /* dJ/ds of every cell */
+  double *checkpoints = malloc(sizeof(double) * state * nsegments);        /* states at the segment starts */
+  double *segment = malloc(sizeof(double) * state * (stride + 1));         /* every state of one segment */
+  double *lambda = calloc(state, sizeof(double));                          /* adjoint of the state after a step */
+  double *lambda_prev = malloc(sizeof(double) * state);                    /* ... and before it */
+
+  if (adj.porosity == NULL || adj.work == NULL || grad == NULL || checkpoints == NULL ||
+      segment == NULL || lambda == NULL || lambda_prev == NULL)
+    die("cannot allocate memory for the adjoint (try fewer --adjoint-checkpoints)", __LINE__, __FILE__);
+
+  /* the deck's obstacles are fully solid, everything else fully fluid */
+  for (size_t ii = 0; ii < ncells; ii++)
+  {
+    adj.porosity[ii] = obstacles[ii] ? 1.0 : 0.0;
+    adj.nfluid += !obstacles[ii];
+  }
+
+  printf("==adjoint: d(%s)/d(porosity), %d steps, %d checkpoints every %d steps==\n",
+         objective == ADJ_DRAG ? "drag" : "av. velocity", nsteps, nsegments, stride);
+  /* the checkpoints and a segment, instead of every state; the two adjoints and three work states on top */
+  printf("memory: %d of %d lattice states (%.2f MiB in all)\n", nsegments + stride + 1, nsteps + 1,
+         (nsegments + stride + 6) * state * sizeof(double) / 1048576.0);
+
+  double tic = wall_time();
+  const double objective_value = adj_run(params, &adj, checkpoints, stride);
+  printf("objective:\t\t\t%.12E\n", objective_value);
+  printf("Elapsed Forward time:\t\t\t%.6lf (s)\n", wall_time() - tic);
+
+  /* reverse sweep, one segment at a time, from the last */
+  tic = wall_time();
+  for (int seg = nsegments - 1; seg >= 0; seg--)
+  {
+    const int t0 = seg * stride;
+    const int t1 = (t0 + stride < nsteps) ? t0 + stride : nsteps;
+
+    memcpy(segment, checkpoints + seg * state, sizeof(double) * state);
+    for (int tt = t0; tt < t1; tt++)
+      adj_step(params, &adj, segment + (tt - t0) * state, segment + (tt - t0 + 1) * state);
+
+    for (int tt = t1 - 1; tt >= t0; tt--)
+    {
+      adj_step_back(params, &adj, segment + (tt - t0) * state, segment + (tt - t0 + 1) * state,
+                    lambda, lambda_prev, grad);
+      double *tmp = lambda;
+      lambda = lambda_prev;
+      lambda_prev = tmp;
+    }
+  }
+  printf("Elapsed Adjoint time:\t\t\t%.6lf (s)\n", wall_time() - tic);
+
+  FILE *fp = fopen(SENSITIVITYFILE, "w");
+
+  if (fp == NULL)
+    die("could not open file output file", __LINE__, __FILE__);
+
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    for (int ii = 0; ii < params.nx; ii++)
+      fprintf(fp, "%d %d %.12E %d\n", ii, jj, grad[ii + jj * params.nx], obstacles[ii + jj * params.nx]);
+  }
+
+  fclose(fp);
+
+  /* central differences at the most sensitive cells */
+  char *checked = calloc(ncells, 1);
+  int failures = 0;
+
+  if (checked == NULL)
+    die("cannot allocate memory for the adjoint check", __LINE__, __FILE__);
+
+  if (ncheck > 0)
+    printf("%-12s %20s %20s %12s\n", "cell", "adjoint", "finite difference", "rel. error");
+
+  for (int cc = 0; cc < ncheck; cc++)
+  {
+    size_t best = ncells;
+
+    for (size_t ii = 0; ii < ncells; ii++)
+    {
+      if (!checked[ii] && (best == ncells || fabs(grad[ii]) > fabs(grad[best])))
+        best = ii;
+    }
+
+    if (best == ncells)
+      break;
+    checked[best] = 1;
+
+    const double saved = adj.porosity[best];
+    adj.porosity[best] = saved + ADJFDSTEP;
+    const double j_plus = adj_run(params, &adj, NULL, 0);
+    adj.porosity[best] = saved - ADJFDSTEP;
+    const double j_minus = adj_run(params, &adj, NULL, 0);
+    adj.porosity[best] = saved;
+
+    const double fd = (j_plus - j_minus) / (2.0 * ADJFDSTEP);
+    const double error = fabs(fd - grad[best]) / fmax(fabs(fd), 1e-300);
+    char cell[32];
+
+    sprintf(cell, "(%d,%d)", (int)(best % params.nx), (int)(best / params.nx));
+    printf("%-12s %20.12E %20.12E %12.3E\n", cell, grad[best], fd, error);
+    failures += error > ADJCHECKTOL;
+  }
+
+  if (ncheck > 0)
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+
+  free(checked);
+  free(adj.porosity);
+  free(adj.work);
+  free(grad);
+  free(checkpoints);
+  free(segment);
+  free(lambda);
+  free(lambda_prev);
+
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+double adj_run(const t_param params, const t_adjoint *adj, double *checkpoints, int stride)
+{
+  const size_t state = NSPEEDS * (size_t)params.nx * params.ny;
+  double *f = malloc(sizeof(double) * state);
+  double *f_next = malloc(sizeof(double) * state);
+  double objective = 0.0;
+
+  if (f == NULL || f_next == NULL)
+    die("cannot allocate memory for the adjoint", __LINE__, __FILE__);
+
+  /* the same initial state as init_speeds() */
+  const double w[NSPEEDS] = {4.0 / 9.0, 1.0 / 9.0, 1.0 / 9.0, 1.0 / 9.0, 1.0 / 9.0,
+                             1.0 / 36.0, 1.0 / 36.0, 1.0 / 36.0, 1.0 / 36.0};
+
+  for (int ss = 0; ss < NSPEEDS; ss++)
+  {
+    for (size_t ii = 0; ii < state / NSPEEDS; ii++)
+      f[ss * (state / NSPEEDS) + ii] = (double)params.density * w[ss];
+  }
+
+  for (int tt = 0; tt < params.maxIters; tt++)
+  {
+    if (checkpoints != NULL && tt % stride == 0)
+      memcpy(checkpoints + (tt / stride) * state, f, sizeof(double) * state);
+
+    objective += adj->weight * adj_step(params, adj, f, f_next);
+    double *tmp = f;
+    f = f_next;
+    f_next = tmp;
+  }
+
+  free(f);
+  free(f_next);
+
+  return objective;
+}
+
+void adj_accelerate(const t_param params, const t_adjoint *adj, double *f)
+{
+  const size_t ncells = (size_t)params.nx * params.ny;
+  const double w1 = (double)params.density * params.accel / 9.0;
+  const double w2 = (double)params.density * params.accel / 36.0;
+  const int jj = params.ny - 2;
+
+  /* accelerate_flow(), with the same test for negative densities */
+  for (int ii = 0; ii < params.nx; ii++)
+  {
+    const size_t idx = ii + jj * params.nx;
+
+    if (!adj->obstacles[idx] && f[3 * ncells + idx] - w1 > 0.0 && f[6 * ncells + idx] - w2 > 0.0 &&
+        f[7 * ncells + idx] - w2 > 0.0)
+    {
+      f[1 * ncells + idx] += w1;
+      f[5 * ncells + idx] += w2;
+      f[8 * ncells + idx] += w2;
+      f[3 * ncells + idx] -= w1;
+      f[6 * ncells + idx] -= w2;
+      f[7 * ncells + idx] -= w2;
+    }
+  }
+}
+
+double adj_step(const t_param params, const t_adjoint *adj, const double *f, double *f_next)
+{
+  const size_t ncells = (size_t)params.nx * params.ny;
+  const double omega = params.omega;
+  double total = 0.0; /* av. velocity or drag of this step */
+
+  memcpy(adj->work, f, sizeof(double) * NSPEEDS * ncells);
+  adj_accelerate(params, adj, adj->work);
+
+#pragma omp parallel for reduction(+ : total)
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    for (int ii = 0; ii < params.nx; ii++)
+    {
+      const size_t idx = ii + jj * params.nx;
+      const double s = adj->porosity[idx];
+      double h[NSPEEDS], rho = 0.0, m_x = 0.0, m_y = 0.0;
+
+      /* pull streaming */
+      for (int ss = 0; ss < NSPEEDS; ss++)
+      {
+        const int x = (ii - lat_cx[ss] + params.nx) % params.nx;
+        const int y = (jj - lat_cy[ss] + params.ny) % params.ny;
+        h[ss] = adj->work[ss * ncells + x + y * params.nx];
+        rho += h[ss];
+        m_x += lat_cx[ss] * h[ss];
+        m_y += lat_cy[ss] * h[ss];
+      }
+
+      const double u_x = m_x / rho;
+      const double u_y = m_y / rho;
+      const double u_sq = u_x * u_x + u_y * u_y;
+      double out_x = 0.0, out_y = 0.0, out_rho = 0.0;
+
+      /* BGK collision, blended with bounce-back by the porosity */
+      for (int ss = 0; ss < NSPEEDS; ss++)
+      {
+        const double cu = lat_cx[ss] * u_x + lat_cy[ss] * u_y;
+        const double f_eq = lat_w[ss] * rho * (1.0 + 3.0 * cu + 4.5 * cu * cu - 1.5 * u_sq);
+        const double g = h[ss] + omega * (f_eq - h[ss]);
+        const double out = (1.0 - s) * g + s * h[lat_opp[ss]];
+
+        f_next[ss * ncells + idx] = out;
+        out_rho += out;
+        out_x += lat_cx[ss] * out;
+        out_y += lat_cy[ss] * out;
+      }
+
+      if (adj->objective == ADJ_DRAG)
+        total += 2.0 * s * m_x;
+      else if (!adj->obstacles[idx])
+        total += sqrt((out_x * out_x + out_y * out_y) / (out_rho * out_rho) + ADJVELEPS * ADJVELEPS) / adj->nfluid;
+    }
+  }
+
+  return total;
+}
+
+void adj_step_back(const t_param params, const t_adjoint *adj, const double *f, const double *f_next,
+                   const double *lambda_next, double *lambda, double *grad)
+{
+  const size_t ncells = (size_t)params.nx * params.ny;
+  const double omega = params.omega;
+
+  /* the step is recomputed cell by cell from its accelerated input */
+  memcpy(adj->work, f, sizeof(double) * NSPEEDS * ncells);
+  adj_accelerate(params, adj, adj->work);
+
+#pragma omp parallel for
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    for (int ii = 0; ii < params.nx; ii++)
+    {
+      const size_t idx = ii + jj * params.nx;
+      const double s = adj->porosity[idx];
+      double h[NSPEEDS], l_out[NSPEEDS], l_g[NSPEEDS], l_h[NSPEEDS];
+      double rho = 0.0, m_x = 0.0, m_y = 0.0;
+
+      for (int ss = 0; ss < NSPEEDS; ss++)
+      {
+        const int x = (ii - lat_cx[ss] + params.nx) % params.nx;
+        const int y = (jj - lat_cy[ss] + params.ny) % params.ny;
+        h[ss] = adj->work[ss * ncells + x + y * params.nx];
+        rho += h[ss];
+        m_x += lat_cx[ss] * h[ss];
+        m_y += lat_cy[ss] * h[ss];
+        l_out[ss] = lambda_next[ss * ncells + idx];
+        l_h[ss] = 0.0;
+      }
+
+      /* the av. velocity of the new state: d|u|/df_i = u.(c_i - u) / (rho |u|), |u| smoothed */
+      if (adj->objective == ADJ_VELOCITY && !adj->obstacles[idx])
+      {
+        double n_rho = 0.0, n_x = 0.0, n_y = 0.0;
+
+        for (int ss = 0; ss < NSPEEDS; ss++)
+        {
+          n_rho += f_next[ss * ncells + idx];
+          n_x += lat_cx[ss] * f_next[ss * ncells + idx];
+          n_y += lat_cy[ss] * f_next[ss * ncells + idx];
+        }
+
+        const double v_x = n_x / n_rho;
+        const double v_y = n_y / n_rho;
+        const double v = sqrt(v_x * v_x + v_y * v_y + ADJVELEPS * ADJVELEPS);
+
+        for (int ss = 0; ss < NSPEEDS; ss++)
+          l_out[ss] += adj->weight / adj->nfluid * (v_x * (lat_cx[ss] - v_x) + v_y * (lat_cy[ss] - v_y)) / (n_rho * v);
+      }
+
+      const double u_x = m_x / rho;
+      const double u_y = m_y / rho;
+      const double u_sq = u_x * u_x + u_y * u_y;
+      double a = 0.0, b_x = 0.0, b_y = 0.0; /* lambda_g . dfeq/drho and . dfeq/dm */
+      double ds = 0.0;
+
+      /* out_i = (1 - s) g_i + s h_opp(i) */
+      for (int ss = 0; ss < NSPEEDS; ss++)
+      {
+        const double cu = lat_cx[ss] * u_x + lat_cy[ss] * u_y;
+        const double f_eq = lat_w[ss] * rho * (1.0 + 3.0 * cu + 4.5 * cu * cu - 1.5 * u_sq);
+        const double g = h[ss] + omega * (f_eq - h[ss]);
+
+        ds += l_out[ss] * (h[lat_opp[ss]] - g);
+        l_g[ss] = (1.0 - s) * l_out[ss];
+        l_h[lat_opp[ss]] += s * l_out[ss];
+
+        a += l_g[ss] * lat_w[ss] * (1.0 - 4.5 * cu * cu + 1.5 * u_sq);
+        b_x += l_g[ss] * lat_w[ss] * (3.0 * lat_cx[ss] + 9.0 * cu * lat_cx[ss] - 3.0 * u_x);
+        b_y += l_g[ss] * lat_w[ss] * (3.0 * lat_cy[ss] + 9.0 * cu * lat_cy[ss] - 3.0 * u_y);
+      }
+
+      /* the drag of this step, 2 s m_x */
+      if (adj->objective == ADJ_DRAG)
+      {
+        ds += adj->weight * 2.0 * m_x;
+        for (int ss = 0; ss < NSPEEDS; ss++)
+          l_h[ss] += adj->weight * 2.0 * s * lat_cx[ss];
+      }
+
+      grad[idx] += ds;
+
+      /* g = h + omega (f_eq(rho, m) - h), then back along the streaming to where h came from */
+      for (int ss = 0; ss < NSPEEDS; ss++)
+      {
+        const int x = (ii - lat_cx[ss] + params.nx) % params.nx;
+        const int y = (jj - lat_cy[ss] + params.ny) % params.ny;
+
+        l_h[ss] += (1.0 - omega) * l_g[ss] + omega * (a + b_x * lat_cx[ss] + b_y * lat_cy[ss]);
+        lambda[ss * ncells + x + y * params.nx] = l_h[ss];
+      }
+    }
+  }
+}
+
+void steady_init(const t_param params, t_steady *steady, float tol, int depth, int period)
+{
+  const int nvalues = 3 * params.nx * params.ny;
+
+  if (depth > ANDERSONMAX)
+    depth = ANDERSONMAX;
+
+  steady->tol = tol;
+  steady->depth = depth;
+  steady->period = (period > 0) ? period : ANDERSONPERIOD;
+  steady->nhist = 0;
+  steady->have_prev = 0;
+  steady->mixed = 0;
+  steady->cooldown = 0;
+  steady->streak = 0;
+  steady->residual = -1.0;
+  steady->mixes = 0;
+  steady->rejected = 0;
+  steady->x_prev = malloc(sizeof(float) * nvalues);
+  steady->x_cur = malloc(sizeof(float) * nvalues);
+  steady->backup = (depth > 0) ? alloc_speeds(&params, "anderson backup") : NULL;
+
+  if (steady->x_prev == NULL || steady->x_cur == NULL)
+    die("cannot allocate memory for the steady state check", __LINE__, __FILE__);
+
+  for (int hh = 0; hh <= depth && depth > 0; hh++)
+  {
+    steady->x[hh] = malloc(sizeof(float) * nvalues);
+    steady->r[hh] = malloc(sizeof(float) * nvalues);
+
+    if (steady->x[hh] == NULL || steady->r[hh] == NULL)
+      die("cannot allocate memory for anderson mixing (try a smaller --anderson)", __LINE__, __FILE__);
+  }
+}
+
+int steady_update(const t_param params, t_steady *steady, t_speeds *cells, int *obstacles)
+{
+  const int ncells = params.nx * params.ny;
+  const int nvalues = 3 * ncells;
+  float *x = steady->x_cur;
+  double change = 0.0, norm = 0.0;
+
+  macroscopic_state(params, cells, obstacles, x);
+
+  if (!steady->have_prev)
+  {
+    memcpy(steady->x_prev, x, sizeof(float) * nvalues);
+    steady->have_prev = 1;
+    return 0;
+  }
+
+  /* residual: the relative change of the velocity per timestep, over the last period */
+#pragma omp parallel for reduction(+ : change, norm)
+  for (int ii = ncells; ii < nvalues; ii++)
+  {
+    change += (double)(x[ii] - steady->x_prev[ii]) * (x[ii] - steady->x_prev[ii]);
+    norm += (double)x[ii] * x[ii];
+  }
+
+  const double residual = (norm > 0.0) ? sqrt(change / norm) / steady->period : 0.0;
+
+  /*
+  ** guard: a mix that made the residual grow is undone, and mixing
+  ** pauses for twice as long after each failure in a row, so that a
+  ** state it cannot improve converges by plain timesteps instead
+  */
+  if (steady->mixed && residual > ANDERSONGUARD * steady->res_before)
+  {
+    copy_speeds(params, cells, steady->backup);
+    macroscopic_state(params, cells, obstacles, steady->x_prev);
+    steady->mixed = 0;
+    steady->nhist = 0;
+    steady->cooldown = (steady->depth + 1) << (steady->streak < 16 ? steady->streak : 16);
+    steady->streak++;
+    steady->rejected++;
+    return -1;
+  }
+
+  if (steady->mixed)
+    steady->streak = 0;
+  steady->mixed = 0;
+  steady->residual = residual;
+
+  if (residual < steady->tol)
+    return 1;
+
+  if (steady->depth == 0)
+  {
+    memcpy(steady->x_prev, x, sizeof(float) * nvalues);
+    return 0;
+  }
+
+  /* the newest (iterate, residual) pair, dropping the oldest when full */
+  if (steady->nhist == steady->depth + 1)
+  {
+    float *old_x = steady->x[0], *old_r = steady->r[0];
+
+    for (int hh = 0; hh < steady->depth; hh++)
+    {
+      steady->x[hh] = steady->x[hh + 1];
+      steady->r[hh] = steady->r[hh + 1];
+    }
+    steady->x[steady->depth] = old_x;
+    steady->r[steady->depth] = old_r;
+    steady->nhist--;
+  }
+
+  float *x_k = steady->x[steady->nhist];
+  float *r_k = steady->r[steady->nhist];
+
+#pragma omp parallel for
+  for (int ii = 0; ii < nvalues; ii++)
+  {
+    x_k[ii] = steady->x_prev[ii];
+    r_k[ii] = x[ii] - steady->x_prev[ii];
+  }
+  steady->nhist++;
+
+  if (steady->cooldown > 0)
+    steady->cooldown--;
+
+  if (steady->nhist < 2 || steady->cooldown > 0 || !anderson_mix(params, steady, cells, obstacles))
+  {
+    memcpy(steady->x_prev, x, sizeof(float) * nvalues);
+    return 0;
+  }
+
+  steady->res_before = residual;
+  steady->mixed = 1;
+  steady->mixes++;
+
+  return 0;
+}
+
+int anderson_mix(const t_param params, t_steady *steady, t_speeds *cells, int *obstacles)
+{
+  const int ncells = params.nx * params.ny;
+  const int nvalues = 3 * ncells;
+  const int m = steady->nhist - 1; /* no. of differences */
+  const int k = m;                 /* newest pair */
+  double a[ANDERSONMAX][ANDERSONMAX + 1];
+  double gamma[ANDERSONMAX];
+
+  /*
+  ** gamma minimises |r_k - dR gamma|, dR_j = r_(j+1) - r_j, through
+  ** the m x m normal equations, with a little Tikhonov regularisation.
+  */
+  for (int ii = 0; ii < m; ii++)
+  {
+    for (int jj = ii; jj <= m; jj++)
+    {
+      const float *ri1 = steady->r[ii + 1], *ri0 = steady->r[ii];
+      const float *rj1 = (jj < m) ? steady->r[jj + 1] : NULL, *rj0 = (jj < m) ? steady->r[jj] : steady->r[k];
+      double sum = 0.0;
+
+#pragma omp parallel for reduction(+ : sum)
+      for (int vv = 0; vv < nvalues; vv++)
+      {
+        const double dri = (double)ri1[vv] - ri0[vv];
+        const double drj = (rj1 != NULL) ? (double)rj1[vv] - rj0[vv] : rj0[vv];
+        sum += dri * drj;
+      }
+
+      a[ii][jj] = sum;
+      if (jj < m)
+        a[jj][ii] = sum;
+    }
+  }
+
+  double trace = 0.0;
+  for (int ii = 0; ii < m; ii++)
+    trace += a[ii][ii];
+  for (int ii = 0; ii < m; ii++)
+    a[ii][ii] += 1e-10 * trace + 1e-300;
+
+  /* Gaussian elimination with partial pivoting on [A | b] */
+  for (int col = 0; col < m; col++)
+  {
+    int pivot = col;
+
+    for (int row = col + 1; row < m; row++)
+    {
+      if (fabs(a[row][col]) > fabs(a[pivot][col]))
+        pivot = row;
+    }
+
+    for (int cc = 0; cc <= m; cc++)
+    {
+      const double tmp = a[col][cc];
+      a[col][cc] = a[pivot][cc];
+      a[pivot][cc] = tmp;
+    }
+
+    if (a[col][col] == 0.0)
+      return 0;
+
+    for (int row = col + 1; row < m; row++)
+    {
+      const double factor = a[row][col] / a[col][col];
+
+      for (int cc = col; cc <= m; cc++)
+        a[row][cc] -= factor * a[col][cc];
+    }
+  }
+
+  for (int row = m - 1; row >= 0; row--)
+  {
+    double sum = a[row][m];
+
+    for (int cc = row + 1; cc < m; cc++)
+      sum -= a[row][cc] * gamma[cc];
+    gamma[row] = sum / a[row][row];
+  }
+
+  /*
+  ** x_new = x_k + r_k - (dX + dR) gamma; x_k + r_k is the current state,
+  ** whose populations keep their non-equilibrium part and take the
+  ** equilibrium of the extrapolated fields. Only the velocity is moved:
+  ** an extrapolated density starts sound waves that ring for longer
+  ** than a period, and the residual then stalls on them.
+  */
+  float *x_new = steady->x_prev; /* the next iterate */
+
+#pragma omp parallel for
+  for (int vv = 0; vv < nvalues; vv++)
+  {
+    double value = (double)steady->x[k][vv] + steady->r[k][vv];
+
+    for (int jj = 0; jj < m; jj++)
+      value -= gamma[jj] * (((double)steady->x[jj + 1][vv] - steady->x[jj][vv]) +
+                            ((double)steady->r[jj + 1][vv] - steady->r[jj][vv]));
+
+    x_new[vv] = (vv < ncells) ? steady->x_cur[vv] : (float)value;
+  }
+
+  copy_speeds(params, steady->backup, cells);
+  reequilibrate(params, cells, obstacles, steady->x_cur, x_new);
+
+  return 1;
+}
+
+void macroscopic_state(const t_param params, t_speeds *cells, int *obstacles, float *x)
+{
+  const int ncells = params.nx * params.ny;
+
+#pragma omp parallel for
+  for (int ii = 0; ii < ncells; ii++)
+  {
+    if (obstacles[ii])
+    {
+      x[ii] = params.density;
+      x[ii + ncells] = x[ii + 2 * ncells] = 0.f;
+      continue;
+    }
+
+    const float local_density = cells->s0[ii] + cells->s1[ii] + cells->s2[ii] + cells->s3[ii] + cells->s4[ii] +
+                                cells->s5[ii] + cells->s6[ii] + cells->s7[ii] + cells->s8[ii];
+
+    x[ii] = local_density;
+    x[ii + ncells] = (cells->s1[ii] + cells->s5[ii] + cells->s8[ii] - (cells->s3[ii] + cells->s6[ii] + cells->s7[ii])) / local_density;
+    x[ii + 2 * ncells] = (cells->s2[ii] + cells->s5[ii] + cells->s6[ii] - (cells->s4[ii] + cells->s7[ii] + cells->s8[ii])) / local_density;
+  }
+}
+
+void reequilibrate(const t_param params, t_speeds *cells, int *obstacles, const float *x_old, const float *x_new)
+{
+  const int ncells = params.nx * params.ny;
+  float *f[NSPEEDS] = {cells->s0, cells->s1, cells->s2, cells->s3, cells->s4,
+                       cells->s5, cells->s6, cells->s7, cells->s8};
+
+#pragma omp parallel for
+  for (int ii = 0; ii < ncells; ii++)
+  {
+    if (obstacles[ii])
+      continue;
+
+    const float *x[2] = {x_old, x_new};
+    float f_eq[2][NSPEEDS];
+
+    for (int xx = 0; xx < 2; xx++)
+    {
+      const float rho = x[xx][ii], u_x = x[xx][ii + ncells], u_y = x[xx][ii + 2 * ncells];
+      const float u_sq = u_x * u_x + u_y * u_y;
+
+      for (int ss = 0; ss < NSPEEDS; ss++)
+      {
+        const float cu = lat_cx[ss] * u_x + lat_cy[ss] * u_y;
+        f_eq[xx][ss] = (float)lat_w[ss] * rho * (1.f + 3.f * cu + 4.5f * cu * cu - 1.5f * u_sq);
+      }
+    }
+
+    for (int ss = 0; ss < NSPEEDS; ss++)
+      f[ss][ii] += f_eq[1][ss] - f_eq[0][ss];
+  }
+}
+
+void steady_free(t_steady *steady)
+{
+  for (int hh = 0; hh <= steady->depth && steady->depth > 0; hh++)
+  {
+    free(steady->x[hh]);
+    free(steady->r[hh]);
+  }
+  free(steady->x_prev);
+  free(steady->x_cur);
+  free_speeds(&steady->backup);
+}
+
+float timestep_moments(const t_param params, t_moments *restrict cells, t_moments *restrict tmp_cells, int *obstacles)
+{
+  const float c_sq = 1.f / 3.f; /* sq. of speed of sound */
+  const int nx = params.nx;
+  const int pitch = nx + 2; /* a buffered row, with the periodic neighbour at each end */
+  int tot_cells = 0;
+  float tot_u = 0.f;
+
+  /*
+  ** Populations are rebuilt once per source row into three rolling row
+  ** buffers (south, own, north) that stay in cache; a static schedule hands
+  ** each thread a contiguous block of rows, so a step rebuilds only the
+  ** row that enters the window. Padding the rows with their wrap-around
+  ** cells leaves the inner loop free of modulo and branches.
+  */
+#pragma omp parallel reduction(+ : tot_cells, tot_u)
+  {
+    float *buffer = cells->rows + (size_t)omp_get_thread_num() * 3 * NSPEEDS * pitch;
+    float *row[3] = {buffer, buffer + NSPEEDS * pitch, buffer + 2 * NSPEEDS * pitch};
+    int last = -2; /* the row the window was last centred on */
+
+#pragma omp for schedule(static)
+    for (int jj = 0; jj < params.ny; jj++)
+    {
+      /* determine indices of axis-direction neighbours, as in timestep() */
+      const int y_n = (jj + 1) % params.ny;
+      const int y_s = (jj == 0) ? (jj + params.ny - 1) : (jj - 1);
+
+      if (jj == last + 1)
+      {
+        float *tmp_row = row[0];
+        row[0] = row[1];
+        row[1] = row[2];
+        row[2] = tmp_row;
+        moment_row(params, cells, obstacles, y_n, row[2]);
+      }
+      else
+      {
+        moment_row(params, cells, obstacles, y_s, row[0]);
+        moment_row(params, cells, obstacles, jj, row[1]);
+        moment_row(params, cells, obstacles, y_n, row[2]);
+      }
+      last = jj;
+
+      /* the row each speed streams from (in padded coordinates) */
+      const float *from[NSPEEDS] = {row[1], row[1], row[0], row[1], row[2], row[0], row[0], row[2], row[2]};
+      const int *own_mask = obstacles + jj * nx;
+      float *restrict rho_out = tmp_cells->rho + jj * nx, *restrict j_x_out = tmp_cells->j_x + jj * nx;
+      float *restrict j_y_out = tmp_cells->j_y + jj * nx, *restrict p_xx_out = tmp_cells->p_xx + jj * nx;
+      float *restrict p_yy_out = tmp_cells->p_yy + jj * nx, *restrict p_xy_out = tmp_cells->p_xy + jj * nx;
+
+#pragma omp simd reduction(+ : tot_cells, tot_u)
+      for (int ii = 1; ii <= nx; ii++)
+      {
+        float rho = 0.f, j_x = 0.f, j_y = 0.f, p_xx = 0.f, p_yy = 0.f, p_xy = 0.f;
+
+        /* gather each population from the cell it streams from, as propagate() does */
+        for (int ss = 0; ss < NSPEEDS; ss++)
+        {
+          const float f = from[ss][ss * pitch + ii - lat_cx[ss]];
+
+          rho += f;
+          j_x += lat_cx[ss] * f;
+          j_y += lat_cy[ss] * f;
+          p_xx += lat_cx[ss] * lat_cx[ss] * f;
+          p_yy += lat_cy[ss] * lat_cy[ss] * f;
+          p_xy += lat_cx[ss] * lat_cy[ss] * f;
+        }
+
+        /* BGK relaxation of the momentum flux towards j j / rho + rho c_sq I */
+        const float eq_xx = j_x * j_x / rho + rho * c_sq;
+        const float eq_yy = j_y * j_y / rho + rho * c_sq;
+        const float eq_xy = j_x * j_y / rho;
+
+        /* the moments of a solid cell are never read, its populations are written below */
+        const int fluid = !own_mask[ii - 1];
+
+        rho_out[ii - 1] = rho;
+        j_x_out[ii - 1] = j_x;
+        j_y_out[ii - 1] = j_y;
+        p_xx_out[ii - 1] = p_xx + params.omega * (eq_xx - p_xx);
+        p_yy_out[ii - 1] = p_yy + params.omega * (eq_yy - p_yy);
+        p_xy_out[ii - 1] = p_xy + params.omega * (eq_xy - p_xy);
+
+        tot_u += fluid ? sqrtf(j_x * j_x + j_y * j_y) / rho : 0.f;
+        tot_cells += fluid;
+      }
+
+      /* a solid cell mirrors what streamed into it, as rebound() does, for the fluid to gather next step */
+      float *solid_out = tmp_cells->solid + (size_t)NSPEEDS * tmp_cells->solid_row[jj];
+
+      for (int ii = 1; ii <= nx; ii++)
+      {
+        if (!own_mask[ii - 1])
+          continue;
+
+        for (int ss = 0; ss < NSPEEDS; ss++)
+        {
+          const int opp = lat_opp[ss];
+          solid_out[ss] = from[opp][opp * pitch + ii - lat_cx[opp]];
+        }
+        solid_out += NSPEEDS;
+      }
+    }
+  }
+
+  return tot_u / (float)tot_cells;
+}
+
+void moment_row(const t_param params, t_moments *restrict cells, int *obstacles, int jj, float *restrict row)
+{
+  const int nx = params.nx, pitch = nx + 2;
+  const float *rho = cells->rho + jj * nx, *j_x = cells->j_x + jj * nx;
+  const float *j_y = cells->j_y + jj * nx, *p_xx = cells->p_xx + jj * nx;
+  const float *p_yy = cells->p_yy + jj * nx, *p_xy = cells->p_xy + jj * nx;
+  const float *solid = cells->solid + (size_t)NSPEEDS * cells->solid_row[jj];
+
+  /* row[ss * pitch + 1 + ii] holds population ss of cell ii; entries 0 and nx + 1 wrap around */
+  for (int ss = 0; ss < NSPEEDS; ss++)
+  {
+    float *out = row + ss * pitch + 1;
+
+#pragma omp simd
+    for (int ii = 0; ii < nx; ii++)
+      out[ii] = moment_population(ss, rho[ii], j_x[ii], j_y[ii], p_xx[ii], p_yy[ii], p_xy[ii]);
+  }
+
+  /* solid cells hold their populations */
+  for (int ii = 0; ii < nx; ii++)
+  {
+    if (!obstacles[ii + jj * nx])
+      continue;
+
+    for (int ss = 0; ss < NSPEEDS; ss++)
+      row[ss * pitch + 1 + ii] = solid[ss];
+    solid += NSPEEDS;
+  }
+
+  for (int ss = 0; ss < NSPEEDS; ss++)
+  {
+    float *out = row + ss * pitch + 1;
+
+    out[-1] = out[nx - 1];
+    out[nx] = out[0];
+  }
+}
+
+float moment_population(int ss, float rho, float j_x, float j_y, float p_xx, float p_yy, float p_xy)
+{
+  const float c_sq = 1.f / 3.f; /* sq. of speed of sound */
+  const float cx = lat_cx[ss], cy = lat_cy[ss];
+
+  /* second order Hermite expansion: w (rho + j.c / c_sq + (cc - c_sq I) : (P - rho c_sq I) / (2 c_sq^2)) */
+  return (float)lat_w[ss] * (rho + 3.f * (cx * j_x + cy * j_y) +
+                             4.5f * ((cx * cx - c_sq) * (p_xx - rho * c_sq) + (cy * cy - c_sq) * (p_yy - rho * c_sq) +
+                                     2.f * cx * cy * p_xy));
+}
+
+int accelerate_flow_moments(const t_param params, t_moments *cells, int *obstacles)
+{
+  /* compute weighting factors */
+  float w1 = params.density * params.accel / 9.f;
+  float w2 = params.density * params.accel / 36.f;
+
+  /* modify the 2nd row of the grid */
+  int jj = params.ny - 2;
+
+  for (int ii = 0; ii < params.nx; ii++)
+  {
+    const int idx = ii + jj * params.nx;
+
+    /* the same test as accelerate_flow(), on the populations the moments stand for */
+    if (!obstacles[idx] &&
+        moment_population(3, cells->rho[idx], cells->j_x[idx], cells->j_y[idx], cells->p_xx[idx], cells->p_yy[idx], cells->p_xy[idx]) - w1 > 0.f &&
+        moment_population(6, cells->rho[idx], cells->j_x[idx], cells->j_y[idx], cells->p_xx[idx], cells->p_yy[idx], cells->p_xy[idx]) - w2 > 0.f &&
+        moment_population(7, cells->rho[idx], cells->j_x[idx], cells->j_y[idx], cells->p_xx[idx], cells->p_yy[idx], cells->p_xy[idx]) - w2 > 0.f)
+    {
+      /* moving w1 from speed 3 to 1 and w2 from 6, 7 to 5, 8 only adds x-momentum */
+      cells->j_x[idx] += 2.f * w1 + 4.f * w2;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+t_moments *alloc_moments(const t_param *params, int *obstacles, const char *name)
+{
+  char message[1024];                                                   /* message buffer */
+  const size_t bytes = sizeof(float) * (size_t)params->ny * params->nx; /* per moment */
+  const size_t row_bytes = sizeof(float) * 3 * NSPEEDS * (params->nx + 2); /* per thread */
+  t_moments *moments = (t_moments *)malloc(sizeof(t_moments));
+
+  if (moments == NULL)
+  {
+    sprintf(message, "cannot allocate memory for %s", name);
+    die(message, __LINE__, __FILE__);
+  }
+
+  moments->solid_row = malloc(sizeof(int) * (params->ny + 1));
+  moments->rows = (float *)_mm_malloc(row_bytes * omp_get_max_threads(), 64);
+
+  if (moments->solid_row == NULL || moments->rows == NULL)
+  {
+    sprintf(message, "cannot allocate row buffers for %s", name);
+    die(message, __LINE__, __FILE__);
+  }
+
+  moments->solid_row[0] = 0;
+  for (int jj = 0; jj < params->ny; jj++)
+  {
+    moments->solid_row[jj + 1] = moments->solid_row[jj];
+    for (int ii = 0; ii < params->nx; ii++)
+      moments->solid_row[jj + 1] += obstacles[ii + jj * params->nx];
+  }
+
+  /* one more population than a solid cell needs, so that a grid without any still gets a buffer */
+  moments->solid = (float *)_mm_malloc(sizeof(float) * NSPEEDS * ((size_t)moments->solid_row[params->ny] + 1), 64);
+
+  if (moments->solid == NULL)
+  {
+    sprintf(message, "cannot allocate the solid cells of %s (see --plan)", name);
+    die(message, __LINE__, __FILE__);
+  }
+
+  float **arrays[NMOMENTS] = {&moments->rho, &moments->j_x, &moments->j_y,
+                              &moments->p_xx, &moments->p_yy, &moments->p_xy};
+
+  for (int mm = 0; mm < NMOMENTS; mm++)
+  {
+    *arrays[mm] = (float *)_mm_malloc(bytes, 64);
+
+    if (*arrays[mm] == NULL)
+    {
+      sprintf(message, "cannot allocate %.2f MiB for moment %d of %s (see --plan)", bytes / 1048576.0, mm, name);
+      die(message, __LINE__, __FILE__);
+    }
+  }
+
+  return moments;
+}
+
+void init_moments(const t_param *params, t_moments *cells)
+{
+  /* the rest state of init_speeds() */
+#pragma omp parallel for
+  for (int jj = 0; jj < params->ny; jj++)
+  {
+    for (int ii = 0; ii < params->nx; ii++)
+    {
+      cells->rho[ii + jj * params->nx] = params->density;
+      cells->j_x[ii + jj * params->nx] = 0.f;
+      cells->j_y[ii + jj * params->nx] = 0.f;
+      cells->p_xx[ii + jj * params->nx] = params->density / 3.f;
+      cells->p_yy[ii + jj * params->nx] = params->density / 3.f;
+      cells->p_xy[ii + jj * params->nx] = 0.f;
+    }
+  }
+
+  for (int kk = 0; kk < cells->solid_row[params->ny]; kk++)
+  {
+    for (int ss = 0; ss < NSPEEDS; ss++)
+      cells->solid[kk * NSPEEDS + ss] = params->density * (float)lat_w[ss];
+  }
+}
+
+void free_moments(t_moments **moments_ptr)
+{
+  t_moments *moments = *moments_ptr;
+
+  if (moments == NULL)
+    return;
+
+  _mm_free(moments->rho);
+  _mm_free(moments->j_x);
+  _mm_free(moments->j_y);
+  _mm_free(moments->p_xx);
+  _mm_free(moments->p_yy);
+  _mm_free(moments->p_xy);
+  _mm_free(moments->solid);
+  _mm_free(moments->rows);
+  free(moments->solid_row);
+  free(moments);
+  *moments_ptr = NULL;
+}
+
+void moments_to_speeds(const t_param params, t_moments *moments, int *obstacles, t_speeds *cells)
+{
+  float *f[NSPEEDS] = {cells->s0, cells->s1, cells->s2, cells->s3, cells->s4,
+                       cells->s5, cells->s6, cells->s7, cells->s8};
+
+#pragma omp parallel for
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    const float *solid = moments->solid + (size_t)NSPEEDS * moments->solid_row[jj];
+
+    for (int ii = jj * params.nx; ii < (jj + 1) * params.nx; ii++)
+    {
+      for (int ss = 0; ss < NSPEEDS; ss++)
+        f[ss][ii] = obstacles[ii] ? solid[ss]
+                                  : moment_population(ss, moments->rho[ii], moments->j_x[ii], moments->j_y[ii],
+                                                      moments->p_xx[ii], moments->p_yy[ii], moments->p_xy[ii]);
+      solid += obstacles[ii] ? NSPEEDS : 0;
+    }
+  }
+}
+
+int initialise_tiles(const char *paramfile, const char *obstaclefile, t_param *params, t_tiles *tiles,
+                     float **av_vels_ptr)
+{
+  char message[1024]; /* message buffer */
+  FILE *fp;           /* file pointer */
+  int xx, yy;         /* generic array indices */
+  int blocked;        /* indicates whether a cell is blocked by an obstacle */
+  int retval;         /* to hold return value for checking */
+
+  read_params(paramfile, params);
+
+  if (params->nx % TILESIZE || params->ny % TILESIZE)
+  {
+    sprintf(message, "--sparse needs nx and ny to be multiples of %d", TILESIZE);
+    die(message, __LINE__, __FILE__);
+  }
+
+  /* one bit per cell while the tiles are chosen, freed once the fluid ones hold their own mask */
+  const size_t ncells = (size_t)params->nx * params->ny;
+  unsigned char *solid = (unsigned char *)calloc(ncells / 8 + 1, 1);
+
+  if (solid == NULL)
+    die("cannot allocate memory for the tile map", __LINE__, __FILE__);
+
+  /* open the obstacle data file */
+  fp = fopen(obstaclefile, "r");
+
+  if (fp == NULL)
+  {
+    sprintf(message, "could not open input obstacles file: %s", obstaclefile);
+    die(message, __LINE__, __FILE__);
+  }
+
+  /* read-in the blocked cells list, with the checks of initialise() */
+  while ((retval = fscanf(fp, "%d %d %d\n", &xx, &yy, &blocked)) != EOF)
+  {
+    if (retval != 3)
+      die("expected 3 values per line in obstacle file", __LINE__, __FILE__);
+
+    if (xx < 0 || xx > params->nx - 1)
+      die("obstacle x-coord out of range", __LINE__, __FILE__);
+
+    if (yy < 0 || yy > params->ny - 1)
+      die("obstacle y-coord out of range", __LINE__, __FILE__);
+
+    if (blocked != 1)
+      die("obstacle blocked value should be 1", __LINE__, __FILE__);
+
+    const size_t cell = xx + (size_t)yy * params->nx;
+    solid[cell / 8] |= 1 << (cell % 8);
+  }
+
+  fclose(fp);
+
+  tiles_init(params, tiles, solid);
+  free(solid);
+
+  *av_vels_ptr = (float *)malloc(sizeof(float) * params->maxIters);
+
+  if (*av_vels_ptr == NULL)
+    die("cannot allocate memory for av_vels", __LINE__, __FILE__);
+
+  return EXIT_SUCCESS;
+}
+
+void tiles_init(const t_param *params, t_tiles *tiles, const unsigned char *solid)
+{
+  char message[1024]; /* message buffer */
+
+  tiles->ntx = params->nx / TILESIZE;
+  tiles->nty = params->ny / TILESIZE;
+  tiles->tile_of = (int *)malloc(sizeof(int) * tiles->ntx * tiles->nty);
+
+  if (tiles->tile_of == NULL)
+    die("cannot allocate memory for the tile map", __LINE__, __FILE__);
+
+  /*
+  ** A tile is kept if fluid lies anywhere in it or its one cell halo:
+  ** then every solid cell a fluid cell streams from is kept too, and
+  ** what the dropped solid cells would hold never reaches the fluid.
+  */
+#pragma omp parallel for
+  for (int tt = 0; tt < tiles->ntx * tiles->nty; tt++)
+  {
+    const int tx = tt % tiles->ntx, ty = tt / tiles->ntx;
+    int fluid = 0;
+
+    for (int by = -1; by <= TILESIZE && !fluid; by++)
+    {
+      const int jj = (ty * TILESIZE + by + params->ny) % params->ny;
+
+      for (int bx = -1; bx <= TILESIZE && !fluid; bx++)
+      {
+        const size_t cell = (tx * TILESIZE + bx + params->nx) % params->nx + (size_t)jj * params->nx;
+        fluid = !(solid[cell / 8] & (1 << (cell % 8)));
+      }
+    }
+
+    tiles->tile_of[tt] = fluid;
+  }
+
+  /* number the kept tiles in row major order; the rest share the rest tile, number ntiles */
+  tiles->ntiles = 0;
+  for (int tt = 0; tt < tiles->ntx * tiles->nty; tt++)
+    tiles->tile_of[tt] = tiles->tile_of[tt] ? tiles->ntiles++ : -1;
+
+  for (int tt = 0; tt < tiles->ntx * tiles->nty; tt++)
+    tiles->tile_of[tt] = (tiles->tile_of[tt] < 0) ? tiles->ntiles : tiles->tile_of[tt];
+
+  /* fail now, rather than part way through allocating */
+  const size_t lattice = sizeof(float) * NSPEEDS * TILECELLS * (size_t)(tiles->ntiles + 1);
+  const size_t required = 2 * lattice + sizeof(int) * (TILECELLS + NSPEEDS + 2) * (size_t)tiles->ntiles +
+                          sizeof(float) * params->maxIters;
+  const size_t available = available_memory(NULL, NULL);
+
+  if (available > 0 && required > available)
+  {
+    sprintf(message, "%d tiles need %.2f GiB but only %.2f GiB is available",
+            tiles->ntiles, required / 1073741824.0, available / 1073741824.0);
+    die(message, __LINE__, __FILE__);
+  }
+
+  tiles->coords = (int *)malloc(sizeof(int) * 2 * (tiles->ntiles + 1));
+  tiles->neighbours = (int *)malloc(sizeof(int) * NSPEEDS * (tiles->ntiles + 1));
+  tiles->obstacles = (int *)_mm_malloc(sizeof(int) * TILECELLS * (size_t)tiles->ntiles, 64);
+  tiles->cells = (float *)_mm_malloc(lattice, 64);
+  tiles->tmp_cells = (float *)_mm_malloc(lattice, 64);
+
+  if (tiles->coords == NULL || tiles->neighbours == NULL || tiles->obstacles == NULL ||
+      tiles->cells == NULL || tiles->tmp_cells == NULL)
+  {
+    sprintf(message, "cannot allocate %.2f MiB for %d tiles", required / 1048576.0, tiles->ntiles);
+    die(message, __LINE__, __FILE__);
+  }
+
+  /* where each tile is, and which tile lies in each lattice direction from it */
+  for (int tt = 0; tt < tiles->ntx * tiles->nty; tt++)
+  {
+    const int t = tiles->tile_of[tt];
+
+    if (t == tiles->ntiles)
+      continue;
+
+    tiles->coords[2 * t] = tt % tiles->ntx;
+    tiles->coords[2 * t + 1] = tt / tiles->ntx;
+
+    for (int ss = 0; ss < NSPEEDS; ss++)
+    {
+      const int tx = (tt % tiles->ntx + lat_cx[ss] + tiles->ntx) % tiles->ntx;
+      const int ty = (tt / tiles->ntx + lat_cy[ss] + tiles->nty) % tiles->nty;
+      tiles->neighbours[t * NSPEEDS + ss] = tiles->tile_of[tx + ty * tiles->ntx];
+    }
+  }
+
+  /* the rest tile is its own neighbour, so that it is never left */
+  for (int ss = 0; ss < NSPEEDS; ss++)
+    tiles->neighbours[tiles->ntiles * NSPEEDS + ss] = tiles->ntiles;
+
+  /* the tiles' own masks, and the rest state of init_speeds(), touched by the threads that update them */
+  const float w[NSPEEDS] = {params->density * 4.f / 9.f,
+                            params->density / 9.f, params->density / 9.f, params->density / 9.f, params->density / 9.f,
+                            params->density / 36.f, params->density / 36.f, params->density / 36.f, params->density / 36.f};
+  int nfluid = 0;
+
+#pragma omp parallel for reduction(+ : nfluid)
+  for (int t = 0; t <= tiles->ntiles; t++)
+  {
+    for (int ss = 0; ss < NSPEEDS; ss++)
+    {
+      for (int cc = 0; cc < TILECELLS; cc++)
+      {
+        tiles->cells[((size_t)t * NSPEEDS + ss) * TILECELLS + cc] = w[ss];
+        tiles->tmp_cells[((size_t)t * NSPEEDS + ss) * TILECELLS + cc] = w[ss];
+      }
+    }
+
+    if (t == tiles->ntiles)
+      continue;
+
+    for (int cc = 0; cc < TILECELLS; cc++)
+    {
+      const size_t cell = tiles->coords[2 * t] * TILESIZE + cc % TILESIZE +
+                          (size_t)(tiles->coords[2 * t + 1] * TILESIZE + cc / TILESIZE) * params->nx;
+      tiles->obstacles[(size_t)t * TILECELLS + cc] = (solid[cell / 8] >> (cell % 8)) & 1;
+      nfluid += !tiles->obstacles[(size_t)t * TILECELLS + cc];
+    }
+  }
+
+  tiles->nfluid = nfluid;
+}
+
+float timestep_tiles(const t_param params, t_tiles *tiles)
+{
+  const float c = 3.f;
+  const float w0 = 4.f / 9.f;  /* weighting factor */
+  const float w1 = 1.f / 9.f;  /* weighting factor */
+  const float w2 = 1.f / 36.f; /* weighting factor */
+  const int side[3][3] = {{7, 4, 8}, {3, 0, 1}, {6, 2, 5}}; /* the speed pointing to tile (dx, dy), as side[dy + 1][dx + 1] */
+  const float *restrict cells = tiles->cells;
+  float *restrict tmp_cells = tiles->tmp_cells;
+
+  int tot_cells = 0;
+  float tot_u = 0.f;
+
+#pragma omp parallel for schedule(static) reduction(+ : tot_cells) reduction(+ : tot_u)
+  for (int t = 0; t < tiles->ntiles; t++)
+  {
+    /* the tile and a one cell halo from its neighbours, TILEHALO x TILEHALO per speed */
+    float halo[NSPEEDS][TILEHALO * TILEHALO];
+    const int *neighbours = &tiles->neighbours[t * NSPEEDS];
+    const int *obstacles = &tiles->obstacles[(size_t)t * TILECELLS];
+
+    for (int by = 0; by < TILEHALO; by++)
+    {
+      const int dy = (by == 0) ? -1 : ((by == TILEHALO - 1) ? 1 : 0);
+      const int ly = by - 1 - dy * TILESIZE; /* row within the tile it comes from */
+      const size_t west = (size_t)neighbours[side[dy + 1][0]] * NSPEEDS * TILECELLS + (TILESIZE - 1) + ly * TILESIZE;
+      const size_t centre = (size_t)neighbours[side[dy + 1][1]] * NSPEEDS * TILECELLS + ly * TILESIZE;
+      const size_t east = (size_t)neighbours[side[dy + 1][2]] * NSPEEDS * TILECELLS + ly * TILESIZE;
+
+      for (int ss = 0; ss < NSPEEDS; ss++)
+      {
+        halo[ss][by * TILEHALO] = cells[west + ss * TILECELLS];
+        for (int lx = 0; lx < TILESIZE; lx++)
+          halo[ss][by * TILEHALO + 1 + lx] = cells[centre + ss * TILECELLS + lx];
+        halo[ss][by * TILEHALO + TILEHALO - 1] = cells[east + ss * TILECELLS];
+      }
+    }
+
+    float *out = &tmp_cells[(size_t)t * NSPEEDS * TILECELLS];
+
+    for (int ly = 0; ly < TILESIZE; ly++)
+    {
+#pragma omp simd reduction(+ : tot_cells) reduction(+ : tot_u)
+      for (int lx = 0; lx < TILESIZE; lx++)
+      {
+        const int cc = lx + ly * TILESIZE;
+        const int bb = (lx + 1) + (ly + 1) * TILEHALO;
+
+        /* propagate, as in timestep() */
+        const float prop0 = halo[0][bb];                /* central cell, no movement */
+        const float prop1 = halo[1][bb - 1];            /* east */
+        const float prop2 = halo[2][bb - TILEHALO];     /* north */
+        const float prop3 = halo[3][bb + 1];            /* west */
+        const float prop4 = halo[4][bb + TILEHALO];     /* south */
+        const float prop5 = halo[5][bb - 1 - TILEHALO]; /* north-east */
+        const float prop6 = halo[6][bb + 1 - TILEHALO]; /* north-west */
+        const float prop7 = halo[7][bb + 1 + TILEHALO]; /* south-west */
+        const float prop8 = halo[8][bb - 1 + TILEHALO]; /* south-east */
+
+        /* rebound */
+        if (obstacles[cc])
+        {
+          out[1 * TILECELLS + cc] = prop3;
+          out[2 * TILECELLS + cc] = prop4;
+          out[3 * TILECELLS + cc] = prop1;
+          out[4 * TILECELLS + cc] = prop2;
+          out[5 * TILECELLS + cc] = prop7;
+          out[6 * TILECELLS + cc] = prop8;
+          out[7 * TILECELLS + cc] = prop5;
+          out[8 * TILECELLS + cc] = prop6;
+        }
+        /* collision */
+        else
+        {
+          const float local_density = prop0 + prop1 + prop2 + prop3 + prop4 + prop5 + prop6 + prop7 + prop8;
+          const float u_x = (prop1 + prop5 + prop8 - (prop3 + prop6 + prop7)) / local_density;
+          const float u_y = (prop2 + prop5 + prop6 - (prop4 + prop7 + prop8)) / local_density;
+          const float u_sq = (u_x * u_x) + (u_y * u_y);
+
+          /* directional velocity components */
+          float u[NSPEEDS];
+          u[1] = u_x;        /* east */
+          u[2] = u_y;        /* north */
+          u[3] = -u_x;       /* west */
+          u[4] = -u_y;       /* south */
+          u[5] = u_x + u_y;  /* north-east */
+          u[6] = -u_x + u_y; /* north-west */
+          u[7] = -u_x - u_y; /* south-west */
+          u[8] = u_x - u_y;  /* south-east */
+
+          /* equilibrium densities */
+          float d_equ[NSPEEDS];
+          d_equ[0] = w0 * local_density * (1.f - u_sq * (0.5f * c));
+          d_equ[1] = w1 * local_density * (1.f + u[1] * c + (u[1] * u[1]) * (1.5f * c) - u_sq * (0.5f * c));
+          d_equ[2] = w1 * local_density * (1.f + u[2] * c + (u[2] * u[2]) * (1.5f * c) - u_sq * (0.5f * c));
+          d_equ[3] = w1 * local_density * (1.f + u[3] * c + (u[3] * u[3]) * (1.5f * c) - u_sq * (0.5f * c));
+          d_equ[4] = w1 * local_density * (1.f + u[4] * c + (u[4] * u[4]) * (1.5f * c) - u_sq * (0.5f * c));
+          d_equ[5] = w2 * local_density * (1.f + u[5] * c + (u[5] * u[5]) * (1.5f * c) - u_sq * (0.5f * c));
+          d_equ[6] = w2 * local_density * (1.f + u[6] * c + (u[6] * u[6]) * (1.5f * c) - u_sq * (0.5f * c));
+          d_equ[7] = w2 * local_density * (1.f + u[7] * c + (u[7] * u[7]) * (1.5f * c) - u_sq * (0.5f * c));
+          d_equ[8] = w2 * local_density * (1.f + u[8] * c + (u[8] * u[8]) * (1.5f * c) - u_sq * (0.5f * c));
+
+          /* relaxation step */
+          out[0 * TILECELLS + cc] = prop0 + params.omega * (d_equ[0] - prop0);
+          out[1 * TILECELLS + cc] = prop1 + params.omega * (d_equ[1] - prop1);
+          out[2 * TILECELLS + cc] = prop2 + params.omega * (d_equ[2] - prop2);
+          out[3 * TILECELLS + cc] = prop3 + params.omega * (d_equ[3] - prop3);
+          out[4 * TILECELLS + cc] = prop4 + params.omega * (d_equ[4] - prop4);
+          out[5 * TILECELLS + cc] = prop5 + params.omega * (d_equ[5] - prop5);
+          out[6 * TILECELLS + cc] = prop6 + params.omega * (d_equ[6] - prop6);
+          out[7 * TILECELLS + cc] = prop7 + params.omega * (d_equ[7] - prop7);
+          out[8 * TILECELLS + cc] = prop8 + params.omega * (d_equ[8] - prop8);
+
+          /* average speed */
+          tot_cells = tot_cells + 1;
+          tot_u = tot_u + sqrtf(u_sq);
+        }
+      }
+    }
+  }
+
+  return tot_u / (float)tot_cells;
+}
+
+int accelerate_flow_tiles(const t_param params, t_tiles *tiles)
+{
+  /* compute weighting factors */
+  float w1 = params.density * params.accel / 9.f;
+  float w2 = params.density * params.accel / 36.f;
+
+  /* modify the 2nd row of the grid, which crosses one row of tiles */
+  const int jj = params.ny - 2;
+  const int ty = jj / TILESIZE, ly = jj % TILESIZE;
+
+  for (int tx = 0; tx < tiles->ntx; tx++)
+  {
+    const int t = tiles->tile_of[tx + ty * tiles->ntx];
+
+    /* the row is all solid here */
+    if (t == tiles->ntiles)
+      continue;
+
+    float *f = &tiles->cells[(size_t)t * NSPEEDS * TILECELLS];
+    const int *obstacles = &tiles->obstacles[(size_t)t * TILECELLS];
+
+    for (int cc = ly * TILESIZE; cc < (ly + 1) * TILESIZE; cc++)
+    {
+      /* the test of accelerate_flow() */
+      if (!obstacles[cc] && (f[3 * TILECELLS + cc] - w1) > 0.f && (f[6 * TILECELLS + cc] - w2) > 0.f &&
+          (f[7 * TILECELLS + cc] - w2) > 0.f)
+      {
+        /* increase 'east-side' densities */
+        f[1 * TILECELLS + cc] += w1;
+        f[5 * TILECELLS + cc] += w2;
+        f[8 * TILECELLS + cc] += w2;
+        /* decrease 'west-side' densities */
+        f[3 * TILECELLS + cc] -= w1;
+        f[6 * TILECELLS + cc] -= w2;
+        f[7 * TILECELLS + cc] -= w2;
+      }
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+float av_velocity_tiles(const t_param params, t_tiles *tiles)
+{
+  int tot_cells = 0; /* no. of cells used in calculation */
+  float tot_u = 0.f; /* accumulated magnitudes of velocity for each cell */
+
+#pragma omp parallel for reduction(+ : tot_cells, tot_u)
+  for (int t = 0; t < tiles->ntiles; t++)
+  {
+    const float *f = &tiles->cells[(size_t)t * NSPEEDS * TILECELLS];
+
+    for (int cc = 0; cc < TILECELLS; cc++)
+    {
+      /* ignore occupied cells */
+      if (tiles->obstacles[(size_t)t * TILECELLS + cc])
+        continue;
+
+      float local_density = 0.f;
+      for (int ss = 0; ss < NSPEEDS; ss++)
+        local_density += f[ss * TILECELLS + cc];
+
+      const float u_x = (f[1 * TILECELLS + cc] + f[5 * TILECELLS + cc] + f[8 * TILECELLS + cc] -
+                         (f[3 * TILECELLS + cc] + f[6 * TILECELLS + cc] + f[7 * TILECELLS + cc])) / local_density;
+      const float u_y = (f[2 * TILECELLS + cc] + f[5 * TILECELLS + cc] + f[6 * TILECELLS + cc] -
+                         (f[4 * TILECELLS + cc] + f[7 * TILECELLS + cc] + f[8 * TILECELLS + cc])) / local_density;
+
+      tot_u += sqrtf((u_x * u_x) + (u_y * u_y));
+      ++tot_cells;
+    }
+  }
+
+  return tot_u / (float)tot_cells;
+}
+
+int write_tiles(const t_param params, t_tiles *tiles, float *av_vels, int gzip)
+{
+  write_state(params, NULL, NULL, tiles, gzip);
+
+  return write_av_vels(params, av_vels);
+}
+
+/* row_values() of row jj of the tiles, with the cells of dropped tiles as obstacles */
+void tile_row_values(const t_param params, t_tiles *tiles, int jj, float *u_x, float *u_y, float *u,
+                     float *pressure, int *blocked)
+{
+  const float c_sq = 1.f / 3.f; /* sq. of speed of sound */
+  const int ty = jj / TILESIZE, ly = jj % TILESIZE;
+
+  for (int ii = 0; ii < params.nx; ii++)
+  {
+    const int t = tiles->tile_of[ii / TILESIZE + ty * tiles->ntx];
+    const int cc = ii % TILESIZE + ly * TILESIZE;
+
+    blocked[ii] = (t == tiles->ntiles) ? 1 : tiles->obstacles[(size_t)t * TILECELLS + cc];
+    u_x[ii] = u_y[ii] = u[ii] = 0.f;
+    pressure[ii] = params.density * c_sq;
+
+    if (!blocked[ii])
+    {
+      const float *f = &tiles->cells[(size_t)t * NSPEEDS * TILECELLS];
+      float local_density = 0.f;
+
+      for (int ss = 0; ss < NSPEEDS; ss++)
+        local_density += f[ss * TILECELLS + cc];
+
+      u_x[ii] = (f[1 * TILECELLS + cc] + f[5 * TILECELLS + cc] + f[8 * TILECELLS + cc] -
+                 (f[3 * TILECELLS + cc] + f[6 * TILECELLS + cc] + f[7 * TILECELLS + cc])) / local_density;
+      u_y[ii] = (f[2 * TILECELLS + cc] + f[5 * TILECELLS + cc] + f[6 * TILECELLS + cc] -
+                 (f[4 * TILECELLS + cc] + f[7 * TILECELLS + cc] + f[8 * TILECELLS + cc])) / local_density;
+      u[ii] = sqrtf((u_x[ii] * u_x[ii]) + (u_y[ii] * u_y[ii]));
+      pressure[ii] = local_density * c_sq;
+    }
+  }
+}
+
+void free_tiles(t_tiles *tiles)
+{
+  free(tiles->tile_of);
+  free(tiles->coords);
+  free(tiles->neighbours);
+  _mm_free(tiles->obstacles);
+  _mm_free(tiles->cells);
+  _mm_free(tiles->tmp_cells);
+  tiles->tile_of = tiles->coords = tiles->neighbours = tiles->obstacles = NULL;
+  tiles->cells = tiles->tmp_cells = NULL;
+}
+
+int smt_start(const t_param params, t_smt *smt, int *obstacles, int distance)
+{
+  char message[1024]; /* message buffer */
+
+  smt->params = params;
+  smt->obstacles = obstacles;
+  smt->distance = (distance > 0) ? distance : SMTDISTANCE;
+  smt->cells = NULL;
+  smt->stop = 0;
+  smt->nhelpers = 0;
+  smt->nthreads = omp_get_max_threads();
+  smt->rows = (int *)_mm_malloc(sizeof(int) * SMTSTRIDE * smt->nthreads, 64);
+  smt->compute_cpu = (int *)malloc(sizeof(int) * smt->nthreads);
+  smt->helpers = (t_smt_helper *)malloc(sizeof(t_smt_helper) * smt->nthreads);
+
+  if (smt->rows == NULL || smt->compute_cpu == NULL || smt->helpers == NULL)
+    die("cannot allocate memory for the SMT helpers", __LINE__, __FILE__);
+
+  /* where the compute threads run: this needs OMP_PROC_BIND, or they may move away from their helpers */
+#pragma omp parallel
+  {
+    smt->compute_cpu[omp_get_thread_num()] = sched_getcpu();
+    smt->rows[omp_get_thread_num() * SMTSTRIDE] = -1;
+  }
+
+  for (int tt = 0; tt < smt->nthreads; tt++)
+  {
+    t_smt_helper *helper = &smt->helpers[tt];
+    helper->smt = smt;
+    helper->thread = tt;
+    helper->cpu = smt_sibling(smt->compute_cpu[tt]);
+    helper->rows = 0;
+    helper->running = 0;
+
+    /* a sibling that runs a compute thread is not idle */
+    for (int other = 0; other < smt->nthreads && helper->cpu >= 0; other++)
+    {
+      if (smt->compute_cpu[other] == helper->cpu)
+        helper->cpu = -1;
+    }
+
+    if (helper->cpu < 0)
+    {
+      printf("SMT prefetch:\t\t\tthread %d on cpu %d has no idle sibling, no helper\n", tt, smt->compute_cpu[tt]);
+      continue;
+    }
+
+    /* pinned before it starts, so that it never runs anywhere else */
+    pthread_attr_t attr;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(helper->cpu, &cpus);
+    pthread_attr_init(&attr);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+
+    if (pthread_create(&helper->tid, &attr, smt_helper, helper) != 0)
+    {
+      sprintf(message, "cannot start the SMT helper for thread %d on cpu %d", tt, helper->cpu);
+      die(message, __LINE__, __FILE__);
+    }
+
+    pthread_attr_destroy(&attr);
+    helper->running = 1;
+    smt->nhelpers++;
+    printf("SMT prefetch:\t\t\tthread %d on cpu %d, helper on cpu %d, %d rows ahead\n",
+           tt, smt->compute_cpu[tt], helper->cpu, smt->distance);
+  }
+
+  /* only now does timestep() publish its progress */
+  if (smt->nhelpers > 0)
+    smt_rows = smt->rows;
+
+  return smt->nhelpers;
+}
+
+/*
+** Start a timestep for the helpers: clear each compute thread's progress,
+** so that a helper does not take the last row of the previous timestep
+** for this one's, then publish the lattice, which tells them it began.
+*/
+void smt_step(t_smt *smt, t_speeds *cells)
+{
+  for (int tt = 0; tt < smt->nthreads; tt++)
+    __atomic_store_n(&smt->rows[tt * SMTSTRIDE], -1, __ATOMIC_RELAXED);
+
+  __atomic_store_n(&smt->cells, cells, __ATOMIC_RELEASE);
+}
+
+void *smt_helper(void *arg)
+{
+  t_smt_helper *helper = (t_smt_helper *)arg;
+  t_smt *smt = helper->smt;
+  const int nx = smt->params.nx, ny = smt->params.ny;
+  const int *progress = &smt->rows[helper->thread * SMTSTRIDE];
+  t_speeds *last_cells = NULL; /* the lattice of the timestep being followed */
+  int first = ny;              /* first row of the compute thread's block, learnt from its progress */
+  int ahead = -1;              /* last row prefetched for this timestep */
+
+  while (!__atomic_load_n(&smt->stop, __ATOMIC_ACQUIRE))
+  {
+    t_speeds *cells = __atomic_load_n(&smt->cells, __ATOMIC_ACQUIRE);
+    int row = __atomic_load_n(progress, __ATOMIC_ACQUIRE);
+
+    if (cells == NULL)
+      continue;
+
+    if (row >= 0 && row < first)
+      first = row;
+
+    /* a new timestep starts again at the top of the block */
+    if (cells != last_cells)
+    {
+      last_cells = cells;
+      ahead = (first < ny) ? first - 1 : row;
+    }
+
+    /* no row done yet this timestep: the thread is about to start its block */
+    if (row < 0)
+      row = (first < ny) ? first - 1 : -1;
+
+    /*
+    ** Row jj reads rows jj - 1 to jj + 1 of the speeds and row jj of the
+    ** mask; rows up to jj are in the cache already, so each new row ahead
+    ** brings in the speeds one further north, and its own mask row.
+    */
+    const int target = (row >= ahead - smt->distance) ? row + smt->distance : ahead;
+
+    if (target <= ahead)
+    {
+#if defined(__x86_64__) || defined(__i386__)
+      _mm_pause();
+#endif
+      continue;
+    }
+
+    for (int jj = ahead + 1; jj <= target; jj++)
+    {
+      const size_t north = (size_t)((jj + 1) % ny) * nx;
+      const float *speeds[NSPEEDS] = {cells->s0 + north, cells->s1 + north, cells->s2 + north,
+                                      cells->s3 + north, cells->s4 + north, cells->s5 + north,
+                                      cells->s6 + north, cells->s7 + north, cells->s8 + north};
+      const int *mask = smt->obstacles + (size_t)(jj % ny) * nx;
+
+      /* into L2, which the sibling shares with the compute thread */
+      for (int ii = 0; ii < nx; ii += 64 / sizeof(float))
+      {
+        for (int ss = 0; ss < NSPEEDS; ss++)
+          __builtin_prefetch(speeds[ss] + ii, 0, 2);
+        __builtin_prefetch(mask + ii, 0, 2);
+      }
+    }
+
+    helper->rows += target - ahead;
+    ahead = target;
+  }
+
+  return NULL;
+}
+
+int smt_sibling(int cpu)
+{
+  char file[128];  /* sysfs path */
+  char list[256];  /* e.g. "3,67" or "2-3" */
+  FILE *fp;        /* file pointer */
+  int sibling = -1;
+
+  sprintf(file, "%s/cpu%d/topology/thread_siblings_list", CPUDIR, cpu);
+  fp = fopen(file, "r");
+
+  if (fp == NULL)
+    return -1;
+
+  if (fgets(list, sizeof(list), fp) != NULL)
+  {
+    /* the first cpu of the list, ranges included, that is not this one */
+    for (char *item = strtok(list, ",\n"); item != NULL && sibling < 0; item = strtok(NULL, ",\n"))
+    {
+      int lo, hi;
+
+      if (sscanf(item, "%d-%d", &lo, &hi) != 2)
+        hi = lo = atoi(item);
+
+      for (int cc = lo; cc <= hi && sibling < 0; cc++)
+      {
+        if (cc != cpu)
+          sibling = cc;
+      }
+    }
+  }
+
+  fclose(fp);
+
+  return sibling;
+}
+
+void smt_stop(t_smt *smt)
+{
+  smt_rows = NULL;
+  __atomic_store_n(&smt->stop, 1, __ATOMIC_RELEASE);
+
+  for (int tt = 0; tt < smt->nthreads; tt++)
+  {
+    if (!smt->helpers[tt].running)
+      continue;
+
+    pthread_join(smt->helpers[tt].tid, NULL);
+    printf("SMT prefetch:\t\t\thelper on cpu %d prefetched %ld rows\n", smt->helpers[tt].cpu, smt->helpers[tt].rows);
+  }
+
+  _mm_free(smt->rows);
+  free(smt->compute_cpu);
+  free(smt->helpers);
+}
+
+int aio_init(t_aio *aio, int backend)
+{
+  memset(aio, 0, sizeof(*aio));
+  aio->ring_fd = -1;
+
+  /* the kernel may be too old, or io_uring disabled by seccomp or sysctl */
+  if (backend == AIO_URING && !uring_init(aio))
+    backend = AIO_THREADS;
+
+  aio->backend = backend;
+
+  if (backend == AIO_THREADS)
+  {
+    pthread_mutex_init(&aio->lock, NULL);
+    pthread_cond_init(&aio->wake, NULL);
+    pthread_cond_init(&aio->done, NULL);
+
+    for (int tt = 0; tt < AIOTHREADS; tt++)
+    {
+      if (pthread_create(&aio->threads[tt], NULL, aio_worker, aio) != 0)
+        die("cannot start the output threads", __LINE__, __FILE__);
+    }
+  }
+
+  return backend;
+}
+
+/* set up an io_uring with raw system calls, 0 if the kernel does not provide one */
+int uring_init(t_aio *aio)
+{
+  struct io_uring_params p; /* ring sizes and offsets, filled in by the kernel */
+
+  memset(&p, 0, sizeof(p));
+
+  const int fd = (int)syscall(__NR_io_uring_setup, AIOENTRIES, &p);
+
+  if (fd < 0)
+    return 0;
+
+  /* IORING_OP_WRITE arrived with IORING_FEAT_RW_CUR_POS, in Linux 5.6 */
+  if (!(p.features & IORING_FEAT_RW_CUR_POS))
+  {
+    close(fd);
+    return 0;
+  }
+
+  aio->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  aio->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+  /* both rings may share one mapping */
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    aio->sq_size = aio->cq_size = (aio->sq_size > aio->cq_size) ? aio->sq_size : aio->cq_size;
+
+  aio->sq_map = mmap(NULL, aio->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  aio->cq_map = (p.features & IORING_FEAT_SINGLE_MMAP)
+                    ? aio->sq_map
+                    : mmap(NULL, aio->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  aio->sqes = (struct io_uring_sqe *)mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+  if (aio->sq_map == MAP_FAILED || aio->cq_map == MAP_FAILED || aio->sqes == MAP_FAILED)
+  {
+    if (aio->sqes != MAP_FAILED)
+      munmap(aio->sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+    if (aio->cq_map != MAP_FAILED && aio->cq_map != aio->sq_map)
+      munmap(aio->cq_map, aio->cq_size);
+    if (aio->sq_map != MAP_FAILED)
+      munmap(aio->sq_map, aio->sq_size);
+    close(fd);
+    return 0;
+  }
+
+  char *sq = (char *)aio->sq_map; /* the submission ring */
+  char *cq = (char *)aio->cq_map; /* the completion ring */
+
+  aio->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  aio->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  aio->sq_array = (unsigned *)(sq + p.sq_off.array);
+  aio->cq_head = (unsigned *)(cq + p.cq_off.head);
+  aio->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  aio->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  aio->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  aio->sq_entries = p.sq_entries;
+  aio->ring_fd = fd;
+
+  return 1;
+}
+
+/* a zeroed AIOALIGN aligned buffer for a file image of length bytes, padding included */
+char *aio_alloc(size_t length)
+{
+  const size_t padded = (length + AIOALIGN - 1) / AIOALIGN * AIOALIGN;
+  char *buffer = (char *)_mm_malloc(padded, AIOALIGN);
+
+  if (buffer == NULL)
+    die("cannot allocate memory for output", __LINE__, __FILE__);
+
+  /* the O_DIRECT padding, truncated away once written */
+  memset(buffer + length, 0, padded - length);
+
+  return buffer;
+}
+
+/*
+** Queue the image from aio_alloc() as the file name, and return. The
+** engine owns the image from here on. Only when AIOMAXFILES are still
+** in flight does the caller wait, for the oldest to complete.
+*/
+void aio_write(t_aio *aio, const char *name, char *buffer, size_t length)
+{
+  char message[160];                                              /* error message */
+  t_aio_file *file = (t_aio_file *)calloc(1, sizeof(t_aio_file)); /* the write, until it completes */
+
+  if (file == NULL)
+    die("cannot allocate memory for output", __LINE__, __FILE__);
+
+  snprintf(file->name, sizeof(file->name), "%s", name);
+  file->buffer = buffer;
+  file->length = length;
+  file->direct = (length >= AIODIRECTMIN);
+  file->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | (file->direct ? O_DIRECT : 0), 0666);
+
+  /* not every file system supports O_DIRECT */
+  if (file->fd < 0 && file->direct && errno == EINVAL)
+  {
+    file->direct = 0;
+    file->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  }
+
+  if (file->fd < 0)
+  {
+    sprintf(message, "could not open output file: %s", file->name);
+    die(message, __LINE__, __FILE__);
+  }
+
+  file->padded = file->direct ? (length + AIOALIGN - 1) / AIOALIGN * AIOALIGN : length;
+  aio->files++;
+  aio->bytes += length;
+
+  if (aio->backend == AIO_SYNC)
+  {
+    const double tic = wall_time();
+    const int err = aio_pwrite(file);
+
+    if (err)
+    {
+      sprintf(message, "could not write %s: %s", file->name, strerror(err));
+      die(message, __LINE__, __FILE__);
+    }
+
+    aio_finish(file);
+    aio->blocked += wall_time() - tic;
+  }
+  else if (aio->backend == AIO_THREADS)
+  {
+    const double tic = wall_time();
+
+    pthread_mutex_lock(&aio->lock);
+    while (aio->inflight >= AIOMAXFILES)
+      pthread_cond_wait(&aio->done, &aio->lock);
+    aio->blocked += wall_time() - tic;
+
+    aio->inflight++;
+    if (aio->tail != NULL)
+      aio->tail->next = file;
+    else
+      aio->head = file;
+    aio->tail = file;
+    pthread_cond_signal(&aio->wake);
+    pthread_mutex_unlock(&aio->lock);
+  }
+  else
+  {
+    const double tic = wall_time();
+    const int nops = (int)((file->padded + AIOCHUNK - 1) / AIOCHUNK); /* writes of at most AIOCHUNK */
+
+    while (aio->inflight >= AIOMAXFILES)
+      uring_reap(aio, 1);
+    aio->blocked += wall_time() - tic;
+
+    file->ops = (t_aio_op *)malloc(sizeof(t_aio_op) * nops);
+
+    if (file->ops == NULL)
+      die("cannot allocate memory for output", __LINE__, __FILE__);
+
+    aio->inflight++;
+    file->pending = nops;
+
+    for (int oo = 0; oo < nops; oo++)
+    {
+      file->ops[oo].file = file;
+      file->ops[oo].offset = (size_t)oo * AIOCHUNK;
+      file->ops[oo].bytes = (file->padded - file->ops[oo].offset < AIOCHUNK) ? file->padded - file->ops[oo].offset
+                                                                             : AIOCHUNK;
+      uring_submit(aio, &file->ops[oo]);
+    }
+  }
+}
+
+/* put one write on the submission ring and tell the kernel */
+void uring_submit(t_aio *aio, t_aio_op *op)
+{
+  /* the ring is full: make room */
+  while (aio->ops >= aio->sq_entries)
+    uring_reap(aio, 1);
+
+  const unsigned tail = *aio->sq_tail;
+  const unsigned index = tail & *aio->sq_mask;
+  struct io_uring_sqe *sqe = &aio->sqes[index];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = op->file->fd;
+  sqe->addr = (unsigned long)(op->file->buffer + op->offset);
+  sqe->len = (unsigned)op->bytes;
+  sqe->off = op->offset;
+  sqe->user_data = (unsigned long)op;
+  aio->sq_array[index] = index;
+
+  /* the kernel reads the entry once it sees the new tail */
+  __atomic_store_n(aio->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  aio->ops++;
+
+  while (syscall(__NR_io_uring_enter, aio->ring_fd, 1, 0, 0, NULL, 0) < 0)
+  {
+    if (errno == EAGAIN || errno == EBUSY)
+      uring_reap(aio, 0);
+    else if (errno != EINTR)
+      die("could not submit to the io_uring", __LINE__, __FILE__);
+  }
+}
+
+/* handle the completed writes, first waiting for one if wait is set */
+void uring_reap(t_aio *aio, int wait)
+{
+  char message[160]; /* error message */
+
+  if (wait)
+  {
+    while (syscall(__NR_io_uring_enter, aio->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+    {
+      if (errno != EINTR)
+        die("could not wait on the io_uring", __LINE__, __FILE__);
+    }
+  }
+
+  /*
+  ** Each entry is taken off the ring before it is handled: resubmitting
+  ** can reap again from uring_submit(), and that nested reap must start
+  ** after it, so the head is read afresh for every entry.
+  */
+  for (;;)
+  {
+    const unsigned head = __atomic_load_n(aio->cq_head, __ATOMIC_ACQUIRE);
+
+    if (head == __atomic_load_n(aio->cq_tail, __ATOMIC_ACQUIRE))
+      break;
+
+    const struct io_uring_cqe *cqe = &aio->cqes[head & *aio->cq_mask];
+    t_aio_op *op = (t_aio_op *)(unsigned long)cqe->user_data;
+    t_aio_file *file = op->file;
+    const int res = cqe->res; /* bytes written, or -errno */
+
+    __atomic_store_n(aio->cq_head, head + 1, __ATOMIC_RELEASE);
+    aio->ops--;
+
+    /* O_DIRECT was refused at write time: the file falls back to the page cache */
+    if (res == -EINVAL && file->direct)
+    {
+      aio_undirect(file);
+      uring_submit(aio, op);
+    }
+    else if (res == -EINTR || res == -EAGAIN)
+      uring_submit(aio, op);
+    else if (res <= 0)
+    {
+      sprintf(message, "could not write %s: %s", file->name, res ? strerror(-res) : "no bytes written");
+      die(message, __LINE__, __FILE__);
+    }
+    else if ((size_t)res < op->bytes)
+    {
+      op->offset += res;
+      op->bytes -= res;
+      uring_submit(aio, op);
+    }
+    else if (--file->pending == 0)
+    {
+      aio_finish(file);
+      aio->inflight--;
+    }
+  }
+}
+
+/* write a whole image with pwrite(), 0 or an errno */
+int aio_pwrite(t_aio_file *file)
+{
+  size_t offset = 0; /* bytes written */
+
+  while (offset < file->padded)
+  {
+    const size_t bytes = (file->padded - offset < AIOCHUNK) ? file->padded - offset : AIOCHUNK;
+    const ssize_t done = pwrite(file->fd, file->buffer + offset, bytes, (off_t)offset);
+
+    if (done < 0 && errno == EINVAL && file->direct)
+      aio_undirect(file);
+    else if (done < 0 && errno == EINTR)
+      continue;
+    else if (done <= 0)
+      return done ? errno : EIO;
+    else
+      offset += done;
+  }
+
+  return 0;
+}
+
+/* drop O_DIRECT from a file whose file system refused it */
+void aio_undirect(t_aio_file *file)
+{
+  fcntl(file->fd, F_SETFL, fcntl(file->fd, F_GETFL) & ~O_DIRECT);
+  file->direct = 0;
+}
+
+/* cut a written file to its length, close it and release its image */
+void aio_finish(t_aio_file *file)
+{
+  char message[160]; /* error message */
+
+  if (file->padded != file->length && ftruncate(file->fd, (off_t)file->length) != 0)
+  {
+    sprintf(message, "could not truncate %s", file->name);
+    die(message, __LINE__, __FILE__);
+  }
+
+  if (close(file->fd) != 0)
+  {
+    sprintf(message, "could not write %s", file->name);
+    die(message, __LINE__, __FILE__);
+  }
+
+  _mm_free(file->buffer);
+  free(file->ops);
+  free(file);
+}
+
+/* a writer of the thread pool engine: takes queued files, oldest first, until stopped */
+void *aio_worker(void *arg)
+{
+  t_aio *aio = (t_aio *)arg;
+  char message[160]; /* error message */
+
+  pthread_mutex_lock(&aio->lock);
+
+  for (;;)
+  {
+    while (aio->head == NULL && !aio->stop)
+      pthread_cond_wait(&aio->wake, &aio->lock);
+
+    /* stopped, and nothing left to write */
+    if (aio->head == NULL)
+      break;
+
+    t_aio_file *file = aio->head;
+
+    aio->head = file->next;
+    if (aio->head == NULL)
+      aio->tail = NULL;
+    pthread_mutex_unlock(&aio->lock);
+
+    const int err = aio_pwrite(file);
+
+    if (err)
+    {
+      sprintf(message, "could not write %s: %s", file->name, strerror(err));
+      die(message, __LINE__, __FILE__);
+    }
+
+    aio_finish(file);
+
+    pthread_mutex_lock(&aio->lock);
+    aio->inflight--;
+    pthread_cond_broadcast(&aio->done);
+  }
+
+  pthread_mutex_unlock(&aio->lock);
+
+  return NULL;
+}
+
+/* release the images already written, without waiting: a few loads when nothing completed */
+void aio_poll(t_aio *aio)
+{
+  if (aio->backend == AIO_URING && aio->inflight > 0)
+    uring_reap(aio, 0);
+}
+
+/* wait until every queued file is on disk */
+void aio_wait(t_aio *aio)
+{
+  const double tic = wall_time();
+
+  if (aio->backend == AIO_URING)
+  {
+    while (aio->inflight > 0)
+      uring_reap(aio, 1);
+  }
+  else if (aio->backend == AIO_THREADS)
+  {
+    pthread_mutex_lock(&aio->lock);
+    while (aio->inflight > 0)
+      pthread_cond_wait(&aio->done, &aio->lock);
+    pthread_mutex_unlock(&aio->lock);
+  }
+
+  aio->blocked += wall_time() - tic;
+}
+
+void aio_close(t_aio *aio)
+{
+  aio_wait(aio);
+
+  if (aio->backend == AIO_THREADS)
+  {
+    pthread_mutex_lock(&aio->lock);
+    aio->stop = 1;
+    pthread_cond_broadcast(&aio->wake);
+    pthread_mutex_unlock(&aio->lock);
+
+    for (int tt = 0; tt < AIOTHREADS; tt++)
+      pthread_join(aio->threads[tt], NULL);
+
+    pthread_mutex_destroy(&aio->lock);
+    pthread_cond_destroy(&aio->wake);
+    pthread_cond_destroy(&aio->done);
+  }
+  else if (aio->backend == AIO_URING)
+  {
+    munmap(aio->sqes, aio->sq_entries * sizeof(struct io_uring_sqe));
+    if (aio->cq_map != aio->sq_map)
+      munmap(aio->cq_map, aio->cq_size);
+    munmap(aio->sq_map, aio->sq_size);
+    close(aio->ring_fd);
+  }
+}
+
+/*
+** final_state.dat, formatted in parallel: each pass formats a group of
+** blocks of rows into one buffer, a block per thread at a time, and
+** writes them in order. The dense lattice is read with row_values(),
+** the sparse one with tile_row_values(). With gzip, each thread also
+** deflates its block into a gzip member of its own; the members are
+** concatenated into final_state.dat.gz, which gzip reads as one file.
+*/
+int write_state(const t_param params, t_speeds *cells, int *obstacles, t_tiles *tiles, int gzip)
+{
+  FILE *fp;                                               /* file pointer */
+  const size_t row_chars = (size_t)params.nx * LINECHARS; /* room for the text of one row */
+  int block = 1;                                          /* rows per block, and per gzip member */
+
+  if (gzip && row_chars < GZBLOCK)
+    block = (int)(GZBLOCK / row_chars);
+  if (block > params.ny)
+    block = params.ny;
+
+  const int nblocks = (params.ny + block - 1) / block;
+  const size_t block_chars = row_chars * block;                                  /* room for the text of a block */
+  const size_t packed_chars = gzip ? compressBound(block_chars) + GZWRAPPER : 0; /* ... and for its member */
+  int group = (int)(FMTBYTES / (block_chars + packed_chars));                    /* blocks formatted per pass */
+
+  if (group < omp_get_max_threads())
+    group = omp_get_max_threads();
+  if (group > nblocks)
+    group = nblocks;
+
+  char *text = (char *)malloc(block_chars * group);                  /* the blocks of a pass */
+  char *packed = gzip ? (char *)malloc(packed_chars * group) : NULL; /* ... deflated */
+  size_t *length = (size_t *)malloc(sizeof(size_t) * group);         /* ... and their bytes, as written */
+
+  if (text == NULL || length == NULL || (gzip && packed == NULL))
+    die("cannot allocate memory for output", __LINE__, __FILE__);
+
+  fp = fopen(gzip ? FINALSTATEGZ : FINALSTATEFILE, gzip ? "wb" : "w");
+
+  if (fp == NULL)
+  {
+    die("could not open file output file", __LINE__, __FILE__);
+  }
+
+#pragma omp parallel
+  {
+    float *row = (float *)malloc(sizeof(float) * 4 * params.nx); /* u_x, u_y, u and pressure of one row */
+    int *blocked = (int *)malloc(sizeof(int) * params.nx);      /* ... and its obstacle flags, for tiles */
+
+    if (row == NULL || blocked == NULL)
+      die("cannot allocate memory for output", __LINE__, __FILE__);
+
+    for (int first = 0; first < nblocks; first += group)
+    {
+      const int nformat = (nblocks - first < group) ? nblocks - first : group;
+
+#pragma omp for schedule(static, 1)
+      for (int bb = 0; bb < nformat; bb++)
+      {
+        const int start = (first + bb) * block;
+        const int end = (start + block < params.ny) ? start + block : params.ny;
+        char *out = &text[bb * block_chars];
+        size_t chars = 0; /* text of the block so far */
+
+        for (int jj = start; jj < end; jj++)
+        {
+          const int *flags = blocked;
+
+          if (tiles != NULL)
+            tile_row_values(params, tiles, jj, row, row + params.nx, row + 2 * params.nx, row + 3 * params.nx,
+                            blocked);
+          else
+          {
+            row_values(params, cells, obstacles, jj, row, row + params.nx, row + 2 * params.nx, row + 3 * params.nx);
+            flags = &obstacles[jj * params.nx];
+          }
+
+          chars += format_row(params, jj, row, row + params.nx, row + 2 * params.nx, row + 3 * params.nx, flags,
+                              out + chars);
+        }
+
+        length[bb] = gzip ? gzip_member(out, chars, &packed[bb * packed_chars], packed_chars) : chars;
+      }
+
+#pragma omp single
+      for (int bb = 0; bb < nformat; bb++)
+      {
+        const char *bytes = gzip ? &packed[bb * packed_chars] : &text[bb * block_chars];
+
+        if (fwrite(bytes, 1, length[bb], fp) != length[bb])
+          die("could not write final state", __LINE__, __FILE__);
+      }
+    }
+
+    free(row);
+    free(blocked);
+  }
+
+  fclose(fp);
+  free(text);
+  free(packed);
+  free(length);
+
+  return EXIT_SUCCESS;
+}
+
+/* deflate length chars of text into one complete gzip member of at most room bytes, return its bytes */
+size_t gzip_member(const char *text, size_t length, char *out, size_t room)
+{
+  z_stream stream; /* the deflate state */
+
+  memset(&stream, 0, sizeof(stream));
+
+  /* 16 + window bits: a gzip header and trailer rather than zlib's */
+  if (deflateInit2(&stream, GZLEVEL, Z_DEFLATED, 16 + 15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    die("cannot start the gzip compression", __LINE__, __FILE__);
+
+  stream.next_in = (Bytef *)text;
+  stream.avail_in = (uInt)length;
+  stream.next_out = (Bytef *)out;
+  stream.avail_out = (uInt)room;
+
+  if (deflate(&stream, Z_FINISH) != Z_STREAM_END)
+    die("could not compress the final state", __LINE__, __FILE__);
+
+  const size_t bytes = stream.total_out;
+
+  deflateEnd(&stream);
+
+  return bytes;
+}
+
+/* the lines of row jj of final_state.dat, as printf("%d %d %.12E %.12E %.12E %.12E %d\n"); returns the no. of chars */
+size_t format_row(const t_param params, int jj, const float *u_x, const float *u_y, const float *u,
+                  const float *pressure, const int *blocked, char *out)
+{
+  char *p = out; /* next char */
+
+  for (int ii = 0; ii < params.nx; ii++)
+  {
+    p += format_int(p, ii);
+    *p++ = ' ';
+    p += format_int(p, jj);
+    *p++ = ' ';
+    p += format_float(p, u_x[ii]);
+    *p++ = ' ';
+    p += format_float(p, u_y[ii]);
+    *p++ = ' ';
+    p += format_float(p, u[ii]);
+    *p++ = ' ';
+    p += format_float(p, pressure[ii]);
+    *p++ = ' ';
+    p += format_int(p, blocked[ii]);
+    *p++ = '\n';
+  }
+
+  return (size_t)(p - out);
+}
+
+/*
+** printf("%.12E") of a float, exactly: the value m 2^e is scaled by
+** 10^s to the 13 digit integer q with integer arithmetic, and rounded
+** to nearest with ties to even, as glibc does. Writes at most
+** FLOATCHARS chars, and returns how many.
+*/
+int format_float(char *out, float value)
+{
+  unsigned int bits;        /* the float's representation */
+  char *p = out;            /* next char */
+  unsigned long long q = 0; /* the 13 significant digits */
+  int half = 0;             /* remainder of the scaling vs. one half: -1 below, 0 equal, 1 above */
+
+  memcpy(&bits, &value, sizeof(bits));
+
+  const int biased = (bits >> 23) & 0xff; /* biased binary exponent */
+  unsigned int m = bits & 0x7fffff;       /* mantissa */
+
+  /* infinities and NaNs are left to the C library */
+  if (biased == 0xff)
+    return sprintf(out, "%.12E", value);
+
+  if (bits >> 31)
+    *p++ = '-';
+
+  if (biased == 0 && m == 0)
+  {
+    memcpy(p, "0.000000000000E+00", 18);
+    return (int)(p - out) + 18;
+  }
+
+  /* value = m 2^e, with denormals at the lowest exponent */
+  int e = -149;
+
+  if (biased > 0)
+  {
+    m |= 1u << 23;
+    e = biased - 150;
+  }
+
+  static const double tens[] = { /* 10^-46 to 10^39, near enough to correct the estimate */
+      1e-46, 1e-45, 1e-44, 1e-43, 1e-42, 1e-41, 1e-40, 1e-39, 1e-38, 1e-37,
+      1e-36, 1e-35, 1e-34, 1e-33, 1e-32, 1e-31, 1e-30, 1e-29, 1e-28, 1e-27,
+      1e-26, 1e-25, 1e-24, 1e-23, 1e-22, 1e-21, 1e-20, 1e-19, 1e-18, 1e-17,
+      1e-16, 1e-15, 1e-14, 1e-13, 1e-12, 1e-11, 1e-10, 1e-9, 1e-8, 1e-7,
+      1e-6, 1e-5, 1e-4, 1e-3, 1e-2, 1e-1, 1e0, 1e1, 1e2, 1e3,
+      1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13,
+      1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22, 1e23,
+      1e24, 1e25, 1e26, 1e27, 1e28, 1e29, 1e30, 1e31, 1e32, 1e33,
+      1e34, 1e35, 1e36, 1e37, 1e38, 1e39};
+
+  /* floor(log10(value)): floor(log2(value)) x log10(2) is at most one too low, and the table mostly corrects it */
+  int exp10 = ((31 - __builtin_clz(m) + e) * 78913) >> 18;
+
+  if (fabs((double)value) >= tens[exp10 + 47])
+    exp10++;
+
+  for (;;)
+  {
+    decimal_scale(m, e, 12 - exp10, &q, &half);
+
+    if (q >= 10000000000000ull)
+      exp10++;
+    else if (q < 1000000000000ull)
+      exp10--;
+    else
+      break;
+  }
+
+  if (half > 0 || (half == 0 && (q & 1)))
+    q++;
+
+  /* rounded up to 10^13: one more digit before the point */
+  if (q == 10000000000000ull)
+  {
+    q = 1000000000000ull;
+    exp10++;
+  }
+
+  /* d.dddddddddddd, two digits at a time from the right */
+  char digits[13]; /* q in decimal */
+
+  for (int dd = 11; dd >= 1; dd -= 2)
+  {
+    const int pair = (int)(q % 100);
+
+    q /= 100;
+    digits[dd] = (char)('0' + pair / 10);
+    digits[dd + 1] = (char)('0' + pair % 10);
+  }
+  digits[0] = (char)('0' + q);
+
+  *p++ = digits[0];
+  *p++ = '.';
+  memcpy(p, &digits[1], 12);
+  p += 12;
+  *p++ = 'E';
+  *p++ = (exp10 < 0) ? '-' : '+';
+  if (exp10 < 0)
+    exp10 = -exp10;
+  if (exp10 >= 100)
+    *p++ = (char)('0' + exp10 / 100);
+  *p++ = (char)('0' + exp10 / 10 % 10);
+  *p++ = (char)('0' + exp10 % 10);
+
+  return (int)(p - out);
+}
+
+/*
+** q = floor(m 2^e 10^s), and how the remainder compares with one
+** half. With s >= 0 the product m 5^s is shifted by e + s, in 128 bits
+** or, for the smallest floats, in three 64 bit limbs; with s < 0 the
+** value needs only 110 bits and is divided by 5^-s.
+*/
+void decimal_scale(unsigned int m, int e, int s, unsigned long long *q, int *half)
+{
+  static const unsigned long long pow5[28] = { /* 5^0 to 5^27, the largest below 2^63 */
+      1ull, 5ull, 25ull, 125ull, 625ull, 3125ull, 15625ull, 78125ull, 390625ull, 1953125ull, 9765625ull,
+      48828125ull, 244140625ull, 1220703125ull, 6103515625ull, 30517578125ull, 152587890625ull,
+      762939453125ull, 3814697265625ull, 19073486328125ull, 95367431640625ull, 476837158203125ull,
+      2384185791015625ull, 11920928955078125ull, 59604644775390625ull, 298023223876953125ull,
+      1490116119384765625ull, 7450580596923828125ull};
+
+  if (s < 0)
+  {
+    const unsigned __int128 n = (unsigned __int128)m << (e + s);
+    const unsigned long long rem = (unsigned long long)(n % pow5[-s]);
+
+    *q = (unsigned long long)(n / pow5[-s]);
+    *half = (2 * rem > pow5[-s]) ? 1 : -1; /* 5^-s is odd, so never a tie */
+    return;
+  }
+
+  /* the common case: m 5^s and the shift fit in 128 bits */
+  if (s <= 44 && e + s > -128)
+  {
+    const unsigned __int128 n = (s <= 27) ? (unsigned __int128)m * pow5[s]
+                                          : (unsigned __int128)m * pow5[27] * pow5[s - 27];
+    const int shift = e + s;
+
+    if (shift >= 0)
+    {
+      *q = (unsigned long long)(n << shift);
+      *half = -1;
+      return;
+    }
+
+    const unsigned __int128 rem = n & (((unsigned __int128)1 << -shift) - 1);
+    const unsigned __int128 halfway = (unsigned __int128)1 << (-shift - 1);
+
+    *q = (unsigned long long)(n >> -shift);
+    *half = (rem > halfway) - (rem < halfway);
+    return;
+  }
+
+  unsigned long long n[3] = {m, 0, 0}; /* m 5^s, least significant limb first */
+
+  for (int left = s; left > 0; left -= 27)
+  {
+    unsigned long long carry = 0;
+
+    for (int ll = 0; ll < 3; ll++)
+    {
+      const unsigned __int128 product = (unsigned __int128)n[ll] * pow5[left < 27 ? left : 27] + carry;
+
+      n[ll] = (unsigned long long)product;
+      carry = (unsigned long long)(product >> 64);
+    }
+  }
+
+  const int shift = e + s;
+
+  if (shift >= 0)
+  {
+    *q = n[0] << shift;
+    *half = -1;
+    return;
+  }
+
+  /* q is bits r.. of n, and bit r - 1 and those below it decide the rounding */
+  const int r = -shift;
+
+  *q = 0;
+  for (int bb = 0; bb < 64 && r + bb < 192; bb++)
+    *q |= ((n[(r + bb) / 64] >> ((r + bb) % 64)) & 1ull) << bb;
+
+  if (r > 192 || !((n[(r - 1) / 64] >> ((r - 1) % 64)) & 1ull))
+  {
+    *half = -1;
+    return;
+  }
+
+  *half = 0;
+  for (int ll = 0; ll <= (r - 2) / 64 && r >= 2; ll++)
+  {
+    const int top = (ll == (r - 2) / 64) ? (r - 2) % 64 : 63; /* highest bit of this limb below the half bit */
+    const unsigned long long mask = (top == 63) ? ~0ull : ((1ull << (top + 1)) - 1);
+
+    if (n[ll] & mask)
+      *half = 1;
+  }
+}
+
+/* printf("%d"), returns the no. of chars */
+int format_int(char *out, int value)
+{
+  char digits[10]; /* in reverse */
+  int nd = 0;      /* no. of digits */
+  char *p = out;   /* next char */
+  unsigned int u = (unsigned int)value;
+
+  if (value < 0)
+    u = 0u - u;
+
+  do
+  {
+    digits[nd++] = (char)('0' + u % 10);
+    u /= 10;
+  } while (u);
+
+  if (value < 0)
+    *p++ = '-';
+  while (nd)
+    *p++ = digits[--nd];
+
+  return (int)(p - out);
+}
+
+int halo_init(const t_param params, t_halo *halo, int nranks, t_speeds *cells)
+{
+  if (nranks < 2 || nranks > params.ny)
+    die("--halo16 needs between 2 and ny ranks", __LINE__, __FILE__);
+
+  halo->nranks = nranks;
+  halo->first = (int *)malloc(sizeof(int) * (nranks + 1));
+  halo->message = (short *)malloc(sizeof(short) * 2 * nranks * params.nx);
+  halo->ref_av_vels = (float *)malloc(sizeof(float) * params.maxIters);
+
+  if (halo->first == NULL || halo->message == NULL || halo->ref_av_vels == NULL)
+    die("cannot allocate memory for the halo exchange", __LINE__, __FILE__);
+
+  /* equal blocks of rows, as a 1D decomposition in y would give */
+  for (int rr = 0; rr <= nranks; rr++)
+    halo->first[rr] = (int)((long)params.ny * rr / nranks);
+
+  halo->max_error = halo->sum_sq = 0.0;
+  halo->nvalues = 0;
+
+  /* each boundary sends a message each way: three streams of nx values, and a scale per stream */
+  halo->bytes16 = (size_t)2 * nranks * 3 * (sizeof(short) * params.nx + sizeof(float));
+  halo->bytes32 = (size_t)2 * nranks * 3 * sizeof(float) * params.nx;
+
+  /* the full precision run starts from the same state */
+  halo->ref_cells = alloc_speeds(&params, "ref_cells");
+  halo->ref_tmp_cells = alloc_speeds(&params, "ref_tmp_cells");
+  copy_speeds(params, halo->ref_cells, cells);
+
+  return EXIT_SUCCESS;
+}
+
+/*
+** Send the populations that stream across each rank boundary through
+** the 16 bit encoding, in place: upwards s2, s5 and s6 of the top row
+** of a rank, downwards s4, s7 and s8 of the bottom row of the next,
+** with the top and bottom ranks neighbours as the grid is periodic.
+** Nothing else reads these populations before they cross, so the
+** decoded values are exactly what the receiving rank would use.
+*/
+void halo_exchange(const t_param params, t_halo *halo, t_speeds *cells)
+{
+  const float w1 = 1.f / 9.f, w2 = 1.f / 36.f; /* weights of the axis and diagonal speeds */
+  double max_error = 0.0, sum_sq = 0.0;         /* of this exchange, relative to the density */
+
+#pragma omp parallel for reduction(max : max_error) reduction(+ : sum_sq)
+  for (int mm = 0; mm < 2 * halo->nranks; mm++)
+  {
+    const int rank = mm / 2;
+    const int up = (mm % 2 == 0);
+    const int boundary = halo->first[rank + 1] % params.ny; /* first row above the boundary */
+    const int jj = up ? (boundary + params.ny - 1) % params.ny : boundary;
+    float *const streams[3] = {up ? cells->s2 : cells->s4, up ? cells->s5 : cells->s7, up ? cells->s6 : cells->s8};
+    const float weights[3] = {w1, w2, w2};
+    short *message = &halo->message[mm * params.nx];
+
+    for (int ss = 0; ss < 3; ss++)
+    {
+      float *f = &streams[ss][jj * params.nx];
+      const float eq = weights[ss] * params.density; /* the rest equilibrium the deviations are taken from */
+      float max_dev = 0.f;
+
+      for (int ii = 0; ii < params.nx; ii++)
+        max_dev = fmaxf(max_dev, fabsf(f[ii] - eq));
+
+      /* one scale per stream puts its largest deviation at the end of the 16 bit range */
+      const float scale = max_dev / 32767.f;
+      const float inv_scale = (scale > 0.f) ? 1.f / scale : 0.f;
+
+      for (int ii = 0; ii < params.nx; ii++)
+      {
+        long q = lrintf((f[ii] - eq) * inv_scale);
+
+        message[ii] = (short)((q > 32767) ? 32767 : ((q < -32767) ? -32767 : q));
+      }
+
+      /* the receiving side */
+      for (int ii = 0; ii < params.nx; ii++)
+      {
+        const float decoded = eq + message[ii] * scale;
+        const double error = fabs((double)decoded - f[ii]) / params.density;
+
+        max_error = (error > max_error) ? error : max_error;
+        sum_sq += error * error;
+        f[ii] = decoded;
+      }
+    }
+  }
+
+  halo->max_error = (max_error > halo->max_error) ? max_error : halo->max_error;
+  halo->sum_sq += sum_sq;
+  halo->nvalues += (long)2 * halo->nranks * 3 * params.nx;
+}
+
+/* timestep tt of the run alongside, whose halo populations travel as floats */
+void halo_reference_step(const t_param params, t_halo *halo, const t_kernel *kernel, int *obstacles, int tt)
+{
+  accelerate_flow(params, halo->ref_cells, obstacles);
+  halo->ref_av_vels[tt] = kernel->fn(params, halo->ref_cells, halo->ref_tmp_cells, obstacles);
+
+  t_speeds *tmp = halo->ref_cells;
+  halo->ref_cells = halo->ref_tmp_cells;
+  halo->ref_tmp_cells = tmp;
+}
+
+/* message volume, encoding error, and how far the run drifted from the full precision one */
+void report_halo(const t_param params, t_halo *halo, t_speeds *cells, int *obstacles, float *av_vels)
+{
+  float *row = (float *)malloc(sizeof(float) * 4 * params.nx);     /* u_x, u_y, u and pressure of one row */
+  float *ref_row = (float *)malloc(sizeof(float) * 4 * params.nx); /* ... of the full precision run */
+  double max_du = 0.0, max_u = 0.0, max_dav = 0.0;
+
+  if (row == NULL || ref_row == NULL)
+    die("cannot allocate memory for the halo report", __LINE__, __FILE__);
+
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    row_values(params, cells, obstacles, jj, row, row + params.nx, row + 2 * params.nx, row + 3 * params.nx);
+    row_values(params, halo->ref_cells, obstacles, jj, ref_row, ref_row + params.nx, ref_row + 2 * params.nx,
+               ref_row + 3 * params.nx);
+
+    for (int ii = 0; ii < params.nx; ii++)
+    {
+      max_du = fmax(max_du, fabs((double)row[2 * params.nx + ii] - ref_row[2 * params.nx + ii]));
+      max_u = fmax(max_u, ref_row[2 * params.nx + ii]);
+    }
+  }
+
+  for (int tt = 0; tt < params.maxIters; tt++)
+  {
+    if (halo->ref_av_vels[tt] != 0.f)
+      max_dav = fmax(max_dav, fabs((double)av_vels[tt] - halo->ref_av_vels[tt]) / fabs(halo->ref_av_vels[tt]));
+  }
+
+  printf("Halo exchange:\t\t\t%d ranks, %.1f KiB per timestep in 16 bit vs %.1f KiB as floats (%.2fx)\n",
+         halo->nranks, halo->bytes16 / 1024.0, halo->bytes32 / 1024.0, (double)halo->bytes16 / halo->bytes32);
+  printf("Halo encoding error:\t\tmax %.3e, rms %.3e (relative to density)\n", halo->max_error,
+         halo->nvalues ? sqrt(halo->sum_sq / halo->nvalues) : 0.0);
+  printf("Halo drift vs float exchange:\t|u| max %.3e (relative to the largest |u|), av. velocity max %.3e (relative)\n",
+         max_u > 0.0 ? max_du / max_u : max_du, max_dav);
+
+  free(row);
+  free(ref_row);
+}
+
+void halo_free(t_halo *halo)
+{
+  free(halo->first);
+  free(halo->message);
+  free(halo->ref_av_vels);
+  free_speeds(&halo->ref_cells);
+  free_speeds(&halo->ref_tmp_cells);
+}
+
+/*
+** Start the free surface run: obstacles stay solid, the cells below
+** height x ny and left of width x nx are liquid and the rest is gas.
+** Liquid cells next to gas form the interface, half full.
+*/
+int fs_init(const t_param params, t_free_surface *fs, int *obstacles, float height, float width)
+{
+  const int ncells = params.nx * params.ny;
+
+  fs->type = (unsigned char *)malloc(ncells);
+  fs->pending = (unsigned char *)calloc(ncells, 1);
+  fs->mass = (float *)malloc(sizeof(float) * ncells);
+  fs->fill = (float *)malloc(sizeof(float) * ncells);
+  fs->rho = (float *)malloc(sizeof(float) * ncells);
+  fs->active = (int *)malloc(sizeof(int) * ncells);
+  fs->filled = (int *)malloc(sizeof(int) * ncells);
+  fs->emptied = (int *)malloc(sizeof(int) * ncells);
+
+  if (fs->type == NULL || fs->pending == NULL || fs->mass == NULL || fs->fill == NULL || fs->rho == NULL ||
+      fs->active == NULL || fs->filled == NULL || fs->emptied == NULL)
+    die("cannot allocate memory for the free surface", __LINE__, __FILE__);
+
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    for (int ii = 0; ii < params.nx; ii++)
+    {
+      const int liquid = (jj < height * params.ny && ii < width * params.nx);
+
+      fs->type[ii + jj * params.nx] = obstacles[ii + jj * params.nx] ? FS_OBSTACLE : (liquid ? FS_FLUID : FS_GAS);
+    }
+  }
+
+  fs->nactive = 0;
+  fs->initial_mass = 0.0;
+
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    for (int ii = 0; ii < params.nx; ii++)
+    {
+      const int idx = ii + jj * params.nx;
+
+      if (fs->type[idx] == FS_FLUID)
+      {
+        for (int kk = 1; kk < NSPEEDS; kk++)
+        {
+          const int x = (ii + lat_cx[kk] + params.nx) % params.nx;
+          const int y = (jj + lat_cy[kk] + params.ny) % params.ny;
+
+          if (fs->type[x + y * params.nx] == FS_GAS)
+            fs->type[idx] = FS_INTERFACE;
+        }
+      }
+
+      fs->fill[idx] = (fs->type[idx] == FS_FLUID) ? 1.f : ((fs->type[idx] == FS_INTERFACE) ? 0.5f : 0.f);
+      fs->mass[idx] = fs->fill[idx] * params.density;
+      fs->rho[idx] = params.density;
+
+      if (fs->type[idx] == FS_FLUID || fs->type[idx] == FS_INTERFACE)
+      {
+        fs->active[fs->nactive++] = idx;
+        fs->initial_mass += fs->mass[idx];
+      }
+    }
+  }
+
+  if (fs->nactive == 0)
+    die("--free-surface and --free-surface-width leave no liquid in the open cells of the grid", __LINE__, __FILE__);
+
+  fs->lost_mass = 0.0;
+  fs->sum_active = 0.0;
+  fs->conversions = 0;
+
+  return EXIT_SUCCESS;
+}
+
+/* the equilibrium of speed kk at density rho and velocity (u_x, u_y) */
+float fs_equilibrium(int kk, float rho, float u_x, float u_y)
+{
+  const float cu = lat_cx[kk] * u_x + lat_cy[kk] * u_y;
+
+  return (float)lat_w[kk] * rho * (1.f + 3.f * cu + 4.5f * cu * cu - 1.5f * (u_x * u_x + u_y * u_y));
+}
+
+/*
+** Splashes run a free surface well past the speeds a bulk flow sees;
+** the equilibria take the velocity scaled down to at most FSUMAX.
+*/
+void fs_limit(float *u_x, float *u_y)
+{
+  const float speed = sqrtf(*u_x * *u_x + *u_y * *u_y);
+
+  if (speed > FSUMAX)
+  {
+    *u_x *= FSUMAX / speed;
+    *u_y *= FSUMAX / speed;
+  }
+}
+
+/*
+** One free surface timestep over the active (fluid and interface)
+** cells only. Each pulls its populations: from an obstacle they bounce
+** back, from gas they are reconstructed from the equilibrium at the
+** reference density, f_i = f_i^eq + f_opp^eq - f_opp. Interface cells
+** exchange mass with their liquid neighbours in proportion to the
+** mean fill. BGK collision follows, with gravity along -y. Interface
+** cells that overfill or empty are listed, and fs_convert() changes
+** their type. Returns the av. velocity of the liquid.
+*/
+float timestep_free_surface(const t_param params, t_free_surface *fs, t_speeds *cells, t_speeds *tmp_cells)
+{
+  float *const f[NSPEEDS] = {cells->s0, cells->s1, cells->s2, cells->s3, cells->s4,
+                             cells->s5, cells->s6, cells->s7, cells->s8};
+  float *const f_new[NSPEEDS] = {tmp_cells->s0, tmp_cells->s1, tmp_cells->s2, tmp_cells->s3, tmp_cells->s4,
+                                 tmp_cells->s5, tmp_cells->s6, tmp_cells->s7, tmp_cells->s8};
+  const float gravity = params.accel; /* along -y */
+  float tot_u = 0.f;                  /* accumulated magnitudes of velocity of the liquid */
+
+  fs->nfilled = fs->nemptied = 0;
+
+#pragma omp parallel for reduction(+ : tot_u)
+  for (int aa = 0; aa < fs->nactive; aa++)
+  {
+    const int idx = fs->active[aa];
+    const int ii = idx % params.nx, jj = idx / params.nx;
+    const int interface = (fs->type[idx] == FS_INTERFACE);
+    float fin[NSPEEDS]; /* the populations after streaming */
+    float rho_old = 0.f, ux_old = 0.f, uy_old = 0.f;
+    float dm = 0.f; /* mass exchanged with the neighbours */
+
+    /* the velocity the reconstruction from gas uses: this cell's, before streaming */
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      rho_old += f[kk][idx];
+      ux_old += lat_cx[kk] * f[kk][idx];
+      uy_old += lat_cy[kk] * f[kk][idx];
+    }
+    ux_old /= rho_old;
+    uy_old /= rho_old;
+    fs_limit(&ux_old, &uy_old);
+
+    fin[0] = f[0][idx];
+
+    for (int kk = 1; kk < NSPEEDS; kk++)
+    {
+      const int x = (ii - lat_cx[kk] + params.nx) % params.nx;
+      const int y = (jj - lat_cy[kk] + params.ny) % params.ny;
+      const int src = x + y * params.nx;
+      const int opp = lat_opp[kk];
+
+      if (fs->type[src] == FS_OBSTACLE)
+        fin[kk] = f[opp][idx];
+      else if (fs->type[src] == FS_GAS)
+        fin[kk] = fs_equilibrium(kk, params.density, ux_old, uy_old) +
+                  fs_equilibrium(opp, params.density, ux_old, uy_old) - f[opp][idx];
+      else
+      {
+        fin[kk] = f[kk][src];
+
+        /* in from the neighbour, less out to it; both sides see the same exchange */
+        if (interface)
+          dm += (fs->type[src] == FS_FLUID ? 1.f : 0.5f * (fs->fill[src] + fs->fill[idx])) *
+                (f[kk][src] - f[opp][idx]);
+      }
+    }
+
+    float rho = 0.f, u_x = 0.f, u_y = 0.f;
+
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      rho += fin[kk];
+      u_x += lat_cx[kk] * fin[kk];
+      u_y += lat_cy[kk] * fin[kk];
+    }
+    u_x /= rho;
+    u_y /= rho;
+    fs_limit(&u_x, &u_y);
+
+    for (int kk = 0; kk < NSPEEDS; kk++)
+      f_new[kk][idx] = fin[kk] + params.omega * (fs_equilibrium(kk, rho, u_x, u_y) - fin[kk]) -
+                       3.f * (float)lat_w[kk] * rho * lat_cy[kk] * gravity;
+
+    fs->rho[idx] = rho;
+    tot_u += sqrtf(u_x * u_x + u_y * u_y);
+
+    if (!interface)
+      fs->mass[idx] = rho;
+    else
+    {
+      int slot; /* place in a conversion list */
+
+      fs->mass[idx] += dm;
+
+      if (fs->mass[idx] > (1.f + FSKAPPA) * rho)
+      {
+#pragma omp atomic capture
+        slot = fs->nfilled++;
+        fs->filled[slot] = idx;
+        fs->pending[idx] = FS_FILLED;
+      }
+      else if (fs->mass[idx] < -FSKAPPA * rho)
+      {
+#pragma omp atomic capture
+        slot = fs->nemptied++;
+        fs->emptied[slot] = idx;
+        fs->pending[idx] = FS_EMPTIED;
+      }
+    }
+  }
+
+  const int updated = fs->nactive; /* the cells tot_u is over, before the conversions change the list */
+
+  fs->sum_active += updated;
+  fs_convert(params, fs, tmp_cells);
+
+  return (updated > 0) ? tot_u / updated : 0.f;
+}
+
+/*
+** Apply the conversion lists of a timestep, touching only the listed
+** cells and their neighbours: gas next to a filled cell becomes
+** interface at the mean equilibrium of its liquid neighbours, and
+** fluid next to an emptied cell becomes interface. The filled and
+** emptied cells then hand their excess mass to the interface cells
+** around them, and the active list drops the new gas cells.
+*/
+void fs_convert(const t_param params, t_free_surface *fs, t_speeds *cells)
+{
+  float *const f[NSPEEDS] = {cells->s0, cells->s1, cells->s2, cells->s3, cells->s4,
+                             cells->s5, cells->s6, cells->s7, cells->s8};
+
+  for (int ll = 0; ll < fs->nfilled; ll++)
+  {
+    const int idx = fs->filled[ll];
+    const int ii = idx % params.nx, jj = idx / params.nx;
+
+    for (int kk = 1; kk < NSPEEDS; kk++)
+    {
+      const int nb = (ii + lat_cx[kk] + params.nx) % params.nx + (jj + lat_cy[kk] + params.ny) % params.ny * params.nx;
+
+      /* an interface cell next to a filled one stays interface */
+      if (fs->pending[nb] == FS_EMPTIED)
+        fs->pending[nb] = 0;
+
+      if (fs->type[nb] != FS_GAS)
+        continue;
+
+      float rho = 0.f, u_x = 0.f, u_y = 0.f;
+      int n = 0; /* liquid neighbours of the new interface cell */
+
+      for (int mm = 1; mm < NSPEEDS; mm++)
+      {
+        const int src = (nb % params.nx + lat_cx[mm] + params.nx) % params.nx +
+                        (nb / params.nx + lat_cy[mm] + params.ny) % params.ny * params.nx;
+
+        if (fs->type[src] == FS_FLUID || fs->type[src] == FS_INTERFACE)
+        {
+          float r = 0.f, jx = 0.f, jy = 0.f;
+
+          for (int ss = 0; ss < NSPEEDS; ss++)
+          {
+            r += f[ss][src];
+            jx += lat_cx[ss] * f[ss][src];
+            jy += lat_cy[ss] * f[ss][src];
+          }
+
+          rho += r;
+          u_x += jx / r;
+          u_y += jy / r;
+          n++;
+        }
+      }
+
+      rho /= n;
+      u_x /= n;
+      u_y /= n;
+
+      for (int ss = 0; ss < NSPEEDS; ss++)
+        f[ss][nb] = fs_equilibrium(ss, rho, u_x, u_y);
+
+      fs->type[nb] = FS_INTERFACE;
+      fs->mass[nb] = 0.f;
+      fs->rho[nb] = rho;
+      fs->fill[nb] = 0.f;
+      fs->active[fs->nactive++] = nb;
+    }
+  }
+
+  for (int ll = 0; ll < fs->nemptied; ll++)
+  {
+    const int idx = fs->emptied[ll];
+    const int ii = idx % params.nx, jj = idx / params.nx;
+
+    if (fs->pending[idx] != FS_EMPTIED)
+      continue;
+
+    for (int kk = 1; kk < NSPEEDS; kk++)
+    {
+      const int nb = (ii + lat_cx[kk] + params.nx) % params.nx + (jj + lat_cy[kk] + params.ny) % params.ny * params.nx;
+
+      if (fs->type[nb] == FS_FLUID)
+        fs->type[nb] = FS_INTERFACE;
+    }
+  }
+
+  /* the new types first, so that the excess mass only goes to what is interface now */
+  for (int ll = 0; ll < fs->nfilled; ll++)
+    fs->type[fs->filled[ll]] = FS_FLUID;
+
+  for (int ll = 0; ll < fs->nemptied; ll++)
+  {
+    if (fs->pending[fs->emptied[ll]] == FS_EMPTIED)
+      fs->type[fs->emptied[ll]] = FS_GAS;
+  }
+
+  for (int pass = 0; pass < 2; pass++)
+  {
+    const int *list = pass ? fs->emptied : fs->filled;
+    const int nlist = pass ? fs->nemptied : fs->nfilled;
+
+    for (int ll = 0; ll < nlist; ll++)
+    {
+      const int idx = list[ll];
+      const int ii = idx % params.nx, jj = idx / params.nx;
+
+      /* an emptied cell kept as interface by a filled neighbour */
+      if (fs->pending[idx] == 0)
+        continue;
+
+      const float excess = pass ? fs->mass[idx] : fs->mass[idx] - fs->rho[idx];
+      int n = 0; /* interface neighbours that share it */
+
+      fs->mass[idx] -= excess;
+      fs->pending[idx] = 0;
+      fs->conversions++;
+
+      for (int kk = 1; kk < NSPEEDS; kk++)
+      {
+        const int nb = (ii + lat_cx[kk] + params.nx) % params.nx + (jj + lat_cy[kk] + params.ny) % params.ny * params.nx;
+        n += (fs->type[nb] == FS_INTERFACE);
+      }
+
+      if (n == 0)
+      {
+        fs->lost_mass += excess;
+        continue;
+      }
+
+      for (int kk = 1; kk < NSPEEDS; kk++)
+      {
+        const int nb = (ii + lat_cx[kk] + params.nx) % params.nx + (jj + lat_cy[kk] + params.ny) % params.ny * params.nx;
+
+        if (fs->type[nb] == FS_INTERFACE)
+          fs->mass[nb] += excess / n;
+      }
+    }
+  }
+
+  for (int ll = 0; ll < fs->nemptied; ll++)
+    fs->pending[fs->emptied[ll]] = 0;
+
+  /* drop the gas, and refresh the fill of what is left */
+  int kept = 0;
+
+  for (int aa = 0; aa < fs->nactive; aa++)
+  {
+    const int idx = fs->active[aa];
+
+    if (fs->type[idx] == FS_GAS)
+    {
+      fs->fill[idx] = 0.f;
+      continue;
+    }
+
+    fs->fill[idx] = (fs->type[idx] == FS_FLUID) ? 1.f : fs->mass[idx] / fs->rho[idx];
+    fs->active[kept++] = idx;
+  }
+
+  fs->nactive = kept;
+}
+
+/* the liquid mass, summed over the active cells */
+double fs_mass(t_free_surface *fs)
+{
+  double total = 0.0;
+
+#pragma omp parallel for reduction(+ : total)
+  for (int aa = 0; aa < fs->nactive; aa++)
+    total += fs->mass[fs->active[aa]];
+
+  return total;
+}
+
+/* mark the gas cells 2 in the obstacle mask, so that the output and the Reynolds number skip them */
+void fs_mask(const t_param params, t_free_surface *fs, int *obstacles)
+{
+#pragma omp parallel for
+  for (int idx = 0; idx < params.nx * params.ny; idx++)
+  {
+    if (fs->type[idx] == FS_GAS)
+      obstacles[idx] = 2;
+  }
+}
+
+void fs_free(t_free_surface *fs)
+{
+  free(fs->type);
+  free(fs->pending);
+  free(fs->mass);
+  free(fs->fill);
+  free(fs->rho);
+  free(fs->active);
+  free(fs->filled);
+  free(fs->emptied);
+}
+
+/*
+** Build the sponge from a list of edge:width entries, e.g.
+** "east:64,north:8". A cell d cells in from an edge of a sponge of
+** width w is pulled towards the target equilibrium with strength
+** strength (1 - d / w)^2, the largest of any sponge it lies in;
+** obstacles are left alone. The cells are listed once, so
+** apply_sponge() visits only the sponge rows and columns.
+*/
+int sponge_init(const t_param params, t_sponge *sponge, const char *spec, float strength, float velocity,
+                int *obstacles)
+{
+  static const char *edges[4] = {"east", "west", "north", "south"};
+  int width[4] = {0, 0, 0, 0}; /* of each edge's sponge, 0 for none */
+  char message[1024];
+
+  while (*spec)
+  {
+    int edge = -1;
+
+    for (int ee = 0; ee < 4; ee++)
+    {
+      if (!strncmp(spec, edges[ee], strlen(edges[ee])) && spec[strlen(edges[ee])] == ':')
+        edge = ee;
+    }
+
+    char *next;
+    const long value = (edge < 0) ? 0 : strtol(spec + strlen(edges[edge]) + 1, &next, 10);
+    const int across = (edge < 2) ? params.nx : params.ny; /* cells the sponge can span */
+
+    if (value <= 0 || value > across / 2)
+    {
+      sprintf(message, "--sponge expects edge:width entries, east, west, north or south, of 1 to half the grid: %s",
+              spec);
+      die(message, __LINE__, __FILE__);
+    }
+
+    width[edge] = (int)value;
+    spec = (*next == ',') ? next + 1 : next;
+  }
+
+  if (strength <= 0.f || strength > 1.f)
+    die("--sponge-strength expects a blend between 0 and 1", __LINE__, __FILE__);
+
+  sponge->cell = (int *)malloc(sizeof(int) * params.nx * params.ny);
+  sponge->sigma = (float *)malloc(sizeof(float) * params.nx * params.ny);
+
+  if (sponge->cell == NULL || sponge->sigma == NULL)
+    die("cannot allocate memory for the sponge", __LINE__, __FILE__);
+
+  sponge->ncells = 0;
+
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    for (int ii = 0; ii < params.nx; ii++)
+    {
+      /* cells in from each edge */
+      const int depth[4] = {params.nx - 1 - ii, ii, params.ny - 1 - jj, jj};
+      float sigma = 0.f;
+
+      for (int ee = 0; ee < 4; ee++)
+      {
+        if (depth[ee] < width[ee])
+        {
+          const float ramp = 1.f - (float)depth[ee] / width[ee];
+          sigma = fmaxf(sigma, strength * ramp * ramp);
+        }
+      }
+
+      if (sigma > 0.f && !obstacles[ii + jj * params.nx])
+      {
+        sponge->cell[sponge->ncells] = ii + jj * params.nx;
+        sponge->sigma[sponge->ncells] = sigma;
+        sponge->ncells++;
+      }
+    }
+  }
+
+  /* the target is the same everywhere: reference density, flowing east at velocity */
+  for (int kk = 0; kk < NSPEEDS; kk++)
+  {
+    const float cu = lat_cx[kk] * velocity;
+    sponge->target[kk] = (float)lat_w[kk] * params.density * (1.f + 3.f * cu + 4.5f * cu * cu - 1.5f * velocity * velocity);
+  }
+
+  return sponge->ncells;
+}
+
+/* blend the sponge cells of the new lattice towards the target equilibrium, after the kernel */
+void apply_sponge(t_sponge *sponge, t_speeds *cells)
+{
+  float *const f[NSPEEDS] = {cells->s0, cells->s1, cells->s2, cells->s3, cells->s4,
+                             cells->s5, cells->s6, cells->s7, cells->s8};
+
+#pragma omp parallel for
+  for (int ss = 0; ss < sponge->ncells; ss++)
+  {
+    const int idx = sponge->cell[ss];
+    const float sigma = sponge->sigma[ss];
+
+    for (int kk = 0; kk < NSPEEDS; kk++)
+      f[kk][idx] += sigma * (sponge->target[kk] - f[kk][idx]);
+  }
+}
+
+void sponge_free(t_sponge *sponge)
+{
+  free(sponge->cell);
+  free(sponge->sigma);
+}
+
+const t_kernel *find_kernel(const char *name)
+{
+  char message[1024]; /* message buffer */
+
+  for (int kk = 0; kk < NKERNELS; kk++)
+  {
+    if (!strcmp(kernels[kk].name, name))
+      return &kernels[kk];
+  }
+
+  sprintf(message, "unknown kernel '%s' (run with no arguments for the list)", name);
+  die(message, __LINE__, __FILE__);
+
+  return NULL;
+}
+
+int selftest(void)
+{
+  /* small geometries, including odd and non-square sizes, and how much of each is solid */
+  const int sizes[][2] = {{8, 8}, {17, 9}, {31, 64}, {64, 64}, {128, 16}, {50, 37}};
+  const float solid[] = {0.f, 0.1f, 0.25f, 0.4f, 0.15f, 0.3f};
+  const int ngeometries = sizeof(sizes) / sizeof(sizes[0]);
+  const int nsteps = 25;            /* timesteps compared per geometry */
+  const float tolerance = 1e-5f;    /* on speeds, relative to the density */
+  const float av_tolerance = 1e-4f; /* on av. velocities, relative, as their reductions run in a different order */
+  unsigned int seed = 12345u;       /* fixed, so that failures are reproducible */
+  int ref_kernel = 0;               /* index of "reference" in kernels[] */
+  int failures = 0;                 /* no. of kernel/geometry pairs out of tolerance */
+
+  while (strcmp(kernels[ref_kernel].name, "reference"))
+    ref_kernel++;
+
+  printf("==selftest==\n");
+
+  for (int gg = 0; gg < ngeometries; gg++)
+  {
+    t_param params;
+    params.nx = sizes[gg][0];
+    params.ny = sizes[gg][1];
+    params.maxIters = nsteps;
+    params.reynolds_dim = params.nx;
+    params.density = 0.1f;
+    params.accel = 0.005f;
+    params.omega = 0.6f + 1.3f * rand_uniform(&seed);
+
+    const int ncells = params.nx * params.ny;
+    int *obstacles = malloc(sizeof(int) * ncells);
+    float *start = malloc(sizeof(float) * NSPEEDS * ncells);
+    float *expected = malloc(sizeof(float) * nsteps);
+
+    if (obstacles == NULL || start == NULL || expected == NULL)
+      die("cannot allocate memory for the selftest", __LINE__, __FILE__);
+
+    /* random obstacles, and speeds perturbed around the weights so that the flow is not trivial */
+    const float weights[NSPEEDS] = {4.f / 9.f, 1.f / 9.f, 1.f / 9.f, 1.f / 9.f, 1.f / 9.f,
+                                    1.f / 36.f, 1.f / 36.f, 1.f / 36.f, 1.f / 36.f};
+
+    for (int ii = 0; ii < ncells; ii++)
+    {
+      obstacles[ii] = rand_uniform(&seed) < solid[gg];
+
+      for (int ss = 0; ss < NSPEEDS; ss++)
+        start[ss * ncells + ii] = params.density * weights[ss] * (0.8f + 0.4f * rand_uniform(&seed));
+    }
+
+    printf("geometry %d: %d x %d, %.0f%% solid, omega %.3f\n", gg, params.nx, params.ny, 100.f * solid[gg], params.omega);
+
+    /* the reference runs first, so the other kernels have something to compare with */
+    t_speeds *ref = NULL;
+
+    for (int order = 0; order < NKERNELS; order++)
+    {
+      const int kk = (order == 0) ? ref_kernel : (order <= ref_kernel ? order - 1 : order);
+      t_speeds *cells = alloc_speeds(&params, "cells");
+      t_speeds *tmp_cells = alloc_speeds(&params, "tmp_cells");
+      float *const cell_speeds[NSPEEDS] = {cells->s0, cells->s1, cells->s2, cells->s3, cells->s4,
+                                           cells->s5, cells->s6, cells->s7, cells->s8};
+      float *const tmp_speeds[NSPEEDS] = {tmp_cells->s0, tmp_cells->s1, tmp_cells->s2, tmp_cells->s3, tmp_cells->s4,
+                                          tmp_cells->s5, tmp_cells->s6, tmp_cells->s7, tmp_cells->s8};
+
+      for (int ss = 0; ss < NSPEEDS; ss++)
+      {
+        memcpy(cell_speeds[ss], &start[ss * ncells], sizeof(float) * ncells);
+        memcpy(tmp_speeds[ss], &start[ss * ncells], sizeof(float) * ncells);
+      }
+
+      float max_dav = 0.f; /* largest relative difference in av. velocity */
+
+      for (int tt = 0; tt < nsteps; tt++)
+      {
+        accelerate_flow(params, cells, obstacles);
+        const float av_vel = kernels[kk].fn(params, cells, tmp_cells, obstacles);
+        t_speeds *tmp = cells;
+        cells = tmp_cells;
+        tmp_cells = tmp;
+
+        if (order == 0)
+          expected[tt] = av_vel;
+        else if (!(fabsf(av_vel - expected[tt]) <= max_dav * fabsf(expected[tt])))
+          max_dav = fabsf(av_vel - expected[tt]) / fabsf(expected[tt]);
+      }
+
+      if (order == 0)
+      {
+        ref = cells;
+        free_speeds(&tmp_cells);
+        continue;
+      }
+
+      /* the centre speed of an obstacle is never updated, so it is not compared */
+      float max_df = 0.f; /* largest difference in any speed, relative to the density */
+      float *const got[NSPEEDS] = {cells->s0, cells->s1, cells->s2, cells->s3, cells->s4,
+                                   cells->s5, cells->s6, cells->s7, cells->s8};
+      float *const want[NSPEEDS] = {ref->s0, ref->s1, ref->s2, ref->s3, ref->s4, ref->s5, ref->s6, ref->s7, ref->s8};
+
+      for (int ss = 0; ss < NSPEEDS; ss++)
+      {
+        for (int ii = 0; ii < ncells; ii++)
+        {
+          /* written so that a NaN counts as a failure */
+          if ((ss > 0 || !obstacles[ii]) && !(fabsf(got[ss][ii] - want[ss][ii]) <= max_df * params.density))
+            max_df = fabsf(got[ss][ii] - want[ss][ii]) / params.density;
+        }
+      }
+
+      const int ok = (max_df <= tolerance && max_dav <= av_tolerance);
+      printf("  %-10s max speed error %.3e, max av. velocity error %.3e: %s\n",
+             kernels[kk].name, max_df, max_dav, ok ? "ok" : "FAILED");
+      failures += !ok;
+
+      free_speeds(&cells);
+      free_speeds(&tmp_cells);
+    }
+
+    /* --moments runs its own lattice, started from the moments of the same start */
+    failures += selftest_moments(params, obstacles, start, nsteps, tolerance, av_tolerance);
+
+    /* --sparse needs whole tiles, so it runs the geometry's size and solid fraction rounded up to them */
+    failures += selftest_tiles(params, solid[gg], 54321u + gg, nsteps, tolerance, av_tolerance);
+
+    free_speeds(&ref);
+    free(obstacles);
+    free(start);
+    free(expected);
+  }
+
+  /* the generated kernels of every lattice must conserve mass and momentum */
+  failures += selftest_lattices(nsteps, 1e-5);
+
+  /* the text output formatter counts as one more */
+  failures += (format_check() > 0);
+
+  printf("%s: %d failure(s)\n", failures ? "FAILED" : "passed", failures);
+
+  return failures;
+}
+
+int selftest_moments(const t_param params, int *obstacles, const float *start, int nsteps, float tolerance,
+                     float av_tolerance)
+{
+  const int ncells = params.nx * params.ny;
+  int failures = 0;
+
+  /*
+  ** At omega 1 the collision leaves no part of a population that six
+  ** moments cannot hold, and the two schemes agree to rounding; at any
+  ** other omega BGK keeps 1 - omega of the higher (ghost) moments that
+  ** the regularised scheme drops, so that comparison is looser.
+  */
+  const float omegas[2] = {1.f, params.omega};
+  const float tolerances[2] = {tolerance, MOMENTTOL};
+  const float av_tolerances[2] = {av_tolerance, MOMENTTOL};
+
+  for (int oo = 0; oo < 2; oo++)
+  {
+    t_param run = params;
+    run.omega = omegas[oo];
+
+    t_moments *m_cells = alloc_moments(&run, obstacles, "selftest cells");
+    t_moments *m_tmp_cells = alloc_moments(&run, obstacles, "selftest tmp_cells");
+    t_speeds *cells = alloc_speeds(&run, "cells");
+    t_speeds *tmp_cells = alloc_speeds(&run, "tmp_cells");
+    float *expected = malloc(sizeof(float) * nsteps);
+
+    if (expected == NULL)
+      die("cannot allocate memory for the selftest", __LINE__, __FILE__);
+
+    /* the moments of the random start, and the populations of solid cells as they are */
+    for (int jj = 0, kk = 0; jj < run.ny; jj++)
+    {
+      for (int ii = jj * run.nx; ii < (jj + 1) * run.nx; ii++)
+      {
+        float m[NMOMENTS] = {0.f};
+
+        for (int ss = 0; ss < NSPEEDS; ss++)
+        {
+          const float f = start[ss * ncells + ii];
+          m[0] += f;
+          m[1] += lat_cx[ss] * f;
+          m[2] += lat_cy[ss] * f;
+          m[3] += lat_cx[ss] * lat_cx[ss] * f;
+          m[4] += lat_cy[ss] * lat_cy[ss] * f;
+          m[5] += lat_cx[ss] * lat_cy[ss] * f;
+          if (obstacles[ii])
+            m_cells->solid[kk * NSPEEDS + ss] = f;
+        }
+        kk += obstacles[ii];
+
+        m_cells->rho[ii] = m[0];
+        m_cells->j_x[ii] = m[1];
+        m_cells->j_y[ii] = m[2];
+        m_cells->p_xx[ii] = m[3];
+        m_cells->p_yy[ii] = m[4];
+        m_cells->p_xy[ii] = m[5];
+      }
+    }
+
+    /* the reference starts from the populations those moments stand for */
+    moments_to_speeds(run, m_cells, obstacles, cells);
+    copy_speeds(run, tmp_cells, cells);
+
+    for (int tt = 0; tt < nsteps; tt++)
+    {
+      accelerate_flow(run, cells, obstacles);
+      expected[tt] = timestep_reference(run, cells, tmp_cells, obstacles);
+      t_speeds *tmp = cells;
+      cells = tmp_cells;
+      tmp_cells = tmp;
+    }
+
+    float max_dav = 0.f; /* largest relative difference in av. velocity */
+
+    for (int tt = 0; tt < nsteps; tt++)
+    {
+      accelerate_flow_moments(run, m_cells, obstacles);
+      const float av_vel = timestep_moments(run, m_cells, m_tmp_cells, obstacles);
+      t_moments *tmp = m_cells;
+      m_cells = m_tmp_cells;
+      m_tmp_cells = tmp;
+
+      if (!(fabsf(av_vel - expected[tt]) <= max_dav * fabsf(expected[tt])))
+        max_dav = fabsf(av_vel - expected[tt]) / fabsf(expected[tt]);
+    }
 
-        /* compute x velocity component */
-        u_x = (cells->s1[ii + jj * params.nx] + cells->s5[ii + jj * params.nx] + cells->s8[ii + jj * params.nx] - (cells->s3[ii + jj * params.nx] + cells->s6[ii + jj * params.nx] + cells->s7[ii + jj * params.nx])) / local_density;
-        /* compute y velocity component */
-        u_y = (cells->s2[ii + jj * params.nx] + cells->s5[ii + jj * params.nx] + cells->s6[ii + jj * params.nx] - (cells->s4[ii + jj * params.nx] + cells->s7[ii + jj * params.nx] + cells->s8[ii + jj * params.nx])) / local_density;
-        /* compute norm of velocity */
-        u = sqrtf((u_x * u_x) + (u_y * u_y));
-        /* compute pressure */
-        pressure = local_density * c_sq;
+    /* compare populations, the centre speed of an obstacle aside, as selftest() does */
+    moments_to_speeds(run, m_cells, obstacles, tmp_cells);
+
+    float max_df = 0.f; /* largest difference in any speed, relative to the density */
+    float *const got[NSPEEDS] = {tmp_cells->s0, tmp_cells->s1, tmp_cells->s2, tmp_cells->s3, tmp_cells->s4,
+                                 tmp_cells->s5, tmp_cells->s6, tmp_cells->s7, tmp_cells->s8};
+    float *const want[NSPEEDS] = {cells->s0, cells->s1, cells->s2, cells->s3, cells->s4,
+                                  cells->s5, cells->s6, cells->s7, cells->s8};
+
+    for (int ss = 0; ss < NSPEEDS; ss++)
+    {
+      for (int ii = 0; ii < ncells; ii++)
+      {
+        if ((ss > 0 || !obstacles[ii]) && !(fabsf(got[ss][ii] - want[ss][ii]) <= max_df * run.density))
+          max_df = fabsf(got[ss][ii] - want[ss][ii]) / run.density;
       }
+    }
+
+    const int ok = (max_df <= tolerances[oo] && max_dav <= av_tolerances[oo]);
+    printf("  %-10s max speed error %.3e, max av. velocity error %.3e at omega %.3f: %s\n",
+           "moments", max_df, max_dav, run.omega, ok ? "ok" : "FAILED");
+    failures += !ok;
+
+    free_moments(&m_cells);
+    free_moments(&m_tmp_cells);
+    free_speeds(&cells);
+    free_speeds(&tmp_cells);
+    free(expected);
+  }
+
+  return failures;
+}
+
+int selftest_tiles(const t_param geometry, float solid, unsigned int seed, int nsteps, float tolerance,
+                   float av_tolerance)
+{
+  /*
+  ** The geometry rounded up to whole tiles, with a solid band three
+  ** tiles wide on the east side, so that the middle column of tiles,
+  ** solid with its halo, is dropped and its neighbours read the rest tile.
+  */
+  t_param params = geometry;
+  params.nx = (geometry.nx + TILESIZE - 1) / TILESIZE * TILESIZE + 3 * TILESIZE;
+  params.ny = (geometry.ny + TILESIZE - 1) / TILESIZE * TILESIZE;
 
-      /* write to file */
-      fprintf(fp, "%d %d %.12E %.12E %.12E %.12E %d\n", ii, jj, u_x, u_y, u, pressure, obstacles[ii + params.nx * jj]);
+  const int ncells = params.nx * params.ny;
+  const int band = params.nx - 3 * TILESIZE; /* first column of the solid band */
+  int *obstacles = malloc(sizeof(int) * ncells);
+  unsigned char *mask = (unsigned char *)calloc(ncells / 8 + 1, 1);
+  float *expected = malloc(sizeof(float) * nsteps);
+  t_speeds *cells = alloc_speeds(&params, "cells");
+  t_speeds *tmp_cells = alloc_speeds(&params, "tmp_cells");
+  float *const f[NSPEEDS] = {cells->s0, cells->s1, cells->s2, cells->s3, cells->s4,
+                             cells->s5, cells->s6, cells->s7, cells->s8};
+  t_tiles tiles;
+
+  if (obstacles == NULL || mask == NULL || expected == NULL)
+    die("cannot allocate memory for the selftest", __LINE__, __FILE__);
+
+  for (int ii = 0; ii < ncells; ii++)
+  {
+    obstacles[ii] = (ii % params.nx >= band) || rand_uniform(&seed) < solid;
+    mask[ii / 8] |= obstacles[ii] << (ii % 8);
+
+    for (int ss = 0; ss < NSPEEDS; ss++)
+      f[ss][ii] = params.density * (float)lat_w[ss] * (0.8f + 0.4f * rand_uniform(&seed));
+  }
+
+  /* the same start in the kept tiles; the dropped ones are never read by the fluid */
+  tiles_init(&params, &tiles, mask);
+
+  for (int t = 0; t < tiles.ntiles; t++)
+  {
+    for (int cc = 0; cc < TILECELLS; cc++)
+    {
+      const int cell = tiles.coords[2 * t] * TILESIZE + cc % TILESIZE +
+                       (tiles.coords[2 * t + 1] * TILESIZE + cc / TILESIZE) * params.nx;
+
+      for (int ss = 0; ss < NSPEEDS; ss++)
+        tiles.cells[((size_t)t * NSPEEDS + ss) * TILECELLS + cc] = f[ss][cell];
     }
   }
 
-  fclose(fp);
+  for (int tt = 0; tt < nsteps; tt++)
+  {
+    accelerate_flow(params, cells, obstacles);
+    expected[tt] = timestep_reference(params, cells, tmp_cells, obstacles);
+    t_speeds *tmp = cells;
+    cells = tmp_cells;
+    tmp_cells = tmp;
+  }
 
-  fp = fopen(AVVELSFILE, "w");
+  float max_dav = 0.f; /* largest relative difference in av. velocity */
 
-  if (fp == NULL)
+  for (int tt = 0; tt < nsteps; tt++)
   {
-    die("could not open file output file", __LINE__, __FILE__);
+    accelerate_flow_tiles(params, &tiles);
+    const float av_vel = timestep_tiles(params, &tiles);
+    float *tmp = tiles.cells;
+    tiles.cells = tiles.tmp_cells;
+    tiles.tmp_cells = tmp;
+
+    if (!(fabsf(av_vel - expected[tt]) <= max_dav * fabsf(expected[tt])))
+      max_dav = fabsf(av_vel - expected[tt]) / fabsf(expected[tt]);
   }
 
-  for (int ii = 0; ii < params.maxIters; ii++)
+  /*
+  ** the fluid cells of the kept tiles: a solid cell next to a dropped
+  ** tile holds rest populations where the dense lattice holds whatever
+  ** its solid neighbour did, which no fluid cell ever reads
+  */
+  float max_df = 0.f; /* largest difference in any speed, relative to the density */
+  float *const want[NSPEEDS] = {cells->s0, cells->s1, cells->s2, cells->s3, cells->s4,
+                                cells->s5, cells->s6, cells->s7, cells->s8};
+
+  for (int t = 0; t < tiles.ntiles; t++)
   {
-    fprintf(fp, "%d:\t%.12E\n", ii, av_vels[ii]);
+    for (int cc = 0; cc < TILECELLS; cc++)
+    {
+      const int cell = tiles.coords[2 * t] * TILESIZE + cc % TILESIZE +
+                       (tiles.coords[2 * t + 1] * TILESIZE + cc / TILESIZE) * params.nx;
+
+      for (int ss = 0; ss < NSPEEDS; ss++)
+      {
+        const float got = tiles.cells[((size_t)t * NSPEEDS + ss) * TILECELLS + cc];
+
+        if (!obstacles[cell] && !(fabsf(got - want[ss][cell]) <= max_df * params.density))
+          max_df = fabsf(got - want[ss][cell]) / params.density;
+      }
+    }
   }
 
-  fclose(fp);
+  const int ok = (max_df <= tolerance && max_dav <= av_tolerance);
+  printf("  %-10s max speed error %.3e, max av. velocity error %.3e on %d x %d, %d of %d tiles: %s\n",
+         "sparse", max_df, max_dav, params.nx, params.ny, tiles.ntiles, tiles.ntx * tiles.nty, ok ? "ok" : "FAILED");
 
-  return EXIT_SUCCESS;
+  free_tiles(&tiles);
+  free_speeds(&cells);
+  free_speeds(&tmp_cells);
+  free(obstacles);
+  free(mask);
+  free(expected);
+
+  return !ok;
+}
+
+/*
+** Run the conservation check of each lattice codegen/ddqq.py generates
+** on a small periodic box, once without walls, for mass and momentum,
+** and once with every seventh cell solid, for mass. Returns the failures.
+*/
+int selftest_lattices(int nsteps, double tolerance)
+{
+  const char *names[] = {"d2q9", "d3q19", "d3q27"};
+  int failures = 0;
+
+  printf("generated lattices: periodic boxes, %d steps, omega 1.700\n", nsteps);
+
+  for (int ll = 0; ll < 3; ll++)
+  {
+    for (int walls = 0; walls < 2; walls++)
+    {
+      double mass, momentum;
+
+      if (ll == 0)
+      {
+        t_param params = {0};
+        params.nx = 33;
+        params.ny = 20;
+        params.omega = 1.7f;
+        conservation_d2q9(params, nsteps, walls ? 7 : 0, &mass, &momentum);
+      }
+      else if (ll == 1)
+      {
+        const t_d3q19_param params = {17, 12, 9, 1.7f};
+        conservation_d3q19(params, nsteps, walls ? 7 : 0, &mass, &momentum);
+      }
+      else
+      {
+        const t_d3q27_param params = {17, 12, 9, 1.7f};
+        conservation_d3q27(params, nsteps, walls ? 7 : 0, &mass, &momentum);
+      }
+
+      const int ok = (mass <= tolerance && (walls || momentum <= tolerance));
+      if (walls)
+        printf("  %-10s mass drift %.3e with solid cells: %s\n", names[ll], mass, ok ? "ok" : "FAILED");
+      else
+        printf("  %-10s mass drift %.3e, momentum drift %.3e: %s\n", names[ll], mass, momentum, ok ? "ok" : "FAILED");
+      failures += !ok;
+    }
+  }
+
+  return failures;
+}
+
+/* compare format_float() and format_int() with printf on edge cases and random bit patterns, return the mismatches */
+int format_check(void)
+{
+  const float special[] = {0.f, -0.f, 1.f, -1.f, 0.1f, 1e-45f, 1.17549435e-38f, 3.40282347e38f, 9.99999999999995f,
+                           5e-5f, 1e10f, 1e13f, 123456789.f, 16777215.f, INFINITY, -INFINITY, NAN};
+  const int nspecial = sizeof(special) / sizeof(special[0]);
+  const int special_int[] = {0, 1, -1, 9, 10, 99, 100, 2147483647, -2147483647 - 1};
+  const int nspecial_int = sizeof(special_int) / sizeof(special_int[0]);
+  unsigned int seed = 67890u; /* fixed, so that failures are reproducible */
+  int mismatches = 0;
+  char got[64], want[64];     /* the two renderings of a value */
+
+  for (int vv = 0; vv < nspecial + NFORMATCHECK; vv++)
+  {
+    float value = (vv < nspecial) ? special[vv] : 0.f;
+
+    /* any bit pattern: denormals, every exponent and both signs */
+    if (vv >= nspecial)
+    {
+      rand_uniform(&seed);
+      memcpy(&value, &seed, sizeof(value));
+    }
+
+    got[format_float(got, value)] = '\0';
+    snprintf(want, sizeof(want), "%.12E", value);
+
+    if (strcmp(got, want) && mismatches++ < 5)
+      printf("  formatter wrote %s for %s\n", got, want);
+  }
+
+  for (int vv = 0; vv < nspecial_int + NFORMATCHECK; vv++)
+  {
+    const int value = (vv < nspecial_int) ? special_int[vv] : (int)(rand_uniform(&seed) * 16777216.f) - (1 << 23);
+
+    got[format_int(got, value)] = '\0';
+    snprintf(want, sizeof(want), "%d", value);
+
+    if (strcmp(got, want) && mismatches++ < 5)
+      printf("  formatter wrote %s for %s\n", got, want);
+  }
+
+  printf("formatter: %d floats and ints against printf(\"%%.12E\") and printf(\"%%d\"): %s\n",
+         2 * NFORMATCHECK + nspecial + nspecial_int, mismatches ? "FAILED" : "ok");
+
+  return mismatches;
+}
+
+float rand_uniform(unsigned int *state)
+{
+  /* xorshift32, scaled to [0, 1) */
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+
+  return (*state >> 8) * (1.f / 16777216.f);
+}
+
+void check_affinity(const t_param params, t_speeds *cells, t_speeds *tmp_cells, int strict)
+{
+  const int nthreads = omp_get_max_threads(); /* threads the kernel will run with */
+  const long page = sysconf(_SC_PAGESIZE);   /* bytes per page */
+  t_placement *place = calloc(nthreads, sizeof(t_placement));
+  float *arrays[2 * NSPEEDS] = {cells->s0, cells->s1, cells->s2, cells->s3, cells->s4, cells->s5, cells->s6, cells->s7, cells->s8,
+                                tmp_cells->s0, tmp_cells->s1, tmp_cells->s2, tmp_cells->s3, tmp_cells->s4,
+                                tmp_cells->s5, tmp_cells->s6, tmp_cells->s7, tmp_cells->s8};
+  int locality = 1; /* 0 if the kernel will not tell us where pages are */
+
+  if (place == NULL)
+    die("cannot allocate memory for thread placement", __LINE__, __FILE__);
+
+#pragma omp parallel
+  {
+    t_placement *mine = &place[omp_get_thread_num()];
+    mine->cpu = sched_getcpu();
+    cpu_topology(mine->cpu, &mine->core, &mine->socket, &mine->node);
+
+    /* the rows this thread updates, with the kernel's static row schedule: one contiguous block */
+    int first = params.ny, last = -1;
+
+#pragma omp for schedule(static)
+    for (int jj = 0; jj < params.ny; jj++)
+    {
+      first = (jj < first) ? jj : first;
+      last = jj;
+    }
+
+    /* every page those rows span, in each lattice array */
+    const size_t bytes = (last >= first) ? sizeof(float) * (size_t)(last - first + 1) * params.nx : 0;
+    const long per_array = (bytes > 0) ? (long)(bytes / page + 2) : 0;
+    void **pages = malloc(sizeof(void *) * (2 * NSPEEDS * per_array + 1));
+    int *status = malloc(sizeof(int) * (2 * NSPEEDS * per_array + 1));
+    long npages = 0;
+
+    if (pages == NULL || status == NULL)
+      die("cannot allocate memory for page locality", __LINE__, __FILE__);
+
+    for (int ss = 0; ss < 2 * NSPEEDS && bytes > 0; ss++)
+    {
+      const size_t start = (size_t)&arrays[ss][(size_t)first * params.nx] & ~(size_t)(page - 1);
+      const size_t end = (size_t)&arrays[ss][(size_t)first * params.nx] + bytes; /* one past the last byte */
+
+      for (size_t addr = start; addr < end; addr += page)
+        pages[npages++] = (void *)addr;
+    }
+
+    /* NULL nodes: move_pages() only reports the node of each page */
+    if (npages > 0 && syscall(SYS_move_pages, 0, npages, pages, NULL, status, 0) == 0)
+    {
+      for (long pp = 0; pp < npages; pp++)
+      {
+        if (status[pp] == mine->node)
+          mine->local_pages++;
+        else if (status[pp] >= 0)
+          mine->remote_pages++;
+      }
+    }
+    else if (npages > 0)
+    {
+#pragma omp atomic write
+      locality = 0;
+    }
+
+    free(pages);
+    free(status);
+    mine->cpu_after = sched_getcpu();
+  }
+
+  const char *bind = getenv("OMP_PROC_BIND");
+  const char *places = getenv("OMP_PLACES");
+  int problems = 0; /* no. of placement problems found */
+
+  printf("==affinity==\n");
+  printf("OMP_PROC_BIND=%s OMP_PLACES=%s threads=%d\n", bind ? bind : "(unset)", places ? places : "(unset)", nthreads);
+  printf("thread\tcpu\tcore\tsocket\tnode\tlocal pages\tremote pages\n");
+
+  for (int tt = 0; tt < nthreads; tt++)
+  {
+    printf("%d\t%d\t%d\t%d\t%d\t", tt, place[tt].cpu, place[tt].core, place[tt].socket, place[tt].node);
+
+    if (locality)
+      printf("%ld\t\t%ld\n", place[tt].local_pages, place[tt].remote_pages);
+    else
+      printf("n/a\t\tn/a\n");
+
+    if (place[tt].cpu_after != place[tt].cpu)
+    {
+      printf("  thread %d migrated from cpu %d to cpu %d: threads are not bound\n", tt, place[tt].cpu, place[tt].cpu_after);
+      problems++;
+    }
+
+    for (int other = 0; other < tt; other++)
+    {
+      if (place[other].socket == place[tt].socket && place[other].core == place[tt].core)
+      {
+        printf("  threads %d and %d share core %d of socket %d\n", other, tt, place[tt].core, place[tt].socket);
+        problems++;
+      }
+    }
+
+    if (locality && place[tt].remote_pages > 0)
+    {
+      printf("  thread %d updates %ld pages on a remote NUMA node\n", tt, place[tt].remote_pages);
+      problems++;
+    }
+  }
+
+  if (!locality)
+    printf("page locality unavailable: move_pages() is not permitted here\n");
+
+  free(place);
+
+  if (strict && problems)
+  {
+    fflush(stdout);
+    die("thread placement check failed, see the ==affinity== report", __LINE__, __FILE__);
+  }
+}
+
+void cpu_topology(int cpu, int *core, int *socket, int *node)
+{
+  char file[128]; /* sysfs path */
+
+  sprintf(file, "%s/cpu%d/topology/core_id", CPUDIR, cpu);
+  *core = sysfs_int(file);
+  sprintf(file, "%s/cpu%d/topology/physical_package_id", CPUDIR, cpu);
+  *socket = sysfs_int(file);
+
+  /* the cpu directory holds a node<N> link to its NUMA node */
+  *node = -1;
+
+  for (int nn = 0; nn < MAXNODES && *node < 0; nn++)
+  {
+    sprintf(file, "%s/cpu%d/node%d", CPUDIR, cpu, nn);
+
+    if (access(file, F_OK) == 0)
+      *node = nn;
+  }
+
+  /* kernels without NUMA support have no node links: everything is node 0 */
+  if (*node < 0)
+    *node = 0;
+}
+
+int sysfs_int(const char *file)
+{
+  unsigned long long value;
+
+  return read_counter(file, &value) ? (int)value : -1;
+}
+
+void plan_footprint(const t_param params, int roofline, int moments, t_footprint *footprint)
+{
+  const size_t ncells = (size_t)params.nx * params.ny;
+  const int values = moments ? NMOMENTS : NSPEEDS; /* floats per cell of each lattice */
+
+  footprint->per_cell = 2 * values * sizeof(float) + sizeof(int);
+  footprint->lattices = 2 * values * sizeof(float) * ncells;
+  footprint->obstacles = sizeof(int) * ncells;
+  footprint->av_vels = sizeof(float) * params.maxIters;
+
+  /* the probe is freed before initialise(), so it only counts towards the peak */
+  footprint->optional = roofline ? 3 * sizeof(float) * (size_t)PROBESIZE : 0;
+  footprint->fixed = footprint->av_vels + 2 * (moments ? sizeof(t_moments) : sizeof(t_speeds));
+
+  /* the moments add the row buffers of each thread and the row index of the solid cells, for each lattice */
+  if (moments)
+    footprint->fixed += 2 * (sizeof(float) * 3 * NSPEEDS * (params.nx + 2) * omp_get_max_threads() +
+                             sizeof(int) * (params.ny + 1));
+}
+
+size_t available_memory(int *nnodes, size_t *node_bytes)
+{
+  char file[128];    /* sysfs/procfs path */
+  char line[256];    /* one line of a meminfo file */
+  size_t total = 0;  /* bytes available on all nodes */
+  int found = 0;     /* no. of nodes read */
+  FILE *fp;          /* file pointer */
+
+  /*
+  ** Per node, as MemAvailable counts it: the free pages plus the
+  ** inactive page cache and reclaimable slab, which the kernel will
+  ** give up for our allocations. Dirty, mapped and unevictable file
+  ** pages are not counted.
+  */
+  for (int nn = 0; nn < MAXNODES; nn++)
+  {
+    sprintf(file, "%s/node%d/meminfo", NODEDIR, nn);
+    fp = fopen(file, "r");
+
+    if (fp == NULL)
+      continue;
+
+    size_t bytes = 0;
+    unsigned long long kb;
+    int node;
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+      if (sscanf(line, "Node %d MemFree: %llu kB", &node, &kb) == 2 ||
+          sscanf(line, "Node %d Inactive(file): %llu kB", &node, &kb) == 2 ||
+          sscanf(line, "Node %d SReclaimable: %llu kB", &node, &kb) == 2)
+        bytes += kb * 1024;
+    }
+
+    fclose(fp);
+
+    if (node_bytes != NULL && found < MAXNODES)
+      node_bytes[found] = bytes;
+
+    total += bytes;
+    found++;
+  }
+
+  /* no NUMA information: treat the machine as one node */
+  if (found == 0)
+  {
+    fp = fopen("/proc/meminfo", "r");
+
+    if (fp != NULL)
+    {
+      unsigned long long kb;
+
+      while (fgets(line, sizeof(line), fp) != NULL)
+      {
+        if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1)
+          total = kb * 1024;
+      }
+
+      fclose(fp);
+    }
+
+    if (node_bytes != NULL)
+      node_bytes[0] = total;
+
+    found = (total > 0);
+  }
+
+  if (nnodes != NULL)
+    *nnodes = found;
+
+  return total;
+}
+
+int local_ranks(void)
+{
+  /* the launchers we use export the no. of ranks sharing this node */
+  const char *vars[] = {"OMPI_COMM_WORLD_LOCAL_SIZE", "MPI_LOCALNRANKS", "SLURM_NTASKS_PER_NODE"};
+
+  for (int vv = 0; vv < 3; vv++)
+  {
+    const char *value = getenv(vars[vv]);
+
+    if (value != NULL && atoi(value) > 0)
+      return atoi(value);
+  }
+
+  return 1;
+}
+
+void report_plan(const t_param params, int roofline, int moments)
+{
+  const double mib = 1048576.0; /* bytes per MiB */
+  size_t node_bytes[MAXNODES];  /* available on each NUMA node */
+  int nnodes;                   /* no. of NUMA nodes */
+  t_footprint footprint;
+
+  plan_footprint(params, roofline, moments, &footprint);
+  const size_t total = available_memory(&nnodes, node_bytes);
+  const int ranks = local_ranks();
+  const size_t required = footprint.lattices + footprint.obstacles + footprint.av_vels;
+
+  printf("==plan==\n");
+  printf("Grid:\t\t\t\t%d x %d, %d iterations\n", params.nx, params.ny, params.maxIters);
+  printf("Layout:\t\t\t\tSoA, float, %s\n",
+         moments ? "6 moments (rho, j_x, j_y, p_xx, p_yy, p_xy) per cell, and 9 populations per solid cell"
+                 : "9 populations per cell");
+  printf("Lattices (cells, tmp_cells):\t%.1lf (MiB)\n", footprint.lattices / mib);
+  printf("Obstacle mask:\t\t\t%.1lf (MiB)\n", footprint.obstacles / mib);
+  printf("av_vels history:\t\t%.1lf (MiB)\n", footprint.av_vels / mib);
+  if (footprint.optional > 0)
+    printf("Optional buffers (transient):\t%.1lf (MiB)\n", footprint.optional / mib);
+  printf("Total required:\t\t\t%.1lf (MiB)\n", required / mib);
+  printf("Bytes per cell:\t\t\t%zu\n", footprint.per_cell);
+
+  if (total == 0)
+  {
+    printf("available memory unknown: no node or /proc/meminfo information\n");
+    return;
+  }
+
+  printf("Available:\t\t\t%.1lf (MiB) on %d NUMA node(s), %d rank(s) per node\n", total / mib, nnodes, ranks);
+
+  for (int nn = 0; nn < nnodes; nn++)
+  {
+    const size_t cells = node_bytes[nn] > footprint.fixed ? (node_bytes[nn] - footprint.fixed) / footprint.per_cell : 0;
+    printf("  node %d:\t\t\t%.1lf (MiB), largest square grid %d x %d, or %d x %zu\n", nn, node_bytes[nn] / mib,
+           (int)sqrt((double)cells), (int)sqrt((double)cells), params.nx, cells / params.nx);
+  }
+
+  const size_t rank_bytes = total / ranks;
+  const size_t cells = rank_bytes > footprint.fixed ? (rank_bytes - footprint.fixed) / footprint.per_cell : 0;
+  printf("Per rank:\t\t\t%.1lf (MiB), largest square grid %d x %d, or %d x %zu\n", rank_bytes / mib,
+         (int)sqrt((double)cells), (int)sqrt((double)cells), params.nx, cells / params.nx);
+  printf("Fits:\t\t\t\t%s\n", required + footprint.optional <= rank_bytes ? "yes" : "NO");
+}
+
+void bandwidth_probe(double *copy_bw, double *triad_bw)
+{
+  const size_t n = PROBESIZE; /* elements per array */
+  const float scalar = 3.f;   /* triad multiplier */
+  float *a = (float *)_mm_malloc(sizeof(float) * n, 64);
+  float *b = (float *)_mm_malloc(sizeof(float) * n, 64);
+  float *c = (float *)_mm_malloc(sizeof(float) * n, 64);
+
+  if (a == NULL || b == NULL || c == NULL)
+    die("cannot allocate memory for the bandwidth probe", __LINE__, __FILE__);
+
+  /* first touch from the threads that will use each page, as initialise() does */
+#pragma omp parallel for
+  for (size_t ii = 0; ii < n; ii++)
+  {
+    a[ii] = 1.f;
+    b[ii] = 2.f;
+    c[ii] = 0.f;
+  }
+
+  double best_copy = 1e30, best_triad = 1e30; /* fastest time of each kernel */
+
+  for (int rep = 0; rep < PROBEREPS; rep++)
+  {
+    double tic = wall_time();
+#pragma omp parallel for
+    for (size_t ii = 0; ii < n; ii++)
+      c[ii] = a[ii];
+    double toc = wall_time();
+    if (toc - tic < best_copy)
+      best_copy = toc - tic;
+
+    tic = wall_time();
+#pragma omp parallel for
+    for (size_t ii = 0; ii < n; ii++)
+      a[ii] = b[ii] + scalar * c[ii];
+    toc = wall_time();
+    if (toc - tic < best_triad)
+      best_triad = toc - tic;
+  }
+
+  /* STREAM convention: write-allocate traffic is not counted */
+  *copy_bw = 2.0 * sizeof(float) * n / best_copy;
+  *triad_bw = 3.0 * sizeof(float) * n / best_triad;
+
+  _mm_free(a);
+  _mm_free(b);
+  _mm_free(c);
+}
+
+void kernel_traffic(int moments, double *bytes, double *bytes_wa, double *flops)
+{
+  const int values = moments ? NMOMENTS : NSPEEDS; /* floats per cell of each lattice */
+
+  /*
+  ** Per lattice update timestep() reads the nine speeds of the
+  ** neighbouring cells and the obstacle flag, and writes nine speeds
+  ** to tmp_cells. timestep_moments() reads and writes the six moments
+  ** instead, the populations being rebuilt in cached row buffers.
+  ** Without streaming stores each written line is also read first
+  ** (write-allocate).
+  */
+  *bytes = (2.0 * values) * sizeof(float) + sizeof(int);
+  *bytes_wa = *bytes + values * sizeof(float);
+
+  /*
+  ** Flops of a fluid cell of timestep_moments(), with the lattice
+  ** vector components (0 or +-1) folded into adds as the compiler
+  ** does. Each population rebuilt by moment_population(): j.c and
+  ** its factor 2, rho c_sq 1, the two fluxes less it 2, their
+  ** products with the lattice terms 3, their sum 2, the factor 4.5 1,
+  ** rho plus both parts 2, the weight 1. Each population gathered
+  ** adds into the moments. Per cell: equilibria 10, relaxation of
+  ** three fluxes 3 x 3, average speed 5.
+  */
+  if (moments)
+  {
+    const double rebuild = 2.0 + 1.0 + 2.0 + 3.0 + 2.0 + 1.0 + 2.0 + 1.0;
+    const double gather = NMOMENTS;
+
+    *flops = NSPEEDS * (rebuild + gather) + 10.0 + 3.0 * 3.0 + 5.0;
+    return;
+  }
+
+  /*
+  ** Flops of a fluid cell as written in timestep(), divide and sqrt
+  ** counted as one: density 8, velocities 12, u_sq 3, directional
+  ** velocities 4, equilibria 59, relaxation 27, average speed 3.
+  */
+  *flops = 116.0;
+}
+
+void report_roofline(const t_param params, int *obstacles, double comp_time, double copy_bw, double triad_bw,
+                     int moments)
+{
+  double bytes, bytes_wa, flops; /* per lattice update */
+  long fluid = 0;                /* no. of cells doing the collision */
+
+  for (int ii = 0; ii < params.nx * params.ny; ii++)
+    fluid += !obstacles[ii];
+
+  kernel_traffic(moments, &bytes, &bytes_wa, &flops);
+  flops *= (double)fluid / ((double)params.nx * params.ny);
+
+  const double lups = (double)params.nx * params.ny * params.maxIters / comp_time;
+
+  printf("==roofline==\n");
+  printf("Probe copy bandwidth:\t\t%.2lf (GB/s)\n", copy_bw / 1e9);
+  printf("Probe triad bandwidth:\t\t%.2lf (GB/s)\n", triad_bw / 1e9);
+  printf("Bytes per update:\t\t%.1lf (%.1lf with write-allocate)\n", bytes, bytes_wa);
+  printf("Flops per update:\t\t%.1lf\n", flops);
+  printf("Arithmetic intensity:\t\t%.3lf (flop/byte)\n", flops / bytes);
+  printf("Attained:\t\t\t%.1lf (MLUPS) %.2lf (GB/s) %.2lf (GFLOP/s)\n",
+         lups / 1e6, lups * bytes / 1e9, lups * flops / 1e9);
+  printf("Attainable (triad roof):\t%.1lf - %.1lf (MLUPS)\n", triad_bw / bytes_wa / 1e6, triad_bw / bytes / 1e6);
+  printf("Fraction of roof:\t\t%.1lf%% - %.1lf%%\n",
+         100.0 * lups * bytes / triad_bw, 100.0 * lups * bytes_wa / triad_bw);
 }
 
 void die(const char *message, const int line, const char *file)
@@ -739,8 +7477,84 @@ void die(const char *message, const int line, const char *file)
   exit(EXIT_FAILURE);
 }
 
+double wall_time(void)
+{
+  struct timeval timstr; /* structure to hold elapsed time */
+
+  gettimeofday(&timstr, NULL);
+
+  return timstr.tv_sec + (timstr.tv_usec / 1000000.0);
+}
+
 void usage(const char *exe)
 {
-  fprintf(stderr, "Usage: %s <paramfile> <obstaclefile>\n", exe);
+  fprintf(stderr, "Usage: %s [options] <paramfile> <obstaclefile>\n", exe);
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  --energy    report RAPL package/DRAM energy of the init, compute and output phases\n");
+  fprintf(stderr, "  --affinity  report each thread's cpu, core, socket and NUMA node, and lattice page locality\n");
+  fprintf(stderr, "  --affinity-strict  as --affinity, but abort if threads share a core, migrate or touch remote pages\n");
+  fprintf(stderr, "  --kernel <name>  timestep implementation, one of:\n");
+  for (int kk = 0; kk < NKERNELS; kk++)
+    fprintf(stderr, "              %-10s %s%s\n", kernels[kk].name, kernels[kk].description, kk ? "" : " (default)");
+  fprintf(stderr, "  --selftest  run every kernel on small random geometries and compare with the reference\n");
+  fprintf(stderr, "  --binary    write %s and %s instead of the text files\n", FINALSTATEBIN, AVVELSBIN);
+  fprintf(stderr, "  --bench     time every kernel and thread count on generated geometries, writing %s and %s\n",
+          BENCHCSVFILE, BENCHJSONFILE);
+  fprintf(stderr, "              (no files are required)\n");
+  fprintf(stderr, "  --bench-sizes <n,n,..>    grid sizes, default 128,256,...,8192\n");
+  fprintf(stderr, "  --bench-threads <n,n,..>  thread counts, default powers of two up to OMP_NUM_THREADS\n");
+  fprintf(stderr, "  --bench-iters <n>         iterations per run, default about 2e8 lattice updates\n");
+  fprintf(stderr, "  --scaling strong|weak    rerun the deck over thread counts, reporting speedup, efficiency\n");
+  fprintf(stderr, "              and init/accelerate_flow/kernel/output times; weak places one deck per thread\n");
+  fprintf(stderr, "              side by side in x. Each run writes %s and %s, replacing those in the directory\n",
+          FINALSTATEFILE, AVVELSFILE);
+  fprintf(stderr, "  --scaling-threads <n,n,..>  thread counts, default powers of two up to OMP_NUM_THREADS\n");
+  fprintf(stderr, "  --microbench  time the stream, collide, rebound, accelerate_flow and reduction stages alone,\n");
+  fprintf(stderr, "              and the fused timestep, in ns and cycles per cell (no files are required)\n");
+  fprintf(stderr, "  --plan      report the memory a run needs and the largest grid that fits, without allocating\n");
+  fprintf(stderr, "              (only <paramfile> is required)\n");
+  fprintf(stderr, "  --roofline  probe memory bandwidth and report attained vs attainable kernel performance\n");
+  fprintf(stderr, "  --parareal <n>        experimental: split the iterations into n time slices run concurrently,\n");
+  fprintf(stderr, "                        corrected by a 2x coarser lattice (even nx and ny)\n");
+  fprintf(stderr, "  --parareal-iters <k>  most parareal corrections, default n (which reproduces the serial run)\n");
+  fprintf(stderr, "  --adjoint velocity|drag   write the sensitivity of the time averaged objective to the\n");
+  fprintf(stderr, "                            porosity of each cell to %s, instead of a forward run\n", SENSITIVITYFILE);
+  fprintf(stderr, "  --adjoint-checkpoints <n> states kept by the adjoint, default sqrt(iterations)\n");
+  fprintf(stderr, "  --adjoint-check <n>       compare the n largest sensitivities with finite differences\n");
+  fprintf(stderr, "  --steady <tol>        stop once the velocity changes by less than tol (relative) per timestep\n");
+  fprintf(stderr, "  --anderson <m>        accelerate towards the steady state by anderson mixing over m periods\n");
+  fprintf(stderr, "  --anderson-period <n> timesteps between steady state checks and mixes, default %d\n", ANDERSONPERIOD);
+  fprintf(stderr, "  --moments   store %d moments per cell instead of %d populations, and run the regularised scheme\n"
+                  "              (the fused kernel's results at omega 1; elsewhere it drops the higher moments BGK keeps)\n",
+          NMOMENTS, NSPEEDS);
+  fprintf(stderr, "  --sparse    allocate and update only the %dx%d tiles that hold fluid (nx and ny multiples of %d;\n"
+                  "              writes text output only, so not with --binary, and not with --roofline)\n",
+          TILESIZE, TILESIZE, TILESIZE);
+  fprintf(stderr, "  --smt-prefetch    pin a helper thread on the idle SMT sibling of each compute thread to\n");
+  fprintf(stderr, "                    prefetch the rows just ahead of it into L2 (fused kernel, OMP_PROC_BIND set)\n");
+  fprintf(stderr, "  --smt-distance <n> rows the helpers run ahead, default %d\n", SMTDISTANCE);
+  fprintf(stderr, "  --snapshot <n>    every n timesteps, queue the state as snapshot_<timestep>.bin (the format\n");
+  fprintf(stderr, "                    of %s), to be written while the run continues\n", FINALSTATEBIN);
+  fprintf(stderr, "  --io uring|threads|sync  engine of the --binary and --snapshot output, default uring (threads\n");
+  fprintf(stderr, "                    where io_uring is unavailable); files over %d MiB use O_DIRECT\n",
+          AIODIRECTMIN >> 20);
+  fprintf(stderr, "  --gzip      write %s instead of %s, deflated in parallel as one gzip member\n",
+          FINALSTATEGZ, FINALSTATEFILE);
+  fprintf(stderr, "              per block of rows (gunzip, zcat and d2q9-check read it)\n");
+  fprintf(stderr, "  --halo16 <n>  emulate n ranks over the rows, whose halo populations travel as 16 bit\n");
+  fprintf(stderr, "              deviations from equilibrium, and report the error against a float exchange\n");
+  fprintf(stderr, "  --free-surface <h>  free surface flow: liquid up to fraction h of the height, gas above,\n");
+  fprintf(stderr, "              gravity accel along -y; only the liquid is updated, gas cells are written as 2\n");
+  fprintf(stderr, "  --free-surface-width <w>  liquid only in fraction w of the width (a dam break), default 1\n");
+  fprintf(stderr, "  --sponge <edge:width,...>  absorbing layers along east, west, north and/or south, e.g.\n");
+  fprintf(stderr, "              east:64; after each timestep their cells blend towards the target equilibrium\n");
+  fprintf(stderr, "  --sponge-strength <s>  blend at the outer edge, ramped quadratically to 0 inwards, default %g\n",
+          SPONGESTRENGTH);
+  fprintf(stderr, "  --sponge-velocity <u>  eastward velocity of the target equilibrium, default 0\n");
+  fprintf(stderr, "  --roi <x,y,w,h>  snapshots write this window at full resolution, as\n");
+  fprintf(stderr, "              roi_x<x>_y<y>_w<w>_h<h>_<timestep>.bin, instead of the whole grid; repeat for up\n");
+  fprintf(stderr, "              to %d windows\n", MAXROIS);
+  fprintf(stderr, "  --roi-coarse <f>  snapshots also write the whole grid averaged over f x f blocks, as\n");
+  fprintf(stderr, "              coarse<f>_<timestep>.bin\n");
   exit(EXIT_FAILURE);
 }
@@ -0,0 +1,657 @@
+/*
+** Compare the output of a d2q9-bgk run with a reference run.
+**
+** Both the final state and the av. velocities are compared, field by
+** field, reporting the largest absolute and relative error of each.
+** Either file of a pair may be in the text format written by
+** write_values(), gzipped as by --gzip, or the binary format written
+** by write_binary(); the format is detected from the first bytes of
+** the file.
+**
+** Files are memory-mapped, and text files are split into one chunk
+** of lines per thread and parsed in parallel, e.g.:
+**
+**   ./d2q9-check --ref-av-vels-file=check/1024x1024.av_vels.dat \
+**                --ref-final-state-file=check/1024x1024.final_state.dat \
+**                --av-vels-file=av_vels.dat --final-state-file=final_state.dat
+**
+** The exit status is zero only if every field is within tolerance.
+*/
+
+#define _GNU_SOURCE /* mmap() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <zlib.h>
+
+#define BINMAGIC "D2Q9BIN1" /* first bytes of a binary output file */
+#define BINFINALSTATE 0     /* t_binheader.kind: u_x, u_y, u, pressure (floats), obstacles (ints) */
+#define BINAVVELS 1         /* t_binheader.kind: av. velocity of each timestep (floats) */
+#define NFIELDS 4           /* floating point fields per cell of the final state */
+
+/* header of the binary output files, as in d2q9-bgk.c */
+typedef struct
+{
+  char magic[8]; /* BINMAGIC, not terminated */
+  int kind;      /* BINFINALSTATE or BINAVVELS */
+  int nx;        /* no. of cells in x-direction, or no. of timesteps */
+  int ny;        /* no. of cells in y-direction, or 1 */
+  int nfields;   /* no. of arrays that follow */
+} t_binheader;
+
+/* the contents of one output file, whatever its format */
+typedef struct
+{
+  long n;                 /* no. of records (cells or timesteps) */
+  int *ii;                /* x coordinate, or timestep, of each record */
+  int *jj;                /* y coordinate of each record, 0 for av. velocities */
+  double *field[NFIELDS]; /* u_x, u_y, u, pressure; only field[0] for av. velocities */
+  int *obstacle;          /* obstacle flag of each cell, NULL for av. velocities */
+} t_records;
+
+/* a memory-mapped input file */
+typedef struct
+{
+  const char *data; /* file contents */
+  size_t size;      /* bytes */
+  int inflated;     /* 1 if data is a gzip file inflated into memory, rather than mapped */
+} t_mapped;
+
+/* the largest errors of one field */
+typedef struct
+{
+  double max_abs; /* largest |value - ref| */
+  double max_rel; /* largest |value - ref| / |ref| */
+  long worst;     /* record with the largest relative error */
+  long failures;  /* records out of tolerance */
+} t_error;
+
+/*
+** function prototypes
+*/
+
+/* load a final state or av. velocity file, text or binary */
+void load_records(const char *file, int is_final_state, t_records *records);
+void map_file(const char *file, t_mapped *mapped);
+void inflate_file(const char *file, t_mapped *mapped);
+void parse_text(const t_mapped *mapped, int is_final_state, t_records *records);
+void parse_binary(const t_mapped *mapped, const char *file, int is_final_state, t_records *records);
+void alloc_records(long n, int is_final_state, t_records *records);
+void free_records(t_records *records);
+const char *parse_line(const char *p, const char *end, int is_final_state, t_records *records, long rr);
+const char *skip_blank(const char *p, const char *end);
+const char *parse_number(const char *p, const char *end, double *value);
+
+/* compare and report */
+int compare(const char *what, const t_records *ref, const t_records *got, int nfields,
+            const char *const *names, double tolerance, double abs_tolerance);
+void die(const char *message, const int line, const char *file);
+void usage(const char *exe);
+
+int main(int argc, char *argv[])
+{
+  const char *ref_av_vels_file = NULL;     /* reference av. velocities */
+  const char *ref_final_state_file = NULL; /* reference final state */
+  const char *av_vels_file = NULL;         /* av. velocities to check */
+  const char *final_state_file = NULL;     /* final state to check */
+  double tolerance = 1e-2;                 /* largest relative error allowed */
+  double abs_tolerance = 1e-10;            /* absolute errors below this always pass */
+  const char *const state_names[NFIELDS] = {"u_x", "u_y", "u", "pressure"};
+  const char *const av_vels_names[1] = {"av_vel"};
+  t_records ref, got;
+  int failed = 0;
+
+  /* parse the command line, with the same options as check.py */
+  for (int arg = 1; arg < argc; arg++)
+  {
+    if (!strncmp(argv[arg], "--ref-av-vels-file=", 19))
+      ref_av_vels_file = argv[arg] + 19;
+    else if (!strncmp(argv[arg], "--ref-final-state-file=", 23))
+      ref_final_state_file = argv[arg] + 23;
+    else if (!strncmp(argv[arg], "--av-vels-file=", 15))
+      av_vels_file = argv[arg] + 15;
+    else if (!strncmp(argv[arg], "--final-state-file=", 19))
+      final_state_file = argv[arg] + 19;
+    else if (!strncmp(argv[arg], "--tolerance=", 12))
+      tolerance = atof(argv[arg] + 12);
+    else if (!strncmp(argv[arg], "--abs-tolerance=", 16))
+      abs_tolerance = atof(argv[arg] + 16);
+    else
+      usage(argv[0]);
+  }
+
+  if ((ref_av_vels_file == NULL) != (av_vels_file == NULL) ||
+      (ref_final_state_file == NULL) != (final_state_file == NULL) ||
+      (av_vels_file == NULL && final_state_file == NULL))
+    usage(argv[0]);
+
+  if (final_state_file != NULL)
+  {
+    load_records(ref_final_state_file, 1, &ref);
+    load_records(final_state_file, 1, &got);
+    failed += compare("final state", &ref, &got, NFIELDS, state_names, tolerance, abs_tolerance);
+    free_records(&ref);
+    free_records(&got);
+  }
+
+  if (av_vels_file != NULL)
+  {
+    load_records(ref_av_vels_file, 0, &ref);
+    load_records(av_vels_file, 0, &got);
+    failed += compare("av. velocities", &ref, &got, 1, av_vels_names, tolerance, abs_tolerance);
+    free_records(&ref);
+    free_records(&got);
+  }
+
+  printf("%s\n", failed ? "FAILED" : "PASSED");
+
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+void load_records(const char *file, int is_final_state, t_records *records)
+{
+  t_mapped mapped;
+
+  map_file(file, &mapped);
+
+  /* gzip magic: parsed once inflated */
+  if (mapped.size >= 2 && (unsigned char)mapped.data[0] == 0x1f && (unsigned char)mapped.data[1] == 0x8b)
+    inflate_file(file, &mapped);
+
+  if (mapped.size >= sizeof(t_binheader) && !memcmp(mapped.data, BINMAGIC, 8))
+    parse_binary(&mapped, file, is_final_state, records);
+  else
+    parse_text(&mapped, is_final_state, records);
+
+  /* the report names a record of each field, so there has to be one */
+  if (records->n == 0)
+  {
+    char message[1024]; /* message buffer */
+    sprintf(message, "%s holds no records", file);
+    die(message, __LINE__, __FILE__);
+  }
+
+  if (mapped.inflated)
+    free((void *)mapped.data);
+  else if (mapped.size > 0)
+    munmap((void *)mapped.data, mapped.size);
+}
+
+void map_file(const char *file, t_mapped *mapped)
+{
+  char message[1024]; /* message buffer */
+  struct stat st;     /* to find the file size */
+  const int fd = open(file, O_RDONLY);
+
+  if (fd < 0 || fstat(fd, &st) != 0)
+  {
+    sprintf(message, "could not open file: %s", file);
+    die(message, __LINE__, __FILE__);
+  }
+
+  mapped->size = st.st_size;
+  mapped->data = NULL;
+  mapped->inflated = 0;
+
+  if (mapped->size > 0)
+  {
+    mapped->data = mmap(NULL, mapped->size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (mapped->data == MAP_FAILED)
+    {
+      sprintf(message, "could not map file: %s", file);
+      die(message, __LINE__, __FILE__);
+    }
+
+    /* read front to back, once */
+    madvise((void *)mapped->data, mapped->size, MADV_SEQUENTIAL | MADV_WILLNEED);
+  }
+
+  close(fd);
+}
+
+/* replace a mapped gzip file by its contents, every member of it in turn */
+void inflate_file(const char *file, t_mapped *mapped)
+{
+  char message[1024];                /* message buffer */
+  z_stream stream;                   /* the inflate state */
+  size_t room = 4 * mapped->size;    /* bytes allocated, doubled when full */
+  size_t used = 0;                   /* bytes inflated */
+  char *data = (char *)malloc(room); /* the contents */
+
+  memset(&stream, 0, sizeof(stream));
+
+  /* 16 + window bits: gzip members only */
+  if (data == NULL || mapped->size > UINT_MAX || inflateInit2(&stream, 16 + 15) != Z_OK)
+  {
+    sprintf(message, "cannot inflate file: %s", file);
+    die(message, __LINE__, __FILE__);
+  }
+
+  stream.next_in = (Bytef *)mapped->data;
+  stream.avail_in = (uInt)mapped->size;
+
+  for (;;)
+  {
+    if (used == room)
+    {
+      room *= 2;
+      data = (char *)realloc(data, room);
+
+      if (data == NULL)
+        die("cannot allocate memory for an inflated file", __LINE__, __FILE__);
+    }
+
+    const size_t avail = (room - used < (1u << 30)) ? room - used : (1u << 30);
+    stream.next_out = (Bytef *)(data + used);
+    stream.avail_out = (uInt)avail;
+
+    const int status = inflate(&stream, Z_NO_FLUSH);
+    used += avail - stream.avail_out;
+
+    /* the end of a member: the next one, if any, continues the text */
+    if (status == Z_STREAM_END && stream.avail_in == 0)
+      break;
+    else if (status == Z_STREAM_END)
+      inflateReset(&stream);
+    else if ((status != Z_OK && status != Z_BUF_ERROR) || (status == Z_BUF_ERROR && stream.avail_in == 0))
+    {
+      sprintf(message, "corrupt or truncated gzip file: %s", file);
+      die(message, __LINE__, __FILE__);
+    }
+  }
+
+  inflateEnd(&stream);
+  munmap((void *)mapped->data, mapped->size);
+  mapped->data = data;
+  mapped->size = used;
+  mapped->inflated = 1;
+}
+
+void parse_text(const t_mapped *mapped, int is_final_state, t_records *records)
+{
+  const int nthreads = omp_get_max_threads();
+  const char *const end = mapped->data + mapped->size;
+  long *first = calloc(nthreads + 1, sizeof(long)); /* first record of each chunk */
+  const char **start = malloc(sizeof(char *) * (nthreads + 1)); /* first byte of each chunk */
+
+  if (first == NULL || start == NULL)
+    die("cannot allocate memory for chunks", __LINE__, __FILE__);
+
+  /* chunks of roughly equal size, each starting at the beginning of a line */
+  for (int tt = 0; tt <= nthreads; tt++)
+  {
+    const char *p = mapped->data + mapped->size / nthreads * tt;
+
+    if (tt == nthreads)
+      p = end;
+    else if (tt > 0)
+    {
+      while (p < end && p[-1] != '\n')
+        p++;
+    }
+
+    start[tt] = p;
+  }
+
+  /* count the lines of each chunk, then give each chunk its range of records */
+#pragma omp parallel for
+  for (int tt = 0; tt < nthreads; tt++)
+  {
+    long lines = 0;
+
+    for (const char *p = skip_blank(start[tt], start[tt + 1]); p < start[tt + 1];)
+    {
+      const char *eol = memchr(p, '\n', start[tt + 1] - p);
+      p = skip_blank((eol == NULL) ? start[tt + 1] : eol + 1, start[tt + 1]);
+      lines++;
+    }
+
+    first[tt + 1] = lines;
+  }
+
+  for (int tt = 0; tt < nthreads; tt++)
+    first[tt + 1] += first[tt];
+
+  alloc_records(first[nthreads], is_final_state, records);
+  long bad_line = -1; /* first record that could not be parsed */
+
+#pragma omp parallel for
+  for (int tt = 0; tt < nthreads; tt++)
+  {
+    const char *p = start[tt];
+
+    for (long rr = first[tt]; rr < first[tt + 1]; rr++)
+    {
+      p = parse_line(skip_blank(p, start[tt + 1]), start[tt + 1], is_final_state, records, rr);
+
+      if (p == NULL)
+      {
+#pragma omp critical
+        if (bad_line < 0 || rr < bad_line)
+          bad_line = rr;
+        break;
+      }
+    }
+  }
+
+  if (bad_line >= 0)
+  {
+    char message[1024];
+    sprintf(message, "could not parse record %ld (blank lines not counted)", bad_line + 1);
+    die(message, __LINE__, __FILE__);
+  }
+
+  free(first);
+  free(start);
+}
+
+/* the start of the next line with something other than white space on it, or end */
+const char *skip_blank(const char *p, const char *end)
+{
+  const char *line = p; /* start of the line being looked at */
+
+  for (; p < end; p++)
+  {
+    if (*p == '\n')
+      line = p + 1;
+    else if (*p != ' ' && *p != '\t' && *p != '\r')
+      return line;
+  }
+
+  return end;
+}
+
+const char *parse_line(const char *p, const char *end, int is_final_state, t_records *records, long rr)
+{
+  double value;
+
+  /* "%d %d %.12E %.12E %.12E %.12E %d" or "%d:\t%.12E" */
+  if ((p = parse_number(p, end, &value)) == NULL)
+    return NULL;
+  records->ii[rr] = (int)value;
+
+  if (is_final_state)
+  {
+    if ((p = parse_number(p, end, &value)) == NULL)
+      return NULL;
+    records->jj[rr] = (int)value;
+
+    for (int ff = 0; ff < NFIELDS; ff++)
+    {
+      if ((p = parse_number(p, end, &records->field[ff][rr])) == NULL)
+        return NULL;
+    }
+
+    if ((p = parse_number(p, end, &value)) == NULL)
+      return NULL;
+    records->obstacle[rr] = (int)value;
+  }
+  else
+  {
+    records->jj[rr] = 0;
+
+    if (p < end && *p == ':')
+      p++;
+
+    if ((p = parse_number(p, end, &records->field[0][rr])) == NULL)
+      return NULL;
+  }
+
+  /* skip to the next line */
+  while (p < end && *p != '\n')
+    p++;
+
+  return (p < end) ? p + 1 : p;
+}
+
+const char *parse_number(const char *p, const char *end, double *value)
+{
+  /* powers of ten that are exact in a double */
+  static const double exact[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+  unsigned long long mantissa = 0; /* the digits, as an integer */
+  int digits = 0;                  /* significant digits in mantissa */
+  int exponent = 0;                /* power of ten to scale mantissa by */
+  int negative = 0;
+
+  while (p < end && (*p == ' ' || *p == '\t'))
+    p++;
+
+  if (p < end && (*p == '-' || *p == '+'))
+    negative = (*p++ == '-');
+
+  const char *number = p;
+
+  for (; p < end && *p >= '0' && *p <= '9'; p++)
+  {
+    if (digits < 19)
+    {
+      mantissa = mantissa * 10 + (*p - '0');
+      digits += (mantissa > 0);
+    }
+    else
+      exponent++;
+  }
+
+  if (p < end && *p == '.')
+  {
+    for (p++; p < end && *p >= '0' && *p <= '9'; p++)
+    {
+      if (digits < 19)
+      {
+        mantissa = mantissa * 10 + (*p - '0');
+        digits += (mantissa > 0);
+        exponent--;
+      }
+    }
+  }
+
+  if (p == number)
+    return NULL;
+
+  if (p < end && (*p == 'e' || *p == 'E'))
+  {
+    int exp_negative = 0;
+    int exp_value = 0;
+
+    p++;
+    if (p < end && (*p == '-' || *p == '+'))
+      exp_negative = (*p++ == '-');
+
+    for (; p < end && *p >= '0' && *p <= '9'; p++)
+      exp_value = exp_value * 10 + (*p - '0');
+
+    exponent += exp_negative ? -exp_value : exp_value;
+  }
+
+  /* the %.12E values have 13 digits, so one rounding in the scaling */
+  double result = (double)mantissa;
+
+  if (exponent < 0 && -exponent <= 22)
+    result /= exact[-exponent];
+  else if (exponent > 0 && exponent <= 22)
+    result *= exact[exponent];
+  else if (exponent != 0)
+    result *= pow(10.0, exponent);
+
+  *value = negative ? -result : result;
+
+  return p;
+}
+
+void parse_binary(const t_mapped *mapped, const char *file, int is_final_state, t_records *records)
+{
+  char message[1024]; /* message buffer */
+  t_binheader header;
+
+  memcpy(&header, mapped->data, sizeof(header));
+
+  const long n = (long)header.nx * header.ny;
+  const size_t expected = sizeof(header) + (is_final_state ? n * (NFIELDS * sizeof(float) + sizeof(int))
+                                                           : n * sizeof(float));
+
+  if (header.kind != (is_final_state ? BINFINALSTATE : BINAVVELS) || mapped->size < expected)
+  {
+    sprintf(message, "%s is not a complete binary %s file", file, is_final_state ? "final state" : "av. velocity");
+    die(message, __LINE__, __FILE__);
+  }
+
+  alloc_records(n, is_final_state, records);
+  const float *fields = (const float *)(mapped->data + sizeof(header));
+  const int *obstacles = (const int *)(fields + (is_final_state ? NFIELDS * n : n));
+
+#pragma omp parallel for
+  for (long rr = 0; rr < n; rr++)
+  {
+    records->ii[rr] = is_final_state ? (int)(rr % header.nx) : (int)rr;
+    records->jj[rr] = is_final_state ? (int)(rr / header.nx) : 0;
+
+    for (int ff = 0; ff < (is_final_state ? NFIELDS : 1); ff++)
+      records->field[ff][rr] = fields[ff * n + rr];
+
+    if (is_final_state)
+      records->obstacle[rr] = obstacles[rr];
+  }
+}
+
+void alloc_records(long n, int is_final_state, t_records *records)
+{
+  records->n = n;
+  records->ii = malloc(sizeof(int) * (n + 1));
+  records->jj = malloc(sizeof(int) * (n + 1));
+  records->obstacle = is_final_state ? malloc(sizeof(int) * (n + 1)) : NULL;
+
+  for (int ff = 0; ff < NFIELDS; ff++)
+    records->field[ff] = (is_final_state || ff == 0) ? malloc(sizeof(double) * (n + 1)) : NULL;
+
+  if (records->ii == NULL || records->jj == NULL || records->field[0] == NULL ||
+      (is_final_state && (records->obstacle == NULL || records->field[NFIELDS - 1] == NULL)))
+    die("cannot allocate memory for records", __LINE__, __FILE__);
+}
+
+void free_records(t_records *records)
+{
+  free(records->ii);
+  free(records->jj);
+  free(records->obstacle);
+
+  for (int ff = 0; ff < NFIELDS; ff++)
+    free(records->field[ff]);
+}
+
+int compare(const char *what, const t_records *ref, const t_records *got, int nfields,
+            const char *const *names, double tolerance, double abs_tolerance)
+{
+  char message[1024]; /* message buffer */
+  t_error error[NFIELDS];
+  long mismatched = 0; /* records whose coordinates or obstacle flag differ */
+  int failed = 0;
+
+  if (ref->n != got->n)
+  {
+    sprintf(message, "%s: %ld records, but the reference has %ld", what, got->n, ref->n);
+    die(message, __LINE__, __FILE__);
+  }
+
+  for (int ff = 0; ff < nfields; ff++)
+  {
+    double max_abs = 0.0, max_rel = 0.0;
+    long worst = 0, failures = 0;
+
+#pragma omp parallel
+    {
+      double my_abs = 0.0, my_rel = 0.0;
+      long my_worst = 0;
+
+#pragma omp for reduction(+ : failures)
+      for (long rr = 0; rr < ref->n; rr++)
+      {
+        const double diff = fabs(got->field[ff][rr] - ref->field[ff][rr]);
+        const double rel = (ref->field[ff][rr] != 0.0) ? diff / fabs(ref->field[ff][rr]) : (diff > 0.0 ? INFINITY : 0.0);
+
+        /* written so that a NaN counts as a failure */
+        if (!(diff <= abs_tolerance || rel <= tolerance))
+          failures++;
+
+        if (diff > my_abs)
+          my_abs = diff;
+
+        if (diff > abs_tolerance && rel > my_rel)
+        {
+          my_rel = rel;
+          my_worst = rr;
+        }
+      }
+
+#pragma omp critical
+      {
+        if (my_abs > max_abs)
+          max_abs = my_abs;
+
+        if (my_rel > max_rel)
+        {
+          max_rel = my_rel;
+          worst = my_worst;
+        }
+      }
+    }
+
+    error[ff].max_abs = max_abs;
+    error[ff].max_rel = max_rel;
+    error[ff].worst = worst;
+    error[ff].failures = failures;
+  }
+
+#pragma omp parallel for reduction(+ : mismatched)
+  for (long rr = 0; rr < ref->n; rr++)
+  {
+    if (ref->ii[rr] != got->ii[rr] || ref->jj[rr] != got->jj[rr] ||
+        (ref->obstacle != NULL && ref->obstacle[rr] != got->obstacle[rr]))
+      mismatched++;
+  }
+
+  printf("==%s: %ld records==\n", what, ref->n);
+  printf("field\t\tmax abs error\tmax rel error\tworst record\tout of tolerance\n");
+
+  for (int ff = 0; ff < nfields; ff++)
+  {
+    const long rr = error[ff].worst;
+    printf("%-8s\t%.6E\t%.6E\t(%d, %d)\t%ld\n", names[ff], error[ff].max_abs, error[ff].max_rel,
+           ref->ii[rr], ref->jj[rr], error[ff].failures);
+    failed += (error[ff].failures > 0);
+  }
+
+  if (mismatched > 0)
+  {
+    printf("%ld records differ in coordinates or obstacle flag\n", mismatched);
+    failed++;
+  }
+
+  return failed;
+}
+
+void die(const char *message, const int line, const char *file)
+{
+  fprintf(stderr, "Error at line %d of file %s:\n", line, file);
+  fprintf(stderr, "%s\n", message);
+  fflush(stderr);
+  exit(EXIT_FAILURE);
+}
+
+void usage(const char *exe)
+{
+  fprintf(stderr, "Usage: %s --ref-final-state-file=<file> --final-state-file=<file>\n", exe);
+  fprintf(stderr, "          --ref-av-vels-file=<file> --av-vels-file=<file>\n");
+  fprintf(stderr, "          [--tolerance=<relative, default 1e-2>] [--abs-tolerance=<default 1e-10>]\n");
+  fprintf(stderr, "Either pair of files may be omitted. Text, gzipped text and binary files may be mixed.\n");
+  exit(EXIT_FAILURE);
+}
@@ -0,0 +1,246 @@
+/* Generated by codegen/ddqq.py from the D2Q9 descriptor: edit the descriptor, not this file. */
+
+#ifndef D2Q9_GEN_H
+#define D2Q9_GEN_H
+
+/*
+** D2Q9: 9 velocities
+**   s0  c = ( 0,  0)  w = 4/9    opposite s0
+**   s1  c = ( 1,  0)  w = 1/9    opposite s3
+**   s2  c = ( 0,  1)  w = 1/9    opposite s4
+**   s3  c = (-1,  0)  w = 1/9    opposite s1
+**   s4  c = ( 0, -1)  w = 1/9    opposite s2
+**   s5  c = ( 1,  1)  w = 1/36   opposite s7
+**   s6  c = (-1,  1)  w = 1/36   opposite s8
+**   s7  c = (-1, -1)  w = 1/36   opposite s5
+**   s8  c = ( 1, -1)  w = 1/36   opposite s6
+*/
+
+static inline float timestep_d2q9(const t_param params, t_speeds *restrict cells, t_speeds *restrict tmp_cells, int *obstacles)
+{
+  int tot_cells = 0;
+  float tot_u = 0.f;
+
+  __assume_aligned(cells->s0, 64);
+  __assume_aligned(cells->s1, 64);
+  __assume_aligned(cells->s2, 64);
+  __assume_aligned(cells->s3, 64);
+  __assume_aligned(cells->s4, 64);
+  __assume_aligned(cells->s5, 64);
+  __assume_aligned(cells->s6, 64);
+  __assume_aligned(cells->s7, 64);
+  __assume_aligned(cells->s8, 64);
+  __assume_aligned(tmp_cells->s0, 64);
+  __assume_aligned(tmp_cells->s1, 64);
+  __assume_aligned(tmp_cells->s2, 64);
+  __assume_aligned(tmp_cells->s3, 64);
+  __assume_aligned(tmp_cells->s4, 64);
+  __assume_aligned(tmp_cells->s5, 64);
+  __assume_aligned(tmp_cells->s6, 64);
+  __assume_aligned(tmp_cells->s7, 64);
+  __assume_aligned(tmp_cells->s8, 64);
+
+#pragma omp parallel for reduction(+ : tot_cells) reduction(+ : tot_u)
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+    const int y_s = (jj == 0) ? (jj + params.ny - 1) : (jj - 1);
+    const int y_n = (jj + 1) % params.ny;
+#pragma omp simd reduction(+ : tot_cells) reduction(+ : tot_u)
+    for (int ii = 0; ii < params.nx; ii++)
+    {
+      const int x_e = (ii + 1) % params.nx;
+      const int x_w = (ii == 0) ? (ii + params.nx - 1) : (ii - 1);
+
+      /* propagate: pull each population from the cell upstream of it */
+      const float f0 = cells->s0[ii + jj * params.nx];
+      const float f1 = cells->s1[x_w + jj * params.nx];
+      const float f2 = cells->s2[ii + y_s * params.nx];
+      const float f3 = cells->s3[x_e + jj * params.nx];
+      const float f4 = cells->s4[ii + y_n * params.nx];
+      const float f5 = cells->s5[x_w + y_s * params.nx];
+      const float f6 = cells->s6[x_e + y_s * params.nx];
+      const float f7 = cells->s7[x_e + y_n * params.nx];
+      const float f8 = cells->s8[x_w + y_n * params.nx];
+
+      /* rebound: reverse the populations of occupied cells */
+      if (obstacles[ii + jj * params.nx])
+      {
+        tmp_cells->s3[ii + jj * params.nx] = f1;
+        tmp_cells->s4[ii + jj * params.nx] = f2;
+        tmp_cells->s1[ii + jj * params.nx] = f3;
+        tmp_cells->s2[ii + jj * params.nx] = f4;
+        tmp_cells->s7[ii + jj * params.nx] = f5;
+        tmp_cells->s8[ii + jj * params.nx] = f6;
+        tmp_cells->s5[ii + jj * params.nx] = f7;
+        tmp_cells->s6[ii + jj * params.nx] = f8;
+      }
+      /* collision: relax towards the second order equilibrium */
+      else
+      {
+        const float local_density = f0 + f1 + f2 + f3 + f4 + f5 + f6 + f7 + f8;
+        const float u_x = (f1 + f5 + f8 - (f3 + f6 + f7)) / local_density;
+        const float u_y = (f2 + f5 + f6 - (f4 + f7 + f8)) / local_density;
+        const float u_sq = u_x * u_x + u_y * u_y;
+
+        tmp_cells->s0[ii + jj * params.nx] = f0 + params.omega * (4.f / 9.f * local_density * (1.f - u_sq * 1.5f) - f0);
+        const float cu1 = u_x;
+        tmp_cells->s1[ii + jj * params.nx] = f1 + params.omega * (1.f / 9.f * local_density * (1.f + cu1 * 3.f + (cu1 * cu1) * 4.5f - u_sq * 1.5f) - f1);
+        const float cu2 = u_y;
+        tmp_cells->s2[ii + jj * params.nx] = f2 + params.omega * (1.f / 9.f * local_density * (1.f + cu2 * 3.f + (cu2 * cu2) * 4.5f - u_sq * 1.5f) - f2);
+        const float cu3 = -u_x;
+        tmp_cells->s3[ii + jj * params.nx] = f3 + params.omega * (1.f / 9.f * local_density * (1.f + cu3 * 3.f + (cu3 * cu3) * 4.5f - u_sq * 1.5f) - f3);
+        const float cu4 = -u_y;
+        tmp_cells->s4[ii + jj * params.nx] = f4 + params.omega * (1.f / 9.f * local_density * (1.f + cu4 * 3.f + (cu4 * cu4) * 4.5f - u_sq * 1.5f) - f4);
+        const float cu5 = u_x + u_y;
+        tmp_cells->s5[ii + jj * params.nx] = f5 + params.omega * (1.f / 36.f * local_density * (1.f + cu5 * 3.f + (cu5 * cu5) * 4.5f - u_sq * 1.5f) - f5);
+        const float cu6 = -u_x + u_y;
+        tmp_cells->s6[ii + jj * params.nx] = f6 + params.omega * (1.f / 36.f * local_density * (1.f + cu6 * 3.f + (cu6 * cu6) * 4.5f - u_sq * 1.5f) - f6);
+        const float cu7 = -u_x - u_y;
+        tmp_cells->s7[ii + jj * params.nx] = f7 + params.omega * (1.f / 36.f * local_density * (1.f + cu7 * 3.f + (cu7 * cu7) * 4.5f - u_sq * 1.5f) - f7);
+        const float cu8 = u_x - u_y;
+        tmp_cells->s8[ii + jj * params.nx] = f8 + params.omega * (1.f / 36.f * local_density * (1.f + cu8 * 3.f + (cu8 * cu8) * 4.5f - u_sq * 1.5f) - f8);
+
+        /* average speed */
+        tot_cells = tot_cells + 1;
+        tot_u = tot_u + sqrtf(u_sq);
+      }
+    }
+  }
+
+  return tot_u / (float)tot_cells;
+}
+
+static inline void macroscopic_d2q9(const t_param params, t_speeds *cells, float *rho, float *u_x, float *u_y)
+{
+#pragma omp parallel for
+  for (int jj = 0; jj < params.ny; jj++)
+  {
+#pragma omp simd
+    for (int ii = 0; ii < params.nx; ii++)
+    {
+      const float f0 = cells->s0[ii + jj * params.nx];
+      const float f1 = cells->s1[ii + jj * params.nx];
+      const float f2 = cells->s2[ii + jj * params.nx];
+      const float f3 = cells->s3[ii + jj * params.nx];
+      const float f4 = cells->s4[ii + jj * params.nx];
+      const float f5 = cells->s5[ii + jj * params.nx];
+      const float f6 = cells->s6[ii + jj * params.nx];
+      const float f7 = cells->s7[ii + jj * params.nx];
+      const float f8 = cells->s8[ii + jj * params.nx];
+      const float local_density = f0 + f1 + f2 + f3 + f4 + f5 + f6 + f7 + f8;
+      rho[ii + jj * params.nx] = local_density;
+      u_x[ii + jj * params.nx] = (f1 + f5 + f8 - (f3 + f6 + f7)) / local_density;
+      u_y[ii + jj * params.nx] = (f2 + f5 + f6 - (f4 + f7 + f8)) / local_density;
+    }
+  }
+}
+
+/*
+** Run steps timesteps from random populations about rest, with every
+** solid_every-th cell solid (none if 0), and set *mass and *momentum
+** to the change of the totals relative to the mass. Streaming and
+** rebound move every population once and collision keeps the moments,
+** so both are conserved to rounding, the momentum only without walls.
+*/
+static inline void conservation_d2q9(const t_param params, int steps, int solid_every, double *mass, double *momentum)
+{
+  const int ncells = params.nx * params.ny;
+  const size_t bytes = sizeof(float) * ncells;
+  float *rho = (float *)malloc(bytes * 3);
+  int *obstacles = (int *)malloc(sizeof(int) * ncells);
+  double before[3] = {0}, after[3] = {0};
+  unsigned int seed = 12345u;
+  t_speeds cells, tmp_cells, swap;
+
+  cells.s0 = (float *)_mm_malloc(bytes, 64);
+  cells.s1 = (float *)_mm_malloc(bytes, 64);
+  cells.s2 = (float *)_mm_malloc(bytes, 64);
+  cells.s3 = (float *)_mm_malloc(bytes, 64);
+  cells.s4 = (float *)_mm_malloc(bytes, 64);
+  cells.s5 = (float *)_mm_malloc(bytes, 64);
+  cells.s6 = (float *)_mm_malloc(bytes, 64);
+  cells.s7 = (float *)_mm_malloc(bytes, 64);
+  cells.s8 = (float *)_mm_malloc(bytes, 64);
+  tmp_cells.s0 = (float *)_mm_malloc(bytes, 64);
+  tmp_cells.s1 = (float *)_mm_malloc(bytes, 64);
+  tmp_cells.s2 = (float *)_mm_malloc(bytes, 64);
+  tmp_cells.s3 = (float *)_mm_malloc(bytes, 64);
+  tmp_cells.s4 = (float *)_mm_malloc(bytes, 64);
+  tmp_cells.s5 = (float *)_mm_malloc(bytes, 64);
+  tmp_cells.s6 = (float *)_mm_malloc(bytes, 64);
+  tmp_cells.s7 = (float *)_mm_malloc(bytes, 64);
+  tmp_cells.s8 = (float *)_mm_malloc(bytes, 64);
+
+  for (int ii = 0; ii < ncells; ii++)
+  {
+    obstacles[ii] = solid_every > 0 && ii % solid_every == 0;
+    seed = seed * 1664525u + 1013904223u;
+    cells.s0[ii] = tmp_cells.s0[ii] = 4.f / 9.f * (0.9f + 0.2f * (float)(seed >> 8) / 16777216.f);
+    seed = seed * 1664525u + 1013904223u;
+    cells.s1[ii] = tmp_cells.s1[ii] = 1.f / 9.f * (0.9f + 0.2f * (float)(seed >> 8) / 16777216.f);
+    seed = seed * 1664525u + 1013904223u;
+    cells.s2[ii] = tmp_cells.s2[ii] = 1.f / 9.f * (0.9f + 0.2f * (float)(seed >> 8) / 16777216.f);
+    seed = seed * 1664525u + 1013904223u;
+    cells.s3[ii] = tmp_cells.s3[ii] = 1.f / 9.f * (0.9f + 0.2f * (float)(seed >> 8) / 16777216.f);
+    seed = seed * 1664525u + 1013904223u;
+    cells.s4[ii] = tmp_cells.s4[ii] = 1.f / 9.f * (0.9f + 0.2f * (float)(seed >> 8) / 16777216.f);
+    seed = seed * 1664525u + 1013904223u;
+    cells.s5[ii] = tmp_cells.s5[ii] = 1.f / 36.f * (0.9f + 0.2f * (float)(seed >> 8) / 16777216.f);
+    seed = seed * 1664525u + 1013904223u;
+    cells.s6[ii] = tmp_cells.s6[ii] = 1.f / 36.f * (0.9f + 0.2f * (float)(seed >> 8) / 16777216.f);
+    seed = seed * 1664525u + 1013904223u;
+    cells.s7[ii] = tmp_cells.s7[ii] = 1.f / 36.f * (0.9f + 0.2f * (float)(seed >> 8) / 16777216.f);
+    seed = seed * 1664525u + 1013904223u;
+    cells.s8[ii] = tmp_cells.s8[ii] = 1.f / 36.f * (0.9f + 0.2f * (float)(seed >> 8) / 16777216.f);
+  }
+
+  for (int pass = 0; pass < 2; pass++)
+  {
+    double *total = pass ? after : before;
+
+    for (int tt = 0; pass && tt < steps; tt++)
+    {
+      timestep_d2q9(params, &cells, &tmp_cells, obstacles);
+      swap = cells;
+      cells = tmp_cells;
+      tmp_cells = swap;
+    }
+    macroscopic_d2q9(params, &cells, rho, rho + 1 * ncells, rho + 2 * ncells);
+    for (int ii = 0; ii < ncells; ii++)
+    {
+      total[0] += rho[ii];
+      total[1] += (double)rho[ii] * rho[1 * ncells + ii];
+      total[2] += (double)rho[ii] * rho[2 * ncells + ii];
+    }
+  }
+
+  *mass = fabs(after[0] - before[0]) / before[0];
+  *momentum = 0.0;
+  for (int aa = 1; aa < 3; aa++)
+  {
+    *momentum = fmax(*momentum, fabs(after[aa] - before[aa]) / before[0]);
+  }
+
+  _mm_free(cells.s0);
+  _mm_free(cells.s1);
+  _mm_free(cells.s2);
+  _mm_free(cells.s3);
+  _mm_free(cells.s4);
+  _mm_free(cells.s5);
+  _mm_free(cells.s6);
+  _mm_free(cells.s7);
+  _mm_free(cells.s8);
+  _mm_free(tmp_cells.s0);
+  _mm_free(tmp_cells.s1);
+  _mm_free(tmp_cells.s2);
+  _mm_free(tmp_cells.s3);
+  _mm_free(tmp_cells.s4);
+  _mm_free(tmp_cells.s5);
+  _mm_free(tmp_cells.s6);
+  _mm_free(tmp_cells.s7);
+  _mm_free(tmp_cells.s8);
+  free(obstacles);
+  free(rho);
+}
+
+#endif
@@ -0,0 +1,432 @@
+/* Generated by codegen/ddqq.py from the D3Q19 descriptor: edit the descriptor, not this file. */
+
+#ifndef D3Q19_GEN_H
+#define D3Q19_GEN_H
+
+/*
+** D3Q19: 19 velocities
+**   s0  c = ( 0,  0,  0)  w = 1/3    opposite s0
+**   s1  c = ( 1,  0,  0)  w = 1/18   opposite s2
+**   s2  c = (-1,  0,  0)  w = 1/18   opposite s1
+**   s3  c = ( 0,  1,  0)  w = 1/18   opposite s4
+**   s4  c = ( 0, -1,  0)  w = 1/18   opposite s3
+**   s5  c = ( 0,  0,  1)  w = 1/18   opposite s6
+**   s6  c = ( 0,  0, -1)  w = 1/18   opposite s5
+**   s7  c = ( 1,  1,  0)  w = 1/36   opposite s8
+**   s8  c = (-1, -1,  0)  w = 1/36   opposite s7
+**   s9  c = ( 1, -1,  0)  w = 1/36   opposite s10
+**   s10 c = (-1,  1,  0)  w = 1/36   opposite s9
+**   s11 c = ( 1,  0,  1)  w = 1/36   opposite s12
+**   s12 c = (-1,  0, -1)  w = 1/36   opposite s11
+**   s13 c = ( 1,  0, -1)  w = 1/36   opposite s14
+**   s14 c = (-1,  0,  1)  w = 1/36   opposite s13
+**   s15 c = ( 0,  1,  1)  w = 1/36   opposite s16
+**   s16 c = ( 0, -1, -1)  w = 1/36   opposite s15
+**   s17 c = ( 0,  1, -1)  w = 1/36   opposite s18
+**   s18 c = ( 0, -1,  1)  w = 1/36   opposite s17
+*/
+
+#include <math.h>
+#include <stdlib.h>
+#include <x86intrin.h>
+
+typedef struct
+{
+  int nx;      /* no. of cells in x-direction */
+  int ny;      /* no. of cells in y-direction */
+  int nz;      /* no. of cells in z-direction */
+  float omega; /* relaxation parameter */
+} t_d3q19_param;
+
+typedef struct
+{
+  float *s0;
+  float *s1;
+  float *s2;
+  float *s3;
+  float *s4;
+  float *s5;
+  float *s6;
+  float *s7;
+  float *s8;
+  float *s9;
+  float *s10;
+  float *s11;
+  float *s12;
+  float *s13;
+  float *s14;
+  float *s15;
+  float *s16;
+  float *s17;
+  float *s18;
+} t_d3q19_speeds;
+
+static inline float timestep_d3q19(const t_d3q19_param params, t_d3q19_speeds *restrict cells, t_d3q19_speeds *restrict tmp_cells, int *obstacles)
+{
+  int tot_cells = 0;
+  float tot_u = 0.f;
+
+  __assume_aligned(cells->s0, 64);
+  __assume_aligned(cells->s1, 64);
+  __assume_aligned(cells->s2, 64);
+  __assume_aligned(cells->s3, 64);
+  __assume_aligned(cells->s4, 64);
+  __assume_aligned(cells->s5, 64);
+  __assume_aligned(cells->s6, 64);
+  __assume_aligned(cells->s7, 64);
+  __assume_aligned(cells->s8, 64);
+  __assume_aligned(cells->s9, 64);
+  __assume_aligned(cells->s10, 64);
+  __assume_aligned(cells->s11, 64);
+  __assume_aligned(cells->s12, 64);
+  __assume_aligned(cells->s13, 64);
+  __assume_aligned(cells->s14, 64);
+  __assume_aligned(cells->s15, 64);
+  __assume_aligned(cells->s16, 64);
+  __assume_aligned(cells->s17, 64);
+  __assume_aligned(cells->s18, 64);
+  __assume_aligned(tmp_cells->s0, 64);
+  __assume_aligned(tmp_cells->s1, 64);
+  __assume_aligned(tmp_cells->s2, 64);
+  __assume_aligned(tmp_cells->s3, 64);
+  __assume_aligned(tmp_cells->s4, 64);
+  __assume_aligned(tmp_cells->s5, 64);
+  __assume_aligned(tmp_cells->s6, 64);
+  __assume_aligned(tmp_cells->s7, 64);
+  __assume_aligned(tmp_cells->s8, 64);
+  __assume_aligned(tmp_cells->s9, 64);
+  __assume_aligned(tmp_cells->s10, 64);
+  __assume_aligned(tmp_cells->s11, 64);
+  __assume_aligned(tmp_cells->s12, 64);
+  __assume_aligned(tmp_cells->s13, 64);
+  __assume_aligned(tmp_cells->s14, 64);
+  __assume_aligned(tmp_cells->s15, 64);
+  __assume_aligned(tmp_cells->s16, 64);
+  __assume_aligned(tmp_cells->s17, 64);
+  __assume_aligned(tmp_cells->s18, 64);
+
+#pragma omp parallel for collapse(2) reduction(+ : tot_cells) reduction(+ : tot_u)
+  for (int kk = 0; kk < params.nz; kk++)
+  {
+    for (int jj = 0; jj < params.ny; jj++)
+    {
+      const int z_d = (kk == 0) ? (kk + params.nz - 1) : (kk - 1);
+      const int z_u = (kk + 1) % params.nz;
+      const int y_s = (jj == 0) ? (jj + params.ny - 1) : (jj - 1);
+      const int y_n = (jj + 1) % params.ny;
+#pragma omp simd reduction(+ : tot_cells) reduction(+ : tot_u)
+      for (int ii = 0; ii < params.nx; ii++)
+      {
+        const int x_e = (ii + 1) % params.nx;
+        const int x_w = (ii == 0) ? (ii + params.nx - 1) : (ii - 1);
+
+        /* propagate: pull each population from the cell upstream of it */
+        const float f0 = cells->s0[ii + (jj + kk * params.ny) * params.nx];
+        const float f1 = cells->s1[x_w + (jj + kk * params.ny) * params.nx];
+        const float f2 = cells->s2[x_e + (jj + kk * params.ny) * params.nx];
+        const float f3 = cells->s3[ii + (y_s + kk * params.ny) * params.nx];
+        const float f4 = cells->s4[ii + (y_n + kk * params.ny) * params.nx];
+        const float f5 = cells->s5[ii + (jj + z_d * params.ny) * params.nx];
+        const float f6 = cells->s6[ii + (jj + z_u * params.ny) * params.nx];
+        const float f7 = cells->s7[x_w + (y_s + kk * params.ny) * params.nx];
+        const float f8 = cells->s8[x_e + (y_n + kk * params.ny) * params.nx];
+        const float f9 = cells->s9[x_w + (y_n + kk * params.ny) * params.nx];
+        const float f10 = cells->s10[x_e + (y_s + kk * params.ny) * params.nx];
+        const float f11 = cells->s11[x_w + (jj + z_d * params.ny) * params.nx];
+        const float f12 = cells->s12[x_e + (jj + z_u * params.ny) * params.nx];
+        const float f13 = cells->s13[x_w + (jj + z_u * params.ny) * params.nx];
+        const float f14 = cells->s14[x_e + (jj + z_d * params.ny) * params.nx];
+        const float f15 = cells->s15[ii + (y_s + z_d * params.ny) * params.nx];
+        const float f16 = cells->s16[ii + (y_n + z_u * params.ny) * params.nx];
+        const float f17 = cells->s17[ii + (y_s + z_u * params.ny) * params.nx];
+        const float f18 = cells->s18[ii + (y_n + z_d * params.ny) * params.nx];
+
+        /* rebound: reverse the populations of occupied cells */
+        if (obstacles[ii + (jj + kk * params.ny) * params.nx])
+        {
+          tmp_cells->s2[ii + (jj + kk * params.ny) * params.nx] = f1;
+          tmp_cells->s1[ii + (jj + kk * params.ny) * params.nx] = f2;
+          tmp_cells->s4[ii + (jj + kk * params.ny) * params.nx] = f3;
+          tmp_cells->s3[ii + (jj + kk * params.ny) * params.nx] = f4;
+          tmp_cells->s6[ii + (jj + kk * params.ny) * params.nx] = f5;
+          tmp_cells->s5[ii + (jj + kk * params.ny) * params.nx] = f6;
+          tmp_cells->s8[ii + (jj + kk * params.ny) * params.nx] = f7;
+          tmp_cells->s7[ii + (jj + kk * params.ny) * params.nx] = f8;
+          tmp_cells->s10[ii + (jj + kk * params.ny) * params.nx] = f9;
+          tmp_cells->s9[ii + (jj + kk * params.ny) * params.nx] = f10;
+          tmp_cells->s12[ii + (jj + kk * params.ny) * params.nx] = f11;
+          tmp_cells->s11[ii + (jj + kk * params.ny) * params.nx] = f12;
+          tmp_cells->s14[ii + (jj + kk * params.ny) * params.nx] = f13;
+          tmp_cells->s13[ii + (jj + kk * params.ny) * params.nx] = f14;
+          tmp_cells->s16[ii + (jj + kk * params.ny) * params.nx] = f15;
+          tmp_cells->s15[ii + (jj + kk * params.ny) * params.nx] = f16;
+          tmp_cells->s18[ii + (jj + kk * params.ny) * params.nx] = f17;
+          tmp_cells->s17[ii + (jj + kk * params.ny) * params.nx] = f18;
+        }
+        /* collision: relax towards the second order equilibrium */
+        else
+        {
+          const float local_density = f0 + f1 + f2 + f3 + f4 + f5 + f6 + f7 + f8 + f9 + f10 + f11 + f12 + f13 + f14 + f15 + f16 + f17 + f18;
+          const float u_x = (f1 + f7 + f9 + f11 + f13 - (f2 + f8 + f10 + f12 + f14)) / local_density;
+          const float u_y = (f3 + f7 + f10 + f15 + f17 - (f4 + f8 + f9 + f16 + f18)) / local_density;
+          const float u_z = (f5 + f11 + f14 + f15 + f18 - (f6 + f12 + f13 + f16 + f17)) / local_density;
+          const float u_sq = u_x * u_x + u_y * u_y + u_z * u_z;
+
+          tmp_cells->s0[ii + (jj + kk * params.ny) * params.nx] = f0 + params.omega * (1.f / 3.f * local_density * (1.f - u_sq * 1.5f) - f0);
+          const float cu1 = u_x;
+          tmp_cells->s1[ii + (jj + kk * params.ny) * params.nx] = f1 + params.omega * (1.f / 18.f * local_density * (1.f + cu1 * 3.f + (cu1 * cu1) * 4.5f - u_sq * 1.5f) - f1);
+          const float cu2 = -u_x;
+          tmp_cells->s2[ii + (jj + kk * params.ny) * params.nx] = f2 + params.omega * (1.f / 18.f * local_density * (1.f + cu2 * 3.f + (cu2 * cu2) * 4.5f - u_sq * 1.5f) - f2);
+          const float cu3 = u_y;
+          tmp_cells->s3[ii + (jj + kk * params.ny) * params.nx] = f3 + params.omega * (1.f / 18.f * local_density * (1.f + cu3 * 3.f + (cu3 * cu3) * 4.5f - u_sq * 1.5f) - f3);
+          const float cu4 = -u_y;
+          tmp_cells->s4[ii + (jj + kk * params.ny) * params.nx] = f4 + params.omega * (1.f / 18.f * local_density * (1.f + cu4 * 3.f + (cu4 * cu4) * 4.5f - u_sq * 1.5f) - f4);
+          const float cu5 = u_z;
+          tmp_cells->s5[ii + (jj + kk * params.ny) * params.nx] = f5 + params.omega * (1.f / 18.f * local_density * (1.f + cu5 * 3.f + (cu5 * cu5) * 4.5f - u_sq * 1.5f) - f5);
+          const float cu6 = -u_z;
+          tmp_cells->s6[ii + (jj + kk * params.ny) * params.nx] = f6 + params.omega * (1.f / 18.f * local_density * (1.f + cu6 * 3.f + (cu6 * cu6) * 4.5f - u_sq * 1.5f) - f6);
+          const float cu7 = u_x + u_y;
+          tmp_cells->s7[ii + (jj + kk * params.ny) * params.nx] = f7 + params.omega * (1.f / 36.f * local_density * (1.f + cu7 * 3.f + (cu7 * cu7) * 4.5f - u_sq * 1.5f) - f7);
+          const float cu8 = -u_x - u_y;
+          tmp_cells->s8[ii + (jj + kk * params.ny) * params.nx] = f8 + params.omega * (1.f / 36.f * local_density * (1.f + cu8 * 3.f + (cu8 * cu8) * 4.5f - u_sq * 1.5f) - f8);
+          const float cu9 = u_x - u_y;
+          tmp_cells->s9[ii + (jj + kk * params.ny) * params.nx] = f9 + params.omega * (1.f / 36.f * local_density * (1.f + cu9 * 3.f + (cu9 * cu9) * 4.5f - u_sq * 1.5f) - f9);
+          const float cu10 = -u_x + u_y;
+          tmp_cells->s10[ii + (jj + kk * params.ny) * params.nx] = f10 + params.omega * (1.f / 36.f * local_density * (1.f + cu10 * 3.f + (cu10 * cu10) * 4.5f - u_sq * 1.5f) - f10);
+          const float cu11 = u_x + u_z;
+          tmp_cells->s11[ii + (jj + kk * params.ny) * params.nx] = f11 + params.omega * (1.f / 36.f * local_density * (1.f + cu11 * 3.f + (cu11 * cu11) * 4.5f - u_sq * 1.5f) - f11);
+          const float cu12 = -u_x - u_z;
+          tmp_cells->s12[ii + (jj + kk * params.ny) * params.nx] = f12 + params.omega * (1.f / 36.f * local_density * (1.f + cu12 * 3.f + (cu12 * cu12) * 4.5f - u_sq * 1.5f) - f12);
+          const float cu13 = u_x - u_z;
+          tmp_cells->s13[ii + (jj + kk * params.ny) * params.nx] = f13 + params.omega * (1.f / 36.f * local_density * (1.f + cu13 * 3.f + (cu13 * cu13) * 4.5f - u_sq * 1.5f) - f13);
+          const float cu14 = -u_x + u_z;
+          tmp_cells->s14[ii + (jj + kk * params.ny) * params.nx] = f14 + params.omega * (1.f / 36.f * local_density * (1.f + cu14 * 3.f + (cu14 * cu14) * 4.5f - u_sq * 1.5f) - f14);
+          const float cu15 = u_y + u_z;
+          tmp_cells->s15[ii + (jj + kk * params.ny) * params.nx] = f15 + params.omega * (1.f / 36.f * local_density * (1.f + cu15 * 3.f + (cu15 * cu15) * 4.5f - u_sq * 1.5f) - f15);
+          const float cu16 = -u_y - u_z;
+          tmp_cells->s16[ii + (jj + kk * params.ny) * params.nx] = f16 + params.omega * (1.f / 36.f * local_density * (1.f + cu16 * 3.f + (cu16 * cu16) * 4.5f - u_sq * 1.5f) - f16);
+          const float cu17 = u_y - u_z;
+          tmp_cells->s17[ii + (jj + kk * params.ny) * params.nx] = f17 + params.omega * (1.f / 36.f * local_density * (1.f + cu17 * 3.f + (cu17 * cu17) * 4.5f - u_sq * 1.5f) - f17);
+          const float cu18 = -u_y + u_z;
+          tmp_cells->s18[ii + (jj + kk * params.ny) * params.nx] = f18 + params.omega * (1.f / 36.f * local_density * (1.f + cu18 * 3.f + (cu18 * cu18) * 4.5f - u_sq * 1.5f) - f18);
+
+          /* average speed */
+          tot_cells = tot_cells + 1;
+          tot_u = tot_u + sqrtf(u_sq);
+        }
+      }
+    }
+  }
+
+  return tot_u / (float)tot_cells;
+}
+
+static inline void macroscopic_d3q19(const t_d3q19_param params, t_d3q19_speeds *cells, float *rho, float *u_x, float *u_y, float *u_z)
+{
+#pragma omp parallel for collapse(2)
+  for (int kk = 0; kk < params.nz; kk++)
+  {
+    for (int jj = 0; jj < params.ny; jj++)
+    {
+#pragma omp simd
+      for (int ii = 0; ii < params.nx; ii++)
+      {
+        const float f0 = cells->s0[ii + (jj + kk * params.ny) * params.nx];
+        const float f1 = cells->s1[ii + (jj + kk * params.ny) * params.nx];
+        const float f2 = cells->s2[ii + (jj + kk * params.ny) * params.nx];
+        const float f3 = cells->s3[ii + (jj + kk * params.ny) * params.nx];
+        const float f4 = cells->s4[ii + (jj + kk * params.ny) * params.nx];
+        const float f5 = cells->s5[ii + (jj + kk * params.ny) * params.nx];
+        const float f6 = cells->s6[ii + (jj + kk * params.ny) * params.nx];
+        const float f7 = cells->s7[ii + (jj + kk * params.ny) * params.nx];
+        const float f8 = cells->s8[ii + (jj + kk * params.ny) * params.nx];
+        const float f9 = cells->s9[ii + (jj + kk * params.ny) * params.nx];
+        const float f10 = cells->s10[ii + (jj + kk * params.ny) * params.nx];
+        const float f11 = cells->s11[ii + (jj + kk * params.ny) * params.nx];
+        const float f12 = cells->s12[ii + (jj + kk * params.ny) * params.nx];
+        const float f13 = cells->s13[ii + (jj + kk * params.ny) * params.nx];
+        const float f14 = cells->s14[ii + (jj + kk * params.ny) * params.nx];
+        const float f15 = cells->s15[ii + (jj + kk * params.ny) * params.nx];
+        const float f16 = cells->s16[ii + (jj + kk * params.ny) * params.nx];
+        const float f17 = cells->s17[ii + (jj + kk * params.ny) * params.nx];
+        const float f18 = cells->s18[ii + (jj + kk * params.ny) * params.nx];
+        const float local_density = f0 + f1 + f2 + f3 + f4 + f5 + f6 + f7 + f8 + f9 + f10 + f11 + f12 + f13 + f14 + f15 + f16 + f17 + f18;
+        rho[ii + (jj + kk * params.ny) * params.nx] = local_density;
+        u_x[ii + (jj + kk * params.ny) * params.nx] = (f1 + f7 + f9 + f11 + f13 - (f2 + f8 + f10 + f12 + f14)) / local_density;
+        u_y[ii + (jj + kk * params.ny) * params.nx] = (f3 + f7 + f10 + f15 + f17 - (f4 + f8 + f9 + f16 + f18)) / local_density;
+        u_z[ii + (jj + kk * params.ny) * params.nx] = (f5 + f11 + f14 + f15 + f18 - (f6 + f12 + f13 + f16 + f17)) / local_density;
+      }
+    }
+  }
+}
+
+/*
+** Run steps timesteps from random populations about rest, with every
+** solid_every-th cell solid (none if 0), and set *mass and *momentum
+** to the change of the totals relative to the mass. Streaming and
+** rebound move every population once and collision keeps the moments,
+** so both are conserved to rounding, the momentum only without walls.
+*/
+static inline void conservation_d3q19(const t_d3q19_param params, int steps, int solid_every, double *mass, double *momentum)
+{
+  const int ncells = params.nx * params.ny * params.nz;
+  const size_t bytes = sizeof(float) * ncells;
+  float *rho = (float *)malloc(bytes * 4);
+  int *obstacles = (int *)malloc(sizeof(int) * ncells);
+  double before[4] = {0}, after[4] = {0};
+  unsigned int seed = 12345u;
+  t_d3q19_speeds cells, tmp_cells, swap;
+
+  cells.s0 = (float *)_mm_malloc(bytes, 64);
+  cells.s1 = (float *)_mm_malloc(bytes, 64);
+  cells.s2 = (float *)_mm_malloc(bytes, 64);
+  cells.s3 = (float *)_mm_malloc(bytes, 64);
+  cells.s4 = (float *)_mm_malloc(bytes, 64);
+  cells.s5 = (float *)_mm_malloc(bytes, 64);
+  cells.s6 = (float *)_mm_malloc(bytes, 64);
+  cells.s7 = (float *)_mm_malloc(bytes, 64);
+  cells.s8 = (float *)_mm_malloc(bytes, 64);
+  cells.s9 = (float *)_mm_malloc(bytes, 64);
+  cells.s10 = (float *)_mm_malloc(bytes, 64);
+  cells.s11 = (float *)_mm_malloc(bytes, 64);
+  cells.s12 = (float *)_mm_malloc(bytes, 64);
+  cells.s13 = (float *)_mm_malloc(bytes, 64);
+  cells.s14 = (float *)_mm_malloc(bytes, 64);
+  cells.s15 = (float *)_mm_malloc(bytes, 64);
+  cells.s16 = (float *)_mm_malloc(bytes, 64);
+  cells.s17 = (float *)_mm_malloc(bytes, 64);
+  cells.s18 = (float *)_mm_malloc(bytes, 64);
+  tmp_cells.s0 = (float *)_mm_malloc(bytes, 64);
+  tmp_cells.s1 = (float *)_mm_malloc(bytes, 64);
+  tmp_cells.s2 = (float *)_mm_malloc(bytes, 64);
+  tmp_cells.s3 = (float *)_mm_malloc(bytes, 64);
+  tmp_cells.s4 = (float *)_mm_malloc(bytes, 64);
+  tmp_cells.s5 = (float *)_mm_malloc(bytes, 64);
+  tmp_cells.s6 = (float *)_mm_malloc(bytes, 64);
+  tmp_cells.s7 = (float *)_mm_malloc(bytes, 64);
+  tmp_cells.s8 = (float *)_mm_malloc(bytes, 64);
+  tmp_cells.s9 = (float *)_mm_malloc(bytes, 64);
+  tmp_cells.s10 = (float *)_mm_malloc(bytes, 64);
+  tmp_cells.s11 = (float *)_mm_malloc(bytes, 64);
+  tmp_cells.s12 = (float *)_mm_malloc(bytes, 64);
+  tmp_cells.s13 = (float *)_mm_malloc(bytes, 64);
+  tmp_cells.s14 = (float *)_mm_malloc(bytes, 64);
+  tmp_cells.s15 = (float *)_mm_malloc(bytes, 64);
+  tmp_cells.s16 = (float *)_mm_malloc(bytes, 64);
+  tmp_cells.s17 = (float *)_mm_malloc(bytes, 64);
+  tmp_cells.s18 = (float *)_mm_malloc(bytes, 64);
+
+  for (int ii = 0; ii < ncells; ii++)
+  {
+    obstacles[ii] = solid_every > 0 && ii % solid_every == 0;
+    seed = seed * 1664525u + 1013904223u;
+    cells.s0[ii] = tmp_cells.s0[ii] = 1.f / 3.f * (0.9f + 0.2f * (float)(seed >> 8) / 16777216.f);
+    seed = seed * 1664525u + 1013904223u;
+    cells.s1[ii] = tmp_cells.s1[ii] = 1.f / 18.f * (0.9f + 0.2f * (float)(seed >> 8) / 16777216.f);
+    seed = seed * 1664525u + 1013904223u;
+    cells.s2[ii] = tmp_cells.s2[ii] = 1.f / 18.f * (0.9f + 0.2f * (float)(seed >> 8) / 16777216.f);
+    seed = seed * 1664525u + 1013904223u;
+    cells.s3[ii] = tmp_cells.s3[ii] = 1.f / 18.f * (0.9f + 0.2f * (float)(seed >> 8) / 16777216.f);
+    seed = seed * 1664525u + 1013904223u;
+    cells.s4[ii] = tmp_cells.s4[ii] = 1.f / 18.f * (0.9f + 0.2f * (float)(seed >> 8) / 16777216.f);
+    seed = seed * 1664525u + 1013904223u;
+    cells.s5[ii] = tmp_cells.s5[ii] = 1.f / 18.f * (0.9f + 0.2f * (float)(seed >> 8) / 16777216.f);
+    seed = seed * 1664525u + 1013904223u;
+    cells.s6[ii] = tmp_cells.s6[ii] = 1.f / 18.f * (0.9f + 0.2f * (float)(seed >> 8) / 16777216.f);
+    seed = seed * 1664525u + 1013904223u;
+    cells.s7[ii] = tmp_cells.s7[ii] = 1.f / 36.f * (0.9f + 0.2f * (float)(seed >> 8) / 16777216.f);
+    seed = seed * 1664525u + 1013904223u;
+    cells.s8[ii] = tmp_cells.s8[ii] = 1.f / 36.f * (0.9f + 0.2f * (float)(seed >> 8) / 16777216.f);
+    seed = seed * 1664525u + 1013904223u;
+    cells.s9[ii] = tmp_cells.s9[ii] = 1.f / 36.f * (0.9f + 0.2f * (float)(seed >> 8) / 16777216.f);
+    seed = seed * 1664525u + 1013904223u;
+    cells.s10[ii] = tmp_cells.s10[ii] = 1.f / 36.f * (0.9f + 0.2f * (float)(seed >> 8) / 16777216.f);
+    seed = seed * 1664525u + 1013904223u;
+    cells.s11[ii] = tmp_cells.s11[ii] = 1.f / 36.f * (0.9f + 0.2f * (float)(seed >> 8) / 16777216.f);
+    seed = seed * 1664525u + 1013904223u;
+    cells.s12[ii] = tmp_cells.s12[ii] = 1.f / 36.f * (0.9f + 0.2f * (float)(seed >> 8) / 16777216.f);
+    seed = seed * 1664525u + 1013904223u;
+    cells.s13[ii] = tmp_cells.s13[ii] = 1.f / 36.f * (0.9f + 0.2f * (float)(seed >> 8) / 16777216.f);
+    seed = seed * 1664525u + 1013904223u;
+    cells.s14[ii] = tmp_cells.s14[ii] = 1.f / 36.f * (0.9f + 0.2f * (float)(seed >> 8) / 16777216.f);
+    seed = seed * 1664525u + 1013904223u;
+    cells.s15[ii] = tmp_cells.s15[ii] = 1.f / 36.f * (0.9f + 0.2f * (float)(seed >> 8) / 16777216.f);
+    seed = seed * 1664525u + 1013904223u;
+    cells.s16[ii] = tmp_cells.s16[ii] = 1.f / 36.f * (0.9f + 0.2f * (float)(seed >> 8) / 16777216.f);
+    seed = seed * 1664525u + 1013904223u;
+    cells.s17[ii] = tmp_cells.s17[ii] = 1.f / 36.f * (0.9f + 0.2f * (float)(seed >> 8) / 16777216.f);
+    seed = seed * 1664525u + 1013904223u;
+    cells.s18[ii] = tmp_cells.s18[ii] = 1.f / 36.f * (0.9f + 0.2f * (float)(seed >> 8) / 16777216.f);
+  }
+
+  for (int pass = 0; pass < 2; pass++)
+  {
+    double *total = pass ? after : before;
+
+    for (int tt = 0; pass && tt < steps; tt++)
+    {
+      timestep_d3q19(params, &cells, &tmp_cells, obstacles);
+      swap = cells;
+      cells = tmp_cells;
+      tmp_cells = swap;
+    }
+    macroscopic_d3q19(params, &cells, rho, rho + 1 * ncells, rho + 2 * ncells, rho + 3 * ncells);
+    for (int ii = 0; ii < ncells; ii++)
+    {
+      total[0] += rho[ii];
+      total[1] += (double)rho[ii] * rho[1 * ncells + ii];
+      total[2] += (double)rho[ii] * rho[2 * ncells + ii];
+      total[3] += (double)rho[ii] * rho[3 * ncells + ii];
+    }
+  }
+
+  *mass = fabs(after[0] - before[0]) / before[0];
+  *momentum = 0.0;
+  for (int aa = 1; aa < 4; aa++)
+  {
+    *momentum = fmax(*momentum, fabs(after[aa] - before[aa]) / before[0]);
+  }
+
+  _mm_free(cells.s0);
+  _mm_free(cells.s1);
+  _mm_free(cells.s2);
+  _mm_free(cells.s3);
+  _mm_free(cells.s4);
+  _mm_free(cells.s5);
+  _mm_free(cells.s6);
+  _mm_free(cells.s7);
+  _mm_free(cells.s8);
+  _mm_free(cells.s9);
+  _mm_free(cells.s10);
+  _mm_free(cells.s11);
+  _mm_free(cells.s12);
+  _mm_free(cells.s13);
+  _mm_free(cells.s14);
+  _mm_free(cells.s15);
+  _mm_free(cells.s16);
+  _mm_free(cells.s17);
+  _mm_free(cells.s18);
+  _mm_free(tmp_cells.s0);
+  _mm_free(tmp_cells.s1);
+  _mm_free(tmp_cells.s2);
+  _mm_free(tmp_cells.s3);
+  _mm_free(tmp_cells.s4);
+  _mm_free(tmp_cells.s5);
+  _mm_free(tmp_cells.s6);
+  _mm_free(tmp_cells.s7);
+  _mm_free(tmp_cells.s8);
+  _mm_free(tmp_cells.s9);
+  _mm_free(tmp_cells.s10);
+  _mm_free(tmp_cells.s11);
+  _mm_free(tmp_cells.s12);
+  _mm_free(tmp_cells.s13);
+  _mm_free(tmp_cells.s14);
+  _mm_free(tmp_cells.s15);
+  _mm_free(tmp_cells.s16);
+  _mm_free(tmp_cells.s17);
+  _mm_free(tmp_cells.s18);
+  free(obstacles);
+  free(rho);
+}
+
+#endif
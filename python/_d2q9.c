@@ -0,0 +1,533 @@
+/*
+** Python extension over the d2q9-bgk solver.
+**
+** A Case owns the lattices that initialise() allocates, and hands
+** them to Python through the buffer protocol, so that NumPy arrays
+** over the populations, the obstacle mask and the macroscopic fields
+** share the solver's aligned memory rather than copying it. The
+** NumPy wrapper is d2q9.py, next to this file; build with
+**
+**   make python
+**
+** Case.step() releases the GIL for the whole of its timesteps, as
+** macroscopic() does while it fills the fields. A Case takes one of
+** them at a time: another thread calling either meanwhile gets a
+** RuntimeError rather than racing on the lattices.
+**
+** The solver is compiled into the extension as one translation unit,
+** without its main(). Like the command line solver it calls exit()
+** on a malformed deck, so check_deck() reads both files with the same
+** checks as read_params() and initialise(), and the memory check of
+** initialise(), and raises instead. Only an allocation that fails
+** after the memory check passed still ends the interpreter.
+**
+** step() leaves the current lattice in the arrays it started in,
+** copying it back after an odd number of timesteps, so the buffers
+** from speed() stay views of the current populations.
+*/
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#define D2Q9_LIBRARY
+#include "../d2q9-bgk.c"
+
+#define NFIELDS 4 /* u_x, u_y, u and pressure */
+
+/* a solver instance */
+typedef struct
+{
+  PyObject_HEAD
+  t_param params;         /* struct to hold parameter values */
+  t_speeds *cells;        /* grid containing fluid densities */
+  t_speeds *tmp_cells;    /* scratch space */
+  int *obstacles;         /* grid indicating which cells are blocked */
+  float *av_vels;         /* av. velocity of the first maxIters timesteps */
+  float *fields;          /* u_x, u_y, u and pressure, filled by macroscopic() */
+  const t_kernel *kernel; /* timestep implementation */
+  long iters;             /* timesteps taken so far */
+  int busy;               /* 1 while step() or macroscopic() runs without the GIL */
+} t_case;
+
+/* an nx * ny array inside a Case, exported through the buffer protocol */
+typedef struct
+{
+  PyObject_HEAD
+  t_case *owner;        /* kept alive for as long as the view is */
+  void *data;           /* first element */
+  const char *format;   /* "f" or "i" */
+  int readonly;         /* 1 to refuse writable requests */
+  Py_ssize_t shape[2];  /* ny, nx */
+  Py_ssize_t strides[2];
+} t_view;
+
+static PyTypeObject t_case_type;
+static PyTypeObject t_view_type;
+
+PyObject *new_view(t_case *owner, void *data, const char *format, int readonly)
+{
+  t_view *view = PyObject_New(t_view, &t_view_type);
+
+  if (view == NULL)
+    return NULL;
+
+  Py_INCREF(owner);
+  view->owner = owner;
+  view->data = data;
+  view->format = format;
+  view->readonly = readonly;
+  view->shape[0] = owner->params.ny;
+  view->shape[1] = owner->params.nx;
+  view->strides[0] = sizeof(float) * owner->params.nx;
+  view->strides[1] = sizeof(float);
+
+  return (PyObject *)view;
+}
+
+int view_getbuffer(PyObject *self, Py_buffer *buffer, int flags)
+{
+  t_view *view = (t_view *)self;
+
+  if ((flags & PyBUF_WRITABLE) && view->readonly)
+  {
+    PyErr_SetString(PyExc_BufferError, "view is read-only");
+    return -1;
+  }
+
+  buffer->obj = Py_NewRef(self);
+  buffer->buf = view->data;
+  buffer->len = view->shape[0] * view->shape[1] * sizeof(float);
+  buffer->itemsize = sizeof(float);
+  buffer->readonly = view->readonly;
+  buffer->ndim = 2;
+  buffer->format = (flags & PyBUF_FORMAT) ? (char *)view->format : NULL;
+  buffer->shape = (flags & PyBUF_ND) == PyBUF_ND ? view->shape : NULL;
+  buffer->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? view->strides : NULL;
+  buffer->suboffsets = NULL;
+  buffer->internal = NULL;
+
+  return 0;
+}
+
+void view_dealloc(PyObject *self)
+{
+  Py_DECREF(((t_view *)self)->owner);
+  PyObject_Free(self);
+}
+
+/* with the GIL held: raise ValueError or OSError for a deck that read_params() or initialise() would exit on */
+int check_deck(const char *paramfile, const char *obstaclefile)
+{
+  static const char *names[] = {"nx", "ny", "maxIters", "reynolds_dim", "density", "accel", "omega"};
+  t_param params;
+  int *values[4] = {&params.nx, &params.ny, &params.maxIters, &params.reynolds_dim};
+  float *reals[3] = {&params.density, &params.accel, &params.omega};
+  int xx, yy, blocked, retval;
+  long line = 0;
+
+  FILE *fp = fopen(paramfile, "r");
+
+  if (fp == NULL)
+  {
+    PyErr_SetFromErrnoWithFilename(PyExc_OSError, paramfile);
+    return 0;
+  }
+
+  for (int pp = 0; pp < 7; pp++)
+  {
+    retval = (pp < 4) ? fscanf(fp, "%d\n", values[pp]) : fscanf(fp, "%f\n", reals[pp - 4]);
+
+    if (retval != 1)
+    {
+      fclose(fp);
+      PyErr_Format(PyExc_ValueError, "%s: could not read param file: %s", paramfile, names[pp]);
+      return 0;
+    }
+  }
+
+  fclose(fp);
+
+  if (params.nx < 1 || params.ny < 1 || params.maxIters < 0)
+  {
+    PyErr_Format(PyExc_ValueError, "%s: nx and ny must be positive and maxIters not negative", paramfile);
+    return 0;
+  }
+
+  t_footprint footprint;
+  plan_footprint(params, 0, 0, &footprint);
+  const size_t required = footprint.per_cell * params.nx * params.ny + footprint.fixed;
+  const size_t available = available_memory(NULL, NULL);
+
+  if (available > 0 && required > available)
+  {
+    PyErr_Format(PyExc_MemoryError, "grid needs %.2f GiB but only %.2f GiB is available",
+                 required / 1073741824.0, available / 1073741824.0);
+    return 0;
+  }
+
+  fp = fopen(obstaclefile, "r");
+
+  if (fp == NULL)
+  {
+    PyErr_SetFromErrnoWithFilename(PyExc_OSError, obstaclefile);
+    return 0;
+  }
+
+  while ((retval = fscanf(fp, "%d %d %d\n", &xx, &yy, &blocked)) != EOF)
+  {
+    const char *error = NULL;
+
+    line++;
+    if (retval != 3)
+      error = "expected 3 values per line in obstacle file";
+    else if (xx < 0 || xx > params.nx - 1)
+      error = "obstacle x-coord out of range";
+    else if (yy < 0 || yy > params.ny - 1)
+      error = "obstacle y-coord out of range";
+    else if (blocked != 1)
+      error = "obstacle blocked value should be 1";
+
+    if (error != NULL)
+    {
+      fclose(fp);
+      PyErr_Format(PyExc_ValueError, "%s: obstacle %ld: %s", obstaclefile, line, error);
+      return 0;
+    }
+  }
+
+  fclose(fp);
+
+  return 1;
+}
+
+int case_init(PyObject *self, PyObject *args, PyObject *kwds)
+{
+  static char *keywords[] = {"paramfile", "obstaclefile", "kernel", NULL};
+  t_case *c = (t_case *)self;
+  const char *paramfile, *obstaclefile;
+  const char *kernel = kernels[0].name;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "ss|s", keywords, &paramfile, &obstaclefile, &kernel))
+    return -1;
+
+  if (c->cells != NULL)
+  {
+    PyErr_SetString(PyExc_RuntimeError, "Case is already initialised");
+    return -1;
+  }
+
+  c->kernel = NULL;
+  for (int kk = 0; kk < NKERNELS; kk++)
+  {
+    if (!strcmp(kernels[kk].name, kernel))
+      c->kernel = &kernels[kk];
+  }
+
+  if (c->kernel == NULL)
+  {
+    PyErr_Format(PyExc_ValueError, "unknown kernel '%s'", kernel);
+    return -1;
+  }
+
+  if (!check_deck(paramfile, obstaclefile))
+    return -1;
+
+  initialise(paramfile, obstaclefile, &c->params, 0, &c->cells, &c->tmp_cells, &c->obstacles, &c->av_vels);
+
+  c->fields = (float *)_mm_malloc(sizeof(float) * NFIELDS * c->params.nx * c->params.ny, 64);
+
+  if (c->fields == NULL)
+  {
+    finalise(&c->params, &c->cells, &c->tmp_cells, &c->obstacles, &c->av_vels);
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  c->iters = 0;
+
+  return 0;
+}
+
+void case_dealloc(PyObject *self)
+{
+  t_case *c = (t_case *)self;
+
+  if (c->cells != NULL)
+    finalise(&c->params, &c->cells, &c->tmp_cells, &c->obstacles, &c->av_vels);
+
+  if (c->fields != NULL)
+    _mm_free(c->fields);
+
+  Py_TYPE(self)->tp_free(self);
+}
+
+int case_ready(t_case *c)
+{
+  if (c->cells == NULL)
+    PyErr_SetString(PyExc_RuntimeError, "Case is not initialised");
+
+  return c->cells != NULL;
+}
+
+/* with the GIL held: raise if the lattices are missing, or being updated by step() or macroscopic() */
+int case_idle(t_case *c)
+{
+  if (!case_ready(c))
+    return 0;
+
+  if (c->busy)
+    PyErr_SetString(PyExc_RuntimeError, "Case is busy in step() or macroscopic() on another thread");
+
+  return !c->busy;
+}
+
+/* with the GIL held: mark the Case busy for a section without it, or raise if it already is */
+int case_claim(t_case *c)
+{
+  if (c->busy)
+  {
+    PyErr_SetString(PyExc_RuntimeError, "Case is busy in step() or macroscopic() on another thread");
+    return 0;
+  }
+
+  c->busy = 1;
+
+  return 1;
+}
+
+PyObject *case_step(PyObject *self, PyObject *args)
+{
+  t_case *c = (t_case *)self;
+  long steps = 1;
+  float av_vel = 0.f;
+
+  if (!PyArg_ParseTuple(args, "|l", &steps) || !case_ready(c))
+    return NULL;
+
+  if (steps < 0)
+  {
+    PyErr_SetString(PyExc_ValueError, "steps must not be negative");
+    return NULL;
+  }
+
+  if (!case_claim(c))
+    return NULL;
+
+  Py_BEGIN_ALLOW_THREADS
+  for (long tt = 0; tt < steps; tt++)
+  {
+    accelerate_flow(c->params, c->cells, c->obstacles);
+    av_vel = c->kernel->fn(c->params, c->cells, c->tmp_cells, c->obstacles);
+    t_speeds *tmp = c->cells;
+    c->cells = c->tmp_cells;
+    c->tmp_cells = tmp;
+
+    if (c->iters < c->params.maxIters)
+      c->av_vels[c->iters] = av_vel;
+    c->iters++;
+  }
+
+  /* an odd number of swaps: bring the state back to the arrays that speed() hands out */
+  if (steps % 2)
+  {
+    copy_speeds(c->params, c->tmp_cells, c->cells);
+    t_speeds *tmp = c->cells;
+    c->cells = c->tmp_cells;
+    c->tmp_cells = tmp;
+  }
+  Py_END_ALLOW_THREADS
+  c->busy = 0;
+
+  return PyFloat_FromDouble(av_vel);
+}
+
+PyObject *case_speed(PyObject *self, PyObject *args)
+{
+  t_case *c = (t_case *)self;
+  int ss;
+
+  if (!PyArg_ParseTuple(args, "i", &ss) || !case_idle(c))
+    return NULL;
+
+  float *speeds[NSPEEDS] = {c->cells->s0, c->cells->s1, c->cells->s2, c->cells->s3, c->cells->s4,
+                            c->cells->s5, c->cells->s6, c->cells->s7, c->cells->s8};
+
+  if (ss < 0 || ss >= NSPEEDS)
+  {
+    PyErr_Format(PyExc_IndexError, "speed %d out of range 0..%d", ss, NSPEEDS - 1);
+    return NULL;
+  }
+
+  return new_view(c, speeds[ss], "f", 0);
+}
+
+PyObject *case_obstacles(PyObject *self, PyObject *unused)
+{
+  t_case *c = (t_case *)self;
+
+  if (!case_ready(c))
+    return NULL;
+
+  return new_view(c, c->obstacles, "i", 0);
+}
+
+PyObject *case_macroscopic(PyObject *self, PyObject *unused)
+{
+  t_case *c = (t_case *)self;
+
+  if (!case_ready(c))
+    return NULL;
+
+  const size_t ncells = (size_t)c->params.nx * c->params.ny;
+
+  if (!case_claim(c))
+    return NULL;
+
+  Py_BEGIN_ALLOW_THREADS
+#pragma omp parallel for
+  for (int jj = 0; jj < c->params.ny; jj++)
+  {
+    const size_t row = (size_t)jj * c->params.nx;
+    row_values(c->params, c->cells, c->obstacles, jj, c->fields + row, c->fields + ncells + row,
+               c->fields + 2 * ncells + row, c->fields + 3 * ncells + row);
+  }
+  Py_END_ALLOW_THREADS
+  c->busy = 0;
+
+  PyObject *result = PyTuple_New(NFIELDS);
+
+  if (result == NULL)
+    return NULL;
+
+  for (int ff = 0; ff < NFIELDS; ff++)
+  {
+    PyObject *view = new_view(c, c->fields + ff * ncells, "f", 1);
+
+    if (view == NULL)
+    {
+      Py_DECREF(result);
+      return NULL;
+    }
+
+    PyTuple_SET_ITEM(result, ff, view);
+  }
+
+  return result;
+}
+
+PyObject *case_total_density(PyObject *self, PyObject *unused)
+{
+  t_case *c = (t_case *)self;
+
+  if (!case_idle(c))
+    return NULL;
+
+  return PyFloat_FromDouble(total_density(c->params, c->cells));
+}
+
+PyObject *case_reynolds(PyObject *self, PyObject *unused)
+{
+  t_case *c = (t_case *)self;
+
+  if (!case_idle(c))
+    return NULL;
+
+  return PyFloat_FromDouble(calc_reynolds(c->params, c->cells, c->obstacles));
+}
+
+PyObject *case_get_int(PyObject *self, void *offset)
+{
+  return PyLong_FromLong(*(int *)((char *)&((t_case *)self)->params + (size_t)offset));
+}
+
+PyObject *case_get_float(PyObject *self, void *offset)
+{
+  return PyFloat_FromDouble(*(float *)((char *)&((t_case *)self)->params + (size_t)offset));
+}
+
+PyObject *case_get_iters(PyObject *self, void *unused)
+{
+  return PyLong_FromLong(((t_case *)self)->iters);
+}
+
+PyObject *case_get_kernel(PyObject *self, void *unused)
+{
+  const t_kernel *kernel = ((t_case *)self)->kernel;
+
+  return PyUnicode_FromString(kernel != NULL ? kernel->name : kernels[0].name);
+}
+
+static PyMethodDef case_methods[] = {
+    {"step", case_step, METH_VARARGS, "step(n=1): take n timesteps without the GIL, return the last av. velocity"},
+    {"speed", case_speed, METH_VARARGS, "speed(k): buffer over speed k of the current lattice, ny x nx float32"},
+    {"obstacles", case_obstacles, METH_NOARGS, "obstacles(): buffer over the obstacle mask, ny x nx int32"},
+    {"macroscopic", case_macroscopic, METH_NOARGS, "macroscopic(): recompute and return buffers over u_x, u_y, u and pressure"},
+    {"total_density", case_total_density, METH_NOARGS, "total_density(): sum of all populations"},
+    {"reynolds", case_reynolds, METH_NOARGS, "reynolds(): Reynolds number of the current state"},
+    {NULL, NULL, 0, NULL},
+};
+
+static PyGetSetDef case_getset[] = {
+    {"nx", case_get_int, NULL, "no. of cells in x-direction", (void *)offsetof(t_param, nx)},
+    {"ny", case_get_int, NULL, "no. of cells in y-direction", (void *)offsetof(t_param, ny)},
+    {"max_iters", case_get_int, NULL, "no. of iterations in the deck", (void *)offsetof(t_param, maxIters)},
+    {"reynolds_dim", case_get_int, NULL, "dimension for Reynolds number", (void *)offsetof(t_param, reynolds_dim)},
+    {"density", case_get_float, NULL, "density per link", (void *)offsetof(t_param, density)},
+    {"accel", case_get_float, NULL, "density redistribution", (void *)offsetof(t_param, accel)},
+    {"omega", case_get_float, NULL, "relaxation parameter", (void *)offsetof(t_param, omega)},
+    {"iters", case_get_iters, NULL, "timesteps taken so far", NULL},
+    {"kernel", case_get_kernel, NULL, "name of the timestep implementation", NULL},
+    {NULL, NULL, NULL, NULL, NULL},
+};
+
+static PyBufferProcs view_buffer = {view_getbuffer, NULL};
+
+static PyTypeObject t_view_type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_d2q9.View",
+    .tp_basicsize = sizeof(t_view),
+    .tp_dealloc = view_dealloc,
+    .tp_as_buffer = &view_buffer,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "An nx * ny array of a Case, for numpy.asarray() or memoryview()",
+};
+
+static PyTypeObject t_case_type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_d2q9.Case",
+    .tp_basicsize = sizeof(t_case),
+    .tp_dealloc = case_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "Case(paramfile, obstaclefile, kernel='fused'): a d2q9-bgk simulation",
+    .tp_methods = case_methods,
+    .tp_getset = case_getset,
+    .tp_init = case_init,
+    .tp_new = PyType_GenericNew,
+};
+
+static PyModuleDef d2q9_module = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "_d2q9",
+    .m_doc = "d2q9-bgk lattice Boltzmann solver, see d2q9.py for the NumPy interface",
+    .m_size = -1,
+};
+
+PyMODINIT_FUNC PyInit__d2q9(void)
+{
+  if (PyType_Ready(&t_view_type) < 0 || PyType_Ready(&t_case_type) < 0)
+    return NULL;
+
+  PyObject *module = PyModule_Create(&d2q9_module);
+
+  if (module == NULL)
+    return NULL;
+
+  if (PyModule_AddObjectRef(module, "Case", (PyObject *)&t_case_type) < 0 ||
+      PyModule_AddIntConstant(module, "NSPEEDS", NSPEEDS) < 0)
+  {
+    Py_DECREF(module);
+    return NULL;
+  }
+
+  return module;
+}
@@ -0,0 +1,62 @@
+"""NumPy interface to the d2q9-bgk solver.
+
+The arrays share memory with the solver: nothing is copied, and
+writing to an array changes the simulation. Build the extension
+with ``make python`` and put this directory on ``sys.path``::
+
+    import d2q9
+
+    case = d2q9.Case("input_128x128.params", "obstacles_128x128.dat")
+    for _ in range(100):
+        av_vel = case.step(100)
+        u = case.macroscopic()["u"]
+
+The populations live in two lattices that swap roles on every
+timestep; ``step()`` ends with the state back in the first, copying
+it after an odd number of timesteps, so the arrays from ``speeds``
+and ``f`` stay over the current lattice. They, the obstacle mask and
+the arrays from ``macroscopic()`` keep their memory for the life of
+the case; ``macroscopic()`` refills its arrays in place. A malformed
+deck raises ValueError and a missing file OSError.
+
+``step()`` and ``macroscopic()`` release the GIL. A case runs one of
+them at a time; a call from another thread meanwhile raises
+RuntimeError.
+"""
+
+import numpy as np
+
+from _d2q9 import NSPEEDS, Case as _Case
+
+FIELDS = ("u_x", "u_y", "u", "pressure")
+
+
+class Case:
+    """A d2q9-bgk simulation read from a parameter and an obstacle file."""
+
+    def __init__(self, paramfile, obstaclefile, kernel="fused"):
+        self._case = _Case(paramfile, obstaclefile, kernel)
+        self.obstacles = np.asarray(self._case.obstacles())
+
+    def __getattr__(self, name):
+        # nx, ny, max_iters, reynolds_dim, density, accel, omega, iters,
+        # kernel, total_density() and reynolds()
+        return getattr(self._case, name)
+
+    def step(self, n=1):
+        """Take n timesteps with the GIL released, return the last av. velocity."""
+        return self._case.step(n)
+
+    @property
+    def speeds(self):
+        """The nine (ny, nx) float32 arrays of the current lattice."""
+        return [np.asarray(self._case.speed(k)) for k in range(NSPEEDS)]
+
+    @property
+    def f(self):
+        """Alias of speeds."""
+        return self.speeds
+
+    def macroscopic(self):
+        """Recompute u_x, u_y, u and pressure, return them as read-only (ny, nx) arrays."""
+        return dict(zip(FIELDS, (np.asarray(view) for view in self._case.macroscopic())))